@@ -0,0 +1,171 @@
+/*
+ * access.c - binary access log
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+
+#include "access.h"
+#include "log.h"
+#include "util.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// Bytes of the file buffered between two writes
+#define ACCESS_BUFFER (64 * 1024)
+
+static void on_record(void *arg, const char *data, size_t len);
+static void on_flush(void *arg, unsigned long dropped);
+
+/**
+ * Open the log for appending, a new file starts with the header. Returns -1
+ * if it cannot be opened, or holds records of another version.
+ *
+ * */
+int
+access_open(access_log_t *log, const char *path)
+{
+	access_header_t header;
+
+	memset(log, 0, sizeof(access_log_t));
+
+	if((log->fp = fopen(path, "a+b")) == NULL)
+		return -1;
+
+	ring_init(&log->writer, ACCESS_INTERVAL, on_record, on_flush, log);
+
+	setvbuf(log->fp, NULL, _IOFBF, ACCESS_BUFFER);
+
+	if(fread(&header, sizeof header, 1, log->fp) == 1){
+		if(memcmp(header.magic, ACCESS_MAGIC, sizeof ACCESS_MAGIC) != 0 || header.version != ACCESS_VERSION ||
+				header.size != sizeof(access_record_t)){
+			fclose(log->fp);
+			errno = EINVAL;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, ACCESS_MAGIC, sizeof ACCESS_MAGIC);
+	header.version = ACCESS_VERSION;
+	header.size = sizeof(access_record_t);
+
+	if(fwrite(&header, sizeof header, 1, log->fp) != 1 || fflush(log->fp) != 0){
+		fclose(log->fp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * A ring for a worker to queue its records in
+ *
+ * */
+ring_t *
+access_ring(access_log_t *log)
+{
+	return ring_new(&log->writer, ACCESS_BYTES);
+}
+
+/**
+ * Queue a record for the writer, from the ring's worker.
+ *
+ * */
+void
+access_write(ring_t *ring, const access_record_t *record)
+{
+	ring_write(ring, record, sizeof(access_record_t), NULL, 0);
+}
+
+/**
+ * Client address of a record, IPv4 addresses are mapped into IPv6.
+ *
+ * */
+void
+access_addr(const struct sockaddr *sa, uint8_t *addr, uint16_t *port)
+{
+	memset(addr, 0, 16);
+	*port = 0;
+
+	if(sa->sa_family == AF_INET){
+		addr[10] = addr[11] = 0xff;
+		memcpy(addr + 12, &((const struct sockaddr_in*) sa)->sin_addr, 4);
+		*port = ntohs(((const struct sockaddr_in*) sa)->sin_port);
+	} else if(sa->sa_family == AF_INET6){
+		memcpy(addr, &((const struct sockaddr_in6*) sa)->sin6_addr, 16);
+		*port = ntohs(((const struct sockaddr_in6*) sa)->sin6_port);
+	}
+}
+
+/**
+ * Hash of the arguments of the command on line, the same for the same
+ * arguments whichever the command.
+ *
+ * */
+uint32_t
+access_args(const char *line, size_t len)
+{
+	size_t i;
+
+	if(len > 0 && line[len - 1] == '\r')
+		len--;
+
+	for(i = 0; i < len && line[i] != ' '; i++);
+
+	return hash(line + i, len - i);
+}
+
+static void
+on_record(void *arg, const char *data, size_t len)
+{
+	access_log_t *log = (access_log_t*) arg;
+
+	if(fwrite(data, len, 1, log->fp) != 1)
+		log->failed = TRUE;
+}
+
+static void
+on_flush(void *arg, unsigned long dropped)
+{
+	access_log_t *log = (access_log_t*) arg;
+
+	if(dropped > 0)
+		log_write(LOG_WARNING, "access", "Dropped %lu records", dropped);
+
+	if(fflush(log->fp) != 0 || log->failed)
+		print("access_write", strerror(errno));
+
+	log->failed = FALSE;
+}
+
+int
+access_start(access_log_t *log)
+{
+	return ring_start(&log->writer);
+}
+
+/**
+ * Stop the writer, write what is left and close the file.
+ *
+ * */
+void
+access_stop(access_log_t *log)
+{
+	if(log->fp == NULL)
+		return;
+
+	ring_stop(&log->writer);
+
+	fclose(log->fp);
+	log->fp = NULL;
+}
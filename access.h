@@ -0,0 +1,84 @@
+/*
+ * access.h - binary access log
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef ACCESS_H
+#define ACCESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "ring.h"
+
+#define ACCESS_MAGIC "MPDPXAL"
+#define ACCESS_VERSION 1
+
+// Bytes of records a worker may have waiting for the writer, a power of
+// two. Records made while its ring is full are dropped and counted
+#define ACCESS_BYTES (256 * 1024)
+
+// Milliseconds between two writes to the file
+#define ACCESS_INTERVAL 100
+
+// How a command was answered
+#define ACCESS_UPSTREAM 0
+#define ACCESS_MISS 1
+#define ACCESS_HIT 2
+#define ACCESS_COALESCED 3
+#define ACCESS_MIRROR 4
+#define ACCESS_ART 5
+
+/**
+ * Start of the file, the records follow. Both are written in the byte order
+ * of the host.
+ *
+ * */
+typedef struct access_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+} access_header_t;
+
+/**
+ * A command and its response. The client address is an IPv6 address, or an
+ * IPv4 address mapped into one. Arguments are hashed with FNV-1a, latency is
+ * 0 for commands the proxy answered itself.
+ *
+ * */
+typedef struct access_record_t {
+	uint64_t time;
+	uint8_t addr[16];
+	uint16_t port;
+	uint8_t command;
+	uint8_t outcome;
+	uint32_t args;
+	uint32_t size;
+	uint32_t latency;
+} access_record_t;
+
+/**
+ * Appends the records the workers queue in their rings to a file, from the
+ * writer's thread
+ *
+ * */
+typedef struct access_log_t {
+	FILE *fp;
+	int failed;
+
+	ring_writer_t writer;
+} access_log_t;
+
+int access_open(access_log_t *log, const char *path);
+ring_t *access_ring(access_log_t *log);
+int access_start(access_log_t *log);
+void access_stop(access_log_t *log);
+
+void access_write(ring_t *ring, const access_record_t *record);
+void access_addr(const struct sockaddr *sa, uint8_t *addr, uint16_t *port);
+uint32_t access_args(const char *line, size_t len);
+
+#endif
@@ -0,0 +1,529 @@
+/*
+ * art.c - album art cache
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "art.h"
+#include "protocol.h"
+#include "buffer.h"
+#include "log.h"
+#include "util.h"
+#include "list.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// Longest command line looked at, longer URIs do not fit a key anyway
+#define ART_LINE_SIZE (2 * MPD_LINE_SIZE)
+
+// Suffix of the files images spill to
+#define ART_SUFFIX ".art"
+
+/**
+ * Drop the files a previous run spilled images to, and disable the disk tier
+ * if the directory cannot be used.
+ *
+ * */
+static void
+clean(art_cache_t *cache)
+{
+	struct dirent *ent;
+	size_t len;
+	DIR *dir;
+
+	if((dir = opendir(cache->dir)) == NULL){
+		print("art_dir", strerror(errno));
+		cache->dir = NULL;
+		return;
+	}
+
+	while((ent = readdir(dir)) != NULL){
+		len = strlen(ent->d_name);
+		if(len > sizeof(ART_SUFFIX) - 1 && strcmp(ent->d_name + len - (sizeof(ART_SUFFIX) - 1), ART_SUFFIX) == 0)
+			unlinkat(dirfd(dir), ent->d_name, 0);
+	}
+
+	closedir(dir);
+}
+
+/**
+ * Set up a cache of max_mem bytes of images in memory, spilling up to
+ * max_disk bytes to files in dir if it is not NULL.
+ *
+ * */
+void
+art_init(art_cache_t *cache, size_t max_mem, const char *dir, size_t max_disk)
+{
+	memset(cache, 0, sizeof(art_cache_t));
+	pthread_mutex_init(&cache->lock, NULL);
+	INIT_LIST_HEAD(&cache->memory);
+	INIT_LIST_HEAD(&cache->disk);
+	cache->max_mem = max_mem;
+	cache->dir = dir;
+	cache->max_disk = max_disk;
+
+	if(dir != NULL)
+		clean(cache);
+}
+
+static void
+art_free(art_t *art)
+{
+	if(art->map != NULL){
+		munmap(art->map, art->map_len);
+		unlink(art->path);
+		free(art->path);
+	}
+
+	free(art->mem);
+	free(art);
+}
+
+void
+art_put(art_t *art)
+{
+	if(art != NULL && __atomic_sub_fetch(&art->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		art_free(art);
+}
+
+static void
+put_all(struct list_head *head)
+{
+	art_t *art, *tmp;
+
+	list_for_each_entry_safe(art, tmp, head, list){
+		list_del(&art->list);
+		art_put(art);
+	}
+}
+
+static struct hlist_head *
+bucket(art_cache_t *cache, uint32_t h)
+{
+	return &cache->buckets[h & (ART_BUCKETS - 1)];
+}
+
+/**
+ * Find an image in either tier, the cache must be locked.
+ *
+ * */
+static art_t *
+find(art_cache_t *cache, const char *key, size_t key_len, uint32_t h)
+{
+	struct hlist_node *pos;
+	art_t *art;
+
+	hlist_for_each_entry(art, pos, bucket(cache, h), node){
+		if(art->hash == h && art->key_len == key_len && memcmp(art->key, key, key_len) == 0)
+			return art;
+	}
+
+	return NULL;
+}
+
+/**
+ * Take a reference to the image stored under key, NULL if there is none.
+ *
+ * */
+static art_t *
+lookup(art_cache_t *cache, const char *key, size_t key_len)
+{
+	art_t *art;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if((art = find(cache, key, key_len, hash(key, key_len))) != NULL){
+		// Most recently used first, in the tier it is in
+		list_move(&art->list, art->map ? &cache->disk : &cache->memory);
+		__atomic_add_fetch(&art->refs, 1, __ATOMIC_RELAXED);
+		cache->hits++;
+	} else {
+		cache->misses++;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return art;
+}
+
+/**
+ * Drop everything, the database changed and images may have too. Called from
+ * any thread.
+ *
+ * */
+void
+art_invalidate(art_cache_t *cache)
+{
+	struct list_head gone;
+
+	INIT_LIST_HEAD(&gone);
+
+	pthread_mutex_lock(&cache->lock);
+	cache->epoch++;
+	list_splice_init(&cache->memory, &gone);
+	list_splice_init(&cache->disk, &gone);
+	memset(cache->buckets, 0, sizeof cache->buckets);
+	cache->mem_size = 0;
+	cache->disk_size = 0;
+	pthread_mutex_unlock(&cache->lock);
+
+	put_all(&gone);
+}
+
+static int
+write_all(int fd, const char *data, size_t len)
+{
+	ssize_t bytes;
+
+	while(len > 0){
+		if((bytes = write(fd, data, len)) < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		data += bytes;
+		len -= (size_t) bytes;
+	}
+
+	return 0;
+}
+
+/**
+ * Write an image evicted from memory to a file of its own and map it. The
+ * file is removed once the image is dropped from the disk tier. Returns NULL
+ * if it could not be written.
+ *
+ * */
+static art_t *
+spill(art_cache_t *cache, art_t *art)
+{
+	art_t *copy;
+	void *map;
+	char *path;
+	int fd;
+
+	if(asprintf(&path, "%s/%lu" ART_SUFFIX, cache->dir, __atomic_add_fetch(&cache->files, 1, __ATOMIC_RELAXED)) < 0)
+		return NULL;
+
+	if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0){
+		print("art_spill", strerror(errno));
+		free(path);
+		return NULL;
+	}
+
+	if(write_all(fd, art->data, art->size) < 0 ||
+			(map = mmap(NULL, art->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+		print("art_spill", strerror(errno));
+		close(fd);
+		unlink(path);
+		free(path);
+		return NULL;
+	}
+
+	close(fd);
+
+	if((copy = malloc(sizeof(art_t))) == NULL){
+		munmap(map, art->size);
+		unlink(path);
+		free(path);
+		return NULL;
+	}
+
+	memcpy(copy, art, sizeof(art_t));
+	copy->refs = 1;
+	copy->data = map;
+	copy->mem = NULL;
+	copy->map = map;
+	copy->map_len = art->size;
+	copy->path = path;
+
+	return copy;
+}
+
+/**
+ * Move images evicted from memory to the disk tier, outside of the lock so
+ * other workers are not held up by the writes. Images the cache dropped or
+ * stored again meanwhile are not added.
+ *
+ * */
+static void
+spill_all(art_cache_t *cache, struct list_head *evicted, uint64_t epoch)
+{
+	struct list_head gone;
+	art_t *art, *tmp, *copy, *last;
+
+	INIT_LIST_HEAD(&gone);
+
+	list_for_each_entry_safe(art, tmp, evicted, list){
+		list_del(&art->list);
+
+		if(cache->dir == NULL || art->none || art->size == 0 || art->size > cache->max_disk ||
+				(copy = spill(cache, art)) == NULL){
+			art_put(art);
+			continue;
+		}
+
+		art_put(art);
+
+		pthread_mutex_lock(&cache->lock);
+
+		if(cache->epoch != epoch || find(cache, copy->key, copy->key_len, copy->hash) != NULL){
+			list_add(&copy->list, &gone);
+		} else {
+			list_add(&copy->list, &cache->disk);
+			hlist_add_head(&copy->node, bucket(cache, copy->hash));
+			cache->disk_size += copy->size;
+		}
+
+		while(cache->disk_size > cache->max_disk){
+			last = list_entry(cache->disk.prev, art_t, list);
+			cache->disk_size -= last->size;
+			list_move(&last->list, &gone);
+			hlist_del(&last->node);
+		}
+
+		pthread_mutex_unlock(&cache->lock);
+	}
+
+	put_all(&gone);
+}
+
+/**
+ * Store the image a session assembled, unless the database changed since it
+ * started reading it. Evicts the least recently used images to make room.
+ *
+ * */
+static void
+store(art_cache_t *cache, art_build_t *build, int none)
+{
+	struct list_head evicted;
+	art_t *art, *last;
+	uint64_t epoch;
+
+	if((art = calloc(1, sizeof(art_t))) == NULL)
+		return;
+
+	art->refs = 1;
+	memcpy(art->key, build->key, build->key_len);
+	art->key_len = build->key_len;
+	art->hash = hash(build->key, build->key_len);
+	memcpy(art->meta, build->meta, build->meta_len);
+	art->meta_len = build->meta_len;
+	art->data = art->mem = build->data;
+	art->size = build->size;
+	art->none = none;
+	build->data = NULL;
+
+	INIT_LIST_HEAD(&evicted);
+
+	pthread_mutex_lock(&cache->lock);
+
+	// Another session may have stored it first
+	if(build->epoch != cache->epoch || find(cache, art->key, art->key_len, art->hash) != NULL){
+		pthread_mutex_unlock(&cache->lock);
+		art_put(art);
+		return;
+	}
+
+	list_add(&art->list, &cache->memory);
+	hlist_add_head(&art->node, bucket(cache, art->hash));
+	cache->mem_size += sizeof(art_t) + art->size;
+
+	while(cache->mem_size > cache->max_mem){
+		last = list_entry(cache->memory.prev, art_t, list);
+		cache->mem_size -= sizeof(art_t) + last->size;
+		list_move(&last->list, &evicted);
+		hlist_del(&last->node);
+	}
+
+	epoch = cache->epoch;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	spill_all(cache, &evicted, epoch);
+}
+
+void
+art_reset(art_build_t *build)
+{
+	free(build->data);
+	memset(build, 0, sizeof(art_build_t));
+}
+
+/**
+ * Frame the chunk of a cached image at offset the way MPD does.
+ *
+ * */
+static buffer_t *
+respond(art_t *art, size_t offset)
+{
+	char head[ART_LINE_SIZE];
+	buffer_t *buf, *tmp;
+	size_t n = art->size - offset;
+	int len;
+
+	if(art->none)
+		return buffer_append(NULL, "OK\n", 3);
+
+	if(n > ART_CHUNK)
+		n = ART_CHUNK;
+
+	len = snprintf(head, sizeof head, "size: %zu\n%.*sbinary: %zu\n", art->size, (int) art->meta_len, art->meta, n);
+	if(len < 0 || (size_t) len >= sizeof head || (buf = buffer_append(NULL, head, (size_t) len)) == NULL)
+		return NULL;
+
+	if((tmp = buffer_append(buf, art->data + offset, n)) == NULL || (buf = tmp, tmp = buffer_append(buf, "\nOK\n", 4)) == NULL){
+		buffer_put(buf);
+		return NULL;
+	}
+
+	return tmp;
+}
+
+/**
+ * Answer albumart and readpicture from the cache. Returns TRUE with the
+ * response in out, or FALSE if the command is left to MPD: other commands,
+ * images not cached yet and offsets past their end, which MPD refuses. On a
+ * miss the session's build is told which chunk it is waiting for.
+ *
+ * */
+int
+art_answer(art_cache_t *cache, art_build_t *build, const char *line, size_t len, buffer_t **out)
+{
+	char copy[ART_LINE_SIZE], key[MPD_LINE_SIZE], *argv[3], *end;
+	unsigned long long offset;
+	art_t *art;
+	int key_len;
+
+	if(len >= sizeof copy)
+		return FALSE;
+
+	memcpy(copy, line, len);
+
+	if(mpd_split(copy, len, argv, 3) != 3 || (strcmp(argv[0], "albumart") != 0 && strcmp(argv[0], "readpicture") != 0))
+		return FALSE;
+
+	errno = 0;
+	offset = strtoull(argv[2], &end, 10);
+	if(errno != 0 || end == argv[2] || *end != '\0' || argv[2][0] == '-')
+		return FALSE;
+
+	key_len = snprintf(key, sizeof key, "%s %s", argv[0], argv[1]);
+	if(key_len < 0 || (size_t) key_len >= sizeof key)
+		return FALSE;
+
+	if((art = lookup(cache, key, (size_t) key_len)) != NULL){
+		*out = offset <= art->size ? respond(art, (size_t) offset) : NULL;
+		art_put(art);
+
+		return *out != NULL;
+	}
+
+	// A new image starts at the first chunk, others have to follow the last
+	if(offset == 0 || build->key_len != (size_t) key_len || memcmp(build->key, key, build->key_len) != 0 ||
+			build->data == NULL || offset != build->len){
+		art_reset(build);
+
+		if(offset > 0)
+			return FALSE;
+
+		memcpy(build->key, key, (size_t) key_len);
+		build->key_len = (size_t) key_len;
+		build->epoch = __atomic_load_n(&cache->epoch, __ATOMIC_RELAXED);
+	}
+
+	build->waiting = TRUE;
+	build->offset = (size_t) offset;
+
+	return FALSE;
+}
+
+/**
+ * Parse MPD's response to the chunk the build was waiting for: a size line,
+ * maybe a type, and the binary payload. A readpicture of a song without a
+ * picture is answered with OK alone, which is stored as well.
+ *
+ * */
+void
+art_chunk(art_cache_t *cache, art_build_t *build, int status, const char *buf, size_t len)
+{
+	const char *line = buf, *nl, *end = buf + len;
+	size_t size = 0, n = 0;
+	int sized = FALSE, binary = FALSE;
+	char *tmp;
+
+	build->waiting = FALSE;
+
+	if(status != MPD_OK){
+		art_reset(build);
+		return;
+	}
+
+	for(; line < end && (nl = memchr(line, '\n', (size_t) (end - line))) != NULL; line = nl + 1){
+		if(strncmp(line, "size: ", 6) == 0){
+			size = (size_t) strtoull(line + 6, NULL, 10);
+			sized = TRUE;
+		} else if(strncmp(line, "binary: ", 8) == 0){
+			n = (size_t) strtoull(line + 8, NULL, 10);
+			line = nl + 1;
+			binary = TRUE;
+			break;
+		} else if(strncmp(line, "OK", 2) == 0){
+			break;
+		} else if(build->offset == 0){
+			// Lines that do not fit would be missing from the answers
+			if(build->meta_len + (size_t) (nl + 1 - line) >= sizeof build->meta){
+				art_reset(build);
+				return;
+			}
+			memcpy(build->meta + build->meta_len, line, (size_t) (nl + 1 - line));
+			build->meta_len += (size_t) (nl + 1 - line);
+		}
+	}
+
+	if(!binary){
+		if(build->offset == 0 && !sized && build->meta_len == 0)
+			store(cache, build, TRUE);
+		art_reset(build);
+		return;
+	}
+
+	if(!sized || n > (size_t) (end - line) || (build->offset > 0 && size != build->size) ||
+			build->offset != build->len || n > size - build->len){
+		art_reset(build);
+		return;
+	}
+
+	if(build->offset == 0){
+		// Too large to be worth a quarter of the cache
+		if(size > cache->max_mem / 4 || (tmp = malloc(size ? size : 1)) == NULL){
+			art_reset(build);
+			return;
+		}
+
+		build->data = tmp;
+		build->size = size;
+	}
+
+	memcpy(build->data + build->len, line, n);
+	build->len += n;
+
+	if(build->len == build->size){
+		store(cache, build, FALSE);
+		art_reset(build);
+	}
+}
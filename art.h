@@ -0,0 +1,112 @@
+/*
+ * art.h - album art cache
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef ART_H
+#define ART_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "protocol.h"
+#include "buffer.h"
+#include "list.h"
+
+// Bytes of an image sent per response, MPD's default binarylimit. Sessions
+// that changed it are pinned, and not served from the cache
+#define ART_CHUNK 8192
+
+// Buckets of the table images are looked up in, a power of two
+#define ART_BUCKETS 4096
+
+/**
+ * A whole image, the response to albumart or readpicture assembled from its
+ * chunks. Meta holds the lines MPD sends between size and binary, such as
+ * the type of a picture. Images evicted from memory are written to a file
+ * and mapped from there, never modified once cached so workers read them
+ * without locking.
+ *
+ * */
+typedef struct art_t {
+	struct list_head list;
+	struct hlist_node node;
+	int refs;
+
+	char key[MPD_LINE_SIZE];
+	size_t key_len;
+	uint32_t hash;
+
+	char meta[MPD_LINE_SIZE];
+	size_t meta_len;
+	const char *data;
+	size_t size;
+
+	// Set if there is no picture at all, MPD answers OK and nothing else
+	int none;
+
+	// Either allocated, or mapped from path
+	char *mem;
+	void *map;
+	size_t map_len;
+	char *path;
+} art_t;
+
+/**
+ * An image a session reads from MPD chunk by chunk. Chunks are kept as long
+ * as they follow each other, the image is stored once it is complete.
+ *
+ * */
+typedef struct art_build_t {
+	char key[MPD_LINE_SIZE];
+	size_t key_len;
+	uint64_t epoch;
+
+	// The chunk requested is at offset, and is the next one
+	int waiting;
+	size_t offset;
+
+	char meta[MPD_LINE_SIZE];
+	size_t meta_len;
+	char *data;
+	size_t size;
+	size_t len;
+} art_build_t;
+
+/**
+ * Images shared by all workers, keyed by command and song URI. Recently used
+ * images are kept in memory up to max_mem bytes, older ones spill to files in
+ * dir, up to max_disk bytes. Everything is dropped when the database changes;
+ * the epoch counts these so an image read across a change is not stored.
+ * Images of both tiers are hashed by key into the buckets.
+ *
+ * */
+typedef struct art_cache_t {
+	pthread_mutex_t lock;
+	struct list_head memory;
+	struct list_head disk;
+	struct hlist_head buckets[ART_BUCKETS];
+	size_t mem_size;
+	size_t max_mem;
+	size_t disk_size;
+	size_t max_disk;
+	const char *dir;
+	unsigned long files;
+	uint64_t epoch;
+
+	unsigned long hits;
+	unsigned long misses;
+} art_cache_t;
+
+void art_init(art_cache_t *cache, size_t max_mem, const char *dir, size_t max_disk);
+void art_invalidate(art_cache_t *cache);
+void art_put(art_t *art);
+
+int art_answer(art_cache_t *cache, art_build_t *build, const char *line, size_t len, buffer_t **out);
+void art_chunk(art_cache_t *cache, art_build_t *build, int status, const char *buf, size_t len);
+void art_reset(art_build_t *build);
+
+#endif
@@ -0,0 +1,426 @@
+/*
+ * loadgen.c - MPD load generator for benchmarks
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "../protocol.h"
+#include "../util.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define BUF_SIZE 65536
+#define MAX_COMMANDS 64
+
+// Sub-buckets of the latency histogram per power of two, as bits: latencies
+// are kept within about 3% of their value
+#define SUB_BITS 5
+#define SUB (1 << SUB_BITS)
+#define POWERS 40
+#define BUCKETS (POWERS * SUB)
+
+/**
+ * A client, sending its commands one after another and waiting for each
+ * response before the next.
+ *
+ * */
+typedef struct client_t {
+	int fd;
+	int next;
+	uint64_t sent;
+	mpd_response_t res;
+
+	const char *cmd;
+	size_t cmd_len;
+	size_t cmd_off;
+} client_t;
+
+typedef struct thread_t {
+	pthread_t th_id;
+	int epfd;
+
+	client_t *clients;
+	int n_clients;
+
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t counts[BUCKETS];
+	uint64_t max;
+} thread_t;
+
+static const char *commands[MAX_COMMANDS];
+static size_t command_lens[MAX_COMMANDS];
+static int n_commands;
+
+static int recording;
+static int stopping;
+
+static int
+send_command(client_t *c)
+{
+	ssize_t n;
+
+	if(c->cmd_off == 0){
+		c->cmd = commands[c->next];
+		c->cmd_len = command_lens[c->next];
+		c->next = (c->next + 1) % n_commands;
+		c->sent = now_us();
+		mpd_response_init(&c->res);
+	}
+
+	while(c->cmd_off < c->cmd_len){
+		if((n = send(c->fd, c->cmd + c->cmd_off, c->cmd_len - c->cmd_off, MSG_NOSIGNAL)) < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		c->cmd_off += (size_t) n;
+	}
+
+	c->cmd_off = 0;
+	c->cmd_len = 0;
+
+	return 0;
+}
+
+/**
+ * Read what the server sent, recording every response and sending the next
+ * command. Returns -1 if the connection broke.
+ *
+ * */
+static int
+receive(thread_t *th, client_t *c, char *buf)
+{
+	size_t off, n;
+	uint64_t us;
+	ssize_t bytes;
+
+	for(;;){
+		if((bytes = recv(c->fd, buf, BUF_SIZE, 0)) < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+		if(bytes == 0)
+			return -1;
+
+		if(__atomic_load_n(&recording, __ATOMIC_RELAXED))
+			th->bytes += (uint64_t) bytes;
+
+		for(off = 0; off < (size_t) bytes; off += n){
+			n = mpd_response_feed(&c->res, buf + off, (size_t) bytes - off);
+
+			if(!c->res.done)
+				continue;
+
+			if(__atomic_load_n(&recording, __ATOMIC_RELAXED)){
+				us = now_us() - c->sent;
+				th->requests++;
+				th->counts[histogram_bucket(us, SUB_BITS, BUCKETS)]++;
+				if(us > th->max)
+					th->max = us;
+				if(c->res.status != MPD_OK)
+					th->errors++;
+			}
+
+			// One command at a time, nothing else should follow
+			if(off + n < (size_t) bytes || send_command(c) < 0)
+				return -1;
+		}
+	}
+}
+
+static void *
+th_load(void *arg)
+{
+	thread_t *th = arg;
+	struct epoll_event events[64];
+	client_t *c;
+	char *buf;
+	int i, n;
+
+	if((buf = malloc(BUF_SIZE)) == NULL)
+		return NULL;
+
+	for(i = 0; i < th->n_clients; i++){
+		if(send_command(&th->clients[i]) < 0)
+			fprintf(stderr, "send: %s\n", strerror(errno));
+	}
+
+	while(!__atomic_load_n(&stopping, __ATOMIC_RELAXED)){
+		if((n = epoll_wait(th->epfd, events, 64, 100)) < 0){
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		for(i = 0; i < n; i++){
+			c = events[i].data.ptr;
+
+			if(c->fd < 0)
+				continue;
+
+			if((events[i].events & EPOLLOUT) && c->cmd_len > 0 && send_command(c) < 0)
+				goto broken;
+
+			if((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && receive(th, c, buf) < 0)
+				goto broken;
+
+			continue;
+broken:
+			fprintf(stderr, "connection %d broke\n", (int) (c - th->clients));
+			epoll_ctl(th->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+			close(c->fd);
+			c->fd = -1;
+		}
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+/**
+ * Connect a client and read the server's greeting.
+ *
+ * */
+static int
+client_connect(client_t *c, struct addrinfo *addr)
+{
+	char greeting[256];
+	ssize_t n;
+	size_t len = 0;
+	int opt = 1;
+
+	if((c->fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0)
+		return -1;
+
+	if(connect(c->fd, addr->ai_addr, addr->ai_addrlen) < 0)
+		goto error;
+
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof opt);
+
+	while(len == 0 || greeting[len - 1] != '\n'){
+		if(len == sizeof greeting || (n = recv(c->fd, greeting + len, sizeof greeting - len, 0)) <= 0)
+			goto error;
+		len += (size_t) n;
+	}
+
+	if(len < 7 || memcmp(greeting, "OK MPD ", 7) != 0){
+		errno = EPROTO;
+		goto error;
+	}
+
+	if(fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0)
+		goto error;
+
+	return 0;
+
+error:
+	close(c->fd);
+	c->fd = -1;
+	return -1;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-t threads] [-d seconds] [-w seconds] [-m command]...\n", name);
+	fprintf(stderr, "  -h host         server to connect to (default: 127.0.0.1)\n");
+	fprintf(stderr, "  -p port         its port (default: 6600)\n");
+	fprintf(stderr, "  -c connections  clients, each sending a command once the previous one is answered (default: 64)\n");
+	fprintf(stderr, "  -t threads      threads the clients are spread over (default: number of CPUs)\n");
+	fprintf(stderr, "  -d seconds      how long to measure (default: 10)\n");
+	fprintf(stderr, "  -w seconds      how long to warm up first (default: 1)\n");
+	fprintf(stderr, "  -m command      command to send, repeat for a mix each client cycles through (default: status)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1", *port = "6600";
+	int n_clients = 64, n_threads = (int) sysconf(_SC_NPROCESSORS_ONLN), duration = 10, warmup = 1;
+	struct addrinfo hints, *addr;
+	struct epoll_event ev;
+	struct timespec ts;
+	uint64_t requests = 0, errors = 0, bytes = 0, max = 0, total, seen, start, elapsed;
+	uint64_t counts[BUCKETS];
+	double percentiles[] = { 50.0, 99.0, 99.9 };
+	thread_t *threads;
+	client_t *c;
+	unsigned int b;
+	char *line;
+	size_t len;
+	int opt, err, i, j, k;
+
+	while((opt = getopt(argc, argv, "h:p:c:t:d:w:m:")) != -1){
+		switch(opt){
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'c':
+				n_clients = atoi(optarg);
+				break;
+			case 't':
+				n_threads = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'w':
+				warmup = atoi(optarg);
+				break;
+			case 'm':
+				if(n_commands == MAX_COMMANDS){
+					fprintf(stderr, "At most %d commands\n", MAX_COMMANDS);
+					return 1;
+				}
+
+				len = strlen(optarg);
+				if((line = malloc(len + 2)) == NULL){
+					perror("malloc");
+					return 1;
+				}
+				memcpy(line, optarg, len);
+				line[len] = '\n';
+				line[len + 1] = '\0';
+				commands[n_commands] = line;
+				command_lens[n_commands++] = len + 1;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(n_clients < 1 || n_threads < 1 || duration < 1 || warmup < 0){
+		usage(argv[0]);
+		return 1;
+	}
+
+	if(n_threads > n_clients)
+		n_threads = n_clients;
+
+	if(n_commands == 0){
+		commands[0] = "status\n";
+		command_lens[n_commands++] = 7;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if((err = getaddrinfo(host, port, &hints, &addr)) != 0){
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		return 1;
+	}
+
+	if((threads = calloc((size_t) n_threads, sizeof(thread_t))) == NULL){
+		perror("calloc");
+		return 1;
+	}
+
+	for(i = 0, k = 0; i < n_threads; i++){
+		threads[i].n_clients = n_clients / n_threads + (i < n_clients % n_threads);
+
+		if((threads[i].clients = calloc((size_t) threads[i].n_clients, sizeof(client_t))) == NULL ||
+				(threads[i].epfd = epoll_create1(0)) < 0){
+			perror("thread");
+			return 1;
+		}
+
+		for(j = 0; j < threads[i].n_clients; j++, k++){
+			c = &threads[i].clients[j];
+
+			if(client_connect(c, addr) < 0){
+				fprintf(stderr, "connect %s:%s: %s\n", host, port, strerror(errno));
+				return 1;
+			}
+
+			// Spread the mix, not all clients send the same command at once
+			c->next = k % n_commands;
+
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+			ev.data.ptr = c;
+			if(epoll_ctl(threads[i].epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0){
+				perror("epoll_ctl");
+				return 1;
+			}
+		}
+	}
+
+	freeaddrinfo(addr);
+
+	for(i = 0; i < n_threads; i++){
+		if((err = pthread_create(&threads[i].th_id, NULL, &th_load, &threads[i])) != 0){
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			return 1;
+		}
+	}
+
+	ts.tv_sec = warmup;
+	ts.tv_nsec = 0;
+	nanosleep(&ts, NULL);
+
+	__atomic_store_n(&recording, TRUE, __ATOMIC_RELAXED);
+	start = now_us();
+
+	ts.tv_sec = duration;
+	nanosleep(&ts, NULL);
+
+	__atomic_store_n(&recording, FALSE, __ATOMIC_RELAXED);
+	elapsed = now_us() - start;
+	__atomic_store_n(&stopping, TRUE, __ATOMIC_RELAXED);
+
+	memset(counts, 0, sizeof counts);
+
+	for(i = 0; i < n_threads; i++){
+		pthread_join(threads[i].th_id, NULL);
+
+		requests += threads[i].requests;
+		errors += threads[i].errors;
+		bytes += threads[i].bytes;
+		if(threads[i].max > max)
+			max = threads[i].max;
+
+		for(b = 0; b < BUCKETS; b++)
+			counts[b] += threads[i].counts[b];
+	}
+
+	printf("%s:%s, %d connections on %d threads, %d command(s)\n", host, port, n_clients, n_threads, n_commands);
+	printf("requests    %lu in %.2f s, %lu errors\n", (unsigned long) requests, (double) elapsed / 1e6, (unsigned long) errors);
+	printf("throughput  %.0f req/s, %.2f MB/s\n", (double) requests * 1e6 / (double) elapsed,
+			(double) bytes / (double) elapsed);
+
+	printf("latency    ");
+	for(i = 0; i < (int) (sizeof percentiles / sizeof percentiles[0]); i++){
+		total = (uint64_t) ((double) requests * percentiles[i] / 100.0 + 0.5);
+
+		for(b = 0, seen = 0; b < BUCKETS - 1 && seen + counts[b] < total; b++)
+			seen += counts[b];
+
+		printf(" p%g %lu us", percentiles[i], requests > 0 ? (unsigned long) histogram_value(b, SUB_BITS) : 0UL);
+	}
+	printf(" max %lu us\n", (unsigned long) max);
+
+	return 0;
+}
@@ -0,0 +1,540 @@
+/*
+ * mockmpd.c - mock MPD server for benchmarks
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define TRUE 1
+#define FALSE 0
+
+#define GREETING "OK MPD 0.23.5\n"
+
+// Bytes of requests buffered per connection, the longest line accepted
+#define IN_SIZE 65536
+
+// Songs per album of the synthetic library
+#define ALBUM_SONGS 10
+
+#define BINARY_LIMIT 8192
+
+typedef struct buf_t {
+	char *data;
+	size_t len;
+	size_t size;
+} buf_t;
+
+typedef struct client_t {
+	int fd;
+
+	char in[IN_SIZE];
+	size_t in_len;
+	char line[IN_SIZE];
+	buf_t out;
+
+	size_t binary_limit;
+	int list;
+	int list_ok;
+	int list_failed;
+	int list_index;
+} client_t;
+
+static buf_t library;
+static buf_t listing;
+static char *picture;
+static size_t picture_size = 65536;
+static int songs = 10000;
+static int idle_interval;
+
+static int
+buf_grow(buf_t *buf, size_t len)
+{
+	char *data;
+	size_t size = buf->size ? buf->size : 4096;
+
+	while(size < buf->len + len)
+		size *= 2;
+
+	if(size == buf->size)
+		return 0;
+
+	if((data = realloc(buf->data, size)) == NULL)
+		return -1;
+
+	buf->data = data;
+	buf->size = size;
+
+	return 0;
+}
+
+static int
+buf_add(buf_t *buf, const char *data, size_t len)
+{
+	if(buf_grow(buf, len) < 0)
+		return -1;
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+
+	return 0;
+}
+
+static int __attribute__((format(printf, 2, 3)))
+buf_printf(buf_t *buf, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if(n < 0 || buf_grow(buf, (size_t) n + 1) < 0)
+		return -1;
+
+	va_start(ap, fmt);
+	vsnprintf(buf->data + buf->len, (size_t) n + 1, fmt, ap);
+	va_end(ap);
+
+	buf->len += (size_t) n;
+
+	return 0;
+}
+
+/**
+ * Render the synthetic library once: songs spread over albums of
+ * ALBUM_SONGS, ten albums per artist, with the tags MPD usually sends.
+ *
+ * */
+static int
+library_init(void)
+{
+	int i, artist, album, track;
+
+	for(i = 0; i < songs; i++){
+		artist = i / (ALBUM_SONGS * 10);
+		album = i / ALBUM_SONGS % 10;
+		track = i % ALBUM_SONGS + 1;
+
+		if(track == 1){
+			if(album == 0 && (buf_printf(&library, "directory: Artist%d\n", artist) < 0 ||
+						buf_printf(&listing, "directory: Artist%d\n", artist) < 0))
+				return -1;
+
+			if(buf_printf(&library, "directory: Artist%d/Album%d\nLast-Modified: 2024-01-01T00:00:00Z\n", artist, album) < 0 ||
+					buf_printf(&listing, "directory: Artist%d/Album%d\n", artist, album) < 0)
+				return -1;
+		}
+
+		if(buf_printf(&library, "file: Artist%d/Album%d/%02d - Song %d.flac\n"
+					"Last-Modified: 2024-01-01T00:00:00Z\n"
+					"Format: 44100:16:2\n"
+					"Artist: Artist %d\n"
+					"AlbumArtist: Artist %d\n"
+					"Title: Song %d\n"
+					"Album: Album %d\n"
+					"Track: %d\n"
+					"Date: 2024\n"
+					"Genre: Rock\n"
+					"Time: 240\n"
+					"duration: 240.000\n",
+					artist, album, track, i, artist, artist, i, album, track) < 0 ||
+				buf_printf(&listing, "file: Artist%d/Album%d/%02d - Song %d.flac\n", artist, album, track, i) < 0)
+			return -1;
+	}
+
+	if((picture = malloc(picture_size > 0 ? picture_size : 1)) == NULL)
+		return -1;
+
+	for(i = 0; (size_t) i < picture_size; i++)
+		picture[i] = (char) (i * 31);
+
+	return 0;
+}
+
+static int
+flush_out(client_t *c)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while(off < c->out.len){
+		if((n = send(c->fd, c->out.data + off, c->out.len - off, MSG_NOSIGNAL)) < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		off += (size_t) n;
+	}
+
+	c->out.len = 0;
+
+	return 0;
+}
+
+static int
+ack(client_t *c, int code, const char *cmd, const char *msg)
+{
+	c->list_failed = TRUE;
+
+	return buf_printf(&c->out, "ACK [%d@%d] {%s} %s\n", code, c->list ? c->list_index : 0, cmd, msg);
+}
+
+/**
+ * The song or picture an albumart or readpicture asks for, from offset.
+ *
+ * */
+static int
+binary(client_t *c, const char *cmd, const char *args)
+{
+	const char *off;
+	size_t offset = 0, len;
+
+	if(*args == '\0')
+		return ack(c, 2, cmd, "wrong number of arguments");
+
+	if((off = strrchr(args, ' ')) != NULL)
+		offset = (size_t) strtoul(off + 1, NULL, 10);
+
+	if(offset > picture_size)
+		return ack(c, 2, cmd, "Bad file offset");
+
+	len = picture_size - offset < c->binary_limit ? picture_size - offset : c->binary_limit;
+
+	if(buf_printf(&c->out, "size: %zu\n", picture_size) < 0 || (strcmp(cmd, "readpicture") == 0 &&
+				buf_printf(&c->out, "type: image/jpeg\n") < 0) || buf_printf(&c->out, "binary: %zu\n", len) < 0 ||
+			buf_add(&c->out, picture + offset, len) < 0 || buf_add(&c->out, "\n", 1) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Wait for noidle, telling about a changed player every idle_interval
+ * milliseconds if set. Returns -1 if the client went away.
+ *
+ * */
+static int
+idle(client_t *c)
+{
+	struct pollfd pfd = { c->fd, POLLIN, 0 };
+	ssize_t n;
+	int ret;
+
+	if(flush_out(c) < 0)
+		return -1;
+
+	for(;;){
+		// A noidle may have come in with the idle
+		if(c->in_len == 0){
+			if((ret = poll(&pfd, 1, idle_interval > 0 ? idle_interval : -1)) < 0){
+				if(errno == EINTR)
+					continue;
+				return -1;
+			}
+
+			if(ret == 0)
+				return buf_printf(&c->out, "changed: player\n");
+
+			if((n = recv(c->fd, c->in, IN_SIZE, 0)) <= 0)
+				return -1;
+			c->in_len = (size_t) n;
+		}
+
+		if(c->in_len >= 7 && memcmp(c->in, "noidle\n", 7) == 0){
+			memmove(c->in, c->in + 7, c->in_len - 7);
+			c->in_len -= 7;
+			return 0;
+		}
+
+		// MPD closes the connection of clients sending anything else
+		return -1;
+	}
+}
+
+/**
+ * Run a command, its response goes to the output buffer but for the final OK.
+ * Returns -1 if the connection should be closed.
+ *
+ * */
+static int
+command(client_t *c, char *line)
+{
+	char *args;
+
+	if((args = strchr(line, ' ')) != NULL)
+		*args++ = '\0';
+	else
+		args = line + strlen(line);
+
+	if(strcmp(line, "ping") == 0 || strcmp(line, "noidle") == 0 || strcmp(line, "password") == 0 ||
+			strcmp(line, "tagtypes") == 0 || strcmp(line, "clearerror") == 0)
+		return 0;
+
+	if(strcmp(line, "status") == 0)
+		return buf_printf(&c->out, "volume: 50\nrepeat: 0\nrandom: 0\nsingle: 0\nconsume: 0\npartition: default\n"
+				"playlist: 7\nplaylistlength: %d\nmixrampdb: 0\nstate: play\nsong: 3\nsongid: 4\ntime: 61:240\n"
+				"elapsed: 61.137\nbitrate: 912\nduration: 240.000\naudio: 44100:16:2\nnextsong: 4\nnextsongid: 5\n",
+				songs < 100 ? songs : 100);
+
+	if(strcmp(line, "currentsong") == 0)
+		return buf_printf(&c->out, "file: Artist0/Album0/04 - Song 3.flac\nLast-Modified: 2024-01-01T00:00:00Z\n"
+				"Artist: Artist 0\nTitle: Song 3\nAlbum: Album 0\nTrack: 4\nTime: 240\nduration: 240.000\n"
+				"Pos: 3\nId: 4\n");
+
+	if(strcmp(line, "stats") == 0)
+		return buf_printf(&c->out, "artists: %d\nalbums: %d\nsongs: %d\nuptime: 3600\nplaytime: 600\n"
+				"db_playtime: %d\ndb_update: 1704067200\n", (songs + ALBUM_SONGS * 10 - 1) / (ALBUM_SONGS * 10),
+				(songs + ALBUM_SONGS - 1) / ALBUM_SONGS, songs, songs * 240);
+
+	if(strcmp(line, "listallinfo") == 0)
+		return buf_add(&c->out, library.data, library.len);
+
+	if(strcmp(line, "listall") == 0)
+		return buf_add(&c->out, listing.data, listing.len);
+
+	if(strcmp(line, "albumart") == 0 || strcmp(line, "readpicture") == 0)
+		return binary(c, line, args);
+
+	if(strcmp(line, "binarylimit") == 0){
+		c->binary_limit = (size_t) strtoul(args, NULL, 10);
+		if(c->binary_limit < 64)
+			c->binary_limit = 64;
+		return 0;
+	}
+
+	if(strcmp(line, "idle") == 0){
+		if(c->list)
+			return ack(c, 2, line, "idle not allowed in command list");
+		return idle(c);
+	}
+
+	return ack(c, 5, line, "unknown command");
+}
+
+/**
+ * Handle a line, in or out of a command list.
+ *
+ * */
+static int
+handle(client_t *c, char *line)
+{
+	size_t before;
+
+	if(strcmp(line, "command_list_begin") == 0 || strcmp(line, "command_list_ok_begin") == 0){
+		c->list = TRUE;
+		c->list_ok = strcmp(line, "command_list_ok_begin") == 0;
+		c->list_failed = FALSE;
+		c->list_index = 0;
+		return 0;
+	}
+
+	if(c->list){
+		if(strcmp(line, "command_list_end") == 0){
+			c->list = FALSE;
+			return c->list_failed ? 0 : buf_add(&c->out, "OK\n", 3);
+		}
+
+		// Commands after a failed one are skipped
+		if(c->list_failed)
+			return 0;
+
+		if(command(c, line) < 0)
+			return -1;
+
+		if(!c->list_failed && c->list_ok && buf_add(&c->out, "list_OK\n", 8) < 0)
+			return -1;
+
+		c->list_index++;
+		return 0;
+	}
+
+	before = c->out.len;
+	c->list_failed = FALSE;
+
+	if(command(c, line) < 0)
+		return -1;
+
+	// An ACK ends the response by itself
+	if(c->list_failed && c->out.len > before)
+		return 0;
+
+	return buf_add(&c->out, "OK\n", 3);
+}
+
+static void *
+th_client(void *arg)
+{
+	client_t *c = arg;
+	size_t len;
+	ssize_t n;
+	char *nl;
+
+	if(send(c->fd, GREETING, sizeof GREETING - 1, MSG_NOSIGNAL) < 0)
+		goto out;
+
+	for(;;){
+		if((n = recv(c->fd, c->in + c->in_len, IN_SIZE - c->in_len, 0)) <= 0){
+			if(n < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		c->in_len += (size_t) n;
+
+		while((nl = memchr(c->in, '\n', c->in_len)) != NULL){
+			len = (size_t) (nl - c->in);
+			memcpy(c->line, c->in, len);
+			c->line[len] = '\0';
+
+			// Idle reads from the front of the buffer
+			memmove(c->in, nl + 1, c->in_len - len - 1);
+			c->in_len -= len + 1;
+
+			if(handle(c, c->line) < 0)
+				goto out;
+		}
+
+		// A line longer than the buffer is not MPD's either
+		if(c->in_len == IN_SIZE)
+			break;
+
+		// Pipelined requests are answered in one go
+		if(c->out.len > 0 && flush_out(c) < 0)
+			break;
+	}
+
+out:
+	close(c->fd);
+	free(c->out.data);
+	free(c);
+
+	return NULL;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-l host] [-p port] [-s songs] [-a bytes] [-i ms]\n", name);
+	fprintf(stderr, "  -l host   address to listen on (default: 127.0.0.1)\n");
+	fprintf(stderr, "  -p port   port to listen on (default: 6600)\n");
+	fprintf(stderr, "  -s songs  songs in the synthetic library (default: 10000)\n");
+	fprintf(stderr, "  -a bytes  size of the album art and pictures (default: 65536)\n");
+	fprintf(stderr, "  -i ms     tell idling clients the player changed every ms milliseconds (default: never)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1", *port = "6600";
+	struct addrinfo hints, *addr, *p;
+	pthread_attr_t attr;
+	pthread_t th_id;
+	client_t *c;
+	int fd, sock, opt, err;
+
+	while((opt = getopt(argc, argv, "l:p:s:a:i:h")) != -1){
+		switch(opt){
+			case 'l':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 's':
+				songs = atoi(optarg);
+				break;
+			case 'a':
+				picture_size = (size_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'i':
+				idle_interval = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if(library_init() < 0){
+		perror("library");
+		return 1;
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if((err = getaddrinfo(host, port, &hints, &addr)) != 0){
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		return 1;
+	}
+
+	for(p = addr, sock = -1; p != NULL; p = p->ai_next){
+		if((sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+			continue;
+
+		opt = 1;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+
+		if(bind(sock, p->ai_addr, p->ai_addrlen) == 0 && listen(sock, 1024) == 0)
+			break;
+
+		close(sock);
+		sock = -1;
+	}
+
+	freeaddrinfo(addr);
+
+	if(sock < 0){
+		perror("bind");
+		return 1;
+	}
+
+	fprintf(stderr, "Serving %d songs (%zu bytes of listallinfo) on %s:%s\n", songs, library.len, host, port);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 256 * 1024);
+
+	for(;;){
+		if((fd = accept(sock, NULL, NULL)) < 0){
+			if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+				continue;
+			perror("accept");
+			return 1;
+		}
+
+		opt = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof opt);
+
+		if((c = calloc(1, sizeof(client_t))) == NULL){
+			close(fd);
+			continue;
+		}
+
+		c->fd = fd;
+		c->binary_limit = BINARY_LIMIT;
+
+		if(pthread_create(&th_id, &attr, &th_client, c) != 0){
+			close(fd);
+			free(c);
+		}
+	}
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# run.sh - benchmark mpdproxy against the mock MPD server
+#
+# Florian Dejonckheere <florian@floriandejonckheere.be>
+#
+# Starts bench/mockmpd and mpdproxy in front of it, then runs bench/loadgen
+# with the given arguments directly against the mock and through the proxy.
+# MOCK_PORT, PROXY_PORT and THREADS override the defaults, MOCK_ARGS and
+# PROXY_CONF (extra configuration lines) are passed on. Without PROXY_CONF
+# the response and album art caches are disabled, so the proxy relays every
+# command.
+#
+#   $ make bench && bench/run.sh -c 64 -d 10 -m status -m listallinfo
+#
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+MOCK_PORT=${MOCK_PORT:-6671}
+PROXY_PORT=${PROXY_PORT:-6674}
+THREADS=${THREADS:-2}
+PROXY_CONF=${PROXY_CONF:-"CacheSize 0
+ArtCacheSize 0"}
+CONF=$(mktemp)
+
+cleanup() {
+	[ -n "$PROXY" ] && kill -INT "$PROXY" 2>/dev/null && wait "$PROXY" 2>/dev/null
+	[ -n "$MOCK" ] && kill "$MOCK" 2>/dev/null && wait "$MOCK" 2>/dev/null
+	rm -f "$CONF"
+}
+trap cleanup EXIT INT TERM
+
+cat > "$CONF" <<EOF
+Host 127.0.0.1
+Port $MOCK_PORT
+Listen 127.0.0.1
+ProxyPort $PROXY_PORT
+Protocol mpd
+Threads $THREADS
+LogLevel warning
+$PROXY_CONF
+EOF
+
+"$DIR/mockmpd" -p "$MOCK_PORT" $MOCK_ARGS 2>/dev/null &
+MOCK=$!
+sleep 1
+"$DIR/../mpdproxy" -c "$CONF" &
+PROXY=$!
+sleep 1
+
+echo "== mock"
+"$DIR/loadgen" -p "$MOCK_PORT" "$@" || exit 1
+echo
+echo "== mpdproxy ($(echo "$PROXY_CONF" | paste -sd, -))"
+"$DIR/loadgen" -p "$PROXY_PORT" "$@"
@@ -0,0 +1,78 @@
+/*
+ * buffer.c - reference counted buffers
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+// Smallest buffer allocated
+#define BUFFER_MIN 4096
+
+/**
+ * Append data to a buffer nobody else holds a reference to yet, growing it as
+ * needed. A NULL buffer starts a new one. Returns the buffer, which may have
+ * moved, or NULL if it could not grow; the original is left untouched then.
+ *
+ * */
+buffer_t *
+buffer_append(buffer_t *buf, const char *data, size_t len)
+{
+	size_t used = buf ? buf->len : 0, size = buf ? buf->size : BUFFER_MIN;
+	buffer_t *tmp;
+
+	while(size < used + len)
+		size *= 2;
+
+	if(buf == NULL || size != buf->size){
+		if((tmp = realloc(buf, sizeof(buffer_t) + size)) == NULL)
+			return NULL;
+
+		buf = tmp;
+		buf->refs = 1;
+		buf->len = used;
+		buf->size = size;
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+
+	return buf;
+}
+
+/**
+ * Give back the room a buffer grew into but does not use, before it is kept
+ * around.
+ *
+ * */
+buffer_t *
+buffer_trim(buffer_t *buf)
+{
+	buffer_t *tmp;
+
+	if(buf->len == buf->size || (tmp = realloc(buf, sizeof(buffer_t) + buf->len)) == NULL)
+		return buf;
+
+	tmp->size = tmp->len;
+
+	return tmp;
+}
+
+buffer_t *
+buffer_get(buffer_t *buf)
+{
+	buf->refs++;
+
+	return buf;
+}
+
+void
+buffer_put(buffer_t *buf)
+{
+	if(buf != NULL && --buf->refs == 0)
+		free(buf);
+}
@@ -0,0 +1,31 @@
+/*
+ * buffer.h - reference counted buffers
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+/**
+ * Data shared by the connections of an event loop thread, such as a response
+ * sent to several clients. The last reference frees it; buffers are never
+ * shared across threads, the count is not atomic.
+ *
+ * */
+typedef struct buffer_t {
+	int refs;
+	size_t len;
+	size_t size;
+	char data[];
+} buffer_t;
+
+buffer_t *buffer_append(buffer_t *buf, const char *data, size_t len);
+buffer_t *buffer_trim(buffer_t *buf);
+buffer_t *buffer_get(buffer_t *buf);
+void buffer_put(buffer_t *buf);
+
+#endif
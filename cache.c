@@ -0,0 +1,296 @@
+/*
+ * cache.c - response cache for read-only commands
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "event.h"
+#include "protocol.h"
+#include "list.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// Counters are only written by the worker, but read by the main thread
+#define count(c) __atomic_store_n(&(c), (c) + 1, __ATOMIC_RELAXED)
+
+/**
+ * Cacheable commands and the subsystems their response depends on. Timed
+ * responses also change as time goes by, they expire after CACHE_TTL.
+ *
+ * */
+static const struct {
+	const char *command;
+	unsigned int mask;
+	int timed;
+} cacheable[] = {
+	{ "status", MPD_IDLE_PLAYER | MPD_IDLE_MIXER | MPD_IDLE_OPTIONS | MPD_IDLE_PLAYLIST | MPD_IDLE_UPDATE | MPD_IDLE_PARTITION, FALSE },
+	{ "currentsong", MPD_IDLE_PLAYER | MPD_IDLE_PLAYLIST | MPD_IDLE_DATABASE, FALSE },
+	{ "outputs", MPD_IDLE_OUTPUT, FALSE },
+	{ "stats", MPD_IDLE_DATABASE | MPD_IDLE_UPDATE | MPD_IDLE_PLAYER, TRUE },
+	{ "listplaylists", MPD_IDLE_STORED_PLAYLIST, FALSE },
+	{ "playlistinfo", MPD_IDLE_PLAYLIST | MPD_IDLE_DATABASE, FALSE },
+	{ "replay_gain_status", MPD_IDLE_OPTIONS, FALSE },
+	{ "decoders", 0, FALSE },
+};
+
+#define N_CACHEABLE (sizeof(cacheable) / sizeof(cacheable[0]))
+
+void
+cache_init(cache_t *cache, size_t max_size)
+{
+	memset(cache, 0, sizeof(cache_t));
+	INIT_LIST_HEAD(&cache->entries);
+	INIT_LIST_HEAD(&cache->flights);
+	cache->max_size = max_size;
+}
+
+static void
+drop(cache_t *cache, cache_entry_t *entry)
+{
+	list_del(&entry->list);
+	cache->size -= entry->buf->len;
+	buffer_put(entry->buf);
+	free(entry);
+}
+
+void
+cache_destroy(cache_t *cache)
+{
+	cache_entry_t *entry, *tmp;
+	flight_t *flight, *f_tmp;
+
+	list_for_each_entry_safe(entry, tmp, &cache->entries, list)
+		drop(cache, entry);
+
+	list_for_each_entry_safe(flight, f_tmp, &cache->flights, list)
+		cache_land(flight);
+}
+
+/**
+ * Index of the cacheable command a normalized key starts with, -1 if none.
+ *
+ * */
+static int
+command(const char *key, size_t key_len)
+{
+	size_t n;
+	unsigned int i;
+
+	for(n = 0; n < key_len && key[n] != ' '; n++);
+
+	for(i = 0; i < N_CACHEABLE; i++){
+		if(strlen(cacheable[i].command) == n && strncmp(key, cacheable[i].command, n) == 0)
+			return (int) i;
+	}
+
+	return -1;
+}
+
+/**
+ * Normalize a command line into key: surrounding whitespace is dropped and
+ * runs of whitespace outside of quotes become a single space. Returns the
+ * length of the key, or 0 if the command's response is not cacheable.
+ *
+ * */
+size_t
+cache_key(char *key, const char *line, size_t len)
+{
+	size_t i, n = 0;
+	int quoted = FALSE, space = FALSE;
+
+	for(i = 0; i < len && n < MPD_LINE_SIZE - 1; i++){
+		char c = line[i];
+
+		if(!quoted && (c == ' ' || c == '\t' || c == '\r')){
+			space = (n > 0);
+			continue;
+		}
+
+		if(space){
+			key[n++] = ' ';
+			space = FALSE;
+			if(n == MPD_LINE_SIZE - 1)
+				break;
+		}
+
+		if(c == '"' && (n == 0 || key[n - 1] != '\\'))
+			quoted = !quoted;
+
+		key[n++] = c;
+	}
+
+	// Too long to be sure two keys do not collide
+	if(i < len)
+		return 0;
+
+	key[n] = '\0';
+
+	return command(key, n) < 0 ? 0 : n;
+}
+
+/**
+ * Subsystems the response to a normalized key depends on.
+ *
+ * */
+unsigned int
+cache_depends(const char *key, size_t key_len)
+{
+	int i;
+
+	return (i = command(key, key_len)) < 0 ? 0 : cacheable[i].mask;
+}
+
+/**
+ * Look up the response to a command. The buffer stays owned by the cache,
+ * take a reference to keep it.
+ *
+ * */
+buffer_t *
+cache_lookup(cache_t *cache, const char *key, size_t key_len)
+{
+	cache_entry_t *entry, *tmp;
+
+	list_for_each_entry_safe(entry, tmp, &cache->entries, list){
+		if(entry->key_len != key_len || memcmp(entry->key, key, key_len) != 0)
+			continue;
+
+		if(entry->expires && entry->expires <= loop_now()){
+			drop(cache, entry);
+			break;
+		}
+
+		// Most recently used first
+		list_move(&entry->list, &cache->entries);
+
+		count(cache->hits);
+
+		return entry->buf;
+	}
+
+	count(cache->misses);
+
+	return NULL;
+}
+
+/**
+ * Store a complete (OK) response, evicting the least recently used entries
+ * to make room for it. The cache takes a reference to the buffer.
+ *
+ * */
+void
+cache_store(cache_t *cache, const char *key, size_t key_len, buffer_t *buf)
+{
+	cache_entry_t *entry, *tmp;
+	size_t len = buf->len;
+	int i;
+
+	if((i = command(key, key_len)) < 0 || len > cache->max_size / 4)
+		return;
+
+	list_for_each_entry_safe(entry, tmp, &cache->entries, list){
+		if(entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0)
+			drop(cache, entry);
+	}
+
+	while(cache->size + len > cache->max_size && !list_empty(&cache->entries))
+		drop(cache, list_entry(cache->entries.prev, cache_entry_t, list));
+
+	if((entry = malloc(sizeof(cache_entry_t))) == NULL)
+		return;
+
+	memcpy(entry->key, key, key_len);
+	entry->key[key_len] = '\0';
+	entry->key_len = key_len;
+	entry->mask = cacheable[i].mask;
+	entry->buf = buffer_get(buf);
+
+	// Elapsed time, bitrate and such move on while playing
+	entry->expires = 0;
+	if(cacheable[i].timed || memmem(buf->data, len, "\nstate: play\n", sizeof("\nstate: play\n") - 1) != NULL)
+		entry->expires = loop_now() + CACHE_TTL;
+
+	list_add(&entry->list, &cache->entries);
+	cache->size += len;
+}
+
+/**
+ * Drop the responses depending on any of the subsystems in mask. All of
+ * them go if all subsystems changed, as after MPD restarted.
+ *
+ * */
+void
+cache_invalidate(cache_t *cache, unsigned int mask)
+{
+	cache_entry_t *entry, *tmp;
+
+	cache->epoch++;
+
+	list_for_each_entry_safe(entry, tmp, &cache->entries, list){
+		if((entry->mask & mask) || mask == MPD_IDLE_ALL)
+			drop(cache, entry);
+	}
+}
+
+/**
+ * A command missed the cache and goes upstream, other sessions sending it
+ * can wait on the flight. Returns NULL if it cannot be tracked.
+ *
+ * */
+flight_t *
+cache_depart(cache_t *cache, const char *key, size_t key_len)
+{
+	flight_t *flight;
+
+	if((flight = malloc(sizeof(flight_t))) == NULL)
+		return NULL;
+
+	memcpy(flight->key, key, key_len);
+	flight->key[key_len] = '\0';
+	flight->key_len = key_len;
+	flight->epoch = cache->epoch;
+	INIT_LIST_HEAD(&flight->waiters);
+
+	list_add(&flight->list, &cache->flights);
+
+	return flight;
+}
+
+/**
+ * Find the flight a command can wait on. A flight that left before the last
+ * change may bring back an outdated response, it is not joined.
+ *
+ * */
+flight_t *
+cache_join(cache_t *cache, const char *key, size_t key_len)
+{
+	flight_t *flight;
+
+	list_for_each_entry(flight, &cache->flights, list){
+		if(flight->epoch == cache->epoch && flight->key_len == key_len && memcmp(flight->key, key, key_len) == 0){
+			count(cache->coalesced);
+			return flight;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * The flight is over, its waiters must have been taken off it.
+ *
+ * */
+void
+cache_land(flight_t *flight)
+{
+	list_del(&flight->list);
+	free(flight);
+}
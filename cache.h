@@ -0,0 +1,86 @@
+/*
+ * cache.h - response cache for read-only commands
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "buffer.h"
+#include "list.h"
+
+// Milliseconds an answer that changes with time alone (status while
+// playing, stats) is served from the cache
+#define CACHE_TTL 1000
+
+/**
+ * A cached response, keyed by the normalized command line.
+ *
+ * */
+typedef struct cache_entry_t {
+	struct list_head list;
+
+	char key[MPD_LINE_SIZE];
+	size_t key_len;
+
+	unsigned int mask;
+	uint64_t expires;
+
+	buffer_t *buf;
+} cache_entry_t;
+
+/**
+ * A read-only command on its way to upstream. Sessions sending the same
+ * command meanwhile wait on it, and are answered with the same response.
+ *
+ * */
+typedef struct flight_t {
+	struct list_head list;
+
+	char key[MPD_LINE_SIZE];
+	size_t key_len;
+	uint64_t epoch;
+
+	struct list_head waiters;
+} flight_t;
+
+/**
+ * Per-worker cache of responses to read-only commands. Entries are dropped
+ * as soon as one of the subsystems they depend on changes; the epoch counts
+ * these invalidations so a response that raced with one is not stored, and
+ * commands sent after one do not wait on a flight that left before it.
+ *
+ * */
+typedef struct cache_t {
+	struct list_head entries;
+	size_t size;
+	size_t max_size;
+	uint64_t epoch;
+
+	struct list_head flights;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long coalesced;
+} cache_t;
+
+void cache_init(cache_t *cache, size_t max_size);
+void cache_destroy(cache_t *cache);
+
+size_t cache_key(char *key, const char *line, size_t len);
+unsigned int cache_depends(const char *key, size_t key_len);
+buffer_t *cache_lookup(cache_t *cache, const char *key, size_t key_len);
+void cache_store(cache_t *cache, const char *key, size_t key_len, buffer_t *buf);
+void cache_invalidate(cache_t *cache, unsigned int mask);
+
+flight_t *cache_depart(cache_t *cache, const char *key, size_t key_len);
+flight_t *cache_join(cache_t *cache, const char *key, size_t key_len);
+void cache_land(flight_t *flight);
+
+#endif
@@ -5,29 +5,104 @@
  * 
  * */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "config.h"
+#include "log.h"
 
 #define MAX_LEN 255
 
 void config_init(config_t *config)
 {
 	memset(config, 0, sizeof(config_t));
+	config->connect_timeout = 5000;
+	config->pool_idle = 30000;
+	config->log_level = LOG_INFO;
 	config->host_srv = calloc(MAX_LEN, sizeof(char));
 	config->port_srv = calloc(MAX_LEN, sizeof(char));
 	config->host_prx = calloc(MAX_LEN, sizeof(char));
 	config->port_prx = calloc(MAX_LEN, sizeof(char));
+	config->mirror_file = calloc(MAX_LEN, sizeof(char));
+	config->art_cache_dir = calloc(MAX_LEN, sizeof(char));
+	config->metrics_host = calloc(MAX_LEN, sizeof(char));
+	config->metrics_port = calloc(MAX_LEN, sizeof(char));
+	config->access_log = calloc(MAX_LEN, sizeof(char));
+	config->capture = calloc(MAX_LEN, sizeof(char));
 }
 
 void config_destroy(config_t *config)
 {
+	int i;
+
+	for(i = 0; i < config->n_backends; i++){
+		free(config->backends[i].host);
+		free(config->backends[i].port);
+	}
+
 	free(config->host_srv);
 	free(config->port_srv);
 	free(config->host_prx);
 	free(config->port_prx);
+	free(config->mirror_file);
+	free(config->art_cache_dir);
+	free(config->metrics_host);
+	free(config->metrics_port);
+	free(config->access_log);
+	free(config->capture);
+}
+
+/**
+ * Parse a backend as host:port,weight,replica, where the port and options
+ * are optional and an IPv6 address is put between brackets.
+ *
+ * */
+static int
+config_backend(config_t *config, const char *value)
+{
+	config_backend_t *backend = &config->backends[config->n_backends];
+	const char *comma, *colon, *end, *opt;
+	size_t len;
+
+	if(config->n_backends == CONFIG_BACKENDS)
+		return -1;
+
+	backend->weight = 1;
+	backend->replica = 0;
+
+	end = (comma = strchr(value, ',')) ? comma : value + strlen(value);
+
+	// Options are a weight, or replica for a read-only server
+	for(opt = comma; opt != NULL; opt = strchr(opt + 1, ',')){
+		len = strcspn(opt + 1, ",");
+		if(len == sizeof("replica") - 1 && strncmp(opt + 1, "replica", len) == 0)
+			backend->replica = 1;
+		else if((backend->weight = atoi(opt + 1)) <= 0)
+			return -1;
+	}
+
+	colon = memrchr(value, ':', (size_t) (end - value));
+
+	// An IPv6 address without port has colons of its own
+	if(value[0] == '[')
+		colon = (colon && colon[-1] == ']') ? colon : NULL;
+	else if(colon && memchr(value, ':', (size_t) (colon - value)) != NULL)
+		colon = NULL;
+
+	backend->port = strndup(colon ? colon + 1 : "6600", colon ? (size_t) (end - colon - 1) : 4);
+
+	len = (size_t) ((colon ? colon : end) - value);
+	if(value[0] == '[' && len >= 2 && value[len - 1] == ']')
+		backend->host = strndup(value + 1, len - 2);
+	else
+		backend->host = strndup(value, len);
+
+	config->n_backends++;
+
+	return 0;
 }
 
 int config_read_file(config_t *config, FILE *fp){
@@ -56,6 +131,79 @@ int config_read_file(config_t *config, FILE *fp){
 			} else if(strncmp(token, "ProxyPort", sizeof("ProxyPort")) == 0){
 				strncpy(config->port_srv, value, MAX_LEN);
 				config->port_srv[MAX_LEN - 1] = '\0';
+			} else if(strncmp(token, "Backend", sizeof("Backend")) == 0){
+				if(config_backend(config, value) < 0)
+					fprintf(stderr, "[config] Invalid backend: %s\n", value);
+			} else if(strncmp(token, "Balance", sizeof("Balance")) == 0){
+				if(strcmp(value, "latency") == 0)
+					config->balance = BALANCE_LATENCY;
+				else
+					config->balance = BALANCE_CONNECTIONS;
+			} else if(strncmp(token, "Threads", sizeof("Threads")) == 0){
+				config->threads = atoi(value);
+			} else if(strncmp(token, "ConnectTimeout", sizeof("ConnectTimeout")) == 0){
+				config->connect_timeout = atoi(value);
+			} else if(strncmp(token, "PoolSize", sizeof("PoolSize")) == 0){
+				config->pool_size = atoi(value);
+			} else if(strncmp(token, "PoolIdleTimeout", sizeof("PoolIdleTimeout")) == 0){
+				config->pool_idle = atoi(value);
+			} else if(strncmp(token, "Multiplex", sizeof("Multiplex")) == 0){
+				config->multiplex = atoi(value);
+			} else if(strncmp(token, "CacheSize", sizeof("CacheSize")) == 0){
+				config->cache_size = atoi(value);
+			} else if(strncmp(token, "Mirror", sizeof("Mirror")) == 0){
+				config->mirror = (strcmp(value, "yes") == 0);
+			} else if(strncmp(token, "MirrorFile", sizeof("MirrorFile")) == 0){
+				strncpy(config->mirror_file, value, MAX_LEN);
+				config->mirror_file[MAX_LEN - 1] = '\0';
+			} else if(strncmp(token, "ArtCacheSize", sizeof("ArtCacheSize")) == 0){
+				config->art_cache_size = atoi(value);
+			} else if(strncmp(token, "ArtCacheDir", sizeof("ArtCacheDir")) == 0){
+				strncpy(config->art_cache_dir, value, MAX_LEN);
+				config->art_cache_dir[MAX_LEN - 1] = '\0';
+			} else if(strncmp(token, "ArtCacheDirSize", sizeof("ArtCacheDirSize")) == 0){
+				config->art_cache_dir_size = atoi(value);
+			} else if(strncmp(token, "ClientRate", sizeof("ClientRate")) == 0){
+				config->client_rate = atoi(value);
+			} else if(strncmp(token, "ClientBandwidth", sizeof("ClientBandwidth")) == 0){
+				config->client_bandwidth = atoi(value);
+			} else if(strncmp(token, "AddressRate", sizeof("AddressRate")) == 0){
+				config->address_rate = atoi(value);
+			} else if(strncmp(token, "AddressBandwidth", sizeof("AddressBandwidth")) == 0){
+				config->address_bandwidth = atoi(value);
+			} else if(strncmp(token, "MetricsListen", sizeof("MetricsListen")) == 0){
+				strncpy(config->metrics_host, value, MAX_LEN);
+				config->metrics_host[MAX_LEN - 1] = '\0';
+			} else if(strncmp(token, "MetricsPort", sizeof("MetricsPort")) == 0){
+				strncpy(config->metrics_port, value, MAX_LEN);
+				config->metrics_port[MAX_LEN - 1] = '\0';
+			} else if(strncmp(token, "AccessLog", sizeof("AccessLog")) == 0){
+				strncpy(config->access_log, value, MAX_LEN);
+				config->access_log[MAX_LEN - 1] = '\0';
+			} else if(strncmp(token, "Capture", sizeof("Capture")) == 0){
+				strncpy(config->capture, value, MAX_LEN);
+				config->capture[MAX_LEN - 1] = '\0';
+			} else if(strncmp(token, "LogLevel", sizeof("LogLevel")) == 0){
+				if(strcmp(value, "error") == 0)
+					config->log_level = LOG_ERROR;
+				else if(strcmp(value, "warning") == 0)
+					config->log_level = LOG_WARNING;
+				else if(strcmp(value, "debug") == 0)
+					config->log_level = LOG_DEBUG;
+				else
+					config->log_level = LOG_INFO;
+			} else if(strncmp(token, "Protocol", sizeof("Protocol")) == 0){
+				if(strcmp(value, "mpd") == 0)
+					config->protocol = PROTOCOL_MPD;
+				else
+					config->protocol = PROTOCOL_RAW;
+			} else if(strncmp(token, "Forward", sizeof("Forward")) == 0){
+				if(strcmp(value, "splice") == 0)
+					config->forward = FORWARD_SPLICE;
+				else if(strcmp(value, "uring") == 0)
+					config->forward = FORWARD_URING;
+				else
+					config->forward = FORWARD_COPY;
 			} else {
 				fprintf(stderr, "[config] Unknown key: %s\n", token);
 			}
@@ -11,12 +11,59 @@
 #define CONFIG_SUCCESS 0
 #define CONFIG_FAILURE 1
 
+#define FORWARD_COPY 0
+#define FORWARD_SPLICE 1
+#define FORWARD_URING 2
+
+#define PROTOCOL_RAW 0
+#define PROTOCOL_MPD 1
+
+#define BALANCE_CONNECTIONS 0
+#define BALANCE_LATENCY 1
+
+// Most Backend lines read
+#define CONFIG_BACKENDS 16
+
+typedef struct config_backend_t {
+	char *host;
+	char *port;
+	int weight;
+	int replica;
+} config_backend_t;
+
 typedef struct config_t {
 	char *host_srv;
 	char *port_srv;
 
 	char *host_prx;
 	char *port_prx;
+
+	config_backend_t backends[CONFIG_BACKENDS];
+	int n_backends;
+	int balance;
+
+	int threads;
+	int forward;
+	int protocol;
+	int connect_timeout;
+	int pool_size;
+	int pool_idle;
+	int multiplex;
+	int cache_size;
+	int mirror;
+	char *mirror_file;
+	int art_cache_size;
+	char *art_cache_dir;
+	int art_cache_dir_size;
+	int client_rate;
+	int client_bandwidth;
+	int address_rate;
+	int address_bandwidth;
+	char *metrics_host;
+	char *metrics_port;
+	int log_level;
+	char *access_log;
+	char *capture;
 } config_t;
 
 void config_init(config_t *config);
@@ -0,0 +1,1846 @@
+/*
+ * connection.c - proxied client connection
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "connection.h"
+#include "event.h"
+#include "uring.h"
+#include "upstream.h"
+#include "pool.h"
+#include "protocol.h"
+#include "cache.h"
+#include "buffer.h"
+#include "mirror.h"
+#include "art.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+#include "list.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define PIPE_SIZE 65536
+#define PIPE_POOL 64
+
+#define CONN_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+// Ring buffers a channel may hold before it stops receiving
+#define URING_QUEUE 8
+
+// Scratch buffer shared by all connections of an event loop thread
+static __thread char buffer[BUF_SIZE];
+
+// Drained pipes kept around by an event loop thread for reuse
+static __thread int pipes[PIPE_POOL][2];
+static __thread int n_pipes;
+
+// Cleared the first time the kernel refuses to splice sockets
+static int splice_supported = TRUE;
+
+static void on_cli(handler_t*, uint32_t);
+static void on_prx(handler_t*, uint32_t);
+static void on_reap(deferred_t*);
+static void on_wake(deferred_t*);
+static void on_turn(waiter_t*);
+static void on_slow(timeout_t*);
+static void pump(connection_t*, channel_t*, int, int);
+static void on_recv(uring_op_t*, int, uint32_t);
+static void on_send(uring_op_t*, int, uint32_t);
+
+static int
+pipe_get(channel_t *ch)
+{
+	if(n_pipes > 0){
+		n_pipes--;
+		ch->pipe[0] = pipes[n_pipes][0];
+		ch->pipe[1] = pipes[n_pipes][1];
+		return 0;
+	}
+
+	return pipe2(ch->pipe, O_NONBLOCK | O_CLOEXEC);
+}
+
+static void
+pipe_put(channel_t *ch)
+{
+	if(ch->pipe[0] < 0)
+		return;
+
+	// Pipes still holding data cannot be reused by another channel
+	if(ch->in_pipe == 0 && n_pipes < PIPE_POOL){
+		pipes[n_pipes][0] = ch->pipe[0];
+		pipes[n_pipes][1] = ch->pipe[1];
+		n_pipes++;
+	} else {
+		close(ch->pipe[0]);
+		close(ch->pipe[1]);
+	}
+
+	ch->pipe[0] = ch->pipe[1] = -1;
+	ch->in_pipe = 0;
+}
+
+static void
+channel_init(connection_t *conn, channel_t *ch)
+{
+	ch->conn = conn;
+	ch->pipe[0] = ch->pipe[1] = -1;
+	ch->op_recv.cb = &on_recv;
+	ch->op_send.cb = &on_send;
+	ch->q_head = ch->q_tail = -1;
+	INIT_LIST_HEAD(&ch->starved);
+}
+
+connection_t *
+conn_new(int sock_cli, int sock_prx, int forward)
+{
+	connection_t *conn = calloc(1, sizeof(connection_t));
+	if(conn == NULL)
+		return NULL;
+
+	conn->cli.fd = sock_cli;
+	conn->cli.cb = &on_cli;
+	conn->prx.fd = sock_prx;
+	conn->prx.cb = &on_prx;
+	conn->reap.cb = &on_reap;
+	conn->wake.cb = &on_wake;
+	conn->turn.cb = &on_turn;
+
+	if(forward == FORWARD_SPLICE && !splice_supported)
+		forward = FORWARD_COPY;
+	conn->forward = forward;
+
+	channel_init(conn, &conn->upstream);
+	channel_init(conn, &conn->downstream);
+	INIT_LIST_HEAD(&conn->session);
+	INIT_LIST_HEAD(&conn->waiting);
+	INIT_LIST_HEAD(&conn->turn.list);
+	timeout_init(&conn->slow, &on_slow);
+
+	return conn;
+}
+
+static void uring_close(connection_t *conn);
+static void uring_start(connection_t *conn);
+static void land(connection_t *conn, buffer_t *buf);
+
+void
+conn_close(connection_t *conn)
+{
+	if(conn->closed)
+		return;
+
+	conn->closed = TRUE;
+
+	if(conn->connect){
+		upstream_cancel(conn->connect);
+		conn->connect = NULL;
+	}
+
+	if(conn->forward == FORWARD_URING)
+		uring_close(conn);
+
+	list_del_init(&conn->session);
+	list_del_init(&conn->waiting);
+	list_del_init(&conn->turn.list);
+	loop_untimeout(&conn->slow);
+
+	if(conn->limit)
+		limit_leave(conn->limit, &conn->throttle);
+	if(conn->metrics)
+		metrics_add(&conn->metrics->closed, 1);
+	if(conn->tap)
+		tap_write(conn->tap, conn->tap_id, TAP_CLOSE, NULL, 0);
+
+	// Sessions waiting on this one send their command themselves
+	land(conn, NULL);
+
+	// Closing the sockets removes them from the epoll set
+	close(conn->cli.fd);
+	if(conn->prx.fd >= 0)
+		upstream_close(conn->backend, conn->prx.fd);
+	if(conn->held)
+		pool_drop(conn->pool, conn->bulk);
+
+	pipe_put(&conn->upstream);
+	pipe_put(&conn->downstream);
+
+	// Other events of the current batch may still refer to this connection,
+	// and with io_uring the kernel may still complete operations for it
+	if(conn->inflight == 0)
+		loop_defer(conn->loop, &conn->reap);
+}
+
+static void
+on_upstream(void *data, int fd, backend_t *backend)
+{
+	connection_t *conn = (connection_t*) data;
+
+	conn->connect = NULL;
+
+	if(fd < 0){
+		print("connect_prx", strerror(errno));
+		conn_close(conn);
+		return;
+	}
+
+	// Sessions come back for upstream after idling, only log the first time
+	if(conn->backend == NULL){
+		log_write(LOG_INFO, "conn", "Proxying requests to %s", backend->name);
+	}
+
+	conn->prx.fd = fd;
+	conn->backend = backend;
+
+	if(conn->forward == FORWARD_URING){
+		uring_start(conn);
+		return;
+	}
+
+	if(loop_add(conn->loop, &conn->prx, CONN_EVENTS) < 0){
+		conn_close(conn);
+		return;
+	}
+
+	conn->connecting = FALSE;
+
+	// Edges that fired while connecting were ignored, catch up on both sides
+	pump(conn, &conn->upstream, conn->cli.fd, conn->prx.fd);
+	pump(conn, &conn->downstream, conn->prx.fd, conn->cli.fd);
+}
+
+/**
+ * Count data on its way through a channel.
+ *
+ * */
+static void
+relayed(channel_t *ch, size_t len)
+{
+	connection_t *conn = ch->conn;
+
+	if(conn->metrics)
+		metrics_add(ch == &conn->upstream ? &conn->metrics->bytes_up : &conn->metrics->bytes_down, len);
+}
+
+/**
+ * Capture data the client sent, or was sent.
+ *
+ * */
+static void
+tapped(connection_t *conn, int type, const void *data, size_t len)
+{
+	if(conn->tap)
+		tap_write(conn->tap, conn->tap_id, type, data, len);
+}
+
+/**
+ * Greet the client with MPD's cached greeting.
+ *
+ * */
+static int
+greet(connection_t *conn)
+{
+	pool_t *pool = conn->pool;
+
+	// The send buffer of a fresh client socket has room for a single line
+	if(send(conn->cli.fd, pool->greeting, pool->greeting_len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t) pool->greeting_len)
+		return -1;
+
+	relayed(&conn->downstream, pool->greeting_len);
+	tapped(conn, TAP_SERVER, pool->greeting, pool->greeting_len);
+
+	return 0;
+}
+
+/**
+ * Take a connection from the pool, or connect to upstream without blocking
+ * the loop, then start relaying. A pooled connection has already been greeted
+ * by MPD, the cached greeting is replayed to the client instead.
+ * With PROTOCOL_MPD the session joins the worker's sessions, and does not
+ * need upstream until its first command if the greeting is known.
+ * The connection closes itself if upstream cannot be reached.
+ *
+ * */
+int
+conn_connect(connection_t *conn, worker_t *worker)
+{
+	pool_t *pool = &worker->pool;
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof addr;
+	backend_t *backend;
+	int fd, replay;
+
+	conn->loop = &worker->loop;
+	conn->metrics = worker->loop.metrics;
+	conn->access = worker->access;
+	conn->tap = worker->tap;
+	conn->pool = pool;
+	conn->prx.fd = -1;
+	conn->connecting = TRUE;
+
+	conn->protocol = pool->upstream->protocol;
+	conn->mux = conn->protocol == PROTOCOL_MPD && pool->limit > 0;
+	mpd_request_init(&conn->req);
+	mpd_response_init(&conn->res);
+
+	if(conn->metrics)
+		metrics_add(&conn->metrics->opened, 1);
+
+	if(conn->protocol == PROTOCOL_MPD && worker->cache.max_size > 0)
+		conn->cache = &worker->cache;
+	if(conn->protocol == PROTOCOL_MPD){
+		conn->mirror = worker->mirror;
+		conn->art = worker->art;
+	}
+
+	// Clients from the same address share its limits
+	if((conn->protocol == PROTOCOL_MPD && (worker->limit || conn->access)) || conn->tap){
+		if(getpeername(conn->cli.fd, (struct sockaddr*) &addr, &addr_len) < 0)
+			addr.ss_family = AF_UNSPEC;
+
+		if(conn->access || conn->tap)
+			access_addr((struct sockaddr*) &addr, conn->addr, &conn->port);
+
+		if(conn->tap){
+			tap_open_t open;
+
+			memcpy(open.addr, conn->addr, sizeof open.addr);
+			open.port = conn->port;
+
+			conn->tap_id = tap_id();
+			tap_write(conn->tap, conn->tap_id, TAP_OPEN, &open, sizeof open);
+		}
+
+		if(conn->protocol == PROTOCOL_MPD && worker->limit){
+			conn->limit = worker->limit;
+			if(addr.ss_family == AF_UNSPEC || limit_join(conn->limit, &conn->throttle, (struct sockaddr*) &addr) < 0)
+				memset(&conn->throttle, 0, sizeof(throttle_t));
+		}
+	}
+
+	if(conn->forward != FORWARD_URING && loop_add(conn->loop, &conn->cli, CONN_EVENTS) < 0){
+		conn_close(conn);
+		return -1;
+	}
+
+	if(conn->protocol == PROTOCOL_MPD){
+		list_add_tail(&conn->session, &worker->sessions);
+
+		if(pool->greeting_len > 0){
+			if(greet(conn) < 0){
+				conn_close(conn);
+				return -1;
+			}
+
+			conn->connecting = FALSE;
+			return 0;
+		}
+	}
+
+	if((fd = pool_take(pool, FALSE, FALSE, NULL, 0, &backend, &replay)) >= 0){
+		conn->held = TRUE;
+
+		if(greet(conn) < 0){
+			upstream_close(backend, fd);
+			conn_close(conn);
+			return -1;
+		}
+
+		on_upstream(conn, fd, backend);
+		return 0;
+	}
+
+	// Until a greeting is known sessions connect even beyond the limit
+	pool_reserve(pool, FALSE, TRUE);
+	conn->held = TRUE;
+
+	// The greeting is the first response
+	conn->expect = 1;
+	conn->greeting = TRUE;
+
+	if((conn->connect = upstream_connect(conn->loop, pool->upstream, NULL, &on_upstream, conn)) == NULL){
+		print("connect_prx", strerror(errno));
+		conn_close(conn);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Flush pending data of a channel to its destination.
+ * Returns -1 on error, 0 otherwise. The channel is drained if len is 0.
+ *
+ * */
+static int
+flush(channel_t *ch, int to)
+{
+	const char *data = ch->shared ? ch->shared->data : ch->buf;
+	ssize_t bytes;
+
+	while(ch->len > 0){
+		if((bytes = send(to, data + ch->off, ch->len, MSG_NOSIGNAL)) < 0){
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		ch->off += (size_t) bytes;
+		ch->len -= (size_t) bytes;
+	}
+
+	free(ch->buf);
+	buffer_put(ch->shared);
+	ch->buf = NULL;
+	ch->shared = NULL;
+	ch->off = 0;
+
+	return 0;
+}
+
+/**
+ * Send data to the destination of a channel, keeping what it does not
+ * accept. Returns -1 on error, 0 otherwise.
+ *
+ * */
+static int
+channel_send(channel_t *ch, int to, const char *buf, size_t len)
+{
+	ssize_t sent;
+	char *tmp;
+
+	relayed(ch, len);
+	if(ch == &ch->conn->downstream)
+		tapped(ch->conn, TAP_SERVER, buf, len);
+
+	// Queue behind data the destination has not accepted yet
+	if(ch->len > 0){
+		if((tmp = malloc(ch->len + len)) == NULL)
+			return -1;
+
+		memcpy(tmp, (ch->shared ? ch->shared->data : ch->buf) + ch->off, ch->len);
+		memcpy(tmp + ch->len, buf, len);
+		free(ch->buf);
+		buffer_put(ch->shared);
+
+		ch->buf = tmp;
+		ch->shared = NULL;
+		ch->off = 0;
+		ch->len += len;
+		return 0;
+	}
+
+	if((sent = send(to, buf, len, MSG_NOSIGNAL)) < 0){
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		sent = 0;
+	}
+
+	if((size_t) sent < len){
+		ch->len = len - (size_t) sent;
+		if((ch->buf = malloc(ch->len)) == NULL)
+			return -1;
+		memcpy(ch->buf, buf + sent, ch->len);
+	}
+
+	return 0;
+}
+
+/**
+ * Same as channel_send, but what the destination does not accept is kept as
+ * a reference to the shared buffer instead of a copy.
+ *
+ * */
+static int
+channel_share(channel_t *ch, int to, buffer_t *buf)
+{
+	ssize_t sent;
+
+	if(ch->len > 0)
+		return channel_send(ch, to, buf->data, buf->len);
+
+	relayed(ch, buf->len);
+	if(ch == &ch->conn->downstream)
+		tapped(ch->conn, TAP_SERVER, buf->data, buf->len);
+
+	if((sent = send(to, buf->data, buf->len, MSG_NOSIGNAL)) < 0){
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		sent = 0;
+	}
+
+	if((size_t) sent < buf->len){
+		ch->shared = buffer_get(buf);
+		ch->off = (size_t) sent;
+		ch->len = buf->len - (size_t) sent;
+	}
+
+	return 0;
+}
+
+static void
+eof(connection_t *conn, channel_t *ch, int to)
+{
+	ch->eof = TRUE;
+	shutdown(to, SHUT_WR);
+
+	if(conn->upstream.eof && conn->downstream.eof)
+		conn_close(conn);
+}
+
+/**
+ * Move data from one socket to the other until either the source is drained
+ * (EAGAIN, as required by edge-triggered notification) or the destination
+ * stops accepting data. In the latter case the remainder is kept in the
+ * channel and reading resumes once the destination becomes writable.
+ *
+ * */
+static void
+pump_copy(connection_t *conn, channel_t *ch, int from, int to)
+{
+	ssize_t bytes;
+
+	if(ch->len > 0){
+		if(flush(ch, to) < 0){
+			conn_close(conn);
+			return;
+		}
+		if(ch->len > 0)
+			return;
+	}
+
+	for(;;){
+		if((bytes = recv(from, buffer, BUF_SIZE, 0)) < 0){
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				conn_close(conn);
+			return;
+		}
+
+		if(bytes == 0){
+			eof(conn, ch, to);
+			return;
+		}
+
+		if(ch == &conn->upstream)
+			tapped(conn, TAP_CLIENT, buffer, (size_t) bytes);
+
+		if(channel_send(ch, to, buffer, (size_t) bytes) < 0){
+			conn_close(conn);
+			return;
+		}
+
+		if(ch->len > 0)
+			return;
+	}
+}
+
+/**
+ * Same as pump_copy, but the data never leaves the kernel: it is spliced
+ * from the source socket into the channel's pipe and from there into the
+ * destination socket. Whatever the destination does not accept stays in the
+ * pipe until it becomes writable.
+ *
+ * */
+static void
+pump_splice(connection_t *conn, channel_t *ch, int from, int to)
+{
+	ssize_t bytes;
+
+	if(ch->pipe[0] < 0 && pipe_get(ch) < 0){
+		conn->forward = FORWARD_COPY;
+		pump_copy(conn, ch, from, to);
+		return;
+	}
+
+	for(;;){
+		while(ch->in_pipe > 0){
+			if((bytes = splice(ch->pipe[0], NULL, to, NULL, ch->in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0){
+				if(errno == EINTR)
+					continue;
+				if(errno != EAGAIN)
+					conn_close(conn);
+				return;
+			}
+
+			ch->in_pipe -= (size_t) bytes;
+		}
+
+		if((bytes = splice(from, NULL, ch->pipe[1], NULL, PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0){
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN){
+				// Drained, give the pipe back until more data arrives
+				pipe_put(ch);
+				return;
+			}
+			if(errno == EINVAL || errno == ENOSYS){
+				splice_supported = FALSE;
+				conn->forward = FORWARD_COPY;
+				pipe_put(ch);
+				pump_copy(conn, ch, from, to);
+				return;
+			}
+			conn_close(conn);
+			return;
+		}
+
+		if(bytes == 0){
+			pipe_put(ch);
+			eof(conn, ch, to);
+			return;
+		}
+
+		ch->in_pipe += (size_t) bytes;
+		relayed(ch, (size_t) bytes);
+	}
+}
+
+/**
+ * MPD protocol
+ *
+ * Requests are relayed one at a time: once a request is framed the client is
+ * not read from until upstream has sent the response. The socket is peeked
+ * at so the bytes of the next request stay queued in the kernel.
+ *
+ * Idle is answered by the proxy from the subsystems that changed since the
+ * client's previous idle, as reported by the worker. An idling client does
+ * not need upstream, its connection goes back to the pool and a new one is
+ * taken for the next real command. Sessions pinned by a stateful command, or
+ * on another partition, send idle and the noidle ending it upstream instead.
+ *
+ * With a limit on upstream connections, sessions are multiplexed: they give
+ * their connection back as soon as they have no request for it, and wait for
+ * one when the worker is at its limit. Stateful commands that can be are
+ * replayed on the connections a session gets later, the others pin it.
+ * Library queries are bulk requests, they wait behind interactive ones and
+ * are kept from some of the connections so those stay free for the others.
+ * Sessions are served round robin: one that was sent its share of bytes
+ * while others wait gives its connection back, and queues behind them.
+ *
+ * Clients over their rate limits are not read from until they are within
+ * them again, which holds back the commands they send.
+ *
+ * With replicas configured, library queries are sent to a replica and all
+ * other commands to a primary. A session switches connections between
+ * requests as needed, unless it is pinned: stateful commands go to a
+ * primary, which then serves the session for good.
+ *
+ * Responses to read-only commands are cached by the worker, a hit is sent to
+ * the client without involving upstream at all. Sessions missing on a command
+ * that is already on its way upstream wait for that response, and all of them
+ * are sent the same buffer. Database queries the mirror understands are
+ * answered from it, and album art from the images other sessions read.
+ *
+ * */
+/**
+ * Get upstream for a session that gave its connection back. Relaying
+ * resumes once it is there.
+ *
+ * */
+static void
+acquire(connection_t *conn)
+{
+	pool_t *pool = conn->pool;
+	backend_t *backend;
+	int fd, replay;
+
+	conn->connecting = TRUE;
+
+	// Each turn on upstream adds a share to what is left of the last
+	if(conn->mux)
+		conn->deficit = (conn->deficit < 0 ? conn->deficit : 0) + CONN_QUANTUM;
+
+	if((fd = pool_take(pool, conn->replica, conn->bulk, conn->state, conn->state_len, &backend, &replay)) >= 0){
+		conn->held = TRUE;
+		conn->restore = replay;
+		on_upstream(conn, fd, backend);
+		return;
+	}
+
+	// At the limit, another session has to give its connection back first
+	if(pool_reserve(pool, conn->bulk, FALSE) < 0){
+		conn->turn.bulk = conn->bulk;
+		pool_wait(pool, &conn->turn);
+		return;
+	}
+
+	conn->held = TRUE;
+	conn->restore = conn->state_len > 0;
+
+	// The client has been greeted already, upstream's greeting is dropped
+	conn->expect = 1;
+	conn->greeting = TRUE;
+	conn->swallow = TRUE;
+
+	backend = upstream_pick(pool->upstream, conn->replica);
+	if((conn->connect = upstream_connect(conn->loop, pool->upstream, backend, &on_upstream, conn)) == NULL){
+		print("connect_prx", strerror(errno));
+		conn_close(conn);
+	}
+}
+
+static void
+release(connection_t *conn)
+{
+	if(conn->prx.fd < 0 || conn->pinned)
+		return;
+
+	loop_del(conn->loop, &conn->prx);
+
+	// The session's state was not replayed if it went without upstream after all
+	if(conn->restore)
+		pool_put(conn->pool, conn->bulk, conn->prx.fd, conn->backend, NULL, 0);
+	else
+		pool_put(conn->pool, conn->bulk, conn->prx.fd, conn->backend, conn->state, conn->state_len);
+
+	conn->prx.fd = -1;
+	conn->held = FALSE;
+	conn->restore = FALSE;
+}
+
+/**
+ * A multiplexed session that used up its turn gives its connection back to
+ * sessions waiting for one, and queues behind them. Returns TRUE if it did.
+ *
+ * */
+static int
+yield(connection_t *conn)
+{
+	if(!conn->mux || conn->pinned || conn->prx.fd < 0 || conn->deficit > 0 || !pool_queued(conn->pool, conn->bulk))
+		return FALSE;
+
+	release(conn);
+
+	conn->connecting = TRUE;
+	conn->turn.bulk = conn->bulk;
+	pool_wait(conn->pool, &conn->turn);
+
+	return TRUE;
+}
+
+/**
+ * Account for bytes sent to the client, against its turn on upstream and
+ * its rate limits.
+ *
+ * */
+static void
+spend(connection_t *conn, size_t len)
+{
+	conn->deficit -= (long) len;
+
+	if(conn->limit)
+		limit_charge(conn->limit, &conn->throttle, len);
+}
+
+/**
+ * Keep the stateful command just framed to replay it on the connections a
+ * multiplexed session gets later. Returns FALSE if it cannot be, the session
+ * is pinned to its connection instead.
+ *
+ * */
+static int
+remember(connection_t *conn)
+{
+	mpd_request_t *req = &conn->req;
+
+	if(!conn->mux || conn->pinned || req->type != MPD_COMMAND || req->line_len >= MPD_LINE_SIZE - 1)
+		return FALSE;
+
+	if(!mpd_replayable(req->line, req->line_len) || conn->state_len + req->line_len + 1 > CONN_STATE)
+		return FALSE;
+
+	memcpy(conn->state + conn->state_len, req->line, req->line_len);
+	conn->state_len += req->line_len;
+	conn->state[conn->state_len++] = '\n';
+	conn->state_lines++;
+
+	return TRUE;
+}
+
+/**
+ * Whether the session changed the state of MPD's connection, its responses
+ * may then differ from what other sessions get.
+ *
+ * */
+static int
+tailored(connection_t *conn)
+{
+	return conn->pinned || conn->state_len > 0;
+}
+
+/**
+ * Decide whether the request starting with line goes to a replica, and for a
+ * multiplexed session whether it is a bulk request. A connection taken for
+ * the other kind is given back.
+ *
+ * */
+static void
+route(connection_t *conn, int type, const char *line, size_t len)
+{
+	upstream_t *upstream = conn->pool->upstream;
+	int library, replica, bulk;
+
+	if((upstream->replicas == 0 && !conn->mux) || conn->pinned)
+		return;
+
+	library = type == MPD_COMMAND && mpd_library(line, len);
+	replica = library && upstream->replicas > 0 && upstream_replicated(upstream);
+	bulk = library && conn->mux;
+
+	if(conn->prx.fd >= 0 && (conn->backend->replica != replica || conn->bulk != bulk))
+		release(conn);
+
+	conn->replica = replica;
+	conn->bulk = bulk;
+}
+
+/**
+ * Answer an idle with the changes the client is interested in.
+ *
+ * */
+static int
+idle_respond(connection_t *conn)
+{
+	char buf[MPD_IDLE_SIZE];
+	size_t len;
+
+	if((len = mpd_idle_format(buf, sizeof buf, conn->pending & conn->want)) == 0)
+		return -1;
+
+	conn->pending &= ~conn->want;
+	conn->idling = FALSE;
+
+	return channel_send(&conn->downstream, conn->cli.fd, buf, len);
+}
+
+/**
+ * Whether the session idles on its own connection, which alone is told about
+ * the messages of its subscriptions and the changes of its partition.
+ *
+ * */
+static int
+idles_upstream(connection_t *conn)
+{
+	return conn->pinned || conn->partitioned;
+}
+
+/**
+ * Handle a request the proxy answers itself. Returns -1 if the client broke
+ * the protocol, MPD closes the connection in that case too.
+ *
+ * */
+static int
+local(connection_t *conn, int type, const char *line, size_t len)
+{
+	if(type == MPD_IDLE){
+		if(conn->idling)
+			return -1;
+
+		conn->want = mpd_idle_mask(line + sizeof("idle") - 1, len - (sizeof("idle") - 1));
+		conn->idling = TRUE;
+		release(conn);
+
+		return (conn->pending & conn->want) ? idle_respond(conn) : 0;
+	}
+
+	if(type == MPD_NOIDLE)
+		return conn->idling ? idle_respond(conn) : 0;
+
+	// Only noidle is allowed while idling
+	return -1;
+}
+
+/**
+ * Log a command of the session and how it was answered.
+ *
+ * */
+static void
+accessed(connection_t *conn, const char *line, size_t len, int outcome, size_t size, uint64_t latency)
+{
+	access_record_t record;
+
+	record.time = epoch_us();
+	memcpy(record.addr, conn->addr, sizeof record.addr);
+	record.port = conn->port;
+	record.command = (uint8_t) mpd_command_index(line, len);
+	record.outcome = (uint8_t) outcome;
+	record.args = access_args(line, len);
+	record.size = size < UINT32_MAX ? (uint32_t) size : UINT32_MAX;
+	record.latency = latency < UINT32_MAX ? (uint32_t) latency : UINT32_MAX;
+
+	access_write(conn->access, &record);
+}
+
+/**
+ * Answer the command line at the head of the client's socket with buf.
+ *
+ * */
+static int
+answer(connection_t *conn, int from, size_t len, buffer_t *buf, int outcome)
+{
+	conn->key_len = 0;
+	conn->admitted = FALSE;
+	spend(conn, buf->len);
+
+	if(conn->metrics)
+		metrics_add(&conn->metrics->answered, 1);
+
+	if(recv(from, buffer, len + 1, 0) != (ssize_t) len + 1)
+		return -1;
+
+	tapped(conn, TAP_CLIENT, buffer, len + 1);
+
+	if(conn->access)
+		accessed(conn, buffer, len, outcome, buf->len, 0);
+
+	return channel_share(&conn->downstream, conn->cli.fd, buf) < 0 ? -1 : TRUE;
+}
+
+/**
+ * Answer a command from the cache, or wait for the same command another
+ * session sent upstream. On a miss the key is kept, so upstream's response
+ * can be stored, and the command departs as a flight others can wait on.
+ * Returns TRUE if the command was taken care of, -1 on error.
+ *
+ * */
+static int
+cached(connection_t *conn, int from, const char *line, size_t len)
+{
+	buffer_t *buf;
+	flight_t *flight;
+	int ret;
+
+	// The flight this session waited on brought back the response
+	if(conn->landed){
+		ret = answer(conn, from, len, conn->landed, ACCESS_COALESCED);
+		buffer_put(conn->landed);
+		conn->landed = NULL;
+		return ret;
+	}
+
+	// Looked up already, waiting for upstream
+	if(conn->cache == NULL || tailored(conn) || conn->key_len > 0)
+		return FALSE;
+
+	if((conn->key_len = cache_key(conn->key, line, len)) == 0)
+		return FALSE;
+
+	// Responses that raced with a change must not be stored
+	conn->epoch = conn->cache->epoch;
+
+	// Read your own writes
+	if(conn->dirty & cache_depends(conn->key, conn->key_len))
+		return FALSE;
+
+	if((buf = cache_lookup(conn->cache, conn->key, conn->key_len)) != NULL)
+		return answer(conn, from, len, buf, ACCESS_HIT);
+
+	// The command stays queued on the socket while waiting
+	if((flight = cache_join(conn->cache, conn->key, conn->key_len)) != NULL){
+		list_add_tail(&conn->waiting, &flight->waiters);
+		return TRUE;
+	}
+
+	conn->flight = cache_depart(conn->cache, conn->key, conn->key_len);
+
+	return FALSE;
+}
+
+/**
+ * Answer a database query from the mirror. Pinned sessions may have asked for
+ * fewer tags with tagtypes, they are left to MPD. Returns TRUE if the command
+ * was answered, -1 on error.
+ *
+ * */
+static int
+mirrored(connection_t *conn, int from, const char *line, size_t len)
+{
+	buffer_t *buf;
+	db_t *db;
+	int ret;
+
+	if(conn->mirror == NULL || tailored(conn) || (db = mirror_get(conn->mirror)) == NULL)
+		return FALSE;
+
+	ret = db_answer(db, line, len, &buf);
+	db_put(db);
+
+	if(!ret)
+		return FALSE;
+
+	ret = answer(conn, from, len, buf, ACCESS_MIRROR);
+	buffer_put(buf);
+
+	return ret;
+}
+
+/**
+ * Answer albumart and readpicture from the album art cache. On a miss the
+ * session keeps the chunks upstream sends, until it has the whole image.
+ * Pinned sessions may have changed binarylimit, they are left to MPD.
+ * Returns TRUE if the command was answered, -1 on error.
+ *
+ * */
+static int
+pictured(connection_t *conn, int from, const char *line, size_t len)
+{
+	buffer_t *buf;
+	int ret;
+
+	if(conn->art == NULL || tailored(conn) || !art_answer(conn->art, &conn->build, line, len, &buf))
+		return FALSE;
+
+	ret = answer(conn, from, len, buf, ACCESS_ART);
+	buffer_put(buf);
+
+	return ret;
+}
+
+/**
+ * The flight of this session's command is over. Its waiters are answered with
+ * buf, or send the command themselves if it is NULL. They are woken after the
+ * current batch, the scratch buffer still holds this session's data.
+ *
+ * */
+static void
+land(connection_t *conn, buffer_t *buf)
+{
+	connection_t *waiter, *tmp;
+
+	if(conn->flight == NULL)
+		return;
+
+	list_for_each_entry_safe(waiter, tmp, &conn->flight->waiters, waiting){
+		list_del_init(&waiter->waiting);
+		if(buf)
+			waiter->landed = buffer_get(buf);
+
+		// It may have been woken by another flight earlier in this batch
+		if(!waiter->waking){
+			waiter->waking = TRUE;
+			loop_defer(waiter->loop, &waiter->wake);
+		}
+	}
+
+	cache_land(conn->flight);
+	conn->flight = NULL;
+}
+
+static void
+capture_reset(connection_t *conn)
+{
+	land(conn, NULL);
+
+	buffer_put(conn->capture);
+	conn->capture = NULL;
+	conn->key_len = 0;
+}
+
+/**
+ * Keep part of a response to store once it is complete. Responses too large
+ * to be cached are let go.
+ *
+ * */
+static void
+capture(connection_t *conn, const char *buf, size_t len)
+{
+	buffer_t *tmp;
+
+	if((conn->capture ? conn->capture->len : 0) + len > conn->cache->max_size / 4 ||
+			(tmp = buffer_append(conn->capture, buf, len)) == NULL){
+		capture_reset(conn);
+		return;
+	}
+
+	conn->capture = tmp;
+}
+
+static void
+captured(connection_t *conn)
+{
+	if(conn->res.status == MPD_OK){
+		conn->capture = buffer_trim(conn->capture);
+
+		if(conn->epoch == conn->cache->epoch && !tailored(conn))
+			cache_store(conn->cache, conn->key, conn->key_len, conn->capture);
+
+		land(conn, conn->capture);
+	}
+
+	capture_reset(conn);
+}
+
+/**
+ * Keep the response to a chunk of album art, and hand it to the build once
+ * it is complete.
+ *
+ * */
+static void
+picture(connection_t *conn, const char *buf, size_t len)
+{
+	buffer_t *tmp;
+
+	if((conn->capture ? conn->capture->len : 0) + len > 2 * ART_CHUNK ||
+			(tmp = buffer_append(conn->capture, buf, len)) == NULL){
+		art_reset(&conn->build);
+		buffer_put(conn->capture);
+		conn->capture = NULL;
+		return;
+	}
+
+	conn->capture = tmp;
+
+	if(conn->res.done){
+		art_chunk(conn->art, &conn->build, conn->res.status, conn->capture->data, conn->capture->len);
+		buffer_put(conn->capture);
+		conn->capture = NULL;
+	}
+}
+
+/**
+ * Relay the noidle ending an idle the session sent upstream. Anything else is
+ * a protocol violation, MPD closes the connection for it.
+ *
+ * */
+static void
+noidle(connection_t *conn, channel_t *ch, int from, int to)
+{
+	ssize_t bytes;
+	size_t n;
+	char *nl;
+
+	if((bytes = recv(from, buffer, BUF_SIZE, MSG_PEEK)) < 0){
+		if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+			conn_close(conn);
+		return;
+	}
+
+	if(bytes == 0){
+		eof(conn, ch, to);
+		return;
+	}
+
+	if((nl = memchr(buffer, '\n', (size_t) bytes)) == NULL){
+		if(bytes == BUF_SIZE)
+			conn_close(conn);
+		return;
+	}
+
+	n = (size_t) (nl - buffer);
+	if(mpd_command_type(buffer, n) != MPD_NOIDLE || recv(from, buffer, n + 1, 0) != (ssize_t) n + 1){
+		conn_close(conn);
+		return;
+	}
+
+	tapped(conn, TAP_CLIENT, buffer, n + 1);
+
+	// Upstream answers the idle, whatever follows waits for that
+	conn->idle_sent = FALSE;
+
+	if(channel_send(ch, to, buffer, n + 1) < 0)
+		conn_close(conn);
+}
+
+static void
+pump_request(connection_t *conn, channel_t *ch, int from, int to)
+{
+	ssize_t bytes;
+	size_t n;
+	char *nl;
+	int type, hit;
+	unsigned int ms;
+
+	if(ch->len > 0){
+		if(flush(ch, to) < 0){
+			conn_close(conn);
+			return;
+		}
+		if(ch->len > 0)
+			return;
+	}
+
+	if(conn->idle_sent){
+		noidle(conn, ch, from, to);
+		return;
+	}
+
+	while(conn->expect == 0){
+		// Waiting for another session's response to the same command, or
+		// for upstream
+		if(!list_empty(&conn->waiting) || conn->connecting)
+			return;
+
+		if((bytes = recv(from, buffer, BUF_SIZE, MSG_PEEK)) < 0){
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				conn_close(conn);
+			else if(conn->mux)
+				release(conn);
+			return;
+		}
+
+		if(bytes == 0){
+			if(conn->prx.fd < 0)
+				conn_close(conn);
+			else
+				eof(conn, ch, to);
+			return;
+		}
+
+		// Whether a request is relayed depends on its first line
+		if(conn->req.done || conn->req.first){
+			if((nl = memchr(buffer, '\n', (size_t) bytes)) == NULL && bytes < BUF_SIZE)
+				return;
+
+			type = nl ? mpd_command_type(buffer, (size_t) (nl - buffer)) : MPD_COMMAND;
+
+			// Relayed like a command, a noidle without an idle is dropped
+			if(conn->idling || (type == MPD_IDLE && !idles_upstream(conn)) || type == MPD_NOIDLE){
+				if(nl == NULL){
+					conn_close(conn);
+					return;
+				}
+
+				n = (size_t) (nl - buffer);
+				if(recv(from, buffer, n + 1, 0) != (ssize_t) n + 1){
+					conn_close(conn);
+					return;
+				}
+
+				tapped(conn, TAP_CLIENT, buffer, n + 1);
+
+				if(local(conn, type, buffer, n) < 0){
+					conn_close(conn);
+					return;
+				}
+
+				continue;
+			}
+
+			// Over its limits, the client is read from again once within them
+			if(conn->limit && !conn->admitted){
+				if(conn->throttled)
+					return;
+
+				if((ms = limit_admit(conn->limit, &conn->throttle)) > 0){
+					conn->throttled = TRUE;
+					loop_timeout(conn->loop, &conn->slow, ms);
+					return;
+				}
+
+				conn->admitted = TRUE;
+			}
+
+			if(nl && type == MPD_COMMAND){
+				n = (size_t) (nl - buffer);
+				if((hit = cached(conn, from, buffer, n)) == FALSE)
+					hit = mirrored(conn, from, buffer, n);
+				if(hit == FALSE)
+					hit = pictured(conn, from, buffer, n);
+				if(hit < 0){
+					conn_close(conn);
+					return;
+				}
+				if(hit && conn->downstream.len > 0)
+					return;
+				if(hit)
+					continue;
+			}
+
+			route(conn, type, buffer, nl ? (size_t) (nl - buffer) : (size_t) bytes);
+
+			if(yield(conn))
+				return;
+
+			if(conn->prx.fd < 0){
+				acquire(conn);
+				return;
+			}
+
+			// A connection without the session's state is given it first
+			if(conn->restore){
+				conn->restore = FALSE;
+				conn->replay = conn->state_lines;
+
+				if(channel_send(ch, to, conn->state, conn->state_len) < 0){
+					conn_close(conn);
+					return;
+				}
+			}
+		}
+
+		n = mpd_request_feed(&conn->req, buffer, (size_t) bytes);
+
+		if(recv(from, buffer, n, 0) != (ssize_t) n){
+			conn_close(conn);
+			return;
+		}
+
+		tapped(conn, TAP_CLIENT, buffer, n);
+
+		if(conn->req.done){
+			conn->expect++;
+			conn->admitted = FALSE;
+			if(conn->metrics || conn->access)
+				conn->sent = now_us();
+			conn->outcome = (conn->key_len > 0 || conn->build.waiting) ? ACCESS_MISS : ACCESS_UPSTREAM;
+			conn->res_size = 0;
+			if(conn->req.stateful && !remember(conn))
+				conn->pinned = TRUE;
+			if(conn->req.touches){
+				conn->dirty |= conn->req.touches;
+				conn->writing = TRUE;
+			}
+			if(conn->req.rescans && conn->mirror)
+				mirror_rescan(conn->mirror);
+			if(conn->req.partitions)
+				conn->partitioned = TRUE;
+			if(conn->req.type == MPD_IDLE)
+				conn->idle_sent = TRUE;
+		}
+
+		if(channel_send(ch, to, buffer, n) < 0){
+			conn_close(conn);
+			return;
+		}
+
+		if(ch->len > 0)
+			return;
+	}
+}
+
+/**
+ * The first response on a fresh upstream connection is MPD's greeting. It is
+ * cached for sessions greeted by the proxy, and dropped if this session
+ * already was.
+ *
+ * */
+static void
+greeted(connection_t *conn)
+{
+	pool_t *pool = conn->pool;
+	size_t len = strlen(conn->res.cur);
+
+	conn->greeting = FALSE;
+	conn->swallow = FALSE;
+
+	if(conn->res.status == MPD_OK && pool->greeting_len == 0 && len < GREETING_SIZE - 1){
+		memcpy(pool->greeting, conn->res.cur, len);
+		pool->greeting[len] = '\n';
+		pool->greeting_len = len + 1;
+	}
+}
+
+/**
+ * Count how long upstream took to answer the session's command, and log it.
+ *
+ * */
+static void
+timed(connection_t *conn)
+{
+	uint64_t us = now_us() - conn->sent;
+
+	if(conn->metrics)
+		metrics_record(&conn->metrics->commands[mpd_command_index(conn->req.line, conn->req.line_len)], us);
+	if(conn->access)
+		accessed(conn, conn->req.line, conn->req.line_len, conn->outcome, conn->res_size, us);
+
+	conn->sent = 0;
+}
+
+static void
+pump_response(connection_t *conn, channel_t *ch, int from, int to)
+{
+	ssize_t bytes;
+	size_t off, n, skip;
+	int resume, greeting;
+
+	if(ch->len > 0){
+		if(flush(ch, to) < 0){
+			conn_close(conn);
+			return;
+		}
+		if(ch->len > 0)
+			return;
+
+		// Answers from the proxy itself waited for the client to catch up
+		if(conn->expect == 0)
+			pump_request(conn, &conn->upstream, conn->cli.fd, conn->prx.fd);
+	}
+
+	// Upstream was given back while data for the client was pending
+	if(from < 0)
+		return;
+
+	for(;;){
+		if((bytes = recv(from, buffer, BUF_SIZE, 0)) < 0){
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				conn_close(conn);
+			return;
+		}
+
+		if(bytes == 0){
+			eof(conn, ch, to);
+			return;
+		}
+
+		for(off = 0, skip = 0, resume = FALSE; off < (size_t) bytes; off += n){
+			n = mpd_response_feed(&conn->res, buffer + off, (size_t) bytes - off);
+			greeting = conn->greeting;
+
+			if(conn->greeting){
+				if(conn->swallow)
+					skip = off + n;
+				if(conn->res.done)
+					greeted(conn);
+			} else if(conn->replay > 0){
+				// Responses to the replayed state are not the client's
+				skip = off + n;
+				if(conn->res.done)
+					conn->replay--;
+				continue;
+			} else if(conn->key_len > 0){
+				capture(conn, buffer + off, n);
+				if(conn->res.done && conn->key_len > 0)
+					captured(conn);
+			} else if(conn->build.waiting){
+				picture(conn, buffer + off, n);
+			}
+
+			if(!greeting)
+				conn->res_size += (uint32_t) n;
+
+			if(conn->res.done && conn->expect > 0){
+				if(conn->sent && !greeting)
+					timed(conn);
+				if(--conn->expect == 0){
+					conn->idle_sent = FALSE;
+					conn->writing = FALSE;
+					resume = TRUE;
+				}
+			}
+		}
+
+		if(channel_send(ch, to, buffer + skip, (size_t) bytes - skip) < 0){
+			conn_close(conn);
+			return;
+		}
+
+		spend(conn, (size_t) bytes - skip);
+
+		// Upstream is done with the client's request, relay the next one
+		if(resume)
+			pump_request(conn, &conn->upstream, conn->cli.fd, conn->prx.fd);
+
+		if(conn->closed || ch->len > 0 || conn->prx.fd != from)
+			return;
+	}
+}
+
+/**
+ * Subsystems changed upstream, called by the worker for all of its sessions.
+ *
+ * */
+void
+conn_changed(connection_t *conn, unsigned int mask)
+{
+	conn->pending |= mask;
+
+	// Changes reported before upstream answered may predate the write
+	if(!conn->writing)
+		conn->dirty &= ~mask;
+
+	if(conn->idling && (conn->pending & conn->want) && idle_respond(conn) < 0)
+		conn_close(conn);
+}
+
+static void
+pump(connection_t *conn, channel_t *ch, int from, int to)
+{
+	if(conn->closed || ch->eof)
+		return;
+
+	if(conn->protocol == PROTOCOL_MPD){
+		if(ch == &conn->upstream)
+			pump_request(conn, ch, from, to);
+		else
+			pump_response(conn, ch, from, to);
+	} else if(conn->forward == FORWARD_SPLICE)
+		pump_splice(conn, ch, from, to);
+	else
+		pump_copy(conn, ch, from, to);
+}
+
+/**
+ * io_uring
+ *
+ * The ring receives into provided buffers with a multishot recv per channel.
+ * Received buffers are queued on the channel and sent one at a time to keep
+ * them ordered. A channel holding URING_QUEUE buffers cancels its recv until
+ * the destination catches up, one the ring ran dry for waits on the starved
+ * list until another channel returns a buffer.
+ *
+ * */
+static int
+uring_submit(connection_t *conn, uring_op_t *op, struct io_uring_sqe **sqe)
+{
+	if((*sqe = uring_sqe(conn->loop->ring, op)) == NULL)
+		return -1;
+
+	conn->inflight++;
+	return 0;
+}
+
+static void
+uring_done(connection_t *conn)
+{
+	if(--conn->inflight == 0 && conn->closed)
+		loop_defer(conn->loop, &conn->reap);
+}
+
+static int
+channel_from(channel_t *ch)
+{
+	return ch == &ch->conn->upstream ? ch->conn->cli.fd : ch->conn->prx.fd;
+}
+
+static int
+channel_to(channel_t *ch)
+{
+	return ch == &ch->conn->upstream ? ch->conn->prx.fd : ch->conn->cli.fd;
+}
+
+static void
+arm_recv(channel_t *ch)
+{
+	connection_t *conn = ch->conn;
+	struct io_uring_sqe *sqe;
+
+	if(conn->closed || ch->eof || ch->recving || ch->q_count >= URING_QUEUE)
+		return;
+
+	if(uring_submit(conn, &ch->op_recv, &sqe) < 0){
+		conn_close(conn);
+		return;
+	}
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = channel_from(ch);
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	if(conn->loop->ring->multishot)
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+
+	ch->recving = TRUE;
+	ch->cancelling = FALSE;
+}
+
+static void
+cancel_recv(channel_t *ch)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!ch->recving || ch->cancelling)
+		return;
+
+	if((sqe = uring_sqe(ch->conn->loop->ring, NULL)) == NULL)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t) (uintptr_t) &ch->op_recv;
+
+	ch->cancelling = TRUE;
+}
+
+static void
+buf_release(uring_t *ring, uint16_t bid)
+{
+	uring_buf_put(ring, bid);
+
+	if(!list_empty(&ring->starved)){
+		channel_t *ch = list_first_entry(&ring->starved, channel_t, starved);
+		list_del_init(&ch->starved);
+		arm_recv(ch);
+	}
+}
+
+static void
+send_head(channel_t *ch)
+{
+	connection_t *conn = ch->conn;
+	uring_t *ring = conn->loop->ring;
+	struct io_uring_sqe *sqe;
+	uint16_t bid = (uint16_t) ch->q_head;
+
+	if(uring_submit(conn, &ch->op_send, &sqe) < 0){
+		conn_close(conn);
+		return;
+	}
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = channel_to(ch);
+	sqe->addr = (uint64_t) (uintptr_t) (uring_buf(ring, bid) + ch->q_off);
+	sqe->len = (uint32_t) (ring->buf_len[bid] - ch->q_off);
+	sqe->msg_flags = MSG_NOSIGNAL;
+
+	ch->sending = TRUE;
+}
+
+/**
+ * Propagate EOF once everything received before it has been sent.
+ *
+ * */
+static void
+drained(channel_t *ch)
+{
+	connection_t *conn = ch->conn;
+
+	if(!ch->eof || ch->q_count > 0)
+		return;
+
+	shutdown(channel_to(ch), SHUT_WR);
+
+	if(conn->upstream.eof && conn->upstream.q_count == 0 && conn->downstream.eof && conn->downstream.q_count == 0)
+		conn_close(conn);
+}
+
+static void
+uring_start(connection_t *conn)
+{
+	arm_recv(&conn->upstream);
+	arm_recv(&conn->downstream);
+}
+
+static void
+uring_close(connection_t *conn)
+{
+	uring_t *ring = conn->loop->ring;
+	channel_t *chs[] = { &conn->upstream, &conn->downstream };
+	int i, bid, next;
+
+	if(conn->prx.fd >= 0)
+		shutdown(conn->prx.fd, SHUT_RDWR);
+	shutdown(conn->cli.fd, SHUT_RDWR);
+
+	for(i = 0; i < 2; i++){
+		channel_t *ch = chs[i];
+
+		list_del_init(&ch->starved);
+		cancel_recv(ch);
+
+		// An in-flight send still refers to the head, on_send releases it
+		bid = ch->sending ? ring->buf_next[ch->q_head] : ch->q_head;
+		while(bid >= 0){
+			next = ring->buf_next[bid];
+			ch->q_count--;
+			buf_release(ring, (uint16_t) bid);
+			bid = next;
+		}
+
+		if(ch->sending){
+			ring->buf_next[ch->q_head] = -1;
+			ch->q_tail = ch->q_head;
+		} else {
+			ch->q_head = ch->q_tail = -1;
+		}
+	}
+}
+
+/**
+ * Callbacks
+ *
+ * */
+static void
+on_cli(handler_t *handler, uint32_t events)
+{
+	connection_t *conn = container_of(handler, connection_t, cli);
+
+	if(conn->connecting)
+		return;
+
+	if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		pump(conn, &conn->upstream, conn->cli.fd, conn->prx.fd);
+	if(events & EPOLLOUT)
+		pump(conn, &conn->downstream, conn->prx.fd, conn->cli.fd);
+}
+
+static void
+on_prx(handler_t *handler, uint32_t events)
+{
+	connection_t *conn = container_of(handler, connection_t, prx);
+
+	// Still connecting, or upstream was given back earlier in this batch
+	if(conn->connecting || handler->fd < 0)
+		return;
+
+	if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		pump(conn, &conn->downstream, conn->prx.fd, conn->cli.fd);
+	if(events & EPOLLOUT)
+		pump(conn, &conn->upstream, conn->cli.fd, conn->prx.fd);
+}
+
+static void
+on_reap(deferred_t *deferred)
+{
+	connection_t *conn = container_of(deferred, connection_t, reap);
+
+	free(conn->upstream.buf);
+	free(conn->downstream.buf);
+	buffer_put(conn->upstream.shared);
+	buffer_put(conn->downstream.shared);
+	buffer_put(conn->capture);
+	buffer_put(conn->landed);
+	art_reset(&conn->build);
+	free(conn);
+}
+
+static void
+on_wake(deferred_t *deferred)
+{
+	connection_t *conn = container_of(deferred, connection_t, wake);
+
+	conn->waking = FALSE;
+
+	if(!conn->closed)
+		pump_request(conn, &conn->upstream, conn->cli.fd, conn->prx.fd);
+}
+
+static void
+on_slow(timeout_t *timeout)
+{
+	connection_t *conn = container_of(timeout, connection_t, slow);
+
+	conn->throttled = FALSE;
+	pump_request(conn, &conn->upstream, conn->cli.fd, conn->prx.fd);
+}
+
+static void
+on_turn(waiter_t *waiter)
+{
+	connection_t *conn = container_of(waiter, connection_t, turn);
+
+	if(!conn->closed)
+		acquire(conn);
+}
+
+static void
+on_recv(uring_op_t *op, int res, uint32_t flags)
+{
+	channel_t *ch = container_of(op, channel_t, op_recv);
+	connection_t *conn = ch->conn;
+	uring_t *ring = conn->loop->ring;
+
+	if(!(flags & IORING_CQE_F_MORE))
+		ch->recving = FALSE;
+
+	if(res > 0 && (flags & IORING_CQE_F_BUFFER)){
+		uint16_t bid = (uint16_t) (flags >> IORING_CQE_BUFFER_SHIFT);
+
+		if(conn->closed){
+			buf_release(ring, bid);
+		} else {
+			ring->buf_len[bid] = (uint32_t) res;
+			relayed(ch, (size_t) res);
+			ring->buf_next[bid] = -1;
+			if(ch->q_tail >= 0)
+				ring->buf_next[ch->q_tail] = bid;
+			else
+				ch->q_head = bid;
+			ch->q_tail = bid;
+			ch->q_count++;
+
+			if(!ch->sending){
+				ch->q_off = 0;
+				send_head(ch);
+			}
+
+			if(ch->q_count >= URING_QUEUE)
+				cancel_recv(ch);
+		}
+	} else if(res == 0){
+		ch->eof = TRUE;
+		if(!conn->closed)
+			drained(ch);
+	} else if(res == -EINVAL && ring->multishot && !conn->closed){
+		// Kernel without multishot recv, fall back to one recv per buffer
+		ring->multishot = FALSE;
+	} else if(res == -ENOBUFS && !conn->closed){
+		if(ch->q_count == 0 && list_empty(&ch->starved))
+			list_add_tail(&ch->starved, &ring->starved);
+	} else if(res < 0 && res != -ECANCELED && !conn->closed){
+		conn_close(conn);
+	}
+
+	if(ch->recving)
+		return;
+
+	// Starved channels are re-armed by buf_release, busy ones by on_send
+	if(res != -ENOBUFS)
+		arm_recv(ch);
+	uring_done(conn);
+}
+
+static void
+on_send(uring_op_t *op, int res, uint32_t flags)
+{
+	channel_t *ch = container_of(op, channel_t, op_send);
+	connection_t *conn = ch->conn;
+	uring_t *ring = conn->loop->ring;
+	uint16_t bid = (uint16_t) ch->q_head;
+
+	ch->sending = FALSE;
+
+	if(conn->closed || res < 0){
+		ch->q_head = ring->buf_next[bid];
+		if(ch->q_head < 0)
+			ch->q_tail = -1;
+		ch->q_count--;
+		buf_release(ring, bid);
+
+		conn_close(conn);
+		uring_done(conn);
+		return;
+	}
+
+	ch->q_off += (size_t) res;
+	if(ch->q_off < ring->buf_len[bid]){
+		send_head(ch);
+		uring_done(conn);
+		return;
+	}
+
+	ch->q_head = ring->buf_next[bid];
+	if(ch->q_head < 0)
+		ch->q_tail = -1;
+	ch->q_count--;
+	ch->q_off = 0;
+	buf_release(ring, bid);
+
+	if(ch->q_head >= 0)
+		send_head(ch);
+	else
+		drained(ch);
+
+	arm_recv(ch);
+	uring_done(conn);
+}
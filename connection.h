@@ -0,0 +1,202 @@
+/*
+ * connection.h - proxied client connection
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>
+
+#include <netdb.h>
+
+#include "config.h"
+#include "event.h"
+#include "uring.h"
+#include "upstream.h"
+#include "pool.h"
+#include "protocol.h"
+#include "cache.h"
+#include "buffer.h"
+#include "mirror.h"
+#include "art.h"
+#include "limit.h"
+#include "metrics.h"
+#include "access.h"
+#include "tap.h"
+#include "worker.h"
+#include "list.h"
+
+#define BUF_SIZE 4096
+
+// Bytes of stateful commands a multiplexed session keeps to replay
+#define CONN_STATE 512
+
+// Bytes of responses a multiplexed session is served per turn while others
+// wait for upstream
+#define CONN_QUANTUM 16384
+
+/**
+ * One direction of a connection. Data is only buffered on the heap when the
+ * destination socket would block, an idle channel owns no buffer at all.
+ * Pending data is either the channel's own, or a reference to a buffer shared
+ * with other connections.
+ *
+ * In splice mode data moves through a pipe borrowed from the loop while the
+ * channel is busy, and the pipe is handed back once it is drained. With
+ * io_uring the kernel receives into the loop's provided buffers, which are
+ * queued on the channel until they are sent and then returned to the ring.
+ *
+ * */
+typedef struct channel_t {
+	char *buf;
+	buffer_t *shared;
+	size_t off;
+	size_t len;
+	int eof;
+
+	int pipe[2];
+	size_t in_pipe;
+
+	// io_uring: ring buffers received from the source, waiting to be sent
+	struct connection_t *conn;
+	uring_op_t op_recv;
+	uring_op_t op_send;
+	int q_head;
+	int q_tail;
+	unsigned int q_count;
+	size_t q_off;
+	int recving;
+	int sending;
+	int cancelling;
+	struct list_head starved;
+} channel_t;
+
+typedef struct connection_t {
+	handler_t cli;
+	handler_t prx;
+
+	channel_t upstream;
+	channel_t downstream;
+
+	loop_t *loop;
+	int forward;
+	int closed;
+	deferred_t reap;
+
+	// Upstream connect in progress, and the backend it ended up at
+	connect_t *connect;
+	backend_t *backend;
+	int connecting;
+
+	// io_uring: operations not completed yet
+	int inflight;
+
+	// PROTOCOL_MPD: request being framed, response being relayed, and the
+	// number of responses still to come from upstream
+	int protocol;
+	mpd_request_t req;
+	mpd_response_t res;
+	int expect;
+
+	// PROTOCOL_MPD: upstream's greeting is still to come, and has to be
+	// dropped because the proxy greeted the client itself
+	int greeting;
+	int swallow;
+
+	// PROTOCOL_MPD: a session on the worker. Changed subsystems pile up in
+	// pending until an idle for them, connections changed by a stateful
+	// command are pinned to the session. Pinned sessions, and those on
+	// another partition, send idle upstream: only their connection is told
+	// about their messages and partition. Library queries go to a replica,
+	// the session switches connections between requests
+	struct list_head session;
+	pool_t *pool;
+	unsigned int pending;
+	unsigned int want;
+	int idling;
+	int pinned;
+	int partitioned;
+	int idle_sent;
+	int replica;
+
+	// PROTOCOL_MPD: the worker's cache, unless disabled. A miss keeps its key
+	// and captures upstream's response to store it. Sessions that changed
+	// subsystems read what depends on them from upstream, until a change to
+	// them is reported after upstream answered the write
+	cache_t *cache;
+	char key[MPD_LINE_SIZE];
+	size_t key_len;
+	uint64_t epoch;
+	buffer_t *capture;
+	unsigned int dirty;
+	int writing;
+
+	// PROTOCOL_MPD: the flight of a miss other sessions may wait on, or the
+	// flight this session waits on and the response it brought back
+	flight_t *flight;
+	struct list_head waiting;
+	buffer_t *landed;
+	deferred_t wake;
+	int waking;
+
+	// PROTOCOL_MPD: answers database queries, if enabled
+	mirror_t *mirror;
+
+	// PROTOCOL_MPD: serves album art, if enabled, and the image this session
+	// reads from upstream meanwhile
+	art_cache_t *art;
+	art_build_t build;
+
+	// PROTOCOL_MPD: multiplexed sessions give upstream back after every
+	// response, waiting their turn if the worker is at its limit. Stateful
+	// commands are kept as state and replayed on a connection that does not
+	// have it yet, the responses to these are dropped. Held is set while the
+	// session counts as busy in the pool, bulk if that is for a bulk request
+	int mux;
+	int held;
+	int bulk;
+	waiter_t turn;
+	char state[CONN_STATE];
+	size_t state_len;
+	int state_lines;
+	int restore;
+	int replay;
+
+	// PROTOCOL_MPD: the client's rate limits, if any. A client over them is
+	// not read from until slow fires, admitted is set once the request at the
+	// head of its socket may go. A multiplexed session has deficit bytes
+	// left of its turn on upstream
+	limit_t *limit;
+	throttle_t throttle;
+	timeout_t slow;
+	int throttled;
+	int admitted;
+	long deficit;
+
+	// The worker's metrics, if exported, and when the command upstream is
+	// answering was sent
+	metrics_t *metrics;
+	uint64_t sent;
+
+	// PROTOCOL_MPD: the worker's access log, if enabled, the client it logs
+	// commands of, and how upstream is answering the current one
+	ring_t *access;
+	uint8_t addr[16];
+	uint16_t port;
+	int outcome;
+	uint32_t res_size;
+
+	// The worker's capture, if enabled, and the connection's number in it
+	ring_t *tap;
+	uint32_t tap_id;
+} connection_t;
+
+connection_t *conn_new(int sock_cli, int sock_prx, int forward);
+int conn_connect(connection_t *conn, worker_t *worker);
+void conn_changed(connection_t *conn, unsigned int mask);
+void conn_close(connection_t *conn);
+
+#endif
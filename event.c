@@ -0,0 +1,356 @@
+/*
+ * event.c - epoll event loop
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "event.h"
+#include "queue.h"
+#include "list.h"
+#include "log.h"
+#include "util.h"
+
+#define TRUE 1
+#define FALSE 0
+
+static void *th_loop(void*);
+static void on_poll(uring_op_t*, int, uint32_t);
+static void on_wake(handler_t*, uint32_t);
+
+static int
+arm_poll(loop_t *loop)
+{
+	struct io_uring_sqe *sqe;
+
+	if((sqe = uring_sqe(loop->ring, &loop->poll)) == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = loop->epfd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+
+	return 0;
+}
+
+static int
+dispatch(loop_t *loop, int timeout)
+{
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	int i, n;
+
+	if((n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, timeout)) < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for(i = 0; i < n; i++){
+		handler_t *handler = (handler_t*) events[i].data.ptr;
+		handler->cb(handler, events[i].events);
+	}
+
+	return 0;
+}
+
+int
+loop_init(loop_t *loop)
+{
+	memset(loop, 0, sizeof(loop_t));
+	INIT_LIST_HEAD(&loop->deferred);
+	INIT_LIST_HEAD(&loop->timeouts);
+	INIT_LIST_HEAD(&loop->posts);
+	pthread_mutex_init(&loop->posts_mutex, NULL);
+	loop->wake.fd = -1;
+	loop->wake.cb = &on_wake;
+
+	if((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return -1;
+
+	if((loop->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+			loop_add(loop, &loop->wake, EPOLLIN | EPOLLET) < 0){
+		loop_destroy(loop);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+loop_destroy(loop_t *loop)
+{
+	if(loop->ring){
+		uring_destroy(loop->ring);
+		free(loop->ring);
+	}
+	if(loop->wake.fd >= 0)
+		close(loop->wake.fd);
+	close(loop->epfd);
+	pthread_mutex_destroy(&loop->posts_mutex);
+}
+
+int
+loop_start(loop_t *loop)
+{
+	sigset_t set, old;
+	int err;
+
+	// Signals are handled by the main thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	err = pthread_create(&loop->th_id, NULL, &th_loop, loop);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	loop->started = (err == 0);
+
+	return err;
+}
+
+/**
+ * Stop the loop once it is done with the events at hand, and wait for its
+ * thread to exit.
+ *
+ * */
+void
+loop_stop(loop_t *loop)
+{
+	uint64_t one = 1;
+
+	if(!loop->started)
+		return;
+
+	__atomic_store_n(&loop->stopping, TRUE, __ATOMIC_RELEASE);
+
+	if(write(loop->wake.fd, &one, sizeof one) == sizeof one)
+		pthread_join(loop->th_id, NULL);
+
+	loop->started = FALSE;
+}
+
+/**
+ * Switch the loop over to io_uring. Must be called before loop_start.
+ * Returns -1 (and leaves the loop on plain epoll) if the kernel cannot do it.
+ *
+ * */
+int
+loop_uring(loop_t *loop)
+{
+	uring_t *ring;
+
+	if((ring = malloc(sizeof(uring_t))) == NULL)
+		return -1;
+
+	if(uring_init(ring, URING_ENTRIES) < 0){
+		free(ring);
+		return -1;
+	}
+
+	loop->ring = ring;
+	loop->poll.cb = &on_poll;
+
+	return arm_poll(loop);
+}
+
+int
+loop_add(loop_t *loop, handler_t *handler, uint32_t events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = events;
+	ev.data.ptr = handler;
+
+	return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, handler->fd, &ev);
+}
+
+int
+loop_del(loop_t *loop, handler_t *handler)
+{
+	return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, handler->fd, NULL);
+}
+
+void
+loop_defer(loop_t *loop, deferred_t *deferred)
+{
+	list_add_tail(&deferred->list, &loop->deferred);
+}
+
+/**
+ * Hand work to a loop from any thread.
+ *
+ * */
+void
+loop_post(loop_t *loop, post_t *post)
+{
+	uint64_t one = 1;
+	int wake;
+
+	pthread_mutex_lock(&loop->posts_mutex);
+	wake = list_empty(&loop->posts);
+	list_add_tail(&post->list, &loop->posts);
+	pthread_mutex_unlock(&loop->posts_mutex);
+
+	// A non-empty list means the loop has already been woken up
+	if(wake && write(loop->wake.fd, &one, sizeof one) < 0)
+		return;
+}
+
+uint64_t
+loop_now(void)
+{
+	return now_us() / 1000;
+}
+
+void
+timeout_init(timeout_t *timeout, void (*cb)(timeout_t*))
+{
+	INIT_LIST_HEAD(&timeout->list);
+	timeout->cb = cb;
+}
+
+/**
+ * (Re)arm a timeout to fire in ms milliseconds.
+ *
+ * */
+void
+loop_timeout(loop_t *loop, timeout_t *timeout, unsigned int ms)
+{
+	struct list_head *pos;
+
+	list_del_init(&timeout->list);
+	timeout->when = loop_now() + ms;
+
+	list_for_each_prev(pos, &loop->timeouts){
+		if(list_entry(pos, timeout_t, list)->when <= timeout->when)
+			break;
+	}
+	list_add(&timeout->list, pos);
+}
+
+void
+loop_untimeout(timeout_t *timeout)
+{
+	list_del_init(&timeout->list);
+}
+
+/**
+ * Milliseconds until the first timeout fires, -1 if there is none.
+ *
+ * */
+static int
+next_timeout(loop_t *loop)
+{
+	uint64_t now;
+	timeout_t *first;
+
+	if(list_empty(&loop->timeouts))
+		return -1;
+
+	first = list_first_entry(&loop->timeouts, timeout_t, list);
+	now = loop_now();
+
+	return first->when <= now ? 0 : (int) (first->when - now);
+}
+
+static void
+run_timeouts(loop_t *loop)
+{
+	uint64_t now = loop_now();
+	timeout_t *first;
+
+	while(!list_empty(&loop->timeouts)){
+		first = list_first_entry(&loop->timeouts, timeout_t, list);
+		if(first->when > now)
+			break;
+
+		list_del_init(&first->list);
+		first->cb(first);
+	}
+}
+
+/**
+ * Threads
+ *
+ * */
+static void *
+th_loop(void *l)
+{
+	queue_ins(pthread_self());
+
+	// Cancelled in a callback, the loop would leave locks held and
+	// structures half updated: it is stopped by loop_stop instead
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	loop_t *loop = (loop_t*) l;
+
+	while(!__atomic_load_n(&loop->stopping, __ATOMIC_ACQUIRE)){
+		if(loop->ring){
+			if(uring_enter(loop->ring, 1, next_timeout(loop)) < 0)
+				break;
+			uring_reap(loop->ring);
+		} else if(dispatch(loop, next_timeout(loop)) < 0){
+			break;
+		}
+
+		run_timeouts(loop);
+
+		// Deferred work may defer more, all of it runs before the next wait
+		while(!list_empty(&loop->deferred)){
+			deferred_t *d = list_first_entry(&loop->deferred, deferred_t, list);
+			list_del(&d->list);
+			d->cb(d);
+		}
+	}
+
+	if(!__atomic_load_n(&loop->stopping, __ATOMIC_ACQUIRE))
+		log_write(LOG_ERROR, "loop", "%s: %s", loop->ring ? "io_uring_enter" : "epoll_wait", strerror(errno));
+
+	queue_rem(pthread_self());
+	return NULL;
+}
+
+/**
+ * Callbacks
+ *
+ * */
+static void
+on_wake(handler_t *handler, uint32_t events)
+{
+	loop_t *loop = container_of(handler, loop_t, wake);
+	struct list_head posts;
+	post_t *p, *p_tmp;
+	uint64_t n;
+
+	if(read(handler->fd, &n, sizeof n) < 0 && errno != EAGAIN)
+		return;
+
+	INIT_LIST_HEAD(&posts);
+	pthread_mutex_lock(&loop->posts_mutex);
+	list_splice_init(&loop->posts, &posts);
+	pthread_mutex_unlock(&loop->posts_mutex);
+
+	list_for_each_entry_safe(p, p_tmp, &posts, list){
+		list_del(&p->list);
+		p->cb(p);
+	}
+}
+
+static void
+on_poll(uring_op_t *op, int res, uint32_t flags)
+{
+	loop_t *loop = container_of(op, loop_t, poll);
+
+	if(!(flags & IORING_CQE_F_MORE))
+		arm_poll(loop);
+
+	dispatch(loop, 0);
+}
@@ -0,0 +1,105 @@
+/*
+ * event.h - epoll event loop
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "list.h"
+#include "uring.h"
+
+#define LOOP_MAX_EVENTS 64
+
+/**
+ * A file descriptor watched by a loop. Handlers are embedded in the structure
+ * owning the descriptor, the callback retrieves it using container_of.
+ *
+ * */
+typedef struct handler_t {
+	int fd;
+	void (*cb)(struct handler_t *handler, uint32_t events);
+} handler_t;
+
+/**
+ * Work that has to wait until the current batch of events is dispatched,
+ * typically freeing a structure other pending events may still refer to.
+ *
+ * */
+typedef struct deferred_t {
+	struct list_head list;
+	void (*cb)(struct deferred_t *deferred);
+} deferred_t;
+
+/**
+ * One-shot timer, millisecond resolution. Timeouts are kept sorted by
+ * deadline; as most of them share a duration, arming one is usually O(1).
+ *
+ * */
+typedef struct timeout_t {
+	struct list_head list;
+	uint64_t when;
+	void (*cb)(struct timeout_t *timeout);
+} timeout_t;
+
+/**
+ * Work handed to a loop by another thread. Like deferred work it is embedded
+ * in the structure it concerns; the callback runs on the loop's thread and
+ * owns the structure from then on.
+ *
+ * */
+typedef struct post_t {
+	struct list_head list;
+	void (*cb)(struct post_t *post);
+} post_t;
+
+/**
+ * With io_uring the ring drives the loop: the epoll set is polled through the
+ * ring, so submissions and waiting for both kinds of events share a syscall.
+ *
+ * */
+typedef struct loop_t {
+	int epfd;
+	pthread_t th_id;
+	struct list_head deferred;
+	struct list_head timeouts;
+
+	// Posted work, the eventfd wakes the loop up
+	handler_t wake;
+	pthread_mutex_t posts_mutex;
+	struct list_head posts;
+
+	uring_t *ring;
+	uring_op_t poll;
+
+	// Metrics of the loop's thread, NULL if not exported
+	struct metrics_t *metrics;
+
+	// Stopped through the eventfd, the thread is never cancelled
+	int started;
+	int stopping;
+} loop_t;
+
+int loop_init(loop_t *loop);
+void loop_destroy(loop_t *loop);
+int loop_start(loop_t *loop);
+void loop_stop(loop_t *loop);
+int loop_uring(loop_t *loop);
+
+int loop_add(loop_t *loop, handler_t *handler, uint32_t events);
+int loop_del(loop_t *loop, handler_t *handler);
+void loop_defer(loop_t *loop, deferred_t *deferred);
+void loop_post(loop_t *loop, post_t *post);
+
+uint64_t loop_now(void);
+void timeout_init(timeout_t *timeout, void (*cb)(timeout_t*));
+void loop_timeout(loop_t *loop, timeout_t *timeout, unsigned int ms);
+void loop_untimeout(timeout_t *timeout);
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ * health.c - backend health checks
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "health.h"
+#include "event.h"
+#include "upstream.h"
+#include "protocol.h"
+#include "log.h"
+#include "util.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define PING "ping\n"
+
+static void on_connected(void*, int, backend_t*);
+static void on_check(handler_t*, uint32_t);
+static void on_timer(timeout_t*);
+
+void
+check_init(check_t *check, loop_t *loop, upstream_t *upstream, backend_t *backend)
+{
+	memset(check, 0, sizeof(check_t));
+	check->loop = loop;
+	check->upstream = upstream;
+	check->backend = backend;
+	check->h.fd = -1;
+	check->h.cb = &on_check;
+
+	timeout_init(&check->timer, &on_timer);
+}
+
+static void
+reset(check_t *check)
+{
+	if(check->connect){
+		upstream_cancel(check->connect);
+		check->connect = NULL;
+	}
+
+	// Closing the socket removes it from the epoll set
+	if(check->h.fd >= 0){
+		upstream_close(check->backend, check->h.fd);
+		check->h.fd = -1;
+	}
+}
+
+/**
+ * A check failed, the connection is started over after HEALTH_INTERVAL.
+ *
+ * */
+static void
+failed(check_t *check, const char *msg)
+{
+	backend_t *backend = check->backend;
+
+	reset(check);
+
+	if(++check->fails >= HEALTH_FAILS && __atomic_load_n(&backend->up, __ATOMIC_RELAXED)){
+		__atomic_store_n(&backend->up, FALSE, __ATOMIC_RELAXED);
+		log_write(LOG_WARNING, "health", "%s is down: %s", backend->name, msg);
+	}
+
+	check->waiting = FALSE;
+	loop_timeout(check->loop, &check->timer, HEALTH_INTERVAL);
+}
+
+/**
+ * Connect to the backend, it has HEALTH_TIMEOUT to greet. Must be called from
+ * the check's loop, or before it is started.
+ *
+ * */
+void
+check_start(check_t *check)
+{
+	check->waiting = TRUE;
+	loop_timeout(check->loop, &check->timer, HEALTH_TIMEOUT);
+
+	if((check->connect = upstream_connect(check->loop, check->upstream, check->backend, &on_connected, check)) == NULL)
+		failed(check, strerror(errno));
+}
+
+/**
+ * The backend answered a ping, rtt microseconds after it was sent.
+ *
+ * */
+static void
+passed(check_t *check, uint64_t rtt)
+{
+	backend_t *backend = check->backend;
+	unsigned int latency = __atomic_load_n(&backend->latency, __ATOMIC_RELAXED);
+
+	// Moving average, weighing the last round trip an eighth
+	latency = latency ? (unsigned int) ((7 * (uint64_t) latency + rtt) / 8) : (unsigned int) rtt;
+	__atomic_store_n(&backend->latency, latency ? latency : 1, __ATOMIC_RELAXED);
+
+	check->fails = 0;
+
+	if(!__atomic_load_n(&backend->up, __ATOMIC_RELAXED)){
+		__atomic_store_n(&backend->up, TRUE, __ATOMIC_RELAXED);
+		log_write(LOG_INFO, "health", "%s is up", backend->name);
+	}
+
+	check->waiting = FALSE;
+	loop_timeout(check->loop, &check->timer, HEALTH_INTERVAL);
+}
+
+static void
+ping(check_t *check)
+{
+	// The socket has nothing queued, a short command always fits
+	if(send(check->h.fd, PING, sizeof(PING) - 1, MSG_NOSIGNAL) != sizeof(PING) - 1){
+		failed(check, strerror(errno));
+		return;
+	}
+
+	check->sent = now_us();
+	check->waiting = TRUE;
+	loop_timeout(check->loop, &check->timer, HEALTH_TIMEOUT);
+}
+
+/**
+ * Callbacks
+ *
+ * */
+static void
+on_connected(void *data, int fd, backend_t *backend)
+{
+	check_t *check = (check_t*) data;
+
+	check->connect = NULL;
+
+	if(fd < 0){
+		failed(check, strerror(errno));
+		return;
+	}
+
+	check->h.fd = fd;
+	check->greeted = FALSE;
+	mpd_response_init(&check->res);
+
+	if(loop_add(check->loop, &check->h, EPOLLIN | EPOLLRDHUP | EPOLLET) < 0)
+		failed(check, strerror(errno));
+}
+
+static void
+on_check(handler_t *handler, uint32_t events)
+{
+	check_t *check = container_of(handler, check_t, h);
+	char buf[MPD_LINE_SIZE];
+	ssize_t bytes;
+	size_t off, n;
+
+	for(;;){
+		if((bytes = recv(handler->fd, buf, sizeof buf, 0)) < 0){
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				failed(check, strerror(errno));
+			return;
+		}
+
+		if(bytes == 0){
+			failed(check, "Connection closed by MPD server");
+			return;
+		}
+
+		for(off = 0; off < (size_t) bytes; off += n){
+			n = mpd_response_feed(&check->res, buf + off, (size_t) bytes - off);
+
+			if(!check->res.done)
+				continue;
+
+			if(check->res.status != MPD_OK){
+				failed(check, check->res.cur);
+				return;
+			}
+
+			// Pinged right after the greeting, then every HEALTH_INTERVAL
+			if(!check->greeted){
+				check->greeted = TRUE;
+				ping(check);
+			} else {
+				passed(check, now_us() - check->sent);
+			}
+
+			if(check->h.fd < 0)
+				return;
+		}
+	}
+}
+
+static void
+on_timer(timeout_t *timeout)
+{
+	check_t *check = container_of(timeout, check_t, timer);
+
+	if(check->waiting)
+		failed(check, "Timed out");
+	else if(check->h.fd < 0)
+		check_start(check);
+	else
+		ping(check);
+}
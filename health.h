@@ -0,0 +1,52 @@
+/*
+ * health.h - backend health checks
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdint.h>
+
+#include "event.h"
+#include "upstream.h"
+#include "protocol.h"
+
+// Milliseconds between two pings of a backend
+#define HEALTH_INTERVAL 1000
+
+// Milliseconds a backend has to answer a ping, or to accept a connection
+// and greet
+#define HEALTH_TIMEOUT 2000
+
+// Checks failed in a row before a backend is taken out of rotation
+#define HEALTH_FAILS 2
+
+/**
+ * Keeps a connection to a backend and pings it every HEALTH_INTERVAL. A
+ * backend that fails HEALTH_FAILS checks in a row is marked down, and new
+ * connections go to the others until it answers again. Round trips of the
+ * pings are averaged into the backend's latency.
+ *
+ * */
+typedef struct check_t {
+	loop_t *loop;
+	upstream_t *upstream;
+	backend_t *backend;
+
+	connect_t *connect;
+	handler_t h;
+	mpd_response_t res;
+	int greeted;
+	int waiting;
+	int fails;
+	uint64_t sent;
+	timeout_t timer;
+} check_t;
+
+void check_init(check_t *check, loop_t *loop, upstream_t *upstream, backend_t *backend);
+void check_start(check_t *check);
+
+#endif
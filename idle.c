@@ -0,0 +1,186 @@
+/*
+ * idle.c - shared idle subscription
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "idle.h"
+#include "event.h"
+#include "upstream.h"
+#include "protocol.h"
+#include "log.h"
+#include "list.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define IDLE "idle\n"
+
+static void on_connected(void*, int, backend_t*);
+static void on_watch(handler_t*, uint32_t);
+static void on_line(mpd_response_t*, const char*, size_t);
+static void on_retry(timeout_t*);
+
+void
+watcher_init(watcher_t *watcher, loop_t *loop, upstream_t *upstream, void (*cb)(void*, unsigned int), void *data)
+{
+	memset(watcher, 0, sizeof(watcher_t));
+	watcher->loop = loop;
+	watcher->upstream = upstream;
+	watcher->h.fd = -1;
+	watcher->h.cb = &on_watch;
+	watcher->cb = cb;
+	watcher->data = data;
+
+	timeout_init(&watcher->retry, &on_retry);
+}
+
+/**
+ * Connect to upstream. Must be called from the watcher's loop, or before it
+ * is started.
+ *
+ * */
+void
+watcher_start(watcher_t *watcher)
+{
+	if((watcher->connect = upstream_connect(watcher->loop, watcher->upstream, upstream_primary(watcher->upstream), &on_connected, watcher)) == NULL){
+		print("idle", strerror(errno));
+		loop_timeout(watcher->loop, &watcher->retry, WATCH_RETRY);
+	}
+}
+
+static void
+reset(watcher_t *watcher)
+{
+	// Closing the socket removes it from the epoll set
+	if(watcher->h.fd >= 0){
+		upstream_close(watcher->backend, watcher->h.fd);
+		watcher->h.fd = -1;
+	}
+
+	watcher->reconnect = TRUE;
+	loop_timeout(watcher->loop, &watcher->retry, WATCH_RETRY);
+}
+
+/**
+ * A response from upstream is complete: the greeting, or the answer to idle.
+ * Either way the watcher goes (back) to idle.
+ *
+ * */
+static int
+response(watcher_t *watcher)
+{
+	if(watcher->res.status != MPD_OK){
+		print("idle", watcher->res.cur);
+		return -1;
+	}
+
+	if(!watcher->greeted){
+		watcher->greeted = TRUE;
+		if(watcher->reconnect)
+			watcher->cb(watcher->data, MPD_IDLE_ALL);
+	} else if(watcher->changed){
+		watcher->cb(watcher->data, watcher->changed);
+	}
+
+	watcher->changed = 0;
+
+	// The socket has nothing queued, a short command always fits
+	if(send(watcher->h.fd, IDLE, sizeof(IDLE) - 1, MSG_NOSIGNAL) != sizeof(IDLE) - 1)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Callbacks
+ *
+ * */
+static void
+on_connected(void *data, int fd, backend_t *backend)
+{
+	watcher_t *watcher = (watcher_t*) data;
+
+	watcher->connect = NULL;
+
+	if(fd < 0){
+		print("idle", strerror(errno));
+		watcher->reconnect = TRUE;
+		loop_timeout(watcher->loop, &watcher->retry, WATCH_RETRY);
+		return;
+	}
+
+	watcher->h.fd = fd;
+	watcher->backend = backend;
+	watcher->greeted = FALSE;
+	watcher->changed = 0;
+	mpd_response_init(&watcher->res);
+	watcher->res.line_cb = &on_line;
+	watcher->res.data = watcher;
+
+	if(loop_add(watcher->loop, &watcher->h, EPOLLIN | EPOLLRDHUP | EPOLLET) < 0){
+		print("idle", strerror(errno));
+		reset(watcher);
+		return;
+	}
+
+	log_write(LOG_INFO, "idle", "Watching %s", backend->name);
+}
+
+static void
+on_watch(handler_t *handler, uint32_t events)
+{
+	watcher_t *watcher = container_of(handler, watcher_t, h);
+	char buf[MPD_LINE_SIZE];
+	ssize_t bytes;
+	size_t off, n;
+
+	for(;;){
+		if((bytes = recv(handler->fd, buf, sizeof buf, 0)) < 0){
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK){
+				print("idle", strerror(errno));
+				reset(watcher);
+			}
+			return;
+		}
+
+		if(bytes == 0){
+			print("idle", "Connection closed by MPD server");
+			reset(watcher);
+			return;
+		}
+
+		for(off = 0; off < (size_t) bytes; off += n){
+			n = mpd_response_feed(&watcher->res, buf + off, (size_t) bytes - off);
+
+			if(watcher->res.done && response(watcher) < 0){
+				reset(watcher);
+				return;
+			}
+		}
+	}
+}
+
+static void
+on_line(mpd_response_t *res, const char *line, size_t len)
+{
+	watcher_t *watcher = (watcher_t*) res->data;
+
+	watcher->changed |= mpd_changed(line, len);
+}
+
+static void
+on_retry(timeout_t *timeout)
+{
+	watcher_start(container_of(timeout, watcher_t, retry));
+}
@@ -0,0 +1,47 @@
+/*
+ * idle.h - shared idle subscription
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <netdb.h>
+
+#include "event.h"
+#include "upstream.h"
+#include "protocol.h"
+
+// Milliseconds to wait before reconnecting the watcher
+#define WATCH_RETRY 1000
+
+/**
+ * Keeps a single connection to upstream in idle and reports the subsystems
+ * that changed, so clients can idle on the proxy instead of on MPD.
+ * After a reconnect all subsystems are reported, changes may have been missed.
+ * The watcher follows the first backend that is up.
+ *
+ * */
+typedef struct watcher_t {
+	loop_t *loop;
+	upstream_t *upstream;
+
+	connect_t *connect;
+	backend_t *backend;
+	handler_t h;
+	mpd_response_t res;
+	int greeted;
+	int reconnect;
+	unsigned int changed;
+	timeout_t retry;
+
+	void (*cb)(void *data, unsigned int mask);
+	void *data;
+} watcher_t;
+
+void watcher_init(watcher_t *watcher, loop_t *loop, upstream_t *upstream, void (*cb)(void*, unsigned int), void *data);
+void watcher_start(watcher_t *watcher);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * limit.c - client rate limits
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "limit.h"
+#include "util.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// Millionths of a token in a token
+#define TOKEN 1000000
+
+// Longest time a bucket is refilled for at once, in microseconds
+#define REFILL_MAX 1000000000
+
+void
+limit_init(limit_t *limit, rate_t client, rate_t source)
+{
+	memset(limit, 0, sizeof(limit_t));
+	pthread_mutex_init(&limit->lock, NULL);
+	limit->client = client;
+	limit->source = source;
+}
+
+/**
+ * Add the tokens earned since the bucket was last looked at. A new bucket
+ * starts out full.
+ *
+ * */
+static void
+refill(bucket_t *b, uint64_t rate, uint64_t now)
+{
+	int64_t full = (int64_t) (rate * TOKEN);
+	uint64_t elapsed = now - b->stamp;
+
+	if(b->stamp == 0){
+		b->level = full;
+	} else {
+		if(elapsed > REFILL_MAX)
+			elapsed = REFILL_MAX;
+
+		b->level += (int64_t) (elapsed * rate);
+		if(b->level > full)
+			b->level = full;
+	}
+
+	b->stamp = now;
+}
+
+/**
+ * Microseconds until the bucket holds need, 0 if it does now or there is no
+ * limit.
+ *
+ * */
+static uint64_t
+wait(bucket_t *b, uint64_t rate, int64_t need, uint64_t now)
+{
+	if(rate == 0)
+		return 0;
+
+	refill(b, rate, now);
+
+	if(b->level >= need)
+		return 0;
+
+	return ((uint64_t) (need - b->level) + rate - 1) / rate;
+}
+
+static void
+charge(bucket_t *b, uint64_t rate, int64_t amount)
+{
+	if(rate > 0)
+		b->level -= amount;
+}
+
+/**
+ * Find the entry of an address, or add it. The table must be locked.
+ *
+ * */
+static source_t *
+source_get(limit_t *limit, const char *addr)
+{
+	size_t len = strlen(addr);
+	uint32_t h = hash(addr, len);
+	source_t *s;
+
+	for(s = limit->table[h % LIMIT_BUCKETS]; s != NULL; s = s->next){
+		if(s->hash == h && strcmp(s->addr, addr) == 0)
+			return s;
+	}
+
+	if((s = calloc(1, sizeof(source_t))) == NULL)
+		return NULL;
+
+	memcpy(s->addr, addr, len + 1);
+	s->hash = h;
+	s->next = limit->table[h % LIMIT_BUCKETS];
+	limit->table[h % LIMIT_BUCKETS] = s;
+
+	return s;
+}
+
+/**
+ * Start limiting a client connected from addr. Returns -1 if its address
+ * could not be tracked, only the client's own limits apply then.
+ *
+ * */
+int
+limit_join(limit_t *limit, throttle_t *throttle, const struct sockaddr *addr)
+{
+	char str[LIMIT_ADDR];
+	const void *src;
+
+	memset(throttle, 0, sizeof(throttle_t));
+
+	if(addr->sa_family == AF_INET)
+		src = &((const struct sockaddr_in*) addr)->sin_addr;
+	else if(addr->sa_family == AF_INET6)
+		src = &((const struct sockaddr_in6*) addr)->sin6_addr;
+	else
+		return -1;
+
+	if(inet_ntop(addr->sa_family, src, str, sizeof str) == NULL)
+		return -1;
+
+	pthread_mutex_lock(&limit->lock);
+	if((throttle->source = source_get(limit, str)) != NULL)
+		throttle->source->refs++;
+	pthread_mutex_unlock(&limit->lock);
+
+	return throttle->source ? 0 : -1;
+}
+
+/**
+ * The client is gone, its address is forgotten with its last client.
+ *
+ * */
+void
+limit_leave(limit_t *limit, throttle_t *throttle)
+{
+	source_t *s = throttle->source, **p;
+
+	if(s == NULL)
+		return;
+
+	pthread_mutex_lock(&limit->lock);
+
+	if(--s->refs == 0){
+		for(p = &limit->table[s->hash % LIMIT_BUCKETS]; *p != s; p = &(*p)->next);
+		*p = s->next;
+		free(s);
+	}
+
+	pthread_mutex_unlock(&limit->lock);
+
+	throttle->source = NULL;
+}
+
+/**
+ * Whether a client may send its next command. A token is taken from the
+ * command buckets if so, and 0 returned. Otherwise nothing is taken, and the
+ * milliseconds until all buckets allow it are returned.
+ *
+ * */
+unsigned int
+limit_admit(limit_t *limit, throttle_t *throttle)
+{
+	source_t *s = throttle->source;
+	uint64_t now = now_us(), us, t;
+
+	us = wait(&throttle->commands, limit->client.commands, TOKEN, now);
+	if((t = wait(&throttle->bytes, limit->client.bytes, 0, now)) > us)
+		us = t;
+
+	if(s != NULL){
+		pthread_mutex_lock(&limit->lock);
+
+		if((t = wait(&s->commands, limit->source.commands, TOKEN, now)) > us)
+			us = t;
+		if((t = wait(&s->bytes, limit->source.bytes, 0, now)) > us)
+			us = t;
+
+		if(us == 0)
+			charge(&s->commands, limit->source.commands, TOKEN);
+		else
+			s->delayed++;
+
+		pthread_mutex_unlock(&limit->lock);
+	}
+
+	if(us > 0){
+		__atomic_add_fetch(&limit->delayed, 1, __ATOMIC_RELAXED);
+		return (unsigned int) ((us + 999) / 1000);
+	}
+
+	charge(&throttle->commands, limit->client.commands, TOKEN);
+	return 0;
+}
+
+/**
+ * Count bytes sent to a client against its byte buckets.
+ *
+ * */
+void
+limit_charge(limit_t *limit, throttle_t *throttle, size_t bytes)
+{
+	source_t *s = throttle->source;
+
+	charge(&throttle->bytes, limit->client.bytes, (int64_t) bytes * TOKEN);
+
+	if(s != NULL && limit->source.bytes > 0){
+		pthread_mutex_lock(&limit->lock);
+		charge(&s->bytes, limit->source.bytes, (int64_t) bytes * TOKEN);
+		pthread_mutex_unlock(&limit->lock);
+	}
+}
+
+/**
+ * Print the addresses whose clients were held back.
+ *
+ * */
+void
+limit_report(limit_t *limit, FILE *fp)
+{
+	source_t *s;
+	int i;
+
+	fprintf(fp, "[limit] %lu commands delayed\n", __atomic_load_n(&limit->delayed, __ATOMIC_RELAXED));
+
+	pthread_mutex_lock(&limit->lock);
+
+	for(i = 0; i < LIMIT_BUCKETS; i++){
+		for(s = limit->table[i]; s != NULL; s = s->next){
+			if(s->delayed > 0)
+				fprintf(fp, "[limit] %s: %d clients, %lu commands delayed\n", s->addr, s->refs, s->delayed);
+		}
+	}
+
+	pthread_mutex_unlock(&limit->lock);
+}
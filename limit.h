@@ -0,0 +1,89 @@
+/*
+ * limit.h - client rate limits
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef LIMIT_H
+#define LIMIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+// Hash buckets of the address table
+#define LIMIT_BUCKETS 1024
+
+// Longest address kept, an IPv6 address in text
+#define LIMIT_ADDR 46
+
+/**
+ * Token bucket. The level is kept in millionths of a token, it fills at the
+ * rate per second up to a second's worth of tokens. Bytes are charged once
+ * sent, so their level may drop below zero.
+ *
+ * */
+typedef struct bucket_t {
+	int64_t level;
+	uint64_t stamp;
+} bucket_t;
+
+/**
+ * Commands and bytes per second, 0 for no limit
+ *
+ * */
+typedef struct rate_t {
+	uint64_t commands;
+	uint64_t bytes;
+} rate_t;
+
+/**
+ * The clients connected from one address, which share its buckets. Delayed
+ * counts the commands of these clients held back by either limit.
+ *
+ * */
+typedef struct source_t {
+	struct source_t *next;
+	char addr[LIMIT_ADDR];
+	uint32_t hash;
+	int refs;
+
+	bucket_t commands;
+	bucket_t bytes;
+	unsigned long delayed;
+} source_t;
+
+/**
+ * A client's own buckets, and the address it connected from
+ *
+ * */
+typedef struct throttle_t {
+	bucket_t commands;
+	bucket_t bytes;
+	source_t *source;
+} throttle_t;
+
+/**
+ * Rate limits of clients, and of all clients from the same address. The
+ * addresses are shared by all workers.
+ *
+ * */
+typedef struct limit_t {
+	pthread_mutex_t lock;
+	rate_t client;
+	rate_t source;
+	source_t *table[LIMIT_BUCKETS];
+
+	unsigned long delayed;
+} limit_t;
+
+void limit_init(limit_t *limit, rate_t client, rate_t source);
+int limit_join(limit_t *limit, throttle_t *throttle, const struct sockaddr *addr);
+void limit_leave(limit_t *limit, throttle_t *throttle);
+unsigned int limit_admit(limit_t *limit, throttle_t *throttle);
+void limit_charge(limit_t *limit, throttle_t *throttle, size_t bytes);
+void limit_report(limit_t *limit, FILE *fp);
+
+#endif
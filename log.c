@@ -0,0 +1,235 @@
+/*
+ * log.c - logging
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "ring.h"
+#include "util.h"
+
+#define TRUE 1
+#define FALSE 0
+
+/**
+ * A line being rate limited, and how often it came up in the current window
+ *
+ * */
+typedef struct log_key_t {
+	uint32_t hash;
+	uint64_t start;
+	unsigned int count;
+	unsigned long suppressed;
+
+	uint16_t len;
+	char line[LOG_LINE];
+} log_key_t;
+
+FILE *errstr;
+int log_level = LOG_INFO;
+
+static void on_line(void *arg, const char *line, size_t len);
+static void on_flush(void *arg, unsigned long dropped);
+
+// The calling thread's ring, and the flusher draining those of all threads
+static __thread ring_t *ring;
+static ring_writer_t flusher = {
+	.on_record = on_line,
+	.on_flush = on_flush,
+	.interval = LOG_INTERVAL,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static log_key_t keys[LOG_KEYS];
+
+/**
+ * Queue a line for the flusher, without waiting for it. The calling thread's
+ * ring is set up the first time it logs, rings are never freed, the threads
+ * of the proxy live as long as it does.
+ *
+ * */
+static void
+submit(const char *line, size_t len)
+{
+	if(ring == NULL && (ring = ring_new(&flusher, LOG_BYTES)) == NULL)
+		return;
+
+	ring_write(ring, line, len, NULL, 0);
+}
+
+/**
+ * Log a line as [comp] followed by the formatted message, if level is
+ * logged at all. The line is written by the flusher shortly after.
+ *
+ * */
+void
+log_write(int level, const char *comp, const char *fmt, ...)
+{
+	char line[LOG_LINE];
+	va_list ap;
+	size_t len;
+	int n;
+
+	if(level > log_level)
+		return;
+
+	if((n = snprintf(line, sizeof line, "[%s] ", comp)) < 0)
+		return;
+	len = (size_t) n < sizeof line - 1 ? (size_t) n : sizeof line - 1;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line + len, sizeof line - len, fmt, ap);
+	va_end(ap);
+
+	if(n < 0)
+		return;
+
+	// Cut to leave room for the newline
+	len += (size_t) n;
+	if(len > sizeof line - 1)
+		len = sizeof line - 1;
+	line[len++] = '\n';
+
+	submit(line, len);
+}
+
+static void
+report(log_key_t *k)
+{
+	if(k->suppressed == 0)
+		return;
+
+	fprintf(errstr, "[log] Suppressed %lu repeats of: %.*s", k->suppressed, (int) k->len, k->line);
+	k->suppressed = 0;
+}
+
+/**
+ * Write a line, unless it came up LOG_BURST times already in the current
+ * window. A line pushing another out of its key has the repeats of that one
+ * reported first.
+ *
+ * */
+static void
+emit(const char *line, size_t len, uint64_t now)
+{
+	uint32_t h = hash(line, len);
+	log_key_t *k = &keys[h % LOG_KEYS];
+
+	if(k->len != len || k->hash != h || memcmp(k->line, line, len) != 0){
+		report(k);
+
+		k->hash = h;
+		k->start = now;
+		k->count = 0;
+		k->len = (uint16_t) len;
+		memcpy(k->line, line, len);
+	} else if(now - k->start >= LOG_WINDOW){
+		report(k);
+
+		k->start = now;
+		k->count = 0;
+	}
+
+	if(++k->count > LOG_BURST){
+		k->suppressed++;
+		return;
+	}
+
+	fwrite(line, 1, len, errstr);
+}
+
+static void
+on_line(void *arg, const char *line, size_t len)
+{
+	emit(line, len, now_us() / 1000);
+}
+
+/**
+ * After the lines of all threads are written: report the dropped ones, and
+ * the repeats of lines whose window is over, even if they do not come up
+ * again.
+ *
+ * */
+static void
+on_flush(void *arg, unsigned long dropped)
+{
+	uint64_t now = now_us() / 1000;
+	int i;
+
+	if(dropped > 0)
+		fprintf(errstr, "[log] Dropped %lu lines\n", dropped);
+
+	for(i = 0; i < LOG_KEYS; i++){
+		if(keys[i].suppressed > 0 && now - keys[i].start >= LOG_WINDOW)
+			report(&keys[i]);
+	}
+
+	fflush(errstr);
+}
+
+/**
+ * Start the flusher. Lines are buffered from now on, and written with a
+ * single write every LOG_INTERVAL.
+ *
+ * */
+int
+log_start(void)
+{
+	setvbuf(errstr, NULL, _IOFBF, BUFSIZ);
+
+	return ring_start(&flusher);
+}
+
+/**
+ * Stop the flusher, and write out what is left.
+ *
+ * */
+void
+log_stop(void)
+{
+	ring_stop(&flusher);
+}
+
+void
+print(const char *comp, const char *msg)
+{
+	char line[LOG_LINE];
+	int n;
+
+	if((n = snprintf(line, sizeof line, "[%s]: %s (%d)\n", comp, msg, errno)) < 0)
+		return;
+
+	if((size_t) n > sizeof line - 1){
+		n = (int) sizeof line - 1;
+		line[n - 1] = '\n';
+	}
+
+	submit(line, (size_t) n);
+}
+
+void
+print_addr(const char *comp, const char *msg, const struct sockaddr *addr)
+{
+	char s[INET6_ADDRSTRLEN];
+	int port;
+
+	if(addr->sa_family == AF_INET){
+		inet_ntop(AF_INET, &((struct sockaddr_in*) addr)->sin_addr, s, sizeof(s));
+		port = htons(((struct sockaddr_in*) addr)->sin_port);
+	} else {
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*) addr)->sin6_addr, s, sizeof(s));
+		port = htons(((struct sockaddr_in6*) addr)->sin6_port);
+	}
+
+	log_write(LOG_INFO, comp, "%s %s:%d", msg, s, port);
+}
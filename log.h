@@ -0,0 +1,47 @@
+/*
+ * log.h - logging
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define LOG_ERROR 0
+#define LOG_WARNING 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+// Longest line logged, longer ones are cut
+#define LOG_LINE 256
+
+// Bytes of lines a thread may have waiting for the flusher, a power of two.
+// Lines logged while its ring is full are dropped and counted
+#define LOG_BYTES (64 * 1024)
+
+// Milliseconds between two flushes
+#define LOG_INTERVAL 100
+
+// The same line is written at most LOG_BURST times per LOG_WINDOW
+// milliseconds, further repeats are counted and reported once the window
+// is over. LOG_KEYS lines are tracked at once
+#define LOG_BURST 5
+#define LOG_WINDOW 1000
+#define LOG_KEYS 64
+
+extern FILE *errstr;
+extern int log_level;
+
+void log_write(int level, const char *comp, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+int log_start(void);
+void log_stop(void);
+
+void print(const char *comp, const char *msg);
+void print_addr(const char *comp, const char *msg, const struct sockaddr *addr);
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * metrics.c - Prometheus metrics
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+
+#include "metrics.h"
+#include "log.h"
+#include "queue.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// Histogram buckets exported: every power of two of microseconds from
+// 2^METRICS_FIRST, finer buckets are added up into these
+#define METRICS_FIRST 4
+
+void
+metrics_init(metrics_t *metrics)
+{
+	memset(metrics, 0, sizeof(metrics_t));
+}
+
+void
+exporter_init(exporter_t *exporter, upstream_t *upstream, metrics_t **shards, int n_shards)
+{
+	memset(exporter, 0, sizeof(exporter_t));
+	exporter->fd = -1;
+	exporter->upstream = upstream;
+	exporter->shards = shards;
+	exporter->n_shards = n_shards;
+}
+
+/**
+ * Listen for scrapes on addr. The socket blocks, the exporter's thread has
+ * nothing else to do.
+ *
+ * */
+int
+exporter_listen(exporter_t *exporter, struct addrinfo *addr)
+{
+	int fd, optval = 1;
+
+	if((fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol)) < 0)
+		return -1;
+
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval) < 0 ||
+			bind(fd, addr->ai_addr, addr->ai_addrlen) < 0 || listen(fd, SOMAXCONN) < 0){
+		close(fd);
+		return -1;
+	}
+
+	exporter->fd = fd;
+
+	return 0;
+}
+
+static void
+merge_histogram(histogram_t *to, const histogram_t *from)
+{
+	int i;
+
+	for(i = 0; i < METRICS_BUCKETS; i++)
+		to->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+
+	to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add up the metrics of all loops. Each counter is read on its own, a scrape
+ * may see a loop halfway through an update of several.
+ *
+ * */
+static void
+merge(exporter_t *exporter, metrics_t *total)
+{
+	metrics_t *m;
+	int i, j;
+
+	memset(total, 0, sizeof(metrics_t));
+
+	for(i = 0; i < exporter->n_shards; i++){
+		m = exporter->shards[i];
+
+		total->opened += __atomic_load_n(&m->opened, __ATOMIC_RELAXED);
+		total->closed += __atomic_load_n(&m->closed, __ATOMIC_RELAXED);
+		total->bytes_up += __atomic_load_n(&m->bytes_up, __ATOMIC_RELAXED);
+		total->bytes_down += __atomic_load_n(&m->bytes_down, __ATOMIC_RELAXED);
+		total->answered += __atomic_load_n(&m->answered, __ATOMIC_RELAXED);
+
+		merge_histogram(&total->connect, &m->connect);
+		for(j = 0; j <= MPD_COMMANDS; j++)
+			merge_histogram(&total->commands[j], &m->commands[j]);
+	}
+}
+
+/**
+ * Microseconds up to which bucket i counts latencies, exclusive.
+ *
+ * */
+static uint64_t
+bucket_end(int i)
+{
+	return histogram_value((unsigned int) i + 1, METRICS_SUB_BITS);
+}
+
+/**
+ * Write a histogram in seconds, with the given labels (may be empty).
+ *
+ * */
+static void
+render_histogram(FILE *fp, const char *name, const char *labels, const histogram_t *h)
+{
+	const char *sep = labels[0] ? "," : "";
+	const char *left = labels[0] ? "{" : "", *right = labels[0] ? "}" : "";
+	uint64_t count = 0, edge;
+	int i = 0, p;
+
+	for(p = METRICS_FIRST; p <= METRICS_POWERS; p++){
+		edge = (uint64_t) 1 << p;
+
+		for(; i < METRICS_BUCKETS && bucket_end(i) <= edge; i++)
+			count += h->counts[i];
+
+		fprintf(fp, "%s_bucket{%s%sle=\"%.6f\"} %lu\n", name, labels, sep, (double) edge / 1000000, count);
+	}
+
+	for(; i < METRICS_BUCKETS; i++)
+		count += h->counts[i];
+
+	fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, count);
+	fprintf(fp, "%s_sum%s%s%s %.6f\n", name, left, labels, right, (double) h->sum / 1000000);
+	fprintf(fp, "%s_count%s%s%s %lu\n", name, left, labels, right, count);
+}
+
+static uint64_t
+histogram_count(const histogram_t *h)
+{
+	uint64_t count = 0;
+	int i;
+
+	for(i = 0; i < METRICS_BUCKETS; i++)
+		count += h->counts[i];
+
+	return count;
+}
+
+/**
+ * Write the metrics in Prometheus' text format. Returns the text, to be freed
+ * by the caller, or NULL if out of memory.
+ *
+ * */
+static char *
+render(exporter_t *exporter, size_t *len)
+{
+	upstream_t *upstream = exporter->upstream;
+	metrics_t *total;
+	backend_t *b;
+	char *text = NULL, labels[64];
+	FILE *fp;
+	int i;
+
+	if((total = malloc(sizeof(metrics_t))) == NULL)
+		return NULL;
+
+	if((fp = open_memstream(&text, len)) == NULL){
+		free(total);
+		return NULL;
+	}
+
+	merge(exporter, total);
+
+	fprintf(fp, "# HELP mpdproxy_connections Client connections open.\n");
+	fprintf(fp, "# TYPE mpdproxy_connections gauge\n");
+	fprintf(fp, "mpdproxy_connections %lu\n", total->opened - total->closed);
+
+	fprintf(fp, "# HELP mpdproxy_connections_total Client connections accepted.\n");
+	fprintf(fp, "# TYPE mpdproxy_connections_total counter\n");
+	fprintf(fp, "mpdproxy_connections_total %lu\n", total->opened);
+
+	fprintf(fp, "# HELP mpdproxy_bytes_total Bytes relayed, from clients upstream and from upstream or the proxy downstream.\n");
+	fprintf(fp, "# TYPE mpdproxy_bytes_total counter\n");
+	fprintf(fp, "mpdproxy_bytes_total{direction=\"upstream\"} %lu\n", total->bytes_up);
+	fprintf(fp, "mpdproxy_bytes_total{direction=\"downstream\"} %lu\n", total->bytes_down);
+
+	fprintf(fp, "# HELP mpdproxy_answered_total Commands answered by the proxy from its cache, mirror or art cache.\n");
+	fprintf(fp, "# TYPE mpdproxy_answered_total counter\n");
+	fprintf(fp, "mpdproxy_answered_total %lu\n", total->answered);
+
+	fprintf(fp, "# HELP mpdproxy_backend_up Whether a backend passes its health checks.\n");
+	fprintf(fp, "# TYPE mpdproxy_backend_up gauge\n");
+	for(i = 0; i < upstream->n_backends; i++){
+		b = &upstream->backends[i];
+		fprintf(fp, "mpdproxy_backend_up{backend=\"%s\"} %d\n", b->name, __atomic_load_n(&b->up, __ATOMIC_RELAXED) ? 1 : 0);
+	}
+
+	fprintf(fp, "# HELP mpdproxy_backend_connections Connections open to a backend.\n");
+	fprintf(fp, "# TYPE mpdproxy_backend_connections gauge\n");
+	for(i = 0; i < upstream->n_backends; i++){
+		b = &upstream->backends[i];
+		fprintf(fp, "mpdproxy_backend_connections{backend=\"%s\"} %d\n", b->name, __atomic_load_n(&b->conns, __ATOMIC_RELAXED));
+	}
+
+	fprintf(fp, "# HELP mpdproxy_upstream_connect_seconds Time to connect to a backend.\n");
+	fprintf(fp, "# TYPE mpdproxy_upstream_connect_seconds histogram\n");
+	render_histogram(fp, "mpdproxy_upstream_connect_seconds", "", &total->connect);
+
+	fprintf(fp, "# HELP mpdproxy_command_seconds Time from sending a command upstream to the end of its response.\n");
+	fprintf(fp, "# TYPE mpdproxy_command_seconds histogram\n");
+	for(i = 0; i <= MPD_COMMANDS; i++){
+		if(histogram_count(&total->commands[i]) == 0)
+			continue;
+
+		snprintf(labels, sizeof labels, "command=\"%s\"", mpd_command_name(i));
+		render_histogram(fp, "mpdproxy_command_seconds", labels, &total->commands[i]);
+	}
+
+	free(total);
+
+	if(fclose(fp) != 0){
+		free(text);
+		return NULL;
+	}
+
+	return text;
+}
+
+static int
+send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t bytes;
+
+	while(len > 0){
+		if((bytes = send(fd, buf, len, MSG_NOSIGNAL)) < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		buf += bytes;
+		len -= (size_t) bytes;
+	}
+
+	return 0;
+}
+
+/**
+ * Answer a single HTTP request, then the scraper is hung up on. Any path is
+ * served the metrics, Prometheus asks for /metrics.
+ *
+ * */
+static void
+serve(exporter_t *exporter, int fd)
+{
+	struct timeval tv = { METRICS_TIMEOUT, 0 };
+	char request[METRICS_REQUEST + 1], header[256];
+	const char *status = "200 OK";
+	char *text = NULL;
+	size_t len = 0, text_len = 0;
+	ssize_t bytes;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+	// The body of a GET is empty, the request ends with its headers
+	while(len < METRICS_REQUEST){
+		if((bytes = recv(fd, request + len, METRICS_REQUEST - len, 0)) < 0){
+			if(errno == EINTR)
+				continue;
+			return;
+		}
+
+		if(bytes == 0)
+			return;
+
+		len += (size_t) bytes;
+		request[len] = '\0';
+
+		if(strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+			break;
+	}
+
+	if(strncmp(request, "GET ", 4) != 0)
+		status = "405 Method Not Allowed";
+	else if((text = render(exporter, &text_len)) == NULL)
+		status = "500 Internal Server Error";
+
+	len = (size_t) snprintf(header, sizeof header, "HTTP/1.0 %s\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", status, text_len);
+
+	if(send_all(fd, header, len) == 0 && text)
+		send_all(fd, text, text_len);
+
+	free(text);
+}
+
+static void *
+th_export(void *arg)
+{
+	exporter_t *exporter = (exporter_t*) arg;
+	int fd;
+
+	// Cancelled on exit while it waits in accept
+	queue_ins(pthread_self());
+
+	for(;;){
+		if((fd = accept4(exporter->fd, NULL, NULL, SOCK_CLOEXEC)) < 0){
+			// Most likely out of descriptors, give the workers time to close some
+			if(errno != EINTR && errno != ECONNABORTED){
+				print("metrics_accept", strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+
+		serve(exporter, fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+int
+exporter_start(exporter_t *exporter)
+{
+	sigset_t set, old;
+	int err;
+
+	// Signals are handled by the main thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	err = pthread_create(&exporter->th_id, NULL, &th_export, exporter);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return err;
+}
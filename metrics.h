@@ -0,0 +1,105 @@
+/*
+ * metrics.h - Prometheus metrics
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netdb.h>
+
+#include "upstream.h"
+#include "protocol.h"
+#include "util.h"
+
+// Sub-buckets of a histogram per power of two, as bits: latencies are kept
+// within a quarter of their value
+#define METRICS_SUB_BITS 2
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+
+// Powers of two of microseconds a histogram spans, up to about 4 minutes.
+// Longer latencies are counted in the last bucket
+#define METRICS_POWERS 27
+#define METRICS_BUCKETS (METRICS_POWERS * METRICS_SUB)
+
+// Bytes of a scrape request read at most, and seconds a scraper has to send
+// it or take the response
+#define METRICS_REQUEST 4096
+#define METRICS_TIMEOUT 2
+
+/**
+ * Latencies in microseconds, in log-linear buckets: every power of two is
+ * split in METRICS_SUB equal parts.
+ *
+ * */
+typedef struct histogram_t {
+	uint64_t counts[METRICS_BUCKETS];
+	uint64_t sum;
+} histogram_t;
+
+/**
+ * Metrics of one event loop. Only the loop's thread writes them, without
+ * locks, the scraper reads and adds up those of all loops.
+ *
+ * */
+typedef struct metrics_t {
+	uint64_t opened;
+	uint64_t closed;
+
+	// Bytes relayed from clients to upstream, and to clients
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+
+	// PROTOCOL_MPD: commands the proxy answered itself
+	uint64_t answered;
+
+	histogram_t connect;
+	histogram_t commands[MPD_COMMANDS + 1];
+} metrics_t;
+
+/**
+ * Serves the metrics of all loops over HTTP, from its own thread
+ *
+ * */
+typedef struct exporter_t {
+	int fd;
+	pthread_t th_id;
+
+	metrics_t **shards;
+	int n_shards;
+	upstream_t *upstream;
+} exporter_t;
+
+void metrics_init(metrics_t *metrics);
+
+void exporter_init(exporter_t *exporter, upstream_t *upstream, metrics_t **shards, int n_shards);
+int exporter_listen(exporter_t *exporter, struct addrinfo *addr);
+int exporter_start(exporter_t *exporter);
+
+/**
+ * Add to a counter of the calling loop. There is a single writer, so no
+ * locked instruction is needed, the store only must not tear.
+ *
+ * */
+static inline void
+metrics_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a latency of us microseconds.
+ *
+ * */
+static inline void
+metrics_record(histogram_t *h, uint64_t us)
+{
+	metrics_add(&h->counts[histogram_bucket(us, METRICS_SUB_BITS, METRICS_BUCKETS)], 1);
+	metrics_add(&h->sum, us);
+}
+
+#endif
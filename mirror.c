@@ -0,0 +1,3413 @@
+/*
+ * mirror.c - in-memory mirror of MPD's database
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mirror.h"
+#include "event.h"
+#include "upstream.h"
+#include "protocol.h"
+#include "buffer.h"
+#include "log.h"
+#include "util.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// Whether MPD is updating, and what it counts
+#define STATS "command_list_ok_begin\nstatus\nstats\ncommand_list_end\n"
+#define LISTALL "listall\n"
+#define LISTALLINFO "listallinfo\n"
+
+#define NONE UINT32_MAX
+
+// Longest command, and most arguments and conditions, answered from the mirror
+#define DB_LINE_SIZE 4096
+#define DB_ARGS 32
+#define DB_CONDITIONS 16
+
+// Conditions on something else than a tag
+#define COND_ANY -1
+#define COND_FILE -2
+#define COND_BASE -3
+#define COND_UNKNOWN -4
+
+// Occurrence of a string as the path of a song, rather than a tag value
+#define OCC_PATH DB_TAGS
+
+#define OP_EQ 0
+#define OP_NE 1
+#define OP_CONTAINS 2
+
+// Lines of a song that are not tags
+static const char *attributes[] = {
+	"Last-Modified", "Added", "Format", "Time", "duration", "Range",
+};
+
+// Tags standing in for one a song does not have, as MPD does
+static const struct {
+	const char *tag;
+	const char *fallback;
+} fallbacks[] = {
+	{ "AlbumArtist", "Artist" },
+	{ "ArtistSort", "Artist" },
+	{ "AlbumArtistSort", "AlbumArtist" },
+	{ "AlbumSort", "Album" },
+	{ "TitleSort", "Title" },
+	{ "ComposerSort", "Composer" },
+};
+
+// Sort orders other than a tag
+#define SORT_NONE -1
+#define SORT_MODIFIED -2
+
+// Conditions, and sort orders, on a tag, found by name in each segment
+#define COND_TAG 0
+#define SORT_TAG 0
+
+typedef struct condition_t {
+	int type;
+	const char *name;
+	size_t name_len;
+	int op;
+	const char *value;
+	size_t len;
+} condition_t;
+
+// Snapshot files, rewritten whenever the layout of db_t or segment_t changes
+#define SNAPSHOT_MAGIC "MPDPRXDB"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_ORDER 0x01020304U
+
+#define ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+/**
+ * Header of a snapshot file, followed by its slices, then its segments.
+ *
+ * */
+typedef struct snapshot_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;
+	uint64_t size;
+	uint64_t db_update;
+	int32_t n_segments;
+	uint32_t n_slices;
+} snapshot_t;
+
+/**
+ * Header of a segment in a snapshot file, followed by the arrays of the
+ * segment, each starting on a multiple of eight bytes, in the order layout()
+ * walks them. The size covers the header too.
+ *
+ * */
+typedef struct segment_header_t {
+	uint64_t size;
+	uint64_t text_len;
+	uint32_t n_entries;
+	uint32_t n_strings;
+	uint32_t n_slots;
+	uint32_t n_occ;
+	uint32_t n_tri;
+	int32_t n_tags;
+	int32_t tri_bits;
+	uint32_t tag_name[DB_TAGS];
+	int32_t fallback[DB_TAGS];
+	uint32_t column_n[DB_TAGS];
+} segment_header_t;
+
+/**
+ * A snapshot file mapped into memory, unmapped once no segment loaded from it
+ * is left.
+ *
+ * */
+typedef struct map_t {
+	int refs;
+	void *addr;
+	size_t len;
+} map_t;
+
+typedef struct sort_key_t {
+	uint32_t rank;
+	uint32_t entry;
+	int segment;
+	long number;
+	const char *str;
+	size_t len;
+} sort_key_t;
+
+typedef struct value_t {
+	const char *str;
+	uint32_t len;
+} value_t;
+
+static void on_connected(void*, int, backend_t*);
+static void on_mirror(handler_t*, uint32_t);
+static void on_stats(mpd_response_t*, const char*, size_t);
+static void on_retry(timeout_t*);
+static void on_hold(timeout_t*);
+static void on_indexed(post_t*);
+static void *th_index(void*);
+
+/**
+ * Snapshots
+ *
+ * */
+static void
+map_put(map_t *map)
+{
+	if(__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0){
+		munmap(map->addr, map->len);
+		free(map);
+	}
+}
+
+static segment_t *
+segment_new()
+{
+	segment_t *seg = calloc(1, sizeof(segment_t));
+
+	if(seg != NULL)
+		seg->refs = 1;
+
+	return seg;
+}
+
+static void
+segment_free(segment_t *seg)
+{
+	int i;
+
+	if(seg->map != NULL){
+		map_put(seg->map);
+		free(seg);
+		return;
+	}
+
+	for(i = 0; i < seg->n_tags; i++){
+		free(seg->columns[i].entry);
+		free(seg->columns[i].value);
+		free(seg->has[i]);
+	}
+
+	free(seg->text);
+	free(seg->kind);
+	free(seg->path);
+	free(seg->parent);
+	free(seg->off);
+	free(seg->len);
+	free(seg->str_off);
+	free(seg->str_len);
+	free(seg->slots);
+	free(seg->occ_start);
+	free(seg->occ_entry);
+	free(seg->occ_tag);
+	free(seg->tri_start);
+	free(seg->tri_string);
+	free(seg);
+}
+
+/**
+ * Drop a reference to a segment, from any thread.
+ *
+ * */
+static void
+segment_put(segment_t *seg)
+{
+	if(seg != NULL && __atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		segment_free(seg);
+}
+
+static db_t *
+db_new()
+{
+	db_t *db = calloc(1, sizeof(db_t));
+
+	if(db != NULL)
+		db->refs = 1;
+
+	return db;
+}
+
+static void
+db_free(db_t *db)
+{
+	int s;
+
+	for(s = 0; s < db->n_segments; s++){
+		segment_put(db->segments[s]);
+		free(db->live[s]);
+	}
+
+	free(db->slices);
+	free(db);
+}
+
+/**
+ * Drop a reference to a snapshot, from any thread.
+ *
+ * */
+void
+db_put(db_t *db)
+{
+	if(db != NULL && __atomic_sub_fetch(&db->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		db_free(db);
+}
+
+static void *
+resize(void *array, size_t n, size_t size, int *failed)
+{
+	void *tmp;
+
+	if((tmp = realloc(array, n * size)) == NULL){
+		*failed = TRUE;
+		return array;
+	}
+
+	return tmp;
+}
+
+static int
+text_add(segment_t *seg, const char *data, size_t len)
+{
+	size_t size = seg->text_size ? seg->text_size : 1 << 20;
+	char *tmp;
+
+	while(size < seg->text_len + len)
+		size *= 2;
+
+	if(size != seg->text_size){
+		if(size > UINT32_MAX || (tmp = realloc(seg->text, size)) == NULL)
+			return -1;
+
+		seg->text = tmp;
+		seg->text_size = size;
+	}
+
+	memcpy(seg->text + seg->text_len, data, len);
+	seg->text_len += len;
+
+	return 0;
+}
+
+static int
+string_is(segment_t *seg, uint32_t id, const char *str, size_t len)
+{
+	return seg->str_len[id] == len && memcmp(seg->text + seg->str_off[id], str, len) == 0;
+}
+
+/**
+ * Id of a string, NONE if the database does not know it.
+ *
+ * */
+static uint32_t
+lookup(segment_t *seg, const char *str, size_t len)
+{
+	uint32_t i, id;
+
+	if(seg->n_slots == 0)
+		return NONE;
+
+	for(i = hash(str, len) & (seg->n_slots - 1); (id = seg->slots[i]) != 0; i = (i + 1) & (seg->n_slots - 1)){
+		if(string_is(seg, id - 1, str, len))
+			return id - 1;
+	}
+
+	return NONE;
+}
+
+static int
+rehash(segment_t *seg)
+{
+	uint32_t n_slots = seg->n_slots ? seg->n_slots * 2 : 1 << 16, *slots, i, j, id;
+
+	if((slots = calloc(n_slots, sizeof(uint32_t))) == NULL)
+		return -1;
+
+	for(i = 0; i < seg->n_slots; i++){
+		if((id = seg->slots[i]) == 0)
+			continue;
+
+		for(j = hash(seg->text + seg->str_off[id - 1], seg->str_len[id - 1]) & (n_slots - 1); slots[j] != 0; j = (j + 1) & (n_slots - 1));
+		slots[j] = id;
+	}
+
+	free(seg->slots);
+	seg->slots = slots;
+	seg->n_slots = n_slots;
+
+	return 0;
+}
+
+/**
+ * Id of the string at off in the text, interning it if it is new.
+ *
+ * */
+static uint32_t
+intern(segment_t *seg, size_t off, size_t len)
+{
+	const char *str = seg->text + off;
+	uint32_t i, id;
+	int failed = FALSE;
+
+	if((id = lookup(seg, str, len)) != NONE)
+		return id;
+
+	// Keep the table at most half full
+	if(seg->n_strings * 2 >= seg->n_slots && rehash(seg) < 0)
+		return NONE;
+
+	if(seg->n_strings == seg->strings_size){
+		seg->strings_size = seg->strings_size ? seg->strings_size * 2 : 1 << 16;
+		seg->str_off = resize(seg->str_off, seg->strings_size, sizeof(uint32_t), &failed);
+		seg->str_len = resize(seg->str_len, seg->strings_size, sizeof(uint32_t), &failed);
+		if(failed)
+			return NONE;
+	}
+
+	id = seg->n_strings++;
+	seg->str_off[id] = (uint32_t) off;
+	seg->str_len[id] = (uint32_t) len;
+
+	for(i = hash(str, len) & (seg->n_slots - 1); seg->slots[i] != 0; i = (i + 1) & (seg->n_slots - 1));
+	seg->slots[i] = id + 1;
+
+	return id;
+}
+
+/**
+ * Tag called name, -1 if there is no such tag. Tag names are not case
+ * sensitive.
+ *
+ * */
+static int
+tag_find(segment_t *seg, const char *name, size_t len)
+{
+	int i;
+
+	for(i = 0; i < seg->n_tags; i++){
+		if(seg->str_len[seg->tag_name[i]] == len && strncasecmp(seg->text + seg->str_off[seg->tag_name[i]], name, len) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static int
+tag_add(segment_t *seg, size_t off, size_t len)
+{
+	int tag;
+
+	if((tag = tag_find(seg, seg->text + off, len)) >= 0 || seg->n_tags == DB_TAGS)
+		return tag;
+
+	if((seg->tag_name[seg->n_tags] = intern(seg, off, len)) == NONE)
+		return -1;
+
+	seg->fallback[seg->n_tags] = -1;
+
+	return seg->n_tags++;
+}
+
+static int
+column_add(column_t *col, uint32_t entry, uint32_t value)
+{
+	int failed = FALSE;
+
+	if(col->n == col->size){
+		col->size = col->size ? col->size * 2 : 1024;
+		col->entry = resize(col->entry, col->size, sizeof(uint32_t), &failed);
+		col->value = resize(col->value, col->size, sizeof(uint32_t), &failed);
+		if(failed)
+			return -1;
+	}
+
+	col->entry[col->n] = entry;
+	col->value[col->n] = value;
+	col->n++;
+
+	return 0;
+}
+
+static uint32_t
+entry_add(segment_t *seg, uint8_t kind, size_t off, size_t value, size_t len)
+{
+	const char *slash;
+	uint32_t id;
+	int failed = FALSE;
+
+	if(seg->n_entries == seg->entries_size){
+		seg->entries_size = seg->entries_size ? seg->entries_size * 2 : 1 << 14;
+		seg->kind = resize(seg->kind, seg->entries_size, sizeof(uint8_t), &failed);
+		seg->path = resize(seg->path, seg->entries_size, sizeof(uint32_t), &failed);
+		seg->parent = resize(seg->parent, seg->entries_size, sizeof(uint32_t), &failed);
+		seg->off = resize(seg->off, seg->entries_size, sizeof(uint32_t), &failed);
+		seg->len = resize(seg->len, seg->entries_size, sizeof(uint32_t), &failed);
+		if(failed)
+			return NONE;
+	}
+
+	id = seg->n_entries;
+	seg->kind[id] = kind;
+	seg->off[id] = (uint32_t) off;
+	seg->len[id] = 0;
+
+	// Entries at the top have the empty string as parent
+	slash = memrchr(seg->text + value, '/', len);
+	seg->path[id] = intern(seg, value, len);
+	seg->parent[id] = intern(seg, value, slash ? (size_t) (slash - seg->text) - value : 0);
+
+	if(seg->path[id] == NONE || seg->parent[id] == NONE)
+		return NONE;
+
+	seg->n_entries++;
+
+	return id;
+}
+
+static int
+is_attribute(const char *key, size_t len)
+{
+	unsigned int i;
+
+	for(i = 0; i < sizeof(attributes) / sizeof(attributes[0]); i++){
+		if(strlen(attributes[i]) == len && strncmp(key, attributes[i], len) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static uint64_t *
+bits_new(segment_t *seg)
+{
+	return calloc((seg->n_entries + 63) / 64 + 1, sizeof(uint64_t));
+}
+
+static inline void
+bit_set(uint64_t *bits, uint32_t i)
+{
+	bits[i / 64] |= 1ULL << (i % 64);
+}
+
+static inline void
+bit_clear(uint64_t *bits, uint32_t i)
+{
+	bits[i / 64] &= ~(1ULL << (i % 64));
+}
+
+static inline int
+bit_test(const uint64_t *bits, uint32_t i)
+{
+	return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+/**
+ * Add a segment to a snapshot, taking over the reference to it. Returns its
+ * number in the snapshot, -1 if it could not be added.
+ *
+ * */
+static int
+db_attach(db_t *db, segment_t *seg)
+{
+	if(db->n_segments == DB_SEGMENTS || (db->live[db->n_segments] = bits_new(seg)) == NULL){
+		segment_put(seg);
+		return -1;
+	}
+
+	db->segments[db->n_segments] = seg;
+
+	return db->n_segments++;
+}
+
+/**
+ * Append entry i of segment s to the entries of a snapshot.
+ *
+ * */
+static int
+slice_add(db_t *db, int s, uint32_t i)
+{
+	slice_t *last = db->n_slices > 0 ? &db->slices[db->n_slices - 1] : NULL;
+	int failed = FALSE;
+
+	if(last != NULL && last->segment == (uint32_t) s && last->to == i){
+		last->to++;
+	} else {
+		if(db->n_slices == db->slices_size){
+			db->slices_size = db->slices_size ? db->slices_size * 2 : 256;
+			db->slices = resize(db->slices, db->slices_size, sizeof(slice_t), &failed);
+			if(failed)
+				return -1;
+		}
+
+		last = &db->slices[db->n_slices++];
+		last->segment = (uint32_t) s;
+		last->from = i;
+		last->to = i + 1;
+	}
+
+	bit_set(db->live[s], i);
+	db->n_entries++;
+
+	return 0;
+}
+
+/**
+ * A snapshot of all entries of a segment, taking over the reference to it.
+ *
+ * */
+static db_t *
+db_whole(segment_t *seg, uint64_t db_update)
+{
+	db_t *db;
+	uint32_t i;
+
+	if((db = db_new()) == NULL){
+		segment_put(seg);
+		return NULL;
+	}
+
+	db->db_update = db_update;
+
+	if(db_attach(db, seg) < 0){
+		db_put(db);
+		return NULL;
+	}
+
+	for(i = 0; i < seg->n_entries; i++){
+		if(slice_add(db, 0, i) < 0){
+			db_put(db);
+			return NULL;
+		}
+	}
+
+	return db;
+}
+
+/**
+ * Index the songs each string occurs in, and of which tag it is a value there.
+ *
+ * */
+static int
+index_occurrences(segment_t *seg)
+{
+	column_t *col;
+	uint32_t i, *fill;
+	int tag;
+
+	if((seg->occ_start = calloc(seg->n_strings + 1, sizeof(uint32_t))) == NULL)
+		return -1;
+
+	for(tag = 0; tag < seg->n_tags; tag++){
+		for(i = 0; i < seg->columns[tag].n; i++)
+			seg->occ_start[seg->columns[tag].value[i] + 1]++;
+	}
+
+	for(i = 0; i < seg->n_entries; i++){
+		if(seg->kind[i] == DB_SONG)
+			seg->occ_start[seg->path[i] + 1]++;
+	}
+
+	for(i = 0; i < seg->n_strings; i++)
+		seg->occ_start[i + 1] += seg->occ_start[i];
+
+	if((seg->occ_entry = malloc((seg->occ_start[seg->n_strings] + 1) * sizeof(uint32_t))) == NULL ||
+			(seg->occ_tag = malloc(seg->occ_start[seg->n_strings] + 1)) == NULL ||
+			(fill = malloc((seg->n_strings + 1) * sizeof(uint32_t))) == NULL)
+		return -1;
+
+	memcpy(fill, seg->occ_start, seg->n_strings * sizeof(uint32_t));
+
+	for(tag = 0; tag < seg->n_tags; tag++){
+		col = &seg->columns[tag];
+		for(i = 0; i < col->n; i++){
+			seg->occ_entry[fill[col->value[i]]] = col->entry[i];
+			seg->occ_tag[fill[col->value[i]]++] = (uint8_t) tag;
+		}
+	}
+
+	for(i = 0; i < seg->n_entries; i++){
+		if(seg->kind[i] == DB_SONG){
+			seg->occ_entry[fill[seg->path[i]]] = i;
+			seg->occ_tag[fill[seg->path[i]]++] = OCC_PATH;
+		}
+	}
+
+	free(fill);
+
+	return 0;
+}
+
+/**
+ * Bucket of the case folded trigram at str.
+ *
+ * */
+static inline uint32_t
+trigram(const segment_t *seg, const char *str)
+{
+	uint32_t t = (uint32_t) tolower((unsigned char) str[0]) << 16 |
+		(uint32_t) tolower((unsigned char) str[1]) << 8 |
+		(uint32_t) tolower((unsigned char) str[2]);
+
+	return (t * 2654435761U) >> (32 - seg->tri_bits);
+}
+
+/**
+ * Count (fill NULL) or record the strings containing each trigram, a string
+ * at most once per bucket.
+ *
+ * */
+static void
+trigrams(segment_t *seg, uint32_t *last, uint32_t *fill)
+{
+	const char *str;
+	uint32_t id, b;
+	size_t i;
+
+	memset(last, 0xff, ((size_t) 1 << seg->tri_bits) * sizeof(uint32_t));
+
+	for(id = 0; id < seg->n_strings; id++){
+		str = seg->text + seg->str_off[id];
+
+		for(i = 0; i + 3 <= seg->str_len[id]; i++){
+			if(last[b = trigram(seg, str + i)] == id)
+				continue;
+			last[b] = id;
+
+			if(fill == NULL)
+				seg->tri_start[b + 1]++;
+			else
+				seg->tri_string[fill[b]++] = id;
+		}
+	}
+}
+
+/**
+ * Index the strings by the trigrams they contain. Buckets grow with the
+ * number of strings, collisions only cost candidates the query discards.
+ *
+ * */
+static int
+index_trigrams(segment_t *seg)
+{
+	uint32_t n, i, *last, *fill = NULL;
+	int ret = -1;
+
+	for(seg->tri_bits = 12; seg->tri_bits < 22 && ((uint32_t) 1 << seg->tri_bits) < seg->n_strings; seg->tri_bits++);
+	n = (uint32_t) 1 << seg->tri_bits;
+
+	if((seg->tri_start = calloc(n + 1, sizeof(uint32_t))) == NULL || (last = malloc(n * sizeof(uint32_t))) == NULL)
+		return -1;
+
+	trigrams(seg, last, NULL);
+
+	for(i = 0; i < n; i++)
+		seg->tri_start[i + 1] += seg->tri_start[i];
+
+	if((seg->tri_string = malloc((seg->tri_start[n] + 1) * sizeof(uint32_t))) == NULL ||
+			(fill = malloc(n * sizeof(uint32_t))) == NULL)
+		goto out;
+
+	memcpy(fill, seg->tri_start, n * sizeof(uint32_t));
+	trigrams(seg, last, fill);
+
+	ret = 0;
+
+out:
+	free(last);
+	free(fill);
+
+	return ret;
+}
+
+static int
+entry_kind(const char *key, size_t len)
+{
+	if(len == 4 && strncmp(key, "file", 4) == 0)
+		return DB_SONG;
+	if(len == 9 && strncmp(key, "directory", 9) == 0)
+		return DB_DIRECTORY;
+	if(len == 8 && strncmp(key, "playlist", 8) == 0)
+		return DB_PLAYLIST;
+
+	return -1;
+}
+
+/**
+ * Split the text of listallinfo into entries: entries start with a file,
+ * directory or playlist line, the other lines of a song are its attributes
+ * and tags.
+ *
+ * */
+static int
+segment_parse(segment_t *seg)
+{
+	size_t pos, end, klen, value, vlen;
+	const char *line, *sep, *nl;
+	uint32_t entry = NONE, id;
+	int tag, kind;
+
+	for(pos = 0; pos < seg->text_len; pos = end + 1){
+		line = seg->text + pos;
+		end = (nl = memchr(line, '\n', seg->text_len - pos)) ? (size_t) (nl - seg->text) : seg->text_len;
+
+		if((sep = memmem(line, end - pos, ": ", 2)) != NULL){
+			klen = (size_t) (sep - line);
+			value = pos + klen + 2;
+			vlen = end - value;
+
+			if((kind = entry_kind(line, klen)) >= 0){
+				if((entry = entry_add(seg, (uint8_t) kind, pos, value, vlen)) == NONE)
+					return -1;
+			} else if(entry != NONE && seg->kind[entry] == DB_SONG && !is_attribute(line, klen)){
+				if((tag = tag_add(seg, pos, klen)) >= 0){
+					if((id = intern(seg, value, vlen)) == NONE || column_add(&seg->columns[tag], entry, id) < 0)
+						return -1;
+				}
+			}
+		}
+
+		if(entry != NONE)
+			seg->len[entry] = (uint32_t) (end + 1 - seg->off[entry]);
+	}
+
+	return 0;
+}
+
+/**
+ * Tag MPD falls back to for the one called name, NULL if there is none.
+ *
+ * */
+static const char *
+fallback_of(const char *name, size_t len)
+{
+	unsigned int i;
+
+	for(i = 0; i < sizeof(fallbacks) / sizeof(fallbacks[0]); i++){
+		if(strlen(fallbacks[i].tag) == len && strncasecmp(fallbacks[i].tag, name, len) == 0)
+			return fallbacks[i].fallback;
+	}
+
+	return NULL;
+}
+
+/**
+ * Tag of a segment standing for the one called name: that tag, or else the
+ * first tag of its fallbacks the segment has, as MPD skips over tags a song
+ * does not have. -1 if there is none.
+ *
+ * */
+static int
+tag_resolve(segment_t *seg, const char *name, size_t len)
+{
+	int tag = -1;
+
+	while(name != NULL && (tag = tag_find(seg, name, len)) < 0){
+		if((name = fallback_of(name, len)) != NULL)
+			len = strlen(name);
+	}
+
+	return tag;
+}
+
+/**
+ * Index the entries of a segment, once parsed.
+ *
+ * */
+static int
+segment_index(segment_t *seg)
+{
+	const char *name;
+	uint32_t id;
+	int tag;
+
+	for(tag = 0; tag < seg->n_tags; tag++){
+		if((name = fallback_of(seg->text + seg->str_off[seg->tag_name[tag]], seg->str_len[seg->tag_name[tag]])) != NULL)
+			seg->fallback[tag] = tag_resolve(seg, name, strlen(name));
+	}
+
+	for(tag = 0; tag < seg->n_tags; tag++){
+		if(seg->fallback[tag] < 0)
+			continue;
+
+		if((seg->has[tag] = bits_new(seg)) == NULL)
+			return -1;
+
+		for(id = 0; id < seg->columns[tag].n; id++)
+			bit_set(seg->has[tag], seg->columns[tag].entry[id]);
+	}
+
+	return index_occurrences(seg) < 0 || index_trigrams(seg) < 0 ? -1 : 0;
+}
+
+/**
+ * Snapshot files
+ *
+ * */
+static int
+write_all(int fd, const void *data, size_t len)
+{
+	static const char zero[8];
+	size_t pad = ALIGN(len) - len;
+	ssize_t bytes;
+
+	while(len > 0){
+		if((bytes = write(fd, data, len)) < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		data = (const char*) data + bytes;
+		len -= (size_t) bytes;
+	}
+
+	return pad > 0 && write(fd, zero, pad) != (ssize_t) pad ? -1 : 0;
+}
+
+// Point an array into the mapping at base, or write it to fd
+#define SECTION(field, bytes) do { \
+	if(base != NULL){ \
+		if(off + (bytes) > hdr->size) \
+			return 0; \
+		(field) = (void*) (base + off); \
+	} else if(fd >= 0 && write_all(fd, (field), (bytes)) < 0) { \
+		return 0; \
+	} \
+	off += ALIGN(bytes); \
+} while(0)
+
+/**
+ * Walk the arrays of a segment in file order, sized after its header: point
+ * them into the file mapped at base, where the segment starts, or write them
+ * to fd, or only measure them. Returns the size of the segment, 0 on
+ * failure.
+ *
+ * */
+static size_t
+layout(segment_t *seg, const segment_header_t *hdr, char *base, int fd)
+{
+	size_t off = ALIGN(sizeof(segment_header_t)), words = (hdr->n_entries + 63) / 64 + 1;
+	int tag;
+
+	SECTION(seg->text, hdr->text_len);
+	SECTION(seg->kind, hdr->n_entries);
+	SECTION(seg->path, hdr->n_entries * sizeof(uint32_t));
+	SECTION(seg->parent, hdr->n_entries * sizeof(uint32_t));
+	SECTION(seg->off, hdr->n_entries * sizeof(uint32_t));
+	SECTION(seg->len, hdr->n_entries * sizeof(uint32_t));
+	SECTION(seg->str_off, hdr->n_strings * sizeof(uint32_t));
+	SECTION(seg->str_len, hdr->n_strings * sizeof(uint32_t));
+	SECTION(seg->slots, hdr->n_slots * sizeof(uint32_t));
+
+	for(tag = 0; tag < hdr->n_tags; tag++){
+		SECTION(seg->columns[tag].entry, hdr->column_n[tag] * sizeof(uint32_t));
+		SECTION(seg->columns[tag].value, hdr->column_n[tag] * sizeof(uint32_t));
+		if(hdr->fallback[tag] >= 0)
+			SECTION(seg->has[tag], words * sizeof(uint64_t));
+	}
+
+	SECTION(seg->occ_start, (hdr->n_strings + 1) * sizeof(uint32_t));
+	SECTION(seg->occ_entry, hdr->n_occ * sizeof(uint32_t));
+	SECTION(seg->occ_tag, hdr->n_occ);
+	SECTION(seg->tri_start, (((size_t) 1 << hdr->tri_bits) + 1) * sizeof(uint32_t));
+	SECTION(seg->tri_string, hdr->n_tri * sizeof(uint32_t));
+
+	return off;
+}
+
+static void
+segment_header(segment_t *seg, segment_header_t *hdr)
+{
+	int tag;
+
+	memset(hdr, 0, sizeof(segment_header_t));
+	hdr->text_len = seg->text_len;
+	hdr->n_entries = seg->n_entries;
+	hdr->n_strings = seg->n_strings;
+	hdr->n_slots = seg->n_slots;
+	hdr->n_occ = seg->occ_start[seg->n_strings];
+	hdr->n_tri = seg->tri_start[(size_t) 1 << seg->tri_bits];
+	hdr->n_tags = seg->n_tags;
+	hdr->tri_bits = seg->tri_bits;
+
+	for(tag = 0; tag < seg->n_tags; tag++){
+		hdr->tag_name[tag] = seg->tag_name[tag];
+		hdr->fallback[tag] = seg->fallback[tag];
+		hdr->column_n[tag] = seg->columns[tag].n;
+	}
+
+	hdr->size = layout(seg, hdr, NULL, -1);
+}
+
+/**
+ * Save a snapshot to path, through a temporary file renamed over it so a
+ * file is only ever seen complete.
+ *
+ * */
+static int
+snapshot_save(db_t *db, uint64_t db_update, const char *path)
+{
+	segment_header_t seg_hdr[DB_SEGMENTS];
+	snapshot_t hdr;
+	char tmp[4096];
+	int s, fd;
+
+	if(snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int) sizeof tmp){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof hdr.magic);
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.order = SNAPSHOT_ORDER;
+	hdr.db_update = db_update;
+	hdr.n_segments = db->n_segments;
+	hdr.n_slices = db->n_slices;
+	hdr.size = ALIGN(sizeof hdr) + ALIGN(db->n_slices * sizeof(slice_t));
+
+	for(s = 0; s < db->n_segments; s++){
+		segment_header(db->segments[s], &seg_hdr[s]);
+		hdr.size += seg_hdr[s].size;
+	}
+
+	if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		return -1;
+
+	if(write_all(fd, &hdr, sizeof hdr) < 0 || write_all(fd, db->slices, db->n_slices * sizeof(slice_t)) < 0)
+		goto fail;
+
+	for(s = 0; s < db->n_segments; s++){
+		if(write_all(fd, &seg_hdr[s], sizeof(segment_header_t)) < 0 || layout(db->segments[s], &seg_hdr[s], NULL, fd) == 0)
+			goto fail;
+	}
+
+	if(fsync(fd) < 0)
+		goto fail;
+
+	close(fd);
+
+	if(rename(tmp, path) < 0){
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+
+fail:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+/**
+ * Segment of the snapshot file mapped at map, from its header at hdr.
+ *
+ * */
+static segment_t *
+segment_load(map_t *map, const segment_header_t *hdr)
+{
+	segment_t *seg;
+	int tag;
+
+	if(hdr->n_tags < 0 || hdr->n_tags > DB_TAGS || hdr->tri_bits < 12 || hdr->tri_bits > 22 || (seg = segment_new()) == NULL)
+		return NULL;
+
+	seg->text_len = hdr->text_len;
+	seg->n_entries = hdr->n_entries;
+	seg->n_strings = hdr->n_strings;
+	seg->n_slots = hdr->n_slots;
+	seg->n_tags = hdr->n_tags;
+	seg->tri_bits = hdr->tri_bits;
+
+	for(tag = 0; tag < seg->n_tags; tag++){
+		if(hdr->tag_name[tag] >= hdr->n_strings || hdr->fallback[tag] >= hdr->n_tags){
+			free(seg);
+			return NULL;
+		}
+
+		seg->tag_name[tag] = hdr->tag_name[tag];
+		seg->fallback[tag] = hdr->fallback[tag];
+		seg->columns[tag].n = seg->columns[tag].size = hdr->column_n[tag];
+	}
+
+	// The arrays point into the mapping, there is nothing to free
+	if(layout(seg, hdr, (char*) hdr, -1) != hdr->size || seg->occ_start[seg->n_strings] != hdr->n_occ ||
+			seg->tri_start[(size_t) 1 << seg->tri_bits] != hdr->n_tri){
+		free(seg);
+		return NULL;
+	}
+
+	seg->map = map;
+	__atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+
+	return seg;
+}
+
+/**
+ * Map the snapshot saved to path. Only the headers are checked, the arrays
+ * are paged in as queries touch them. Returns NULL if there is no usable
+ * snapshot.
+ *
+ * */
+static db_t *
+snapshot_load(const char *path)
+{
+	const segment_header_t *seg_hdr;
+	const snapshot_t *hdr;
+	const slice_t *slices;
+	segment_t *seg;
+	struct stat st;
+	map_t *map;
+	db_t *db;
+	size_t off;
+	uint32_t k, i;
+	int fd, s;
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+
+	if((map = calloc(1, sizeof(map_t))) == NULL || fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(snapshot_t) ||
+			(map->addr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+		close(fd);
+		free(map);
+		return NULL;
+	}
+
+	close(fd);
+	map->refs = 1;
+	map->len = (size_t) st.st_size;
+
+	hdr = (const snapshot_t*) map->addr;
+	off = ALIGN(sizeof(snapshot_t)) + ALIGN((size_t) hdr->n_slices * sizeof(slice_t));
+
+	if(memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof hdr->magic) != 0 || hdr->version != SNAPSHOT_VERSION ||
+			hdr->order != SNAPSHOT_ORDER || hdr->size != (uint64_t) st.st_size ||
+			hdr->n_segments < 0 || hdr->n_segments > DB_SEGMENTS || off > hdr->size || (db = db_new()) == NULL){
+		map_put(map);
+		return NULL;
+	}
+
+	db->db_update = hdr->db_update;
+	slices = (const slice_t*) ((const char*) map->addr + ALIGN(sizeof(snapshot_t)));
+
+	for(s = 0; s < hdr->n_segments; s++){
+		seg_hdr = (const segment_header_t*) ((const char*) map->addr + off);
+
+		if(off + sizeof(segment_header_t) > hdr->size || seg_hdr->size > hdr->size - off ||
+				(seg = segment_load(map, seg_hdr)) == NULL || db_attach(db, seg) < 0)
+			goto fail;
+
+		off += seg_hdr->size;
+	}
+
+	for(k = 0; k < hdr->n_slices; k++){
+		if(slices[k].segment >= (uint32_t) db->n_segments || slices[k].from > slices[k].to ||
+				slices[k].to > db->segments[slices[k].segment]->n_entries)
+			goto fail;
+
+		for(i = slices[k].from; i < slices[k].to; i++){
+			if(slice_add(db, (int) slices[k].segment, i) < 0)
+				goto fail;
+		}
+	}
+
+	// Held by the segments from now on
+	map_put(map);
+
+	return db;
+
+fail:
+	db_put(db);
+	map_put(map);
+	return NULL;
+}
+
+/**
+ * Queries
+ *
+ * */
+static int
+contains(const char *str, size_t len, const char *needle, size_t n, int fold)
+{
+	size_t i;
+
+	if(!fold)
+		return memmem(str, len, needle, n) != NULL;
+
+	for(i = 0; i + n <= len; i++){
+		if(strncasecmp(str + i, needle, n) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Whether a string satisfies a condition.
+ *
+ * */
+static int
+satisfies(segment_t *seg, const condition_t *cond, int fold, uint32_t id)
+{
+	const char *str = seg->text + seg->str_off[id];
+	size_t len = seg->str_len[id];
+
+	if(cond->op == OP_CONTAINS)
+		return contains(str, len, cond->value, cond->len, fold);
+
+	return len == cond->len && (fold ? strncasecmp(str, cond->value, len) : memcmp(str, cond->value, len)) == 0;
+}
+
+static int
+posting_has(segment_t *seg, uint32_t b, uint32_t id)
+{
+	uint32_t lo = seg->tri_start[b], hi = seg->tri_start[b + 1], mid;
+
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(seg->tri_string[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < seg->tri_start[b + 1] && seg->tri_string[lo] == id;
+}
+
+/**
+ * Strings satisfying a condition, in ids. Exact values are looked up, values
+ * of three bytes or more are only compared with the strings containing all
+ * of their trigrams, shorter ones with all strings.
+ *
+ * */
+static int
+strings(segment_t *seg, const condition_t *cond, int fold, uint32_t **ids, uint32_t *n)
+{
+	uint32_t *b = NULL, n_b = 0, best = 0, i, j, k, id, from, to;
+
+	*n = 0;
+
+	if(cond->op != OP_CONTAINS && !fold){
+		if((*ids = malloc(sizeof(uint32_t))) == NULL)
+			return -1;
+
+		if((id = lookup(seg, cond->value, cond->len)) != NONE)
+			(*ids)[(*n)++] = id;
+
+		return 0;
+	}
+
+	if(cond->len >= 3){
+		n_b = (uint32_t) cond->len - 2;
+		if((b = malloc(n_b * sizeof(uint32_t))) == NULL)
+			return -1;
+
+		// Walk the shortest bucket, look the others up
+		for(i = 0; i < n_b; i++){
+			b[i] = trigram(seg, cond->value + i);
+			if(seg->tri_start[b[i] + 1] - seg->tri_start[b[i]] < seg->tri_start[b[best] + 1] - seg->tri_start[b[best]])
+				best = i;
+		}
+
+		from = seg->tri_start[b[best]];
+		to = seg->tri_start[b[best] + 1];
+	} else {
+		from = 0;
+		to = seg->n_strings;
+	}
+
+	if((*ids = malloc((to - from + 1) * sizeof(uint32_t))) == NULL){
+		free(b);
+		return -1;
+	}
+
+	for(k = from; k < to; k++){
+		id = b ? seg->tri_string[k] : k;
+
+		for(j = 0; j < n_b && (j == best || posting_has(seg, b[j], id)); j++);
+
+		if(j == n_b && satisfies(seg, cond, fold, id))
+			(*ids)[(*n)++] = id;
+	}
+
+	free(b);
+
+	return 0;
+}
+
+/**
+ * Whether a value of occ_tag on a song is what it has for tag: the tag
+ * itself, or a fallback if it has none of the tags before it.
+ *
+ * */
+static int
+stands_for(segment_t *seg, int tag, int occ_tag, uint32_t entry)
+{
+	for(; tag >= 0; tag = seg->fallback[tag]){
+		if(occ_tag == tag)
+			return TRUE;
+
+		if(seg->has[tag] != NULL && bit_test(seg->has[tag], entry))
+			return FALSE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Add the songs having no value of tag, nor of its fallbacks, to bits.
+ *
+ * */
+static int
+untagged(segment_t *seg, int tag, uint64_t *bits)
+{
+	uint64_t *has;
+	uint32_t i;
+
+	if((has = bits_new(seg)) == NULL)
+		return -1;
+
+	for(; tag >= 0; tag = seg->fallback[tag]){
+		for(i = 0; i < seg->columns[tag].n; i++)
+			bit_set(has, seg->columns[tag].entry[i]);
+	}
+
+	for(i = 0; i < seg->n_entries; i++){
+		if(seg->kind[i] == DB_SONG && !bit_test(has, i))
+			bit_set(bits, i);
+	}
+
+	free(has);
+
+	return 0;
+}
+
+static int
+match(segment_t *seg, const condition_t *cond, int fold, uint64_t *bits)
+{
+	uint32_t *ids, n, i, o, entry;
+	int tag = -1, occ;
+
+	// Songs below a directory, all of them below the top
+	if(cond->type == COND_BASE){
+		for(i = 0; i < seg->n_entries; i++){
+			if(seg->kind[i] == DB_SONG && (cond->len == 0 || (seg->str_len[seg->path[i]] > cond->len &&
+					seg->text[seg->str_off[seg->path[i]] + cond->len] == '/' &&
+					memcmp(seg->text + seg->str_off[seg->path[i]], cond->value, cond->len) == 0)))
+				bit_set(bits, i);
+		}
+
+		return 0;
+	}
+
+	// No song of the segment has the tag nor its fallbacks
+	if(cond->type == COND_TAG && (tag = tag_resolve(seg, cond->name, cond->name_len)) < 0)
+		return cond->len == 0 ? untagged(seg, tag, bits) : 0;
+
+	if(strings(seg, cond, fold, &ids, &n) < 0)
+		return -1;
+
+	for(i = 0; i < n; i++){
+		for(o = seg->occ_start[ids[i]]; o < seg->occ_start[ids[i] + 1]; o++){
+			entry = seg->occ_entry[o];
+			occ = seg->occ_tag[o];
+
+			if(cond->type == COND_FILE ? occ == OCC_PATH :
+					cond->type == COND_ANY ? occ != OCC_PATH : stands_for(seg, tag, occ, entry))
+				bit_set(bits, entry);
+		}
+	}
+
+	free(ids);
+
+	// MPD takes a song without the tag, nor any of its fallbacks, as having
+	// an empty value
+	return cond->type == COND_TAG && cond->len == 0 ? untagged(seg, tag, bits) : 0;
+}
+
+/**
+ * Songs of segment s satisfying all conditions, NULL if the query could not
+ * be run.
+ *
+ * */
+static uint64_t *
+select_songs(db_t *db, int s, condition_t *conds, int n, int fold)
+{
+	segment_t *seg = db->segments[s];
+	uint64_t *sel, *bits;
+	uint32_t i, words = (seg->n_entries + 63) / 64;
+	int c;
+
+	if((sel = bits_new(seg)) == NULL)
+		return NULL;
+
+	for(i = 0; i < seg->n_entries; i++){
+		if(seg->kind[i] == DB_SONG && bit_test(db->live[s], i))
+			bit_set(sel, i);
+	}
+
+	for(c = 0; c < n; c++){
+		if((bits = bits_new(seg)) == NULL || match(seg, &conds[c], fold, bits) < 0){
+			free(bits);
+			free(sel);
+			return NULL;
+		}
+
+		for(i = 0; i < words; i++)
+			sel[i] &= conds[c].op == OP_NE ? ~bits[i] : bits[i];
+
+		free(bits);
+	}
+
+	return sel;
+}
+
+/**
+ * Name of a tag as MPD spells it, NULL if no segment has the tag.
+ *
+ * */
+static const char *
+tag_name(db_t *db, const char *name, size_t len, size_t *name_len)
+{
+	segment_t *seg;
+	int s, tag;
+
+	for(s = 0; s < db->n_segments; s++){
+		seg = db->segments[s];
+
+		if((tag = tag_find(seg, name, len)) >= 0){
+			*name_len = seg->str_len[seg->tag_name[tag]];
+			return seg->text + seg->str_off[seg->tag_name[tag]];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Condition on a type as named by the client: a tag, any, file or base.
+ * Returns COND_UNKNOWN for anything else, which is left to MPD.
+ *
+ * */
+static int
+condition_type(db_t *db, const char *name, size_t len)
+{
+	size_t name_len;
+
+	if(len == 3 && strncasecmp(name, "any", 3) == 0)
+		return COND_ANY;
+	if(len == 4 && strncasecmp(name, "file", 4) == 0)
+		return COND_FILE;
+	if(len == 4 && strncasecmp(name, "base", 4) == 0)
+		return COND_BASE;
+
+	return tag_name(db, name, len, &name_len) != NULL ? COND_TAG : COND_UNKNOWN;
+}
+
+static char *
+skip(char *p)
+{
+	while(*p == ' ')
+		p++;
+
+	return p;
+}
+
+/**
+ * Parse a quoted value of a filter expression in place.
+ *
+ * */
+static char *
+parse_value(char **p, size_t *len)
+{
+	char quote = **p, *value, *out;
+
+	if(quote != '"' && quote != '\'')
+		return NULL;
+
+	for(value = out = ++(*p); **p != quote; (*p)++){
+		if(**p == '\0')
+			return NULL;
+		if(**p == '\\' && (*p)[1] != '\0')
+			(*p)++;
+		*out++ = **p;
+	}
+
+	(*p)++;
+	*len = (size_t) (out - value);
+	*out = '\0';
+
+	return value;
+}
+
+/**
+ * Parse a filter expression such as ((artist == 'x') AND (album contains 'y')).
+ * Only conjunctions of ==, != and contains are understood. Returns -1 for
+ * anything else, which is left to MPD.
+ *
+ * */
+static int
+parse_expression(db_t *db, char **p, condition_t *conds, int *n)
+{
+	condition_t *cond;
+
+	*p = skip(*p);
+	if(**p != '(')
+		return -1;
+	*p = skip(*p + 1);
+
+	if(**p == '('){
+		for(;;){
+			if(parse_expression(db, p, conds, n) < 0)
+				return -1;
+
+			*p = skip(*p);
+			if(**p == ')')
+				break;
+			if(strncmp(*p, "AND ", 4) != 0)
+				return -1;
+			*p += 4;
+		}
+
+		(*p)++;
+		return 0;
+	}
+
+	if(*n == DB_CONDITIONS)
+		return -1;
+	cond = &conds[(*n)++];
+
+	for(cond->name = *p; (**p >= 'a' && **p <= 'z') || (**p >= 'A' && **p <= 'Z') || **p == '_' || **p == '-'; (*p)++);
+
+	cond->name_len = (size_t) (*p - cond->name);
+	if((cond->type = condition_type(db, cond->name, cond->name_len)) == COND_UNKNOWN)
+		return -1;
+
+	*p = skip(*p);
+	cond->op = OP_EQ;
+
+	if(cond->type != COND_BASE){
+		if(strncmp(*p, "==", 2) == 0)
+			*p += 2;
+		else if(strncmp(*p, "!=", 2) == 0){
+			cond->op = OP_NE;
+			*p += 2;
+		} else if(strncmp(*p, "contains", 8) == 0){
+			cond->op = OP_CONTAINS;
+			*p += 8;
+		} else
+			return -1;
+
+		*p = skip(*p);
+	}
+
+	if((cond->value = parse_value(p, &cond->len)) == NULL)
+		return -1;
+
+	*p = skip(*p);
+	if(**p != ')')
+		return -1;
+	(*p)++;
+
+	return 0;
+}
+
+/**
+ * Parse the filter of find, search or list: type/value pairs, or a filter
+ * expression. The pairs of search match substrings.
+ *
+ * */
+static int
+parse_filter(db_t *db, char **argv, int argc, int op, condition_t *conds, int *n)
+{
+	char *p;
+	int i;
+
+	*n = 0;
+
+	if(argc == 1 && argv[0][0] == '('){
+		p = argv[0];
+		return parse_expression(db, &p, conds, n) < 0 || *skip(p) != '\0' ? -1 : 0;
+	}
+
+	if(argc % 2 != 0 || argc / 2 > DB_CONDITIONS)
+		return -1;
+
+	for(i = 0; i < argc; i += 2){
+		conds[*n].name = argv[i];
+		conds[*n].name_len = strlen(argv[i]);
+		if((conds[*n].type = condition_type(db, argv[i], conds[*n].name_len)) == COND_UNKNOWN)
+			return -1;
+
+		conds[*n].op = conds[*n].type == COND_BASE ? OP_EQ : op;
+		conds[*n].value = argv[i + 1];
+		conds[*n].len = strlen(argv[i + 1]);
+		(*n)++;
+	}
+
+	return 0;
+}
+
+static int
+emit(buffer_t **out, const char *data, size_t len)
+{
+	buffer_t *tmp;
+
+	if((tmp = buffer_append(*out, data, len)) == NULL)
+		return -1;
+
+	*out = tmp;
+	return 0;
+}
+
+static int
+emit_entry(segment_t *seg, buffer_t **out, uint32_t i)
+{
+	return emit(out, seg->text + seg->off[i], seg->len[i]);
+}
+
+/**
+ * Parse the range of a window: START:END, START: or a single position.
+ *
+ * */
+static int
+parse_window(const char *arg, uint32_t *start, uint32_t *end)
+{
+	unsigned long from, to;
+	char *p;
+
+	if(*arg < '0' || *arg > '9' || (from = strtoul(arg, &p, 10)) >= UINT32_MAX)
+		return -1;
+
+	if(*p == '\0'){
+		to = from + 1;
+	} else if(*p == ':' && p[1] == '\0'){
+		to = UINT32_MAX;
+	} else if(*p == ':' && p[1] >= '0' && p[1] <= '9'){
+		if((to = strtoul(p + 1, &p, 10)) > UINT32_MAX || *p != '\0')
+			return -1;
+	} else {
+		return -1;
+	}
+
+	if(to < from)
+		return -1;
+
+	*start = (uint32_t) from;
+	*end = (uint32_t) to;
+
+	return 0;
+}
+
+/**
+ * Parse the sort order of find and search. Only orders the mirror sorts
+ * exactly as MPD does are understood: the modification time, and the
+ * numeric tags. Text is collated by MPD, it is left to it.
+ *
+ * */
+static int
+parse_sort(db_t *db, const char *name, int *by, const char **tag, int *descending)
+{
+	size_t len;
+
+	if((*descending = (*name == '-')))
+		name++;
+
+	if(strcmp(name, "Last-Modified") == 0){
+		*by = SORT_MODIFIED;
+		return 0;
+	}
+
+	if((strcasecmp(name, "Track") != 0 && strcasecmp(name, "Disc") != 0) || tag_name(db, name, strlen(name), &len) == NULL)
+		return -1;
+
+	*by = SORT_TAG;
+	*tag = name;
+
+	return 0;
+}
+
+static int
+compare_keys(const void *a, const void *b, void *data)
+{
+	const sort_key_t *x = (const sort_key_t*) a, *y = (const sort_key_t*) b, *tmp;
+	size_t n;
+	int cmp;
+
+	if(*(int*) data){
+		tmp = x;
+		x = y;
+		y = tmp;
+	}
+
+	if(x->str != NULL){
+		n = x->len < y->len ? x->len : y->len;
+		if((cmp = memcmp(x->str, y->str, n)) == 0)
+			cmp = (x->len > y->len) - (x->len < y->len);
+	} else {
+		cmp = (x->number > y->number) - (x->number < y->number);
+	}
+
+	// Equal songs stay in database order
+	if(cmp == 0)
+		return (((const sort_key_t*) a)->rank > ((const sort_key_t*) b)->rank) - (((const sort_key_t*) a)->rank < ((const sort_key_t*) b)->rank);
+
+	return cmp;
+}
+
+/**
+ * Sort keys of the selected songs: the first value of a numeric tag, as
+ * strtol reads it, or the modification time as MPD prints it.
+ *
+ * */
+static int
+sort_keys(db_t *db, int by, const char *name, sort_key_t *keys, uint32_t n)
+{
+	segment_t *seg;
+	column_t *col;
+	uint32_t *first, i, id;
+	const char *text, *line;
+	char number[32];
+	size_t len;
+	int s, tag;
+
+	if(by == SORT_MODIFIED){
+		for(i = 0; i < n; i++){
+			seg = db->segments[keys[i].segment];
+			text = seg->text + seg->off[keys[i].entry];
+			keys[i].str = "";
+			keys[i].len = 0;
+
+			if((line = memmem(text, seg->len[keys[i].entry], "\nLast-Modified: ", 16)) != NULL){
+				keys[i].str = line + 16;
+				keys[i].len = (size_t) ((const char*) memchr(keys[i].str, '\n', (size_t) (text + seg->len[keys[i].entry] - keys[i].str)) - keys[i].str);
+			}
+		}
+
+		return 0;
+	}
+
+	for(i = 0; i < n; i++){
+		keys[i].str = NULL;
+		keys[i].number = 0;
+	}
+
+	for(s = 0; s < db->n_segments; s++){
+		seg = db->segments[s];
+
+		if((tag = tag_find(seg, name, strlen(name))) < 0)
+			continue;
+
+		if((first = malloc((seg->n_entries + 1) * sizeof(uint32_t))) == NULL)
+			return -1;
+
+		memset(first, 0xff, (seg->n_entries + 1) * sizeof(uint32_t));
+
+		col = &seg->columns[tag];
+		for(i = 0; i < col->n; i++){
+			if(first[col->entry[i]] == NONE)
+				first[col->entry[i]] = col->value[i];
+		}
+
+		for(i = 0; i < n; i++){
+			if(keys[i].segment != s || (id = first[keys[i].entry]) == NONE)
+				continue;
+
+			len = seg->str_len[id] < sizeof number - 1 ? seg->str_len[id] : sizeof number - 1;
+			memcpy(number, seg->text + seg->str_off[id], len);
+			number[len] = '\0';
+			keys[i].number = strtol(number, NULL, 10);
+		}
+
+		free(first);
+	}
+
+	return 0;
+}
+
+static int
+find(db_t *db, char **argv, int argc, int fold, buffer_t **out)
+{
+	condition_t conds[DB_CONDITIONS];
+	uint64_t *sel[DB_SEGMENTS] = { NULL };
+	sort_key_t *keys = NULL;
+	const char *tag = NULL;
+	segment_t *seg;
+	slice_t *slice;
+	uint32_t i, k, n_songs = 0, start = 0, end = UINT32_MAX;
+	size_t j;
+	int n, c, s, by = SORT_NONE, descending = FALSE, ret = -1;
+
+	// MPD takes the window off the end first, then the sort order
+	if(argc >= 2 && strcmp(argv[argc - 2], "window") == 0){
+		if(parse_window(argv[argc - 1], &start, &end) < 0)
+			return FALSE;
+		argc -= 2;
+	}
+
+	if(argc >= 2 && strcmp(argv[argc - 2], "sort") == 0){
+		if(parse_sort(db, argv[argc - 1], &by, &tag, &descending) < 0)
+			return FALSE;
+		argc -= 2;
+	}
+
+	if(argc == 0 || parse_filter(db, argv, argc, fold ? OP_CONTAINS : OP_EQ, conds, &n) < 0)
+		return FALSE;
+
+	// MPD folds the case of more than ASCII
+	for(c = 0; fold && c < n; c++){
+		for(j = 0; j < conds[c].len; j++){
+			if((unsigned char) conds[c].value[j] >= 0x80)
+				return FALSE;
+		}
+	}
+
+	for(s = 0; s < db->n_segments; s++){
+		if((sel[s] = select_songs(db, s, conds, n, fold)) == NULL)
+			goto out;
+	}
+
+	if(by == SORT_NONE){
+		for(k = 0, ret = 0; k < db->n_slices && n_songs < end && ret == 0; k++){
+			slice = &db->slices[k];
+			seg = db->segments[slice->segment];
+
+			for(i = slice->from; i < slice->to && n_songs < end && ret == 0; i++){
+				if(bit_test(sel[slice->segment], i) && n_songs++ >= start)
+					ret = emit_entry(seg, out, i);
+			}
+		}
+
+		goto out;
+	}
+
+	for(s = 0; s < db->n_segments; s++){
+		for(i = 0; i < db->segments[s]->n_entries; i++)
+			n_songs += (uint32_t) bit_test(sel[s], i);
+	}
+
+	if((keys = malloc((n_songs + 1) * sizeof(sort_key_t))) == NULL)
+		goto out;
+
+	for(k = 0, n_songs = 0; k < db->n_slices; k++){
+		slice = &db->slices[k];
+
+		for(i = slice->from; i < slice->to; i++){
+			if(!bit_test(sel[slice->segment], i))
+				continue;
+
+			keys[n_songs].rank = n_songs;
+			keys[n_songs].segment = (int) slice->segment;
+			keys[n_songs++].entry = i;
+		}
+	}
+
+	if(sort_keys(db, by, tag, keys, n_songs) < 0)
+		goto out;
+
+	qsort_r(keys, n_songs, sizeof(sort_key_t), &compare_keys, &descending);
+
+	for(i = start, ret = 0; i < n_songs && i < end && ret == 0; i++)
+		ret = emit_entry(db->segments[keys[i].segment], out, keys[i].entry);
+
+out:
+	for(s = 0; s < db->n_segments; s++)
+		free(sel[s]);
+	free(keys);
+
+	return ret == 0;
+}
+
+/**
+ * Values of tag among the selected songs, or of its fallback for songs
+ * without any. Sets missing if a song has none of them: MPD lists the empty
+ * value for it.
+ *
+ * */
+static int
+collect(segment_t *seg, int tag, const uint64_t *sel, uint8_t *seen, int *missing)
+{
+	uint32_t i, words = (seg->n_entries + 63) / 64;
+	uint64_t *rest;
+	column_t *col;
+
+	if((rest = bits_new(seg)) == NULL)
+		return -1;
+
+	memcpy(rest, sel, words * sizeof(uint64_t));
+
+	for(; tag >= 0; tag = seg->fallback[tag]){
+		col = &seg->columns[tag];
+
+		for(i = 0; i < col->n; i++){
+			if(bit_test(rest, col->entry[i]))
+				seen[col->value[i]] = TRUE;
+		}
+
+		// Songs having a value do not fall back
+		for(i = 0; i < col->n; i++)
+			bit_clear(rest, col->entry[i]);
+	}
+
+	for(i = 0, *missing = FALSE; i < words; i++){
+		if(rest[i] != 0)
+			*missing = TRUE;
+	}
+
+	free(rest);
+
+	return 0;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	const value_t *x = (const value_t*) a, *y = (const value_t*) b;
+	int cmp = memcmp(x->str, y->str, x->len < y->len ? x->len : y->len);
+
+	if(cmp != 0)
+		return cmp;
+
+	return (x->len > y->len) - (x->len < y->len);
+}
+
+static int
+list(db_t *db, char **argv, int argc, buffer_t **out)
+{
+	condition_t conds[DB_CONDITIONS];
+	value_t *values = NULL, *tmp;
+	uint64_t *sel = NULL;
+	uint8_t *seen = NULL;
+	const char *name;
+	segment_t *seg;
+	uint32_t n_values = 0, size = 0, i;
+	size_t name_len;
+	int s, n, i_arg, empty = FALSE, missing, ret = -1;
+
+	if(argc == 0 || (name = tag_name(db, argv[0], strlen(argv[0]), &name_len)) == NULL)
+		return FALSE;
+
+	// Grouping, windows and the old list album ARTIST are left to MPD
+	for(i_arg = 1; i_arg < argc; i_arg++){
+		if(strcasecmp(argv[i_arg], "group") == 0 || strcmp(argv[i_arg], "sort") == 0 || strcmp(argv[i_arg], "window") == 0)
+			return FALSE;
+	}
+
+	if(parse_filter(db, argv + 1, argc - 1, OP_EQ, conds, &n) < 0)
+		return FALSE;
+
+	for(s = 0; s < db->n_segments; s++){
+		seg = db->segments[s];
+
+		if((sel = select_songs(db, s, conds, n, FALSE)) == NULL || (seen = calloc(seg->n_strings + 1, sizeof(uint8_t))) == NULL ||
+				collect(seg, tag_resolve(seg, argv[0], strlen(argv[0])), sel, seen, &missing) < 0)
+			goto out;
+
+		if(missing)
+			empty = TRUE;
+
+		for(i = 0; i < seg->n_strings; i++){
+			if(!seen[i])
+				continue;
+
+			if(seg->str_len[i] == 0){
+				empty = TRUE;
+				continue;
+			}
+
+			if(n_values == size){
+				size = size ? size * 2 : 1024;
+				if((tmp = realloc(values, size * sizeof(value_t))) == NULL)
+					goto out;
+				values = tmp;
+			}
+
+			values[n_values].str = seg->text + seg->str_off[i];
+			values[n_values++].len = seg->str_len[i];
+		}
+
+		free(sel);
+		free(seen);
+		sel = NULL;
+		seen = NULL;
+	}
+
+	if(n_values > 1)
+		qsort(values, n_values, sizeof(value_t), &compare);
+
+	// The empty value sorts first
+	if(empty && (emit(out, name, name_len) < 0 || emit(out, ": \n", 3) < 0))
+		goto out;
+
+	for(i = 0; i < n_values; i++){
+		// Values found in several segments are listed once
+		if(i > 0 && compare(&values[i - 1], &values[i]) == 0)
+			continue;
+
+		if(emit(out, name, name_len) < 0 || emit(out, ": ", 2) < 0 ||
+				emit(out, values[i].str, values[i].len) < 0 || emit(out, "\n", 1) < 0)
+			goto out;
+	}
+
+	ret = 0;
+
+out:
+	free(sel);
+	free(seen);
+	free(values);
+
+	return ret == 0;
+}
+
+/**
+ * Songs, playlists and directories in a directory, in database order; or a
+ * single song. The top directory is left to MPD, which lists stored
+ * playlists there too.
+ *
+ * */
+static int
+lsinfo(db_t *db, char **argv, int argc, buffer_t **out)
+{
+	uint32_t id[DB_SEGMENTS], i, k;
+	segment_t *seg;
+	slice_t *slice;
+	int s, dir = FALSE;
+
+	if(argc != 1 || argv[0][0] == '\0' || strcmp(argv[0], "/") == 0)
+		return FALSE;
+
+	for(s = 0; s < db->n_segments; s++)
+		id[s] = lookup(db->segments[s], argv[0], strlen(argv[0]));
+
+	for(k = 0; k < db->n_slices; k++){
+		slice = &db->slices[k];
+		seg = db->segments[slice->segment];
+
+		for(i = slice->from; i < slice->to && id[slice->segment] != NONE; i++){
+			if(seg->path[i] != id[slice->segment])
+				continue;
+
+			if(seg->kind[i] == DB_SONG)
+				return emit_entry(seg, out, i) == 0;
+
+			if(seg->kind[i] == DB_DIRECTORY)
+				dir = TRUE;
+		}
+	}
+
+	if(!dir)
+		return FALSE;
+
+	for(k = 0; k < db->n_slices; k++){
+		slice = &db->slices[k];
+		seg = db->segments[slice->segment];
+
+		for(i = slice->from; i < slice->to && id[slice->segment] != NONE; i++){
+			if(seg->parent[i] == id[slice->segment] && emit_entry(seg, out, i) < 0)
+				return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Answer find, search, list and lsinfo from a snapshot. Returns TRUE with the
+ * response in out, or FALSE if the command is left to MPD: other commands,
+ * and arguments (grouping, sorting by text, unknown tags) the mirror does
+ * not understand.
+ *
+ * */
+int
+db_answer(db_t *db, const char *line, size_t len, buffer_t **out)
+{
+	char copy[DB_LINE_SIZE], *argv[DB_ARGS];
+	int argc, ret;
+
+	if(len >= sizeof copy)
+		return FALSE;
+
+	memcpy(copy, line, len);
+
+	if((argc = mpd_split(copy, len, argv, DB_ARGS)) < 1)
+		return FALSE;
+
+	*out = NULL;
+
+	if(strcmp(argv[0], "find") == 0)
+		ret = find(db, argv + 1, argc - 1, FALSE, out);
+	else if(strcmp(argv[0], "search") == 0)
+		ret = find(db, argv + 1, argc - 1, TRUE, out);
+	else if(strcmp(argv[0], "list") == 0)
+		ret = list(db, argv + 1, argc - 1, out);
+	else if(strcmp(argv[0], "lsinfo") == 0)
+		ret = lsinfo(db, argv + 1, argc - 1, out);
+	else
+		ret = FALSE;
+
+	if(ret && emit(out, "OK\n", 3) == 0)
+		return TRUE;
+
+	buffer_put(*out);
+	*out = NULL;
+
+	return FALSE;
+}
+
+/**
+ * Number of distinct values of a tag, as MPD counts them in stats: without
+ * falling back to other tags, and the empty value included.
+ *
+ * */
+static uint64_t
+distinct(db_t *db, const char *name)
+{
+	value_t *values = NULL, *tmp;
+	uint8_t *seen = NULL;
+	segment_t *seg;
+	column_t *col;
+	uint32_t n_values = 0, size = 0, i;
+	uint64_t n = UINT64_MAX;
+	int s, tag;
+
+	for(s = 0; s < db->n_segments; s++){
+		seg = db->segments[s];
+
+		if((tag = tag_find(seg, name, strlen(name))) < 0)
+			continue;
+
+		if((seen = calloc(seg->n_strings + 1, sizeof(uint8_t))) == NULL)
+			goto out;
+
+		col = &seg->columns[tag];
+		for(i = 0; i < col->n; i++){
+			if(bit_test(db->live[s], col->entry[i]))
+				seen[col->value[i]] = TRUE;
+		}
+
+		for(i = 0; i < seg->n_strings; i++){
+			if(!seen[i])
+				continue;
+
+			if(n_values == size){
+				size = size ? size * 2 : 1024;
+				if((tmp = realloc(values, size * sizeof(value_t))) == NULL)
+					goto out;
+				values = tmp;
+			}
+
+			values[n_values].str = seg->text + seg->str_off[i];
+			values[n_values++].len = seg->str_len[i];
+		}
+
+		free(seen);
+		seen = NULL;
+	}
+
+	if(n_values > 1)
+		qsort(values, n_values, sizeof(value_t), &compare);
+
+	for(i = 0, n = 0; i < n_values; i++){
+		if(i == 0 || compare(&values[i - 1], &values[i]) != 0)
+			n++;
+	}
+
+out:
+	free(seen);
+	free(values);
+
+	return n;
+}
+
+/**
+ * Milliseconds of a song's duration line, 0 if it has none. Sets *unknown
+ * for songs listed by an older MPD, with a Time line in whole seconds only.
+ *
+ * */
+static uint64_t
+duration_of(const char *text, size_t len, int *unknown)
+{
+	const char *line, *end = text + len;
+	uint64_t ms;
+	int digits;
+
+	if((line = memmem(text, len, "\nduration: ", 11)) == NULL){
+		if(memmem(text, len, "\nTime: ", 7) != NULL)
+			*unknown = TRUE;
+		return 0;
+	}
+
+	for(line += 11, ms = 0; line < end && isdigit((unsigned char) *line); line++)
+		ms = ms * 10 + (uint64_t) (*line - '0');
+
+	if(line < end && *line == '.')
+		line++;
+
+	// MPD prints milliseconds, as three decimals
+	for(digits = 0; digits < 3; digits++){
+		ms *= 10;
+		if(line < end && isdigit((unsigned char) *line))
+			ms += (uint64_t) (*line++ - '0');
+	}
+
+	return ms;
+}
+
+/**
+ * Count a snapshot as MPD's stats do.
+ *
+ * */
+static void
+db_stats(db_t *db, db_stats_t *stats)
+{
+	uint64_t ms = 0;
+	segment_t *seg;
+	slice_t *slice;
+	uint32_t i, k;
+	int unknown = FALSE;
+
+	stats->songs = 0;
+
+	for(k = 0; k < db->n_slices; k++){
+		slice = &db->slices[k];
+		seg = db->segments[slice->segment];
+
+		for(i = slice->from; i < slice->to; i++){
+			if(seg->kind[i] != DB_SONG)
+				continue;
+
+			stats->songs++;
+			ms += duration_of(seg->text + seg->off[i], seg->len[i], &unknown);
+		}
+	}
+
+	stats->artists = distinct(db, "Artist");
+	stats->albums = distinct(db, "Album");
+	stats->playtime = unknown ? UINT64_MAX : ms / 1000;
+}
+
+/**
+ * Whether a synchronized snapshot counts what MPD does, where both are known.
+ *
+ * */
+static int
+reconciles(const db_stats_t *stats_mpd, db_t *db)
+{
+	const uint64_t *mpd = (const uint64_t*) stats_mpd, *ours;
+	db_stats_t stats;
+	unsigned int i;
+
+	db_stats(db, &stats);
+	ours = (const uint64_t*) &stats;
+
+	for(i = 0; i < sizeof(db_stats_t) / sizeof(uint64_t); i++){
+		if(mpd[i] != UINT64_MAX && ours[i] != UINT64_MAX && mpd[i] != ours[i]){
+			log_write(LOG_WARNING, "mirror", "Synchronized %llu songs, %llu artists, %llu albums and %llu seconds, "
+					"MPD has %llu, %llu, %llu and %llu; listing it in full", (unsigned long long) stats.songs,
+					(unsigned long long) stats.artists, (unsigned long long) stats.albums, (unsigned long long) stats.playtime,
+					(unsigned long long) stats_mpd->songs, (unsigned long long) stats_mpd->artists,
+					(unsigned long long) stats_mpd->albums, (unsigned long long) stats_mpd->playtime);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Building
+ *
+ * */
+int
+mirror_init(mirror_t *mirror, loop_t *loop, upstream_t *upstream, const char *path, void (*on_synced)(void*), void *data)
+{
+	sigset_t set, old;
+	int err;
+
+	memset(mirror, 0, sizeof(mirror_t));
+	mirror->loop = loop;
+	mirror->upstream = upstream;
+	mirror->path = path;
+	mirror->on_synced = on_synced;
+	mirror->data = data;
+	mirror->h.fd = -1;
+	mirror->h.cb = &on_mirror;
+	pthread_mutex_init(&mirror->lock, NULL);
+	pthread_mutex_init(&mirror->jobs_lock, NULL);
+	pthread_cond_init(&mirror->jobs_cond, NULL);
+
+	timeout_init(&mirror->retry, &on_retry);
+	timeout_init(&mirror->hold, &on_hold);
+
+	// Synchronize from the last snapshot, served once MPD tells it is current
+	if(path != NULL && (mirror->base = snapshot_load(path)) != NULL){
+		log_write(LOG_INFO, "mirror", "Loaded %u entries from %s", mirror->base->n_entries, path);
+	}
+
+	// Signals are handled by the main thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	err = pthread_create(&mirror->th_id, NULL, &th_index, mirror);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	mirror->started = (err == 0);
+
+	return err;
+}
+
+static void
+job_free(mirror_job_t *job)
+{
+	segment_put(job->seg);
+	buffer_put(job->paths);
+	db_put(job->base);
+	db_put(job->db);
+	free(job);
+}
+
+/**
+ * Hand a job to the mirror's thread. Unless it saves db, the job takes what
+ * MPD sent so far and the base, and the connection waits for its result.
+ *
+ * */
+static int
+submit(mirror_t *mirror, int kind, db_t *db)
+{
+	mirror_job_t *job, **last;
+
+	if((job = calloc(1, sizeof(mirror_job_t))) == NULL)
+		return -1;
+
+	job->post.cb = &on_indexed;
+	job->mirror = mirror;
+	job->kind = kind;
+	job->generation = mirror->generation;
+	job->db_update = mirror->db_update;
+	job->stats = mirror->stats;
+
+	if(kind == MIRROR_JOB_SAVE){
+		__atomic_add_fetch(&db->refs, 1, __ATOMIC_RELAXED);
+		job->base = db;
+		job->db_update = db->db_update;
+	} else {
+		if((job->base = mirror->base) != NULL)
+			__atomic_add_fetch(&job->base->refs, 1, __ATOMIC_RELAXED);
+
+		job->seg = mirror->building;
+		job->paths = mirror->paths;
+		mirror->building = NULL;
+		mirror->paths = NULL;
+		mirror->state = MIRROR_INDEXING;
+	}
+
+	pthread_mutex_lock(&mirror->jobs_lock);
+	for(last = &mirror->jobs; *last != NULL; last = &(*last)->next);
+	*last = job;
+	pthread_cond_signal(&mirror->jobs_cond);
+	pthread_mutex_unlock(&mirror->jobs_lock);
+
+	return 0;
+}
+
+/**
+ * Take a reference to the current snapshot, NULL if there is none. Called
+ * from any thread.
+ *
+ * */
+db_t *
+mirror_get(mirror_t *mirror)
+{
+	db_t *db;
+
+	pthread_mutex_lock(&mirror->lock);
+	if((db = mirror->db) != NULL)
+		__atomic_add_fetch(&db->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mirror->lock);
+
+	return db;
+}
+
+static void
+publish(mirror_t *mirror, db_t *db)
+{
+	db_t *old;
+
+	pthread_mutex_lock(&mirror->lock);
+	old = mirror->db;
+	mirror->db = db;
+	pthread_mutex_unlock(&mirror->lock);
+
+	db_put(old);
+}
+
+/**
+ * Pass a database event held back on to clients, what they read in reaction
+ * is current now.
+ *
+ * */
+static void
+release(mirror_t *mirror)
+{
+	if(!mirror->held)
+		return;
+
+	mirror->held = FALSE;
+	loop_untimeout(&mirror->hold);
+	mirror->on_synced(mirror->data);
+}
+
+/**
+ * Abandon the snapshot being built, but keep its base.
+ *
+ * */
+static void
+reset(mirror_t *mirror)
+{
+	if(mirror->connect){
+		upstream_cancel(mirror->connect);
+		mirror->connect = NULL;
+	}
+
+	// Closing the socket removes it from the epoll set
+	if(mirror->h.fd >= 0){
+		upstream_close(mirror->backend, mirror->h.fd);
+		mirror->h.fd = -1;
+	}
+
+	segment_put(mirror->building);
+	mirror->building = NULL;
+
+	buffer_put(mirror->paths);
+	buffer_put(mirror->reply);
+	mirror->paths = mirror->reply = NULL;
+	mirror->fetched = 0;
+
+	// A job still running is for a connection no longer there
+	mirror->generation++;
+
+	loop_untimeout(&mirror->retry);
+}
+
+static void
+fail(mirror_t *mirror, const char *msg)
+{
+	print("mirror", msg);
+	reset(mirror);
+
+	// The snapshot is outdated, MPD answers until it is synchronized
+	if(mirror->base != NULL)
+		publish(mirror, NULL);
+
+	release(mirror);
+	loop_timeout(mirror->loop, &mirror->retry, MIRROR_RETRY);
+}
+
+/**
+ * Build a snapshot. Must be called from the mirror's loop, or before it is
+ * started.
+ *
+ * */
+void
+mirror_start(mirror_t *mirror)
+{
+	reset(mirror);
+
+	if((mirror->building = segment_new()) == NULL){
+		fail(mirror, strerror(errno));
+		return;
+	}
+
+	if((mirror->connect = upstream_connect(mirror->loop, mirror->upstream, upstream_primary(mirror->upstream), &on_connected, mirror)) == NULL)
+		fail(mirror, strerror(errno));
+}
+
+/**
+ * The database changed: a new snapshot is synchronized from the current one.
+ * Returns TRUE if a snapshot is served, the event is then held back until
+ * on_synced is called, and clients must not be told yet.
+ *
+ * */
+int
+mirror_refresh(mirror_t *mirror)
+{
+	if(mirror->db != NULL){
+		db_put(mirror->base);
+		mirror->base = mirror_get(mirror);
+
+		if(!mirror->held){
+			mirror->held = TRUE;
+			loop_timeout(mirror->loop, &mirror->hold, MIRROR_HOLD);
+		}
+	}
+
+	mirror_start(mirror);
+
+	return mirror->held;
+}
+
+/**
+ * A client asked MPD to read all files again: tags may change without their
+ * modification time, the next snapshot is listed in full. Called from any
+ * thread.
+ *
+ * */
+void
+mirror_rescan(mirror_t *mirror)
+{
+	__atomic_store_n(&mirror->rescanned, TRUE, __ATOMIC_RELEASE);
+}
+
+/**
+ * Send a command on the mirror's connection. The socket has nothing queued,
+ * and commands are kept short enough to fit.
+ *
+ * */
+static int
+request(mirror_t *mirror, const char *cmd, size_t len, int state)
+{
+	mirror->state = state;
+
+	return send(mirror->h.fd, cmd, len, MSG_NOSIGNAL) == (ssize_t) len ? 0 : -1;
+}
+
+/**
+ * List the whole database.
+ *
+ * */
+static int
+list_all(mirror_t *mirror)
+{
+	// A rescan still running may change more
+	if(!mirror->updating)
+		__atomic_store_n(&mirror->rescanned, FALSE, __ATOMIC_RELEASE);
+
+	segment_put(mirror->building);
+
+	if((mirror->building = segment_new()) == NULL)
+		return -1;
+
+	return request(mirror, LISTALLINFO, sizeof(LISTALLINFO) - 1, MIRROR_LISTING);
+}
+
+/**
+ * A new snapshot is ready, serve it in place of its base and have it saved.
+ * Only the mirror's loop publishes snapshots, it stays valid while it is
+ * saved.
+ *
+ * */
+static void
+ready(mirror_t *mirror, db_t *db)
+{
+	reset(mirror);
+
+	db_put(mirror->base);
+	mirror->base = NULL;
+
+	publish(mirror, db);
+	release(mirror);
+
+	if(mirror->path != NULL && submit(mirror, MIRROR_JOB_SAVE, db) < 0)
+		print("snapshot_save", strerror(errno));
+}
+
+/**
+ * The base is still current, serve it again if a failed synchronization
+ * took it down.
+ *
+ * */
+static void
+kept(mirror_t *mirror, db_t *db)
+{
+	if(mirror->db != db)
+		publish(mirror, db);
+	else
+		db_put(db);
+
+	db_put(mirror->base);
+	mirror->base = NULL;
+	reset(mirror);
+	release(mirror);
+}
+
+static int
+built(mirror_t *mirror)
+{
+	// Drop the final OK
+	mirror->building->text_len -= strlen(mirror->res.cur) + 1;
+
+	return submit(mirror, MIRROR_JOB_BUILD, NULL);
+}
+
+/**
+ * MPD answered stats: the snapshot is kept if the database was not updated
+ * since it was taken. It is synchronized otherwise, and served meanwhile, or
+ * listed in full if there is none.
+ *
+ * */
+static int
+checked(mirror_t *mirror)
+{
+	db_t *base;
+
+	mirror->res.line_cb = NULL;
+
+	if(mirror->res.status != MPD_OK)
+		return -1;
+
+	if(mirror->db != NULL){
+		db_put(mirror->base);
+		mirror->base = mirror_get(mirror);
+	}
+
+	if((base = mirror->base) == NULL)
+		return list_all(mirror);
+
+	// Unchanged, if it counts what MPD does
+	if(mirror->db_update != 0 && base->db_update == mirror->db_update)
+		return submit(mirror, MIRROR_JOB_CHECK, NULL);
+
+	if(base->db_update == 0 || __atomic_load_n(&mirror->rescanned, __ATOMIC_ACQUIRE))
+		return list_all(mirror);
+
+	return request(mirror, LISTALL, sizeof(LISTALL) - 1, MIRROR_LISTALL);
+}
+
+/**
+ * Synchronizing
+ *
+ * */
+#define ROOT (NONE - 1)
+
+/**
+ * Next file, directory or playlist line of a listing from pos. Returns its
+ * kind, or -1 at the end.
+ *
+ * */
+static int
+next_entry(const char *text, size_t len, size_t *pos, const char **path, size_t *path_len)
+{
+	const char *line, *nl, *sep;
+	size_t end;
+	int kind;
+
+	while(*pos < len){
+		line = text + *pos;
+		end = (nl = memchr(line, '\n', len - *pos)) ? (size_t) (nl - text) : len;
+		*pos = end + 1;
+
+		if((sep = memmem(line, (size_t) (text + end - line), ": ", 2)) != NULL && (kind = entry_kind(line, (size_t) (sep - line))) >= 0){
+			*path = sep + 2;
+			*path_len = (size_t) (text + end - *path);
+			return kind;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Entry of each path string, NONE for strings no entry is at.
+ *
+ * */
+static uint32_t *
+entries_by_path(segment_t *seg)
+{
+	uint32_t *entry_of, i;
+
+	if((entry_of = malloc((seg->n_strings + 1) * sizeof(uint32_t))) == NULL)
+		return NULL;
+
+	memset(entry_of, 0xff, (seg->n_strings + 1) * sizeof(uint32_t));
+
+	for(i = 0; i < seg->n_entries; i++)
+		entry_of[seg->path[i]] = i;
+
+	return entry_of;
+}
+
+static uint32_t
+entry_at(segment_t *seg, const uint32_t *entry_of, int kind, const char *path, size_t len)
+{
+	uint32_t id, entry;
+
+	if((id = lookup(seg, path, len)) == NONE || (entry = entry_of[id]) == NONE || seg->kind[entry] != kind)
+		return NONE;
+
+	return entry;
+}
+
+/**
+ * The entries of a snapshot in database order, numbered across its segments,
+ * and the number of the entry at each path string of every segment.
+ *
+ * */
+typedef struct view_t {
+	db_t *db;
+	uint32_t n;
+	uint8_t *segment;
+	uint32_t *entry;
+	uint32_t *at[DB_SEGMENTS];
+} view_t;
+
+static void
+view_free(view_t *view)
+{
+	int s;
+
+	for(s = 0; s < DB_SEGMENTS; s++)
+		free(view->at[s]);
+
+	free(view->segment);
+	free(view->entry);
+}
+
+static int
+view_init(view_t *view, db_t *db)
+{
+	segment_t *seg;
+	slice_t *slice;
+	uint32_t i, k;
+	int s;
+
+	memset(view, 0, sizeof(view_t));
+	view->db = db;
+
+	if((view->segment = malloc(db->n_entries + 1)) == NULL || (view->entry = malloc((db->n_entries + 1) * sizeof(uint32_t))) == NULL)
+		return -1;
+
+	for(s = 0; s < db->n_segments; s++){
+		seg = db->segments[s];
+		if((view->at[s] = malloc((seg->n_strings + 1) * sizeof(uint32_t))) == NULL)
+			return -1;
+
+		memset(view->at[s], 0xff, (seg->n_strings + 1) * sizeof(uint32_t));
+	}
+
+	for(k = 0; k < db->n_slices; k++){
+		slice = &db->slices[k];
+		seg = db->segments[slice->segment];
+
+		for(i = slice->from; i < slice->to; i++){
+			view->segment[view->n] = (uint8_t) slice->segment;
+			view->entry[view->n] = i;
+			view->at[slice->segment][seg->path[i]] = view->n++;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Number of the entry of a kind at path, NONE if there is none.
+ *
+ * */
+static uint32_t
+view_find(view_t *view, int kind, const char *path, size_t len)
+{
+	segment_t *seg;
+	uint32_t id, n;
+	int s;
+
+	for(s = 0; s < view->db->n_segments; s++){
+		seg = view->db->segments[s];
+
+		if((id = lookup(seg, path, len)) != NONE && (n = view->at[s][id]) != NONE && seg->kind[view->entry[n]] == kind)
+			return n;
+	}
+
+	return NONE;
+}
+
+static const char *
+view_path(view_t *view, uint32_t n, size_t *len)
+{
+	segment_t *seg = view->db->segments[view->segment[n]];
+	uint32_t id = seg->path[view->entry[n]];
+
+	*len = seg->str_len[id];
+
+	return seg->text + seg->str_off[id];
+}
+
+/**
+ * Number of the directory of the base holding path, ROOT at the top. NONE if
+ * that directory is new, or gone.
+ *
+ * */
+static uint32_t
+dir_of(view_t *base, const uint8_t *seen, const char *path, size_t len)
+{
+	const char *slash = memrchr(path, '/', len);
+	uint32_t n;
+
+	if(slash == NULL)
+		return ROOT;
+
+	if((n = view_find(base, DB_DIRECTORY, path, (size_t) (slash - path))) == NONE || !seen[n])
+		return NONE;
+
+	return n;
+}
+
+static int
+command(buffer_t **cmds, const char *cmd, const char *path, size_t len)
+{
+	size_t i;
+
+	if(emit(cmds, cmd, strlen(cmd)) < 0 || emit(cmds, " \"", 2) < 0)
+		return -1;
+
+	for(i = 0; i < len; i++){
+		if((path[i] == '"' || path[i] == '\\') && emit(cmds, "\\", 1) < 0)
+			return -1;
+		if(emit(cmds, path + i, 1) < 0)
+			return -1;
+	}
+
+	return emit(cmds, "\"\n", 2);
+}
+
+/**
+ * Compare the paths MPD lists now with the base. Directories that gained or
+ * lost entries, or hold songs modified since the base was taken, are listed
+ * again; so is their parent, which lists their modification time. New
+ * directories are listed with everything below them.
+ *
+ * */
+static int
+compare_paths(mirror_t *mirror)
+{
+	db_t *base = mirror->base;
+	buffer_t *cmds = NULL;
+	uint8_t *seen = NULL, *mark = NULL;
+	const char *path;
+	uint32_t i, n;
+	size_t pos, len;
+	int kind, root = FALSE, ret = -1;
+	view_t view;
+
+	if(view_init(&view, base) < 0 || (seen = calloc(view.n + 1, 1)) == NULL ||
+			(mark = calloc(view.n + 1, 1)) == NULL || emit(&cmds, "command_list_ok_begin\n", 22) < 0)
+		goto out;
+
+	// Listings start with directories, then what is in them
+	for(pos = 0; (kind = next_entry(mirror->paths->data, mirror->paths->len, &pos, &path, &len)) >= 0;){
+		if((n = view_find(&view, kind, path, len)) != NONE){
+			seen[n] = TRUE;
+			continue;
+		}
+
+		// Below a new directory, which is listed whole
+		if((n = dir_of(&view, seen, path, len)) == NONE)
+			continue;
+
+		if(n == ROOT)
+			root = TRUE;
+		else
+			mark[n] = 1;
+
+		if(kind == DB_DIRECTORY){
+			if(command(&cmds, "listallinfo", path, len) < 0)
+				goto out;
+			mirror->fetched++;
+		}
+	}
+
+	for(i = 0; i < view.n; i++){
+		if(seen[i])
+			continue;
+
+		path = view_path(&view, i, &len);
+		if((n = dir_of(&view, seen, path, len)) == NONE)
+			continue;
+
+		if(n == ROOT)
+			root = TRUE;
+		else
+			mark[n] = 1;
+	}
+
+	for(pos = 0; (kind = next_entry(mirror->reply->data, mirror->reply->len, &pos, &path, &len)) >= 0;){
+		if(kind != DB_SONG || (n = dir_of(&view, seen, path, len)) == NONE)
+			continue;
+
+		if(n == ROOT)
+			root = TRUE;
+		else
+			mark[n] = 1;
+	}
+
+	for(i = 0; i < view.n; i++){
+		if(mark[i] != 1)
+			continue;
+
+		path = view_path(&view, i, &len);
+		if((n = dir_of(&view, seen, path, len)) == NONE)
+			continue;
+
+		if(n == ROOT)
+			root = TRUE;
+		else if(!mark[n])
+			mark[n] = 2;
+	}
+
+	if(root){
+		if(command(&cmds, "lsinfo", "", 0) < 0)
+			goto out;
+		mirror->fetched++;
+	}
+
+	for(i = 0; i < view.n && cmds->len <= MIRROR_SYNC_SIZE; i++){
+		if(!mark[i])
+			continue;
+
+		path = view_path(&view, i, &len);
+		if(command(&cmds, "lsinfo", path, len) < 0)
+			goto out;
+		mirror->fetched++;
+	}
+
+	if(cmds->len > MIRROR_SYNC_SIZE){
+		ret = list_all(mirror);
+		goto out;
+	}
+
+	// Nothing MPD lists changed, the base is current if it counts the same
+	if(mirror->fetched == 0){
+		ret = submit(mirror, MIRROR_JOB_CHECK, NULL);
+		goto out;
+	}
+
+	ret = emit(&cmds, "command_list_end\n", 17) < 0 ? -1 : request(mirror, cmds->data, cmds->len, MIRROR_FETCH);
+
+out:
+	view_free(&view);
+	free(seen);
+	free(mark);
+	buffer_put(cmds);
+
+	return ret;
+}
+
+/**
+ * Drop the segments of a snapshot none of its entries are in, once its
+ * entries were added.
+ *
+ * */
+static void
+db_trim(db_t *db)
+{
+	int number[DB_SEGMENTS], s, t;
+	uint32_t i, k;
+
+	for(s = 0, t = 0; s < db->n_segments; s++){
+		for(i = 0; i < (db->segments[s]->n_entries + 63) / 64 && db->live[s][i] == 0; i++);
+
+		if(i == (db->segments[s]->n_entries + 63) / 64){
+			segment_put(db->segments[s]);
+			free(db->live[s]);
+			continue;
+		}
+
+		number[s] = t;
+		db->segments[t] = db->segments[s];
+		db->live[t++] = db->live[s];
+	}
+
+	db->n_segments = t;
+
+	for(k = 0; k < db->n_slices; k++)
+		db->slices[k].segment = (uint32_t) number[db->slices[k].segment];
+}
+
+/**
+ * The changed directories were listed again, into a segment of their own:
+ * the new snapshot takes the entries MPD lists, in its order, from that
+ * segment or else from the base. Only the new segment is indexed, the others
+ * are shared with the base. Once there would be more than DB_SEGMENTS, or
+ * most entries of the base's segments were replaced, all entries are copied
+ * into a single segment instead, indexed whole.
+ *
+ * */
+static void
+synchronize(mirror_job_t *job)
+{
+	segment_t *fetched = job->seg, *seg, *merged = NULL;
+	db_t *base = job->base, *db = NULL;
+	uint32_t *fetched_of = NULL, entry, n, total = 0;
+	const char *path;
+	size_t pos, out, end, len;
+	int kind, s, used = FALSE;
+	view_t view;
+
+	memset(&view, 0, sizeof(view_t));
+
+	// Drop the list_OK after each listing
+	for(pos = out = 0; pos < fetched->text_len; pos = end){
+		end = (path = memchr(fetched->text + pos, '\n', fetched->text_len - pos)) ? (size_t) (path - fetched->text) + 1 : fetched->text_len;
+		if(end - pos == 8 && memcmp(fetched->text + pos, "list_OK\n", 8) == 0)
+			continue;
+
+		memmove(fetched->text + out, fetched->text + pos, end - pos);
+		out += end - pos;
+	}
+
+	fetched->text_len = out;
+
+	for(s = 0; s < base->n_segments; s++)
+		total += base->segments[s]->n_entries;
+
+	if(segment_parse(fetched) < 0 || (fetched_of = entries_by_path(fetched)) == NULL ||
+			view_init(&view, base) < 0 || (db = db_new()) == NULL)
+		goto out;
+
+	db->db_update = job->db_update;
+
+	if(base->n_segments == DB_SEGMENTS || total - base->n_entries > base->n_entries){
+		if((merged = segment_new()) == NULL)
+			goto out;
+	} else {
+		for(s = 0; s < base->n_segments; s++){
+			__atomic_add_fetch(&base->segments[s]->refs, 1, __ATOMIC_RELAXED);
+			if(db_attach(db, base->segments[s]) < 0)
+				goto out;
+		}
+
+		// Indexed once it is known to be used
+		job->seg = NULL;
+		if(db_attach(db, fetched) < 0)
+			goto out;
+	}
+
+	for(pos = 0; (kind = next_entry(job->paths->data, job->paths->len, &pos, &path, &len)) >= 0;){
+		if((entry = entry_at(fetched, fetched_of, kind, path, len)) != NONE){
+			seg = fetched;
+			s = base->n_segments;
+			used = TRUE;
+		} else if((n = view_find(&view, kind, path, len)) != NONE){
+			seg = base->segments[view.segment[n]];
+			s = view.segment[n];
+			entry = view.entry[n];
+		} else {
+			// The database changed again meanwhile
+			job->relist = TRUE;
+			goto out;
+		}
+
+		if(merged != NULL ? text_add(merged, seg->text + seg->off[entry], seg->len[entry]) < 0 : slice_add(db, s, entry) < 0)
+			goto out;
+	}
+
+	if(merged != NULL){
+		if(segment_parse(merged) < 0 || segment_index(merged) < 0)
+			goto out;
+
+		db_put(db);
+		db = db_whole(merged, job->db_update);
+		merged = NULL;
+
+		if(db == NULL)
+			goto out;
+	} else {
+		if(used && segment_index(fetched) < 0)
+			goto out;
+
+		db_trim(db);
+	}
+
+	// A change the listings do not show, such as a file replaced by one
+	// with an older modification time
+	if(!reconciles(&job->stats, db)){
+		job->relist = TRUE;
+		goto out;
+	}
+
+	job->db = db;
+	db = NULL;
+
+out:
+	view_free(&view);
+	free(fetched_of);
+	segment_put(merged);
+	db_put(db);
+}
+
+/**
+ * Keep what MPD sent in answer to listall, find modified-since and the
+ * listings making up the snapshot.
+ *
+ * */
+static int
+keep(mirror_t *mirror, const char *data, size_t len)
+{
+	buffer_t **buf, *tmp;
+
+	switch(mirror->state){
+		case MIRROR_GREETING:
+		case MIRROR_STATS:
+		case MIRROR_INDEXING:
+			return 0;
+
+		case MIRROR_LISTALL:
+		case MIRROR_MODIFIED:
+			buf = mirror->state == MIRROR_LISTALL ? &mirror->paths : &mirror->reply;
+			if((tmp = buffer_append(*buf, data, len)) == NULL)
+				return -1;
+			*buf = tmp;
+			return 0;
+
+		default:
+			return text_add(mirror->building, data, len);
+	}
+}
+
+/**
+ * A response on the mirror's connection is complete, go on with the next
+ * step. Returns -1 if the snapshot cannot be built.
+ *
+ * */
+static int
+step(mirror_t *mirror)
+{
+	char cmd[64];
+
+	switch(mirror->state){
+		case MIRROR_GREETING:
+			mirror->res.line_cb = &on_stats;
+			return mirror->res.status == MPD_OK ? request(mirror, STATS, sizeof(STATS) - 1, MIRROR_STATS) : -1;
+
+		case MIRROR_STATS:
+			return checked(mirror);
+
+		case MIRROR_LISTALL:
+			if(mirror->res.status != MPD_OK)
+				return list_all(mirror);
+
+			mirror->paths->len -= strlen(mirror->res.cur) + 1;
+
+			snprintf(cmd, sizeof cmd, "find modified-since %llu\n", mirror->base->db_update > MIRROR_SLACK ?
+					(unsigned long long) (mirror->base->db_update - MIRROR_SLACK) : 0ULL);
+
+			return request(mirror, cmd, strlen(cmd), MIRROR_MODIFIED);
+
+		case MIRROR_MODIFIED:
+			return mirror->res.status == MPD_OK ? compare_paths(mirror) : list_all(mirror);
+
+		case MIRROR_FETCH:
+			if(mirror->res.status != MPD_OK)
+				return list_all(mirror);
+
+			// Drop the final OK
+			mirror->building->text_len -= strlen(mirror->res.cur) + 1;
+
+			return submit(mirror, MIRROR_JOB_SYNC, NULL);
+
+		case MIRROR_INDEXING:
+			return 0;
+
+		default:
+			if(mirror->res.status != MPD_OK){
+				print("mirror", mirror->res.cur);
+				return -1;
+			}
+
+			return built(mirror);
+	}
+}
+
+/**
+ * Indexing
+ *
+ * */
+static void
+build(mirror_job_t *job)
+{
+	segment_t *seg = job->seg;
+
+	job->seg = NULL;
+
+	if(segment_parse(seg) < 0 || segment_index(seg) < 0){
+		segment_put(seg);
+		return;
+	}
+
+	job->db = db_whole(seg, job->db_update);
+}
+
+/**
+ * Do a job on the mirror's thread. A snapshot built, synchronized or found
+ * current is left in db; if there is none, relist tells whether to list the
+ * database in full, or else memory ran out.
+ *
+ * */
+static void
+run(mirror_job_t *job)
+{
+	switch(job->kind){
+		case MIRROR_JOB_BUILD:
+			build(job);
+			break;
+
+		case MIRROR_JOB_SYNC:
+			synchronize(job);
+			break;
+
+		case MIRROR_JOB_CHECK:
+			if(!reconciles(&job->stats, job->base)){
+				job->relist = TRUE;
+				break;
+			}
+
+			job->db = job->base;
+			job->base = NULL;
+			break;
+
+		case MIRROR_JOB_SAVE:
+			if(snapshot_save(job->base, job->db_update, job->mirror->path) < 0)
+				print("snapshot_save", strerror(errno));
+			break;
+	}
+}
+
+static void *
+th_index(void *arg)
+{
+	mirror_t *mirror = (mirror_t*) arg;
+	mirror_job_t *job;
+
+	pthread_mutex_lock(&mirror->jobs_lock);
+
+	while(!mirror->stopping){
+		if((job = mirror->jobs) == NULL){
+			pthread_cond_wait(&mirror->jobs_cond, &mirror->jobs_lock);
+			continue;
+		}
+
+		mirror->jobs = job->next;
+		pthread_mutex_unlock(&mirror->jobs_lock);
+
+		run(job);
+
+		// Saving has nothing to tell
+		if(job->kind == MIRROR_JOB_SAVE)
+			job_free(job);
+		else
+			loop_post(mirror->loop, &job->post);
+
+		pthread_mutex_lock(&mirror->jobs_lock);
+	}
+
+	pthread_mutex_unlock(&mirror->jobs_lock);
+
+	return NULL;
+}
+
+/**
+ * Stop the mirror's thread once its current job is done. Of the jobs it did
+ * not start, only the last save is done.
+ *
+ * */
+void
+mirror_stop(mirror_t *mirror)
+{
+	mirror_job_t *job, *save = NULL;
+
+	if(!mirror->started)
+		return;
+
+	pthread_mutex_lock(&mirror->jobs_lock);
+	mirror->stopping = TRUE;
+	pthread_cond_signal(&mirror->jobs_cond);
+	pthread_mutex_unlock(&mirror->jobs_lock);
+
+	pthread_join(mirror->th_id, NULL);
+	mirror->started = FALSE;
+
+	for(job = mirror->jobs; job != NULL; job = job->next){
+		if(job->kind == MIRROR_JOB_SAVE)
+			save = job;
+	}
+
+	// The file would be outdated otherwise
+	if(save != NULL)
+		run(save);
+
+	while((job = mirror->jobs) != NULL){
+		mirror->jobs = job->next;
+		job_free(job);
+	}
+}
+
+/**
+ * Callbacks
+ *
+ * */
+static void
+on_connected(void *data, int fd, backend_t *backend)
+{
+	mirror_t *mirror = (mirror_t*) data;
+
+	mirror->connect = NULL;
+
+	if(fd < 0){
+		fail(mirror, strerror(errno));
+		return;
+	}
+
+	mirror->h.fd = fd;
+	mirror->backend = backend;
+	mirror->state = MIRROR_GREETING;
+	mirror->db_update = 0;
+	mirror->updating = FALSE;
+	memset(&mirror->stats, 0xff, sizeof(db_stats_t));
+	mpd_response_init(&mirror->res);
+	mirror->res.data = mirror;
+
+	if(loop_add(mirror->loop, &mirror->h, EPOLLIN | EPOLLRDHUP | EPOLLET) < 0)
+		fail(mirror, strerror(errno));
+}
+
+static void
+on_mirror(handler_t *handler, uint32_t events)
+{
+	mirror_t *mirror = container_of(handler, mirror_t, h);
+	char buf[65536];
+	ssize_t bytes;
+	size_t off, n;
+
+	for(;;){
+		if((bytes = recv(handler->fd, buf, sizeof buf, 0)) < 0){
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				fail(mirror, strerror(errno));
+			return;
+		}
+
+		// MPD drops clients whose output exceeds max_output_buffer_size
+		if(bytes == 0){
+			fail(mirror, "Connection closed by MPD server");
+			return;
+		}
+
+		for(off = 0; off < (size_t) bytes; off += n){
+			n = mpd_response_feed(&mirror->res, buf + off, (size_t) bytes - off);
+
+			if(keep(mirror, buf + off, n) < 0){
+				fail(mirror, strerror(ENOMEM));
+				return;
+			}
+
+			if(!mirror->res.done)
+				continue;
+
+			if(step(mirror) < 0){
+				fail(mirror, "Could not mirror MPD's database");
+				return;
+			}
+
+			// Done, the connection was closed
+			if(mirror->h.fd < 0)
+				return;
+		}
+	}
+}
+
+static void
+on_stats(mpd_response_t *res, const char *line, size_t len)
+{
+	mirror_t *mirror = (mirror_t*) res->data;
+
+	if(len > 11 && strncmp(line, "db_update: ", 11) == 0)
+		mirror->db_update = strtoull(line + 11, NULL, 10);
+	else if(len > 13 && strncmp(line, "updating_db: ", 13) == 0)
+		mirror->updating = TRUE;
+	else if(len > 7 && strncmp(line, "songs: ", 7) == 0)
+		mirror->stats.songs = strtoull(line + 7, NULL, 10);
+	else if(len > 9 && strncmp(line, "artists: ", 9) == 0)
+		mirror->stats.artists = strtoull(line + 9, NULL, 10);
+	else if(len > 8 && strncmp(line, "albums: ", 8) == 0)
+		mirror->stats.albums = strtoull(line + 8, NULL, 10);
+	else if(len > 13 && strncmp(line, "db_playtime: ", 13) == 0)
+		mirror->stats.playtime = strtoull(line + 13, NULL, 10);
+}
+
+/**
+ * A job is done, go on from its result unless the mirror was reset since.
+ *
+ * */
+static void
+on_indexed(post_t *post)
+{
+	mirror_job_t *job = (mirror_job_t*) post;
+	mirror_t *mirror = job->mirror;
+	db_t *db = job->db;
+
+	job->db = NULL;
+
+	if(job->generation != mirror->generation){
+		db_put(db);
+		job_free(job);
+		return;
+	}
+
+	if(db == NULL){
+		if(!job->relist)
+			fail(mirror, strerror(ENOMEM));
+		else if(list_all(mirror) < 0)
+			fail(mirror, strerror(errno));
+	} else if(job->kind == MIRROR_JOB_CHECK && db->db_update == job->db_update){
+		kept(mirror, db);
+	} else {
+		if(job->kind == MIRROR_JOB_BUILD)
+			log_write(LOG_INFO, "mirror", "Mirrored %u entries", db->n_entries);
+		else if(job->kind == MIRROR_JOB_SYNC)
+			log_write(LOG_INFO, "mirror", "Synchronized %u entries in %d segments, %u directories listed again",
+					db->n_entries, db->n_segments, mirror->fetched);
+
+		// A base found current takes the time of the update, only the
+		// mirror's loop reads it
+		db->db_update = job->db_update;
+		ready(mirror, db);
+	}
+
+	job_free(job);
+}
+
+static void
+on_retry(timeout_t *timeout)
+{
+	mirror_start(container_of(timeout, mirror_t, retry));
+}
+
+/**
+ * The synchronization takes long, MPD answers until it is done.
+ *
+ * */
+static void
+on_hold(timeout_t *timeout)
+{
+	mirror_t *mirror = container_of(timeout, mirror_t, hold);
+
+	publish(mirror, NULL);
+	release(mirror);
+}
@@ -0,0 +1,280 @@
+/*
+ * mirror.h - in-memory mirror of MPD's database
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netdb.h>
+
+#include "event.h"
+#include "upstream.h"
+#include "protocol.h"
+#include "buffer.h"
+
+// Milliseconds to wait before rebuilding after the mirror could not be built
+#define MIRROR_RETRY 5000
+
+// Distinct tags indexed
+#define DB_TAGS 64
+
+// Most segments a snapshot is made of, a synchronization that would add
+// one more merges them into one
+#define DB_SEGMENTS 8
+
+// Seconds before the last update a song may have been changed without the
+// update seeing it, songs modified since are refetched when synchronizing
+#define MIRROR_SLACK 86400
+
+// Milliseconds a database event is held back from clients while the mirror
+// synchronizes, MPD answers for the rest of the synchronization after that
+#define MIRROR_HOLD 3000
+
+// Most bytes of commands refetching changed directories, more changes than
+// that are listed in full
+#define MIRROR_SYNC_SIZE 8192
+
+// What the mirror's connection is waiting for
+#define MIRROR_GREETING 0
+#define MIRROR_STATS 1
+#define MIRROR_LISTING 2
+#define MIRROR_LISTALL 3
+#define MIRROR_MODIFIED 4
+#define MIRROR_FETCH 5
+#define MIRROR_INDEXING 6
+
+// Work done off the mirror's loop
+#define MIRROR_JOB_BUILD 0
+#define MIRROR_JOB_SYNC 1
+#define MIRROR_JOB_CHECK 2
+#define MIRROR_JOB_SAVE 3
+
+// Entry kinds
+#define DB_SONG 0
+#define DB_PLAYLIST 1
+#define DB_DIRECTORY 2
+
+/**
+ * The values of one tag, as parallel arrays of entry and string ids in
+ * database order.
+ *
+ * */
+typedef struct column_t {
+	uint32_t *entry;
+	uint32_t *value;
+	uint32_t n;
+	uint32_t size;
+} column_t;
+
+/**
+ * Entries MPD listed together, and their indexes: listallinfo of the whole
+ * database, or the directories listed again when synchronizing. Never
+ * modified once built, and shared by the snapshots synchronized from the one
+ * it was built for. Entries keep the lines MPD sent for them, which is what
+ * find, search and lsinfo answer with. Paths, tag names and values are
+ * interned: queries find the strings satisfying a condition, through the
+ * trigram index for substrings, and go from there to the songs they occur
+ * in.
+ *
+ * */
+typedef struct segment_t {
+	int refs;
+
+	// The file the segment is mapped from, if it was loaded
+	struct map_t *map;
+
+	char *text;
+	size_t text_len;
+	size_t text_size;
+
+	// Entries in database order, an array per attribute
+	uint32_t n_entries;
+	uint32_t entries_size;
+	uint8_t *kind;
+	uint32_t *path;
+	uint32_t *parent;
+	uint32_t *off;
+	uint32_t *len;
+
+	// Interned strings, pointing into text
+	uint32_t n_strings;
+	uint32_t strings_size;
+	uint32_t *str_off;
+	uint32_t *str_len;
+	uint32_t *slots;
+	uint32_t n_slots;
+
+	// Tags as MPD names them, the tag standing in for a missing one, and
+	// the values of each
+	int n_tags;
+	uint32_t tag_name[DB_TAGS];
+	int fallback[DB_TAGS];
+	column_t columns[DB_TAGS];
+
+	// Songs having a value of each tag that has a fallback
+	uint64_t *has[DB_TAGS];
+
+	// Where each string occurs, as the value of a tag or the path of a
+	// song: occurrences of string i are at occ_start[i] to occ_start[i + 1]
+	uint32_t *occ_start;
+	uint32_t *occ_entry;
+	uint8_t *occ_tag;
+
+	// Strings containing each case folded trigram, hashed into 2^tri_bits
+	// buckets of ascending string ids
+	int tri_bits;
+	uint32_t *tri_start;
+	uint32_t *tri_string;
+} segment_t;
+
+/**
+ * Consecutive entries of a segment, from up to to.
+ *
+ * */
+typedef struct slice_t {
+	uint32_t segment;
+	uint32_t from;
+	uint32_t to;
+} slice_t;
+
+/**
+ * A snapshot of the database, never modified once published, so workers
+ * read it without locking. Its entries in database order are the slices;
+ * entries of a segment no slice holds were listed again since, and are only
+ * skipped by queries.
+ *
+ * */
+typedef struct db_t {
+	int refs;
+
+	// Time of the database update the snapshot was taken after
+	uint64_t db_update;
+
+	// Segments, and which of their entries are in the snapshot
+	int n_segments;
+	segment_t *segments[DB_SEGMENTS];
+	uint64_t *live[DB_SEGMENTS];
+	uint32_t n_entries;
+
+	uint32_t n_slices;
+	uint32_t slices_size;
+	slice_t *slices;
+} db_t;
+
+/**
+ * What MPD counts in stats, UINT64_MAX where it is not known. A synchronized
+ * snapshot must count the same as MPD does, or it missed a change.
+ *
+ * */
+typedef struct db_stats_t {
+	uint64_t songs;
+	uint64_t artists;
+	uint64_t albums;
+	uint64_t playtime;
+} db_stats_t;
+
+/**
+ * Parsing, indexing, counting or saving a snapshot, done by the mirror's
+ * thread and posted back to its loop. Results of a job started before the
+ * mirror was reset are dropped.
+ *
+ * */
+typedef struct mirror_job_t {
+	post_t post;
+	struct mirror_job_t *next;
+	struct mirror_t *mirror;
+	int kind;
+	unsigned int generation;
+
+	// What MPD sent, and what it tells of the database
+	segment_t *seg;
+	buffer_t *paths;
+	uint64_t db_update;
+	db_stats_t stats;
+
+	// The snapshot synchronized from, checked or saved
+	db_t *base;
+
+	// The new snapshot, or NULL and whether to list the database in full
+	db_t *db;
+	int relist;
+} mirror_job_t;
+
+/**
+ * Keeps a snapshot of the database, rebuilt over a connection of its own
+ * whenever the database changes. Until a snapshot is built there is none,
+ * and clients are served by MPD. If a file is given, snapshots are saved to
+ * it and the last one is mapped at startup, then kept if MPD's database was
+ * not updated since.
+ *
+ * A new snapshot is synchronized from the previous one, the base: only the
+ * directories whose entries changed are listed again, into a segment of their
+ * own, and the snapshot takes the other entries from the segments of the
+ * base. Clients are told the database changed once the new snapshot is
+ * ready, so what they read in reaction is current; the base answers until
+ * then, for up to MIRROR_HOLD milliseconds. A snapshot that does not count
+ * what MPD's stats do, or follows a rescan, is listed in full instead.
+ * Snapshots are parsed, indexed and saved by a thread of the mirror's own,
+ * the loop only talks to MPD.
+ *
+ * */
+typedef struct mirror_t {
+	loop_t *loop;
+	upstream_t *upstream;
+	const char *path;
+
+	connect_t *connect;
+	backend_t *backend;
+	handler_t h;
+	mpd_response_t res;
+	int state;
+	uint64_t db_update;
+	db_stats_t stats;
+	int updating;
+	segment_t *building;
+	db_t *base;
+	buffer_t *paths;
+	buffer_t *reply;
+	uint32_t fetched;
+	timeout_t retry;
+	unsigned int generation;
+
+	// A database event clients were not told about yet
+	int held;
+	timeout_t hold;
+	void (*on_synced)(void *data);
+	void *data;
+
+	// A client asked MPD to rescan, set from any thread
+	int rescanned;
+
+	pthread_mutex_t lock;
+	db_t *db;
+
+	// Jobs waiting for the mirror's thread
+	pthread_mutex_t jobs_lock;
+	pthread_cond_t jobs_cond;
+	mirror_job_t *jobs;
+
+	pthread_t th_id;
+	int started;
+	int stopping;
+} mirror_t;
+
+int mirror_init(mirror_t *mirror, loop_t *loop, upstream_t *upstream, const char *path, void (*on_synced)(void*), void *data);
+void mirror_start(mirror_t *mirror);
+void mirror_stop(mirror_t *mirror);
+int mirror_refresh(mirror_t *mirror);
+void mirror_rescan(mirror_t *mirror);
+db_t *mirror_get(mirror_t *mirror);
+
+void db_put(db_t *db);
+int db_answer(db_t *db, const char *line, size_t len, buffer_t **out);
+
+#endif
@@ -22,33 +22,54 @@
 #include <wordexp.h>
 
 #include "config.h"
+#include "log.h"
 #include "queue.h"
 #include "list.h"
-
-#define BUF_SIZE 4096
+#include "upstream.h"
+#include "idle.h"
+#include "health.h"
+#include "mirror.h"
+#include "art.h"
+#include "limit.h"
+#include "metrics.h"
+#include "access.h"
+#include "tap.h"
+#include "worker.h"
 
 #define TRUE 1
 #define FALSE 0
 
 const char* const config_files[] = { "~/.config/mpdproxy.conf", "/.mpdproxy.conf", "/etc/mpdproxy.conf" };
 
-static void *th_sock_client(void*);
-static void *th_sock_server(void*);
-static void *th_cleanup_client(void*);
-static void *th_cleanup_server(void*);
-
-typedef struct connection_t {
-	int sock_prx;
-	int sock_cli;
-	pthread_t th_client;
-	pthread_t th_server;
-	int srv_hup;
-} connection_t;
-
 config_t config;
-struct addrinfo *addr_prx;
-
-FILE *errstr;
+upstream_t upstream;
+
+worker_t *workers;
+int n_workers;
+
+// Health checks of the backends if there are several, and PROTOCOL_MPD:
+// watches upstream on behalf of all idling clients
+loop_t service;
+check_t *checks;
+watcher_t watcher;
+mirror_t mirror;
+art_cache_t art;
+limit_t limit;
+int limited;
+
+// Served to scrapers if MetricsPort is set: a shard per worker, and one
+// for the service loop
+exporter_t exporter;
+metrics_t service_metrics;
+metrics_t **shards;
+
+// PROTOCOL_MPD: commands of all workers, if AccessLog is set
+access_log_t access_log;
+int logged;
+
+// Traffic of all workers, if Capture is set
+tap_log_t tap;
+int tapped;
 
 static struct option long_options[] = {
 	{"config",	required_argument,	NULL,	'c'},
@@ -59,20 +80,96 @@ static struct option long_options[] = {
 	{0, 0, 0, 0}
 };
 
+/**
+ * Fan changed subsystems out to the workers' sessions, and rebuild the mirror
+ * and drop album art if the database changed. Runs on the service loop.
+ *
+ * */
 static void
-print(const char *comp, const char *msg)
+on_changed(void *data, unsigned int mask)
 {
-	fprintf(errstr, "[%s]: %s (%d)\n", comp, msg, errno);
+	int i;
+
+	// Before clients hear of the change, they may react by reading art
+	if(config.art_cache_size > 0 && (mask & MPD_IDLE_DATABASE))
+		art_invalidate(&art);
+
+	// Or by querying the mirror, which tells once it caught up
+	if(config.mirror && (mask & MPD_IDLE_DATABASE) && mirror_refresh(&mirror))
+		mask &= ~MPD_IDLE_DATABASE;
+
+	for(i = 0; i < n_workers && mask != 0; i++)
+		worker_notify(&workers[i], mask);
+}
+
+/**
+ * The mirror answers for the database as it is now, pass the change on.
+ * Runs on the service loop.
+ *
+ * */
+static void
+on_synced(void *data)
+{
+	int i;
+
+	for(i = 0; i < n_workers; i++)
+		worker_notify(&workers[i], MPD_IDLE_DATABASE);
+}
+
+/**
+ * Print cache statistics, summed over the workers, and the state of the
+ * backends.
+ *
+ * */
+static void
+print_stats()
+{
+	unsigned long hits = 0, misses = 0, coalesced = 0;
+	backend_t *b;
+	int i;
+
+	for(i = 0; i < n_workers; i++){
+		hits += __atomic_load_n(&workers[i].cache.hits, __ATOMIC_RELAXED);
+		misses += __atomic_load_n(&workers[i].cache.misses, __ATOMIC_RELAXED);
+		coalesced += __atomic_load_n(&workers[i].cache.coalesced, __ATOMIC_RELAXED);
+	}
+
+	fprintf(errstr, "[cache] %lu hits, %lu misses (%lu coalesced)\n", hits, misses, coalesced);
+
+	if(config.protocol == PROTOCOL_MPD && config.art_cache_size > 0)
+		fprintf(errstr, "[art] %lu hits, %lu misses\n", __atomic_load_n(&art.hits, __ATOMIC_RELAXED), __atomic_load_n(&art.misses, __ATOMIC_RELAXED));
+
+	if(limited)
+		limit_report(&limit, errstr);
+
+	for(i = 0; i < upstream.n_backends; i++){
+		b = &upstream.backends[i];
+		fprintf(errstr, "[backend] %s%s %s, %d connections, %u us\n", b->name, b->replica ? " (replica)" : "",
+				__atomic_load_n(&b->up, __ATOMIC_RELAXED) ? "up" : "down", __atomic_load_n(&b->conns, __ATOMIC_RELAXED),
+				__atomic_load_n(&b->latency, __ATOMIC_RELAXED));
+	}
+
 	fflush(errstr);
 }
 
 static void
 die(const char *comp, const char *msg)
 {
+	int i;
+
 	print(comp, msg);
-	fclose(errstr);
 
-	if(addr_prx) freeaddrinfo(addr_prx);
+	for(i = 0; i < upstream.n_backends; i++){
+		if(upstream.backends[i].addr) freeaddrinfo(upstream.backends[i].addr);
+	}
+
+	// The mirror's thread posts to the service loop, and saves the mirror
+	mirror_stop(&mirror);
+
+	// Loops are stopped between events, the threads left are cancelled
+	for(i = 0; workers != NULL && i < n_workers; i++)
+		loop_stop(&workers[i].loop);
+	loop_stop(&service);
 
 	if(q != NULL){
 		struct queue *q_th, *q_tmp;
@@ -99,6 +196,15 @@ die(const char *comp, const char *msg)
 
 		queue_destroy();
 	}
+
+	// Whatever the threads logged is written out before leaving
+	if(logged)
+		access_stop(&access_log);
+	if(tapped)
+		tap_stop(&tap);
+	log_stop();
+	fclose(errstr);
+
 	config_destroy(&config);
 
 	pthread_exit(&errno);
@@ -217,11 +323,9 @@ main(int argc, char** argv)
 	 *
 	 * */
 
-	int sock_srv, sock_cli, err, port;
+	int err;
 	struct addrinfo hints, *addr_srv, *p;
 
-	char s[INET6_ADDRSTRLEN];
-
 	memset(&hints, 0, sizeof hints);
 	hints.ai_socktype = SOCK_STREAM;
 
@@ -231,9 +335,43 @@ main(int argc, char** argv)
 		hints.ai_family = AF_INET6;
 	} else hints.ai_family = AF_UNSPEC;
 
-	// Proxy
-	if((err = getaddrinfo(config.host_prx, config.port_prx, &hints, &addr_prx)))
-		die("getaddr_proxy", gai_strerror(err));
+	// Proxy, Host and Port stand for a single backend
+	if(config.n_backends == 0){
+		config.backends[0].host = strdup(config.host_prx);
+		config.backends[0].port = strdup(config.port_prx);
+		config.backends[0].weight = 1;
+		config.n_backends = 1;
+	}
+
+	if((upstream.backends = calloc((size_t) config.n_backends, sizeof(backend_t))) == NULL)
+		die("calloc_backends", strerror(errno));
+
+	for(upstream.n_backends = 0; upstream.n_backends < config.n_backends; upstream.n_backends++){
+		config_backend_t *cb = &config.backends[upstream.n_backends];
+		backend_t *b = &upstream.backends[upstream.n_backends];
+
+		if((err = getaddrinfo(cb->host, cb->port, &hints, &b->addr)))
+			die("getaddr_proxy", gai_strerror(err));
+
+		upstream_order(&b->addr);
+		snprintf(b->name, sizeof b->name, strchr(cb->host, ':') ? "[%s]:%s" : "%s:%s", cb->host, cb->port);
+		b->weight = (unsigned int) cb->weight;
+		b->replica = cb->replica;
+		if(b->replica)
+			upstream.replicas++;
+
+		// Up until a health check says otherwise
+		b->up = TRUE;
+	}
+
+	// Replicas only take library queries, everything else needs a primary
+	if(upstream.replicas == upstream.n_backends)
+		die("backends", "No primary backend");
+
+	upstream.balance = config.balance;
+	upstream.timeout = config.connect_timeout > 0 ? (unsigned int) config.connect_timeout : 0;
+	upstream.idle = config.pool_idle > 0 ? (unsigned int) config.pool_idle : 0;
+	upstream.protocol = config.protocol;
 
 	hints.ai_flags = AI_PASSIVE;
 
@@ -241,20 +379,101 @@ main(int argc, char** argv)
 	if((err = getaddrinfo(config.host_srv, config.port_srv, &hints, &addr_srv)))
 		die("getaddrinfo", gai_strerror(err));
 
-	for(p = addr_srv; p != NULL; p = p->ai_next){
-		if((sock_srv = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
-			continue;
+	queue_init();
+
+	log_level = config.log_level;
+	if(log_start())
+		die("pthread_create_log", strerror(errno));
+
+	/**
+	 * Workers
+	 *
+	 * */
+	if((n_workers = config.threads) <= 0)
+		n_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if(n_workers <= 0)
+		n_workers = 1;
+
+	if((workers = calloc((size_t) n_workers, sizeof(worker_t))) == NULL)
+		die("calloc_workers", strerror(errno));
+
+	int i, pool_size, share = 0, forward = config.forward;
+	size_t cache_size = 0;
+	sigset_t signals;
+
+	// Threads inherit the mask, SIGUSR1 is left to the main thread
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	// Framing needs the data in userspace
+	if(config.protocol == PROTOCOL_MPD && forward != FORWARD_COPY){
+		print("protocol", "mpd relays data with copy forwarding");
+		forward = FORWARD_COPY;
+	}
+
+	// So does capturing it
+	if(config.capture[0] && forward != FORWARD_COPY){
+		print("capture", "traffic is captured with copy forwarding");
+		forward = FORWARD_COPY;
+	}
+
+	// Each worker caches responses for its own sessions, album art is shared
+	if(config.protocol == PROTOCOL_MPD && config.cache_size > 0)
+		cache_size = (size_t) config.cache_size * 1024;
 
-		int optval = 1;
-		if(setsockopt(sock_srv, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval) < 0)
-			die("setsockopt", strerror(errno));
+	if(config.protocol == PROTOCOL_MPD && config.art_cache_size > 0)
+		art_init(&art, (size_t) config.art_cache_size * 1024, config.art_cache_dir[0] ? config.art_cache_dir : NULL,
+				config.art_cache_dir_size > 0 ? (size_t) config.art_cache_dir_size * 1024 : 0);
+
+	// Commands per second and kilobytes per second, 0 is no limit
+	if(config.protocol == PROTOCOL_MPD && (config.client_rate > 0 || config.client_bandwidth > 0 ||
+				config.address_rate > 0 || config.address_bandwidth > 0)){
+		rate_t client = {0, 0}, address = {0, 0};
+
+		client.commands = config.client_rate > 0 ? (uint64_t) config.client_rate : 0;
+		client.bytes = config.client_bandwidth > 0 ? (uint64_t) config.client_bandwidth * 1024 : 0;
+		address.commands = config.address_rate > 0 ? (uint64_t) config.address_rate : 0;
+		address.bytes = config.address_bandwidth > 0 ? (uint64_t) config.address_bandwidth * 1024 : 0;
+
+		limit_init(&limit, client, address);
+		limited = TRUE;
+	}
 
-		if(bind(sock_srv, p->ai_addr, p->ai_addrlen) == -1){
-			close(sock_srv);
-			continue;
+	for(i = 0; i < n_workers; i++){
+		// Spread the pool over the workers, it bounds the idle connections to MPD
+		pool_size = config.pool_size / n_workers + (i < config.pool_size % n_workers);
+
+		// Multiplexed sessions share the worker's part, at least a connection
+		if(config.protocol == PROTOCOL_MPD && config.multiplex > 0){
+			share = config.multiplex / n_workers + (i < config.multiplex % n_workers);
+			share = share > 0 ? share : 1;
 		}
 
-		break;
+		if(worker_init(&workers[i], i, forward, &upstream, pool_size, share, cache_size) < 0)
+			die("worker_init", strerror(errno));
+
+		if(config.protocol == PROTOCOL_MPD && config.mirror)
+			workers[i].mirror = &mirror;
+		if(config.protocol == PROTOCOL_MPD && config.art_cache_size > 0)
+			workers[i].art = &art;
+		if(limited)
+			workers[i].limit = &limit;
+
+		if(workers[i].forward != forward){
+			print("io_uring", "not supported by the kernel, falling back to epoll");
+			forward = FORWARD_COPY;
+
+			// Start over so all workers use the same backend
+			for(; i >= 0; i--)
+				worker_destroy(&workers[i]);
+		}
+	}
+
+	// The first address the first worker can bind is used by all of them
+	for(p = addr_srv; p != NULL; p = p->ai_next){
+		if(worker_listen(&workers[0], p) == 0)
+			break;
 	}
 
 	if(p == NULL){
@@ -262,169 +481,134 @@ main(int argc, char** argv)
 		die("bind_srv", strerror(errno));
 	}
 
-	if(ipv4){
-		inet_ntop(AF_INET, &((struct sockaddr_in*) p->ai_addr)->sin_addr, s, sizeof(s));
-		port = htons(((struct sockaddr_in*) p->ai_addr)->sin_port);
-		fprintf(errstr, "[main] Listening on %s:%d\n", s, port);
-	}
-	if(ipv6){
-		inet_ntop(AF_INET6, &((struct sockaddr_in6*) p->ai_addr)->sin6_addr, s, sizeof(s));
-		port = htons(((struct sockaddr_in6*) p->ai_addr)->sin6_port);
-		fprintf(errstr, "[main] Listening on %s:%d\n", s, port);
+	for(i = 1; i < n_workers; i++){
+		if(worker_listen(&workers[i], p) < 0){
+			freeaddrinfo(addr_srv);
+			die("bind_srv", strerror(errno));
+		}
 	}
 
+	print_addr("main", "Listening on", p->ai_addr);
+
 	freeaddrinfo(addr_srv);
 
-	if(listen(sock_srv, SOMAXCONN) < 0){
-		close(sock_srv);
-		die("listen", strerror(errno));
-	};
+	// Loops count into their shard once it is set, before they start
+	if(config.metrics_port[0]){
+		if((shards = calloc((size_t) n_workers + 1, sizeof(metrics_t*))) == NULL)
+			die("calloc_shards", strerror(errno));
 
-	queue_init();
+		for(i = 0; i < n_workers; i++){
+			metrics_init(&workers[i].metrics);
+			workers[i].loop.metrics = shards[i] = &workers[i].metrics;
+		}
 
-	while((sock_cli = accept(sock_srv, NULL, NULL))){
-		connection_t *conn = malloc(sizeof(connection_t));
-		conn->sock_cli = sock_cli;
-		conn->srv_hup = TRUE;
+		metrics_init(&service_metrics);
+		shards[n_workers] = &service_metrics;
 
-		for(p = addr_prx; p != NULL; p = p->ai_next){
-			if((conn->sock_prx = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
-				continue;
+		if((err = getaddrinfo(config.metrics_host[0] ? config.metrics_host : NULL, config.metrics_port, &hints, &addr_srv)))
+			die("getaddr_metrics", gai_strerror(err));
 
-			if(connect(conn->sock_prx, p->ai_addr, p->ai_addrlen)){
-				close(conn->sock_prx);
-				continue;
-			}
+		exporter_init(&exporter, &upstream, shards, n_workers + 1);
 
-			break;
+		for(p = addr_srv; p != NULL; p = p->ai_next){
+			if(exporter_listen(&exporter, p) == 0)
+				break;
 		}
 
 		if(p == NULL){
-			print("bind_prx", strerror(errno));
-			close(sock_cli);
-			free(conn);
-			continue;
+			freeaddrinfo(addr_srv);
+			die("bind_metrics", strerror(errno));
 		}
 
-		if(p->ai_family == AF_INET){
-			inet_ntop(AF_INET, &((struct sockaddr_in*) p->ai_addr)->sin_addr, s, sizeof(s));
-			port = htons(((struct sockaddr_in*) p->ai_addr)->sin_port);
-		} else {
-			inet_ntop(AF_INET6, &((struct sockaddr_in6*) p->ai_addr)->sin6_addr, s, sizeof(s));
-			port = htons(((struct sockaddr_in6*) p->ai_addr)->sin6_port);
-		}
-		fprintf(errstr, "[main] Proxying requests to %s:%d\n", s, port);
-
-		if(pthread_create(&(conn->th_client), NULL, &th_sock_client, conn)){
-			close(conn->sock_prx);
-			free(conn);
-			close(sock_cli);
-			close(sock_srv);
-			die("pthread_create_client", strerror(errno));
-		}
+		print_addr("metrics", "Serving metrics on", p->ai_addr);
 
-		if(pthread_create(&(conn->th_server), NULL, &th_sock_server, conn)){
-			close(conn->sock_prx);
-			free(conn);
-			close(sock_cli);
-			close(sock_srv);
-			die("pthread_create_server", strerror(errno));
-		}
+		freeaddrinfo(addr_srv);
 	}
-	if(sock_cli < 0)
-		die("accept", strerror(errno));
-
-	pthread_exit(EXIT_SUCCESS);
-}
-
-/**
- * Threads
- *
- * */
-static void *
-th_sock_client(void *connection)
-{
-	queue_ins(pthread_self());
-
-	connection_t *conn = (connection_t*) connection;
 
-	pthread_cleanup_push(&th_cleanup_client, connection);
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	if(config.protocol == PROTOCOL_MPD && config.access_log[0]){
+		if(access_open(&access_log, config.access_log) < 0)
+			die("open_access_log", strerror(errno));
+		logged = TRUE;
 
-	char buffer[BUF_SIZE];
-	ssize_t bytes;
+		for(i = 0; i < n_workers; i++){
+			if((workers[i].access = access_ring(&access_log)) == NULL)
+				die("calloc_access", strerror(errno));
+		}
 
-	while((bytes = recv(conn->sock_cli, &buffer, BUF_SIZE, 0)) > 0){
-		if((bytes = send(conn->sock_prx, &buffer, (size_t) bytes, 0)) <= 0)
-			break;
+		if(access_start(&access_log))
+			die("pthread_create_access", strerror(errno));
 	}
 
-	conn->srv_hup = FALSE;
+	if(config.capture[0]){
+		if(tap_open(&tap, config.capture, config.protocol) < 0)
+			die("open_capture", strerror(errno));
+		tapped = TRUE;
 
-	pthread_cleanup_pop(TRUE);
-	pthread_exit(NULL);
-}
+		for(i = 0; i < n_workers; i++){
+			if((workers[i].tap = tap_ring(&tap)) == NULL)
+				die("calloc_capture", strerror(errno));
+		}
 
-static void *
-th_sock_server(void *connection)
-{
-	queue_ins(pthread_self());
+		if(tap_start(&tap))
+			die("pthread_create_capture", strerror(errno));
+	}
 
-	connection_t *conn = (connection_t*) connection;
+	// Workers read the mirror as soon as they start, it is synchronized
+	// once the service loop runs
+	if(config.protocol == PROTOCOL_MPD && config.mirror){
+		if(mirror_init(&mirror, &service, &upstream, config.mirror_file[0] ? config.mirror_file : NULL, &on_synced, NULL))
+			die("pthread_create_mirror", strerror(errno));
+	}
 
-	pthread_cleanup_push(&th_cleanup_server, connection);
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	for(i = 0; i < n_workers; i++){
+		if(worker_start(&workers[i]))
+			die("pthread_create_worker", strerror(errno));
+	}
 
-	char buffer[BUF_SIZE];
-	ssize_t bytes;
+	// Backends are checked if there is a choice. One idle connection
+	// upstream stands in for all idling clients, and tells the mirror when
+	// to rebuild
+	if(config.protocol == PROTOCOL_MPD || upstream.n_backends > 1){
+		if(loop_init(&service) < 0)
+			die("loop_init", strerror(errno));
 
-	while((bytes = recv(conn->sock_prx, &buffer, BUF_SIZE, 0)) > 0){
-		if((bytes = send(conn->sock_cli, &buffer, (size_t) bytes, 0)) <= 0)
-			break;
+		if(shards)
+			service.metrics = &service_metrics;
 	}
 
-	conn->srv_hup = TRUE;
+	if(upstream.n_backends > 1){
+		if((checks = calloc((size_t) upstream.n_backends, sizeof(check_t))) == NULL)
+			die("calloc_checks", strerror(errno));
 
-	pthread_cleanup_pop(TRUE);
-	pthread_exit(NULL);
-}
+		for(i = 0; i < upstream.n_backends; i++){
+			check_init(&checks[i], &service, &upstream, &upstream.backends[i]);
+			check_start(&checks[i]);
+		}
+	}
 
-static void *
-th_cleanup_client(void *connection)
-{
-	connection_t *conn = (connection_t*) connection;
+	if(config.protocol == PROTOCOL_MPD){
+		watcher_init(&watcher, &service, &upstream, &on_changed, NULL);
+		watcher_start(&watcher);
 
-	close(conn->sock_cli);
-	if(!conn->srv_hup){
-		pthread_cancel(conn->th_server);
-		pthread_join(conn->th_server, NULL);
-		free(connection);
+		if(config.mirror)
+			mirror_start(&mirror);
 	}
 
-	queue_rem(pthread_self());
+	if(config.protocol == PROTOCOL_MPD || upstream.n_backends > 1){
+		if(loop_start(&service))
+			die("pthread_create_service", strerror(errno));
+	}
 
-	// Call pthread_detach to let pthread reuse (and ultimately free) alloc'ed resources
-	pthread_detach(pthread_self());
-	return NULL;
-}
+	if(shards && exporter_start(&exporter))
+		die("pthread_create_metrics", strerror(errno));
 
-static void *
-th_cleanup_server(void *connection)
-{
-	connection_t *conn = (connection_t*) connection;
+	log_write(LOG_INFO, "main", "Started %d %s worker(s)", n_workers, forward == FORWARD_URING ? "io_uring" : "epoll");
 
-	close(conn->sock_prx);
-	if(conn->srv_hup){
-		pthread_cancel(conn->th_client);
-		pthread_join(conn->th_client, NULL);
-		free(connection);
+	// Workers accept and serve connections by themselves, SIGUSR1 asks
+	// for statistics
+	for(;;){
+		if(sigwait(&signals, &i) == 0)
+			print_stats();
 	}
-
-	queue_rem(pthread_self());
-
-	// Call pthread_detach to let pthread reuse (and ultimately free) alloc'ed resources
-	pthread_detach(pthread_self());
-	return NULL;
 }
+
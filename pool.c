@@ -0,0 +1,512 @@
+/*
+ * pool.c - warm MPD server connections
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "pool.h"
+#include "event.h"
+#include "upstream.h"
+#include "config.h"
+#include "log.h"
+#include "list.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define GREETING "OK MPD "
+
+static void on_connected(void*, int, backend_t*);
+static void on_pooled(handler_t*, uint32_t);
+static void on_idle(timeout_t*);
+static void on_retry(timeout_t*);
+static void on_reap(deferred_t*);
+static void on_wake(deferred_t*);
+
+/**
+ * Set up a pool of size connections. With a limit, no more than limit
+ * connections are open at once, counting those held by sessions.
+ *
+ * */
+void
+pool_init(pool_t *pool, loop_t *loop, upstream_t *upstream, int size, unsigned int idle, int limit)
+{
+	memset(pool, 0, sizeof(pool_t));
+	pool->loop = loop;
+	pool->upstream = upstream;
+	pool->size = (limit > 0 && size > limit) ? limit : size;
+	pool->idle = idle;
+	pool->limit = limit;
+	pool->reserve = limit > 1 ? (limit / POOL_RESERVE > 0 ? limit / POOL_RESERVE : 1) : 0;
+
+	INIT_LIST_HEAD(&pool->ready);
+	INIT_LIST_HEAD(&pool->waiters);
+	INIT_LIST_HEAD(&pool->bulk_waiters);
+	timeout_init(&pool->retry, &on_retry);
+	pool->wake.cb = &on_wake;
+}
+
+/**
+ * Whether another connection may be opened.
+ *
+ * */
+static int
+room(pool_t *pool)
+{
+	return pool->limit == 0 || pool->count + pool->busy < pool->limit;
+}
+
+/**
+ * Whether a bulk request may have a connection: its lane has room, and no
+ * interactive request is waiting.
+ *
+ * */
+static int
+lane(pool_t *pool)
+{
+	return pool->limit == 0 || (pool->bulk < pool->limit - pool->reserve && list_empty(&pool->waiters));
+}
+
+/**
+ * Whether sessions wait for a connection, for a bulk request if bulk is set.
+ * Interactive requests wait ahead of bulk ones.
+ *
+ * */
+int
+pool_queued(pool_t *pool, int bulk)
+{
+	return !list_empty(&pool->waiters) || (bulk && !list_empty(&pool->bulk_waiters));
+}
+
+/**
+ * Let the waiting sessions know a connection may be had, after the current
+ * batch of events.
+ *
+ * */
+static void
+kick(pool_t *pool)
+{
+	if(pool->waking || (list_empty(&pool->waiters) && list_empty(&pool->bulk_waiters)))
+		return;
+
+	pool->waking = TRUE;
+	loop_defer(pool->loop, &pool->wake);
+}
+
+static pooled_t *
+pooled_new(pool_t *pool)
+{
+	pooled_t *p;
+
+	if((p = calloc(1, sizeof(pooled_t))) == NULL)
+		return NULL;
+
+	p->pool = pool;
+	p->h.fd = -1;
+	p->h.cb = &on_pooled;
+	p->reap.cb = &on_reap;
+	INIT_LIST_HEAD(&p->list);
+	timeout_init(&p->idle, &on_idle);
+
+	return p;
+}
+
+static void
+ready(pooled_t *p)
+{
+	pool_t *pool = p->pool;
+
+	list_add_tail(&p->list, &pool->ready);
+	if(pool->idle > 0)
+		loop_timeout(pool->loop, &p->idle, pool->idle);
+
+	kick(pool);
+}
+
+static void
+drop(pooled_t *p)
+{
+	pool_t *pool = p->pool;
+
+	list_del_init(&p->list);
+	loop_untimeout(&p->idle);
+
+	if(p->connect){
+		upstream_cancel(p->connect);
+		p->connect = NULL;
+	}
+
+	// Closing the socket removes it from the epoll set
+	if(p->h.fd >= 0){
+		upstream_close(p->backend, p->h.fd);
+		p->h.fd = -1;
+	}
+
+	pool->count--;
+	if(p->backend->replica)
+		pool->replicas--;
+	loop_defer(pool->loop, &p->reap);
+}
+
+/**
+ * Drop a pooled connection. If failed is set upstream is assumed to be down,
+ * and the pool waits POOL_RETRY before connecting again.
+ *
+ * */
+static void
+discard(pooled_t *p, int failed)
+{
+	pool_t *pool = p->pool;
+
+	drop(p);
+	kick(pool);
+
+	if(failed){
+		if(!pool->backoff){
+			pool->backoff = TRUE;
+			loop_timeout(pool->loop, &pool->retry, POOL_RETRY);
+		}
+	} else {
+		pool_fill(pool);
+	}
+}
+
+/**
+ * Start connecting until the pool holds its configured number of connections.
+ *
+ * */
+void
+pool_fill(pool_t *pool)
+{
+	pooled_t *p;
+	int replica;
+
+	while(!pool->backoff && pool->count < pool->size && room(pool)){
+		if((p = pooled_new(pool)) == NULL)
+			return;
+
+		// Alternate between the primaries and the replicas, which only
+		// sessions speaking the protocol use
+		replica = pool->upstream->protocol == PROTOCOL_MPD && pool->upstream->replicas > 0 && pool->replicas < pool->count - pool->replicas;
+		p->backend = upstream_pick(pool->upstream, replica);
+
+		if((p->connect = upstream_connect(pool->loop, pool->upstream, p->backend, &on_connected, p)) == NULL){
+			print("pool", strerror(errno));
+			free(p);
+			pool->backoff = TRUE;
+			loop_timeout(pool->loop, &pool->retry, POOL_RETRY);
+			return;
+		}
+
+		pool->count++;
+		if(p->backend->replica)
+			pool->replicas++;
+	}
+}
+
+/**
+ * Take a ready connection to a primary, or a replica if replica is set, out
+ * of the pool, for a bulk request if bulk is set. MPD's greeting has already
+ * been read from it. One that carries the given state is preferred, replay
+ * is set if a clean one is taken instead. Connections to backends that went
+ * down since are dropped, and one of no use is closed to make room if the
+ * pool is at its limit. Returns the socket, or -1 if the pool has none.
+ *
+ * */
+int
+pool_take(pool_t *pool, int replica, int bulk, const char *state, size_t state_len, backend_t **backend, int *replay)
+{
+	pooled_t *p, *next, *clean = NULL, *other = NULL;
+	int fd;
+
+	*replay = FALSE;
+	if((bulk && !lane(pool)) || (!pool->serving && pool_queued(pool, bulk)))
+		return -1;
+
+	list_for_each_entry_safe(p, next, &pool->ready, list){
+		if(!__atomic_load_n(&p->backend->up, __ATOMIC_RELAXED)){
+			discard(p, FALSE);
+			continue;
+		}
+
+		if(p->backend->replica == replica && p->state_len == state_len && (state_len == 0 || memcmp(p->state, state, state_len) == 0))
+			break;
+
+		if(p->backend->replica == replica && p->state_len == 0 && clean == NULL)
+			clean = p;
+		else if(other == NULL)
+			other = p;
+	}
+
+	if(&p->list == &pool->ready){
+		if(clean == NULL){
+			if(other != NULL && !room(pool))
+				drop(other);
+			return -1;
+		}
+
+		p = clean;
+		*replay = state_len > 0;
+	}
+
+	list_del_init(&p->list);
+	loop_untimeout(&p->idle);
+	loop_del(pool->loop, &p->h);
+
+	fd = p->h.fd;
+	*backend = p->backend;
+	p->h.fd = -1;
+
+	pool->count--;
+	pool->busy++;
+	pool->bulk += bulk;
+	if(p->backend->replica)
+		pool->replicas--;
+	loop_defer(pool->loop, &p->reap);
+
+	pool_fill(pool);
+
+	return fd;
+}
+
+/**
+ * Hand a connection back once a session is done with it, along with the
+ * state the session set up on it. There must be no request outstanding on
+ * it. Without a limit it is closed instead if the pool is full, and in any
+ * case if its backend is down.
+ *
+ * */
+void
+pool_put(pool_t *pool, int bulk, int fd, backend_t *backend, const char *state, size_t state_len)
+{
+	pooled_t *p;
+
+	pool->busy--;
+	pool->bulk -= bulk;
+
+	if((pool->limit == 0 && pool->count >= pool->size) || !__atomic_load_n(&backend->up, __ATOMIC_RELAXED) ||
+			(p = pooled_new(pool)) == NULL){
+		upstream_close(backend, fd);
+		kick(pool);
+		return;
+	}
+
+	if(state_len > 0){
+		if((p->state = malloc(state_len)) == NULL){
+			upstream_close(backend, fd);
+			free(p);
+			kick(pool);
+			return;
+		}
+
+		memcpy(p->state, state, state_len);
+		p->state_len = state_len;
+	}
+
+	p->h.fd = fd;
+	p->backend = backend;
+
+	if(loop_add(pool->loop, &p->h, EPOLLIN | EPOLLRDHUP | EPOLLET) < 0){
+		upstream_close(backend, fd);
+		free(p->state);
+		free(p);
+		kick(pool);
+		return;
+	}
+
+	pool->count++;
+	if(backend->replica)
+		pool->replicas++;
+	ready(p);
+}
+
+/**
+ * Count a connection a session opens itself as busy. Returns -1 if the pool
+ * is at its limit, the lane of bulk requests is full or others wait already,
+ * unless force is set.
+ *
+ * */
+int
+pool_reserve(pool_t *pool, int bulk, int force)
+{
+	if(!force && (!room(pool) || (bulk && !lane(pool)) || (!pool->serving && pool_queued(pool, bulk))))
+		return -1;
+
+	pool->busy++;
+	pool->bulk += bulk;
+	return 0;
+}
+
+/**
+ * A session closed the connection it held, or gave up on opening one.
+ *
+ * */
+void
+pool_drop(pool_t *pool, int bulk)
+{
+	pool->busy--;
+	pool->bulk -= bulk;
+	kick(pool);
+}
+
+/**
+ * Queue a session until a connection may be had, behind the other requests
+ * of its kind.
+ *
+ * */
+void
+pool_wait(pool_t *pool, waiter_t *waiter)
+{
+	list_add_tail(&waiter->list, waiter->bulk ? &pool->bulk_waiters : &pool->waiters);
+}
+
+/**
+ * Read (the rest of) MPD's greeting. Returns 1 once the whole line is in,
+ * 0 if more is to come and -1 if the connection is unusable.
+ *
+ * */
+static int
+read_greeting(pooled_t *p)
+{
+	ssize_t n;
+
+	for(;;){
+		n = recv(p->h.fd, p->greeting + p->len, GREETING_SIZE - p->len, MSG_DONTWAIT);
+		if(n <= 0)
+			return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+
+		p->len += (size_t) n;
+
+		if(p->greeting[p->len - 1] == '\n')
+			break;
+
+		if(memchr(p->greeting, '\n', p->len) != NULL || p->len == GREETING_SIZE)
+			return -1;
+	}
+
+	if(p->len < sizeof(GREETING) - 1 || strncmp(p->greeting, GREETING, sizeof(GREETING) - 1) != 0)
+		return -1;
+
+	return 1;
+}
+
+/**
+ * Callbacks
+ *
+ * */
+static void
+on_connected(void *data, int fd, backend_t *backend)
+{
+	pooled_t *p = (pooled_t*) data;
+
+	p->connect = NULL;
+	p->backend = backend;
+
+	if(fd < 0){
+		print("pool", strerror(errno));
+		discard(p, TRUE);
+		return;
+	}
+
+	p->h.fd = fd;
+
+	// Adding the socket reports the greeting if it has already arrived
+	if(loop_add(p->pool->loop, &p->h, EPOLLIN | EPOLLRDHUP | EPOLLET) < 0){
+		print("pool", strerror(errno));
+		discard(p, TRUE);
+	}
+}
+
+static void
+on_pooled(handler_t *handler, uint32_t events)
+{
+	pooled_t *p = container_of(handler, pooled_t, h);
+	pool_t *pool = p->pool;
+	int ret;
+
+	// Discarded earlier in this batch of events
+	if(handler->fd < 0)
+		return;
+
+	// Idle connections are not supposed to hear from MPD, it is closing them
+	if(!list_empty(&p->list)){
+		discard(p, FALSE);
+		return;
+	}
+
+	if((ret = read_greeting(p)) < 0){
+		print("pool", "No greeting from MPD server");
+		discard(p, TRUE);
+		return;
+	}
+
+	if(ret == 0)
+		return;
+
+	memcpy(pool->greeting, p->greeting, p->len);
+	pool->greeting_len = p->len;
+
+	ready(p);
+}
+
+static void
+on_idle(timeout_t *timeout)
+{
+	// Replace the connection before MPD's connection_timeout closes it
+	discard(container_of(timeout, pooled_t, idle), FALSE);
+}
+
+static void
+on_retry(timeout_t *timeout)
+{
+	pool_t *pool = container_of(timeout, pool_t, retry);
+
+	pool->backoff = FALSE;
+	pool_fill(pool);
+}
+
+static void
+on_reap(deferred_t *deferred)
+{
+	pooled_t *p = container_of(deferred, pooled_t, reap);
+
+	free(p->state);
+	free(p);
+}
+
+static void
+on_wake(deferred_t *deferred)
+{
+	pool_t *pool = container_of(deferred, pool_t, wake);
+	waiter_t *waiter;
+
+	pool->waking = FALSE;
+
+	// Waiters going back in line wait for the next connection
+	while(room(pool) || !list_empty(&pool->ready)){
+		if(!list_empty(&pool->waiters))
+			waiter = list_first_entry(&pool->waiters, waiter_t, list);
+		else if(!list_empty(&pool->bulk_waiters) && lane(pool))
+			waiter = list_first_entry(&pool->bulk_waiters, waiter_t, list);
+		else
+			break;
+
+		list_del_init(&waiter->list);
+
+		// The waiter is first in line, it does not queue behind the others
+		pool->serving = TRUE;
+		waiter->cb(waiter);
+		pool->serving = FALSE;
+
+		if(!list_empty(&waiter->list))
+			break;
+	}
+}
@@ -0,0 +1,115 @@
+/*
+ * pool.h - warm MPD server connections
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <netdb.h>
+
+#include "event.h"
+#include "upstream.h"
+#include "list.h"
+
+// Longest greeting accepted from MPD ("OK MPD x.y.z\n")
+#define GREETING_SIZE 64
+
+// Milliseconds to wait before refilling after MPD could not be reached
+#define POOL_RETRY 1000
+
+// With a limit, one in this many connections is kept from bulk requests
+#define POOL_RESERVE 4
+
+struct pool_t;
+
+/**
+ * A connection that is established, or being established, ahead of a client.
+ * Once MPD's greeting is read the connection sits on the pool's ready list
+ * until it is taken or idles out. A connection a session gave back carries
+ * the state the session set up on it, as the commands that did.
+ *
+ * */
+typedef struct pooled_t {
+	handler_t h;
+	struct list_head list;
+	struct pool_t *pool;
+
+	connect_t *connect;
+	backend_t *backend;
+
+	char *state;
+	size_t state_len;
+
+	char greeting[GREETING_SIZE];
+	size_t len;
+
+	timeout_t idle;
+	deferred_t reap;
+} pooled_t;
+
+/**
+ * A session waiting for a connection, cb is called once the pool has one or
+ * may open one. Bulk is set for a request that may take long, such as a
+ * listing of the database.
+ *
+ * */
+typedef struct waiter_t {
+	struct list_head list;
+	int bulk;
+	void (*cb)(struct waiter_t *waiter);
+} waiter_t;
+
+/**
+ * Per-worker pool of connections to upstream. The last greeting read is kept
+ * so it can be replayed to a client as soon as it is handed a connection.
+ * With replicas configured about half of the connections go to them.
+ *
+ * Connections held by sessions are counted as busy. With a limit, the pooled
+ * and busy connections together stay within it, connections given back are
+ * kept whatever the size, and sessions wait their turn. Interactive requests
+ * go first, and bulk requests are held to a lane that leaves reserve
+ * connections free for them. Sessions do not get ahead of those waiting for
+ * the same kind of request.
+ *
+ * */
+typedef struct pool_t {
+	loop_t *loop;
+	upstream_t *upstream;
+
+	int size;
+	int count;
+	int replicas;
+	unsigned int idle;
+
+	int limit;
+	int reserve;
+	int busy;
+	int bulk;
+	struct list_head waiters;
+	struct list_head bulk_waiters;
+	deferred_t wake;
+	int waking;
+	int serving;
+
+	struct list_head ready;
+	timeout_t retry;
+	int backoff;
+
+	char greeting[GREETING_SIZE];
+	size_t greeting_len;
+} pool_t;
+
+void pool_init(pool_t *pool, loop_t *loop, upstream_t *upstream, int size, unsigned int idle, int limit);
+void pool_fill(pool_t *pool);
+int pool_take(pool_t *pool, int replica, int bulk, const char *state, size_t state_len, backend_t **backend, int *replay);
+void pool_put(pool_t *pool, int bulk, int fd, backend_t *backend, const char *state, size_t state_len);
+int pool_reserve(pool_t *pool, int bulk, int force);
+void pool_drop(pool_t *pool, int bulk);
+void pool_wait(pool_t *pool, waiter_t *waiter);
+int pool_queued(pool_t *pool, int bulk);
+
+#endif
@@ -0,0 +1,606 @@
+/*
+ * protocol.c - MPD line protocol framing
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// Indexed by the subsystem's bit in an idle mask
+static const char *subsystems[] = {
+	"database", "update", "stored_playlist", "playlist", "player", "mixer", "output",
+	"options", "partition", "sticker", "subscription", "message", "neighbor", "mount",
+};
+
+// Every command MPD knows, sorted for mpd_command_index
+static const char *commands[MPD_COMMANDS] = {
+	"add", "addid", "addtagid", "albumart", "binarylimit", "channels", "clear", "clearerror",
+	"cleartagid", "close", "command_list_begin", "command_list_ok_begin", "commands", "config",
+	"consume", "count", "crossfade", "currentsong", "decoders", "delete", "deleteid",
+	"delpartition", "disableoutput", "enableoutput", "find", "findadd", "getfingerprint",
+	"getvol", "idle", "kill", "list", "listall", "listallinfo", "listfiles", "listmounts",
+	"listneighbors", "listpartitions", "listplaylist", "listplaylistinfo", "listplaylists",
+	"load", "lsinfo", "mixrampdb", "mixrampdelay", "mount", "move", "moveid", "moveoutput",
+	"newpartition", "next", "noidle", "notcommands", "outputs", "outputset", "partition",
+	"password", "pause", "ping", "play", "playid", "playlist", "playlistadd", "playlistclear",
+	"playlistdelete", "playlistfind", "playlistid", "playlistinfo", "playlistmove",
+	"playlistsearch", "plchanges", "plchangesposid", "previous", "prio", "prioid", "protocol",
+	"random", "rangeid", "readcomments", "readmessages", "readpicture", "rename", "repeat",
+	"replay_gain_mode", "replay_gain_status", "rescan", "rm", "save", "search", "searchadd",
+	"searchaddpl", "searchcount", "searchplaylist", "seek", "seekcur", "seekid", "sendmessage",
+	"setvol", "shuffle", "single", "stats", "status", "sticker", "stickernames", "stop",
+	"subscribe", "swap", "swapid", "tagtypes", "toggleoutput", "unmount", "unsubscribe",
+	"update", "urlhandlers", "volume",
+};
+
+// Commands that only query MPD
+static const char *readonly[] = {
+	"ping", "status", "currentsong", "stats", "outputs", "decoders", "replay_gain_status",
+	"playlistinfo", "playlistid", "playlistfind", "playlistsearch", "plchanges", "plchangesposid",
+	"listplaylists", "listplaylist", "listplaylistinfo", "lsinfo", "listall", "listallinfo",
+	"listfiles", "find", "search", "count", "list", "albumart", "readpicture", "readcomments",
+	"getfingerprint", "commands", "notcommands", "urlhandlers", "listmounts", "listneighbors",
+	"channels", "config",
+};
+
+// Subsystems MPD reports as changed after a command that changes its state.
+// Commands that only change state of their connection change none, writes
+// missing from the table may change any
+static const struct {
+	const char *command;
+	unsigned int mask;
+} touches[] = {
+	{ "play", MPD_IDLE_PLAYER }, { "playid", MPD_IDLE_PLAYER }, { "pause", MPD_IDLE_PLAYER },
+	{ "stop", MPD_IDLE_PLAYER }, { "next", MPD_IDLE_PLAYER }, { "previous", MPD_IDLE_PLAYER },
+	{ "seek", MPD_IDLE_PLAYER }, { "seekid", MPD_IDLE_PLAYER }, { "seekcur", MPD_IDLE_PLAYER },
+	{ "clearerror", MPD_IDLE_PLAYER },
+	{ "setvol", MPD_IDLE_MIXER }, { "volume", MPD_IDLE_MIXER },
+	{ "random", MPD_IDLE_OPTIONS }, { "repeat", MPD_IDLE_OPTIONS }, { "single", MPD_IDLE_OPTIONS },
+	{ "consume", MPD_IDLE_OPTIONS }, { "crossfade", MPD_IDLE_OPTIONS },
+	{ "mixrampdb", MPD_IDLE_OPTIONS }, { "mixrampdelay", MPD_IDLE_OPTIONS },
+	{ "replay_gain_mode", MPD_IDLE_OPTIONS },
+	{ "add", MPD_IDLE_PLAYLIST }, { "addid", MPD_IDLE_PLAYLIST }, { "addtagid", MPD_IDLE_PLAYLIST },
+	{ "cleartagid", MPD_IDLE_PLAYLIST }, { "clear", MPD_IDLE_PLAYLIST },
+	{ "delete", MPD_IDLE_PLAYLIST }, { "deleteid", MPD_IDLE_PLAYLIST },
+	{ "move", MPD_IDLE_PLAYLIST }, { "moveid", MPD_IDLE_PLAYLIST },
+	{ "shuffle", MPD_IDLE_PLAYLIST }, { "swap", MPD_IDLE_PLAYLIST }, { "swapid", MPD_IDLE_PLAYLIST },
+	{ "prio", MPD_IDLE_PLAYLIST }, { "prioid", MPD_IDLE_PLAYLIST }, { "rangeid", MPD_IDLE_PLAYLIST },
+	{ "load", MPD_IDLE_PLAYLIST }, { "findadd", MPD_IDLE_PLAYLIST }, { "searchadd", MPD_IDLE_PLAYLIST },
+	{ "save", MPD_IDLE_STORED_PLAYLIST }, { "rm", MPD_IDLE_STORED_PLAYLIST },
+	{ "rename", MPD_IDLE_STORED_PLAYLIST }, { "playlistadd", MPD_IDLE_STORED_PLAYLIST },
+	{ "playlistclear", MPD_IDLE_STORED_PLAYLIST }, { "playlistdelete", MPD_IDLE_STORED_PLAYLIST },
+	{ "playlistmove", MPD_IDLE_STORED_PLAYLIST }, { "searchaddpl", MPD_IDLE_STORED_PLAYLIST },
+	{ "enableoutput", MPD_IDLE_OUTPUT }, { "disableoutput", MPD_IDLE_OUTPUT },
+	{ "toggleoutput", MPD_IDLE_OUTPUT }, { "outputset", MPD_IDLE_OUTPUT },
+	{ "moveoutput", MPD_IDLE_OUTPUT | MPD_IDLE_PARTITION },
+	{ "newpartition", MPD_IDLE_PARTITION }, { "delpartition", MPD_IDLE_PARTITION },
+	{ "update", MPD_IDLE_UPDATE }, { "rescan", MPD_IDLE_UPDATE },
+	{ "sticker", MPD_IDLE_STICKER },
+	{ "subscribe", MPD_IDLE_SUBSCRIPTION }, { "unsubscribe", MPD_IDLE_SUBSCRIPTION },
+	{ "sendmessage", MPD_IDLE_MESSAGE },
+	{ "mount", MPD_IDLE_MOUNT }, { "unmount", MPD_IDLE_MOUNT },
+	{ "idle", 0 }, { "noidle", 0 }, { "password", 0 }, { "tagtypes", 0 }, { "binarylimit", 0 },
+	{ "protocol", 0 }, { "partition", 0 }, { "readmessages", 0 }, { "close", 0 },
+};
+
+// Queries of the music library, which replicas answer as well as a primary
+static const char *library[] = {
+	"lsinfo", "listall", "listallinfo", "listfiles", "find", "search", "count", "list",
+	"albumart", "readpicture", "readcomments", "getfingerprint",
+};
+
+// Commands whose effect is bound to the connection they are sent on
+static const char *stateful[] = {
+	"password", "tagtypes", "binarylimit", "subscribe", "unsubscribe", "readmessages",
+	"partition", "protocol",
+};
+
+// Stateful commands that set up the same state when sent again on another
+// connection, unlike subscriptions which have messages queued on theirs
+static const char *replayable[] = {
+	"password", "tagtypes", "binarylimit", "partition", "protocol",
+};
+
+/**
+ * Append a line segment to a line buffer, keeping what fits.
+ *
+ * */
+static void
+line_add(char *line, size_t *line_len, const char *buf, size_t len)
+{
+	size_t room = MPD_LINE_SIZE - 1 - *line_len;
+
+	if(len > room)
+		len = room;
+
+	memcpy(line + *line_len, buf, len);
+	*line_len += len;
+	line[*line_len] = '\0';
+}
+
+/**
+ * Strip a trailing carriage return, some clients end lines with CRLF.
+ *
+ * */
+static size_t
+line_trim(char *line, size_t len)
+{
+	if(len > 0 && line[len - 1] == '\r')
+		line[--len] = '\0';
+
+	return len;
+}
+
+/**
+ * Whether a line consists of word, optionally followed by arguments.
+ *
+ * */
+static int
+line_is(const char *line, size_t len, const char *word)
+{
+	size_t n = strlen(word);
+
+	return len >= n && strncmp(line, word, n) == 0 && (len == n || line[n] == ' ');
+}
+
+/**
+ * Type of the request starting with line: MPD_LIST for the start of a command
+ * list, MPD_IDLE or MPD_NOIDLE, MPD_COMMAND for anything else.
+ *
+ * */
+int
+mpd_command_type(const char *line, size_t len)
+{
+	if(len > 0 && line[len - 1] == '\r')
+		len--;
+
+	if(line_is(line, len, "command_list_begin") || line_is(line, len, "command_list_ok_begin"))
+		return MPD_LIST;
+	if(line_is(line, len, "idle"))
+		return MPD_IDLE;
+	if(line_is(line, len, "noidle"))
+		return MPD_NOIDLE;
+
+	return MPD_COMMAND;
+}
+
+/**
+ * Index of the command on line in the table of MPD's commands, MPD_COMMANDS
+ * if MPD does not know it.
+ *
+ * */
+int
+mpd_command_index(const char *line, size_t len)
+{
+	int lo = 0, hi = MPD_COMMANDS - 1, mid, cmp;
+	size_t n;
+
+	for(n = 0; n < len && line[n] != ' ' && line[n] != '\r'; n++);
+
+	while(lo <= hi){
+		mid = (lo + hi) / 2;
+
+		if((cmp = strncmp(commands[mid], line, n)) == 0)
+			cmp = commands[mid][n] != '\0';
+
+		if(cmp == 0)
+			return mid;
+		if(cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return MPD_COMMANDS;
+}
+
+/**
+ * Name of a command by its index, "other" for MPD_COMMANDS.
+ *
+ * */
+const char *
+mpd_command_name(int index)
+{
+	return index >= 0 && index < MPD_COMMANDS ? commands[index] : "other";
+}
+
+/**
+ * Split a command line into its arguments in place, undoing quotes and
+ * backslash escapes. The line must have room for a terminator after len.
+ * Returns the number of arguments, or -1 if there are more than max or a
+ * quote is not closed.
+ *
+ * */
+int
+mpd_split(char *line, size_t len, char **argv, int max)
+{
+	size_t i = 0;
+	int argc = 0;
+	char *out;
+
+	for(;;){
+		while(i < len && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r'))
+			i++;
+
+		if(i >= len)
+			return argc;
+
+		if(argc == max)
+			return -1;
+
+		out = argv[argc++] = line + i;
+
+		if(line[i] == '"'){
+			for(i++; i < len && line[i] != '"'; i++){
+				if(line[i] == '\\' && i + 1 < len)
+					i++;
+				*out++ = line[i];
+			}
+
+			if(i++ >= len)
+				return -1;
+		} else {
+			while(i < len && line[i] != ' ' && line[i] != '\t' && line[i] != '\r')
+				*out++ = line[i++];
+
+			// The separator becomes the terminator
+			i++;
+		}
+
+		*out = '\0';
+	}
+}
+
+static unsigned int
+subsystem_mask(const char *args, size_t len)
+{
+	unsigned int mask = 0, i;
+	size_t n;
+
+	for(;;){
+		while(len > 0 && (*args == ' ' || *args == '"' || *args == '\r')){
+			args++;
+			len--;
+		}
+
+		if(len == 0)
+			break;
+
+		for(n = 0; n < len && args[n] != ' ' && args[n] != '"' && args[n] != '\r'; n++);
+
+		for(i = 0; i < sizeof(subsystems) / sizeof(subsystems[0]); i++){
+			if(strlen(subsystems[i]) == n && strncmp(args, subsystems[i], n) == 0)
+				mask |= 1U << i;
+		}
+
+		args += n;
+		len -= n;
+	}
+
+	return mask;
+}
+
+/**
+ * Subsystems in the arguments of an idle command (the line without "idle").
+ * No arguments means all of them, unknown names are ignored.
+ *
+ * */
+unsigned int
+mpd_idle_mask(const char *args, size_t len)
+{
+	unsigned int mask = subsystem_mask(args, len);
+
+	return mask ? mask : MPD_IDLE_ALL;
+}
+
+/**
+ * Format an idle response reporting the subsystems in mask. Returns its
+ * length, the buffer should hold MPD_IDLE_SIZE bytes.
+ *
+ * */
+size_t
+mpd_idle_format(char *buf, size_t size, unsigned int mask)
+{
+	size_t len = 0;
+	unsigned int i;
+	int n;
+
+	for(i = 0; i < sizeof(subsystems) / sizeof(subsystems[0]); i++){
+		if(!(mask & (1U << i)))
+			continue;
+
+		if((n = snprintf(buf + len, size - len, "changed: %s\n", subsystems[i])) < 0 || (size_t) n >= size - len)
+			return 0;
+		len += (size_t) n;
+	}
+
+	if((n = snprintf(buf + len, size - len, "OK\n")) < 0 || (size_t) n >= size - len)
+		return 0;
+
+	return len + (size_t) n;
+}
+
+/**
+ * Subsystem reported by a "changed:" line of an idle response, 0 if the
+ * line is something else.
+ *
+ * */
+unsigned int
+mpd_changed(const char *line, size_t len)
+{
+	if(!line_is(line, len, "changed:"))
+		return 0;
+
+	return subsystem_mask(line + sizeof("changed:") - 1, len - (sizeof("changed:") - 1));
+}
+
+/**
+ * Requests
+ *
+ * */
+void
+mpd_request_init(mpd_request_t *req)
+{
+	memset(req, 0, sizeof(mpd_request_t));
+	req->first = TRUE;
+}
+
+static int
+is_stateful(const char *line, size_t len)
+{
+	unsigned int i;
+
+	for(i = 0; i < sizeof(stateful) / sizeof(stateful[0]); i++){
+		if(line_is(line, len, stateful[i]))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Whether the command on line only queries MPD, without changing its state.
+ *
+ * */
+int
+mpd_readonly(const char *line, size_t len)
+{
+	unsigned int i;
+
+	if(len > 0 && line[len - 1] == '\r')
+		len--;
+
+	for(i = 0; i < sizeof(readonly) / sizeof(readonly[0]); i++){
+		if(line_is(line, len, readonly[i]))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Subsystems the command on line may change, 0 if it only queries MPD.
+ *
+ * */
+unsigned int
+mpd_touches(const char *line, size_t len)
+{
+	unsigned int i;
+
+	if(mpd_readonly(line, len))
+		return 0;
+
+	if(len > 0 && line[len - 1] == '\r')
+		len--;
+
+	for(i = 0; i < sizeof(touches) / sizeof(touches[0]); i++){
+		if(line_is(line, len, touches[i].command))
+			return touches[i].mask;
+	}
+
+	return MPD_IDLE_ALL;
+}
+
+/**
+ * Whether the command on line only queries the music library.
+ *
+ * */
+int
+mpd_library(const char *line, size_t len)
+{
+	unsigned int i;
+
+	if(len > 0 && line[len - 1] == '\r')
+		len--;
+
+	for(i = 0; i < sizeof(library) / sizeof(library[0]); i++){
+		if(line_is(line, len, library[i]))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Whether the stateful command on line may be replayed on another connection.
+ *
+ * */
+int
+mpd_replayable(const char *line, size_t len)
+{
+	unsigned int i;
+
+	if(len > 0 && line[len - 1] == '\r')
+		len--;
+
+	for(i = 0; i < sizeof(replayable) / sizeof(replayable[0]); i++){
+		if(line_is(line, len, replayable[i]))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+request_line(mpd_request_t *req)
+{
+	size_t len = line_trim(req->cur, req->cur_len);
+
+	// Commands, as opposed to the lines delimiting a list
+	if(mpd_command_type(req->cur, len) != MPD_LIST && !line_is(req->cur, len, "command_list_end")){
+		if(is_stateful(req->cur, len))
+			req->stateful = TRUE;
+		req->touches |= mpd_touches(req->cur, len);
+		if(line_is(req->cur, len, "rescan"))
+			req->rescans = TRUE;
+		if(line_is(req->cur, len, "partition"))
+			req->partitions = TRUE;
+	}
+
+	if(req->first){
+		req->first = FALSE;
+		memcpy(req->line, req->cur, len + 1);
+		req->line_len = len;
+
+		if((req->type = mpd_command_type(req->cur, len)) == MPD_LIST){
+			req->list_ok = line_is(req->cur, len, "command_list_ok_begin");
+		} else {
+			req->commands = 1;
+			req->done = TRUE;
+		}
+	} else if(line_is(req->cur, len, "command_list_end")){
+		req->done = TRUE;
+	} else {
+		req->commands++;
+	}
+
+	req->cur_len = 0;
+	req->cur[0] = '\0';
+}
+
+/**
+ * Feed received data to the parser. Returns the number of bytes belonging to
+ * the current request: all of them unless the request ended within buf, in
+ * which case done is set and the remainder starts the next request.
+ * A finished request stays available until the next call.
+ *
+ * */
+size_t
+mpd_request_feed(mpd_request_t *req, const char *buf, size_t len)
+{
+	const char *nl;
+	size_t off = 0, n;
+
+	if(req->done)
+		mpd_request_init(req);
+
+	while(off < len && !req->done){
+		if((nl = memchr(buf + off, '\n', len - off)) == NULL){
+			line_add(req->cur, &req->cur_len, buf + off, len - off);
+			return len;
+		}
+
+		n = (size_t) (nl - (buf + off));
+		line_add(req->cur, &req->cur_len, buf + off, n);
+		off += n + 1;
+
+		request_line(req);
+	}
+
+	return off;
+}
+
+/**
+ * Responses
+ *
+ * */
+void
+mpd_response_init(mpd_response_t *res)
+{
+	memset(res, 0, sizeof(mpd_response_t));
+}
+
+static void
+response_reset(mpd_response_t *res)
+{
+	void (*line_cb)(mpd_response_t*, const char*, size_t) = res->line_cb;
+	void *data = res->data;
+
+	mpd_response_init(res);
+	res->line_cb = line_cb;
+	res->data = data;
+}
+
+static void
+response_line(mpd_response_t *res)
+{
+	size_t len = line_trim(res->cur, res->cur_len);
+
+	res->lines++;
+
+	// The greeting (OK MPD x.y.z) ends a response of its own
+	if(line_is(res->cur, len, "OK")){
+		res->status = MPD_OK;
+		res->done = TRUE;
+		return;
+	}
+
+	if(line_is(res->cur, len, "ACK")){
+		res->status = MPD_ACK;
+		res->done = TRUE;
+		return;
+	}
+
+	if(line_is(res->cur, len, "binary:"))
+		res->binary = (size_t) strtoull(res->cur + sizeof("binary:") - 1, NULL, 10);
+
+	if(res->line_cb)
+		res->line_cb(res, res->cur, len);
+
+	res->cur_len = 0;
+	res->cur[0] = '\0';
+}
+
+/**
+ * Same as mpd_request_feed, for the response to a request.
+ *
+ * */
+size_t
+mpd_response_feed(mpd_response_t *res, const char *buf, size_t len)
+{
+	const char *nl;
+	size_t off = 0, n;
+
+	if(res->done)
+		response_reset(res);
+
+	while(off < len && !res->done){
+		if(res->binary > 0){
+			n = len - off < res->binary ? len - off : res->binary;
+			res->binary -= n;
+			off += n;
+			continue;
+		}
+
+		if((nl = memchr(buf + off, '\n', len - off)) == NULL){
+			line_add(res->cur, &res->cur_len, buf + off, len - off);
+			return len;
+		}
+
+		n = (size_t) (nl - (buf + off));
+		line_add(res->cur, &res->cur_len, buf + off, n);
+		off += n + 1;
+
+		response_line(res);
+	}
+
+	return off;
+}
@@ -0,0 +1,122 @@
+/*
+ * protocol.h - MPD line protocol framing
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+
+// Longest line kept for inspection, longer lines are framed but truncated
+#define MPD_LINE_SIZE 256
+
+// Request types
+#define MPD_COMMAND 0
+#define MPD_LIST 1
+#define MPD_IDLE 2
+#define MPD_NOIDLE 3
+
+// Commands MPD knows, see mpd_command_index
+#define MPD_COMMANDS 114
+
+// Response status
+#define MPD_OK 0
+#define MPD_ACK 1
+
+// Idle subsystems, as a mask
+#define MPD_IDLE_DATABASE (1U << 0)
+#define MPD_IDLE_UPDATE (1U << 1)
+#define MPD_IDLE_STORED_PLAYLIST (1U << 2)
+#define MPD_IDLE_PLAYLIST (1U << 3)
+#define MPD_IDLE_PLAYER (1U << 4)
+#define MPD_IDLE_MIXER (1U << 5)
+#define MPD_IDLE_OUTPUT (1U << 6)
+#define MPD_IDLE_OPTIONS (1U << 7)
+#define MPD_IDLE_PARTITION (1U << 8)
+#define MPD_IDLE_STICKER (1U << 9)
+#define MPD_IDLE_SUBSCRIPTION (1U << 10)
+#define MPD_IDLE_MESSAGE (1U << 11)
+#define MPD_IDLE_NEIGHBOR (1U << 12)
+#define MPD_IDLE_MOUNT (1U << 13)
+#define MPD_IDLE_ALL ((1U << 14) - 1)
+
+// Longest idle response, reporting all subsystems
+#define MPD_IDLE_SIZE 256
+
+/**
+ * Frames client requests: a single command line, or a command list from
+ * command_list_begin / command_list_ok_begin up to command_list_end.
+ * Data is fed as it is received, in chunks of any size; the parser never
+ * allocates and only remembers the first line of the request.
+ *
+ * */
+typedef struct mpd_request_t {
+	int type;
+	int list_ok;
+	int done;
+	unsigned int commands;
+
+	// Set if a command changes state of the connection itself. Subsystems
+	// of MPD the commands may change
+	int stateful;
+	unsigned int touches;
+
+	// Set if a command has MPD read every file again, changed or not
+	int rescans;
+
+	// Set if a command switches to a partition, whose changes only its
+	// connection is told about
+	int partitions;
+
+	// First line, NUL terminated and without the newline
+	char line[MPD_LINE_SIZE];
+	size_t line_len;
+
+	// Start of the line being framed
+	char cur[MPD_LINE_SIZE];
+	size_t cur_len;
+	int first;
+} mpd_request_t;
+
+/**
+ * Frames server responses, which end with an OK or ACK line. Raw payloads
+ * announced by a binary: line are skipped over, whatever they contain.
+ *
+ * */
+typedef struct mpd_response_t {
+	int status;
+	int done;
+	unsigned int lines;
+	size_t binary;
+
+	// Start of the line being framed, the OK or ACK line once done
+	char cur[MPD_LINE_SIZE];
+	size_t cur_len;
+
+	// Optionally called for every line of a response but the last one
+	void (*line_cb)(struct mpd_response_t *res, const char *line, size_t len);
+	void *data;
+} mpd_response_t;
+
+void mpd_request_init(mpd_request_t *req);
+size_t mpd_request_feed(mpd_request_t *req, const char *buf, size_t len);
+
+void mpd_response_init(mpd_response_t *res);
+size_t mpd_response_feed(mpd_response_t *res, const char *buf, size_t len);
+
+int mpd_command_type(const char *line, size_t len);
+int mpd_command_index(const char *line, size_t len);
+const char *mpd_command_name(int index);
+int mpd_split(char *line, size_t len, char **argv, int max);
+int mpd_readonly(const char *line, size_t len);
+unsigned int mpd_touches(const char *line, size_t len);
+int mpd_library(const char *line, size_t len);
+int mpd_replayable(const char *line, size_t len);
+unsigned int mpd_idle_mask(const char *args, size_t len);
+unsigned int mpd_changed(const char *line, size_t len);
+size_t mpd_idle_format(char *buf, size_t size, unsigned int mask);
+
+#endif
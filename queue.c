@@ -15,6 +15,9 @@
 #include "queue.h"
 #include "list.h"
 
+struct queue *q;
+pthread_mutex_t q_mutex;
+
 static void
 die(const char *comp, const char *msg)
 {
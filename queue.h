@@ -17,8 +17,8 @@ struct queue {
 	pthread_t th_id;
 };
 
-struct queue *q;
-pthread_mutex_t q_mutex;
+extern struct queue *q;
+extern pthread_mutex_t q_mutex;
 
 void queue_init();
 void queue_destroy();
@@ -0,0 +1,191 @@
+/*
+ * ring.c - per-thread record rings and their background writer
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+
+#include "ring.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// Records start on a multiple of RING_ALIGN bytes, after their length
+#define RING_ALIGN sizeof(uint64_t)
+
+// Length of the space left at the end of the ring when the next record does
+// not fit in it, the record starts over at the beginning
+#define RING_SKIP UINT64_MAX
+
+static size_t
+frame(size_t len)
+{
+	return RING_ALIGN + ((len + RING_ALIGN - 1) & ~(RING_ALIGN - 1));
+}
+
+void
+ring_init(ring_writer_t *writer, long interval, void (*on_record)(void*, const char*, size_t),
+		void (*on_flush)(void*, unsigned long), void *arg)
+{
+	memset(writer, 0, sizeof(ring_writer_t));
+
+	writer->interval = interval;
+	writer->on_record = on_record;
+	writer->on_flush = on_flush;
+	writer->arg = arg;
+
+	pthread_mutex_init(&writer->lock, NULL);
+}
+
+/**
+ * A ring of size bytes, a power of two, drained by writer. Rings may be
+ * added while the writer runs, and are never freed.
+ *
+ * */
+ring_t *
+ring_new(ring_writer_t *writer, size_t size)
+{
+	ring_t *ring;
+
+	if((ring = calloc(1, sizeof(ring_t) + size)) == NULL)
+		return NULL;
+
+	ring->size = size;
+
+	ring->next = __atomic_load_n(&writer->rings, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&writer->rings, &ring->next, ring, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return ring;
+}
+
+/**
+ * Queue a record of head followed by data for the writer, from the ring's
+ * thread, without waiting for it. A record that does not fit is dropped
+ * whole and counted. Returns -1 if it was dropped.
+ *
+ * */
+int
+ring_write(ring_t *ring, const void *head, size_t head_len, const void *data, size_t len)
+{
+	uint64_t at = ring->head, word;
+	size_t off = at & (ring->size - 1), need = frame(head_len + len), end = ring->size - off;
+
+	if(need > end)
+		need += end;
+
+	if(need > ring->size - (at - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))){
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if(frame(head_len + len) > end){
+		word = RING_SKIP;
+		memcpy(ring->data + off, &word, sizeof word);
+		at += end;
+		off = 0;
+	}
+
+	word = head_len + len;
+	memcpy(ring->data + off, &word, sizeof word);
+	memcpy(ring->data + off + RING_ALIGN, head, head_len);
+	if(len > 0)
+		memcpy(ring->data + off + RING_ALIGN + head_len, data, len);
+
+	__atomic_store_n(&ring->head, at + frame(head_len + len), __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * Hand the records of all rings to on_record. Records of a ring keep their
+ * order, those of different rings may be interleaved differently than made.
+ *
+ * */
+void
+ring_flush(ring_writer_t *writer)
+{
+	unsigned long dropped = 0;
+	uint64_t head, tail, len;
+	size_t off;
+	ring_t *ring;
+
+	pthread_mutex_lock(&writer->lock);
+
+	for(ring = __atomic_load_n(&writer->rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+		for(tail = ring->tail; tail != head; ){
+			off = tail & (ring->size - 1);
+			memcpy(&len, ring->data + off, sizeof len);
+
+			if(len == RING_SKIP){
+				tail += ring->size - off;
+				continue;
+			}
+
+			writer->on_record(writer->arg, ring->data + off + RING_ALIGN, (size_t) len);
+			tail += frame((size_t) len);
+		}
+
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	}
+
+	writer->on_flush(writer->arg, dropped);
+
+	pthread_mutex_unlock(&writer->lock);
+}
+
+static void *
+th_writer(void *arg)
+{
+	ring_writer_t *writer = (ring_writer_t*) arg;
+	struct timespec ts = { writer->interval / 1000, (writer->interval % 1000) * 1000000L };
+
+	while(!__atomic_load_n(&writer->stopping, __ATOMIC_ACQUIRE)){
+		nanosleep(&ts, NULL);
+		ring_flush(writer);
+	}
+
+	return NULL;
+}
+
+int
+ring_start(ring_writer_t *writer)
+{
+	sigset_t set, old;
+	int err;
+
+	// Signals are handled by the main thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	err = pthread_create(&writer->th_id, NULL, &th_writer, writer);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	writer->started = (err == 0);
+
+	return err;
+}
+
+/**
+ * Stop the writer and hand what is left to on_record. Rings stay allocated,
+ * their threads may still write to them.
+ *
+ * */
+void
+ring_stop(ring_writer_t *writer)
+{
+	if(writer->started){
+		__atomic_store_n(&writer->stopping, TRUE, __ATOMIC_RELEASE);
+		pthread_join(writer->th_id, NULL);
+		writer->started = FALSE;
+	}
+
+	ring_flush(writer);
+}
@@ -0,0 +1,64 @@
+/*
+ * ring.h - per-thread record rings and their background writer
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Records of one thread, on their way to the writer. The thread only moves
+ * head and the writer only moves tail, so neither takes a lock. Records are
+ * stored whole, each after its length; size is a power of two.
+ *
+ * */
+typedef struct ring_t {
+	struct ring_t *next;
+
+	uint64_t head;
+	uint64_t tail;
+	unsigned long dropped;
+
+	size_t size;
+	char data[];
+} ring_t;
+
+/**
+ * Drains the rings of all threads from its own thread, every interval
+ * milliseconds. Each record is handed to on_record, on_flush is called once
+ * all rings are drained with the number of records dropped since the last
+ * time.
+ *
+ * */
+typedef struct ring_writer_t {
+	ring_t *rings;
+
+	void (*on_record)(void *arg, const char *data, size_t len);
+	void (*on_flush)(void *arg, unsigned long dropped);
+	void *arg;
+	long interval;
+
+	// Held by whoever drains the rings
+	pthread_mutex_t lock;
+
+	pthread_t th_id;
+	int started;
+	int stopping;
+} ring_writer_t;
+
+void ring_init(ring_writer_t *writer, long interval, void (*on_record)(void*, const char*, size_t),
+		void (*on_flush)(void*, unsigned long), void *arg);
+ring_t *ring_new(ring_writer_t *writer, size_t size);
+int ring_write(ring_t *ring, const void *head, size_t head_len, const void *data, size_t len);
+
+int ring_start(ring_writer_t *writer);
+void ring_flush(ring_writer_t *writer);
+void ring_stop(ring_writer_t *writer);
+
+#endif
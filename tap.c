@@ -0,0 +1,139 @@
+/*
+ * tap.c - traffic capture
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tap.h"
+#include "log.h"
+#include "util.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// Bytes of the file buffered between two writes
+#define TAP_BUFFER (256 * 1024)
+
+static void on_record(void *arg, const char *data, size_t len);
+static void on_flush(void *arg, unsigned long dropped);
+
+// Connections are numbered across workers
+static uint32_t ids;
+
+/**
+ * Create the capture, replacing what was captured before: connections are
+ * numbered from the start again. Returns -1 if it cannot be written.
+ *
+ * */
+int
+tap_open(tap_log_t *log, const char *path, int protocol)
+{
+	tap_header_t header;
+
+	memset(log, 0, sizeof(tap_log_t));
+
+	if((log->fp = fopen(path, "wb")) == NULL)
+		return -1;
+
+	setvbuf(log->fp, NULL, _IOFBF, TAP_BUFFER);
+
+	ring_init(&log->writer, TAP_INTERVAL, on_record, on_flush, log);
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, TAP_MAGIC, sizeof TAP_MAGIC);
+	header.version = TAP_VERSION;
+	header.protocol = (uint32_t) protocol;
+
+	if(fwrite(&header, sizeof header, 1, log->fp) != 1 || fflush(log->fp) != 0){
+		fclose(log->fp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * A ring for a worker to queue its events in
+ *
+ * */
+ring_t *
+tap_ring(tap_log_t *log)
+{
+	return ring_new(&log->writer, TAP_BYTES);
+}
+
+uint32_t
+tap_id(void)
+{
+	return __atomic_add_fetch(&ids, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Queue an event for the writer, from the ring's worker. An event and its
+ * data are dropped together.
+ *
+ * */
+void
+tap_write(ring_t *ring, uint32_t conn, int type, const void *data, size_t len)
+{
+	tap_event_t event;
+
+	memset(&event, 0, sizeof event);
+	event.time = epoch_us();
+	event.conn = conn;
+	event.len = (uint32_t) len;
+	event.type = (uint8_t) type;
+
+	ring_write(ring, &event, sizeof event, data, len);
+}
+
+static void
+on_record(void *arg, const char *data, size_t len)
+{
+	tap_log_t *log = (tap_log_t*) arg;
+
+	if(fwrite(data, 1, len, log->fp) != len)
+		log->failed = TRUE;
+}
+
+static void
+on_flush(void *arg, unsigned long dropped)
+{
+	tap_log_t *log = (tap_log_t*) arg;
+
+	if(dropped > 0)
+		log_write(LOG_WARNING, "tap", "Dropped %lu events", dropped);
+
+	if(fflush(log->fp) != 0 || log->failed)
+		print("tap_write", strerror(errno));
+
+	log->failed = FALSE;
+}
+
+int
+tap_start(tap_log_t *log)
+{
+	return ring_start(&log->writer);
+}
+
+/**
+ * Stop the writer, write out the events left and close the capture.
+ *
+ * */
+void
+tap_stop(tap_log_t *log)
+{
+	if(log->fp == NULL)
+		return;
+
+	ring_stop(&log->writer);
+
+	fclose(log->fp);
+	log->fp = NULL;
+}
@@ -0,0 +1,86 @@
+/*
+ * tap.h - traffic capture
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef TAP_H
+#define TAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ring.h"
+
+#define TAP_MAGIC "MPDPXCP"
+#define TAP_VERSION 1
+
+// Bytes of events a worker may have waiting for the writer, a power of two.
+// Events made while its ring is full are dropped and counted
+#define TAP_BYTES (16 * 1024 * 1024)
+
+// Milliseconds between two writes to the file
+#define TAP_INTERVAL 50
+
+// Events of a connection: it was accepted, with the client's address and
+// port as data, the client sent data, it was sent data, it was closed
+#define TAP_OPEN 0
+#define TAP_CLIENT 1
+#define TAP_SERVER 2
+#define TAP_CLOSE 3
+
+/**
+ * Start of the file, the events follow. Both are written in the byte order
+ * of the host.
+ *
+ * */
+typedef struct tap_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t protocol;
+} tap_header_t;
+
+/**
+ * Something that happened on a connection, followed by len bytes of data.
+ * Time is in microseconds since the epoch.
+ *
+ * */
+typedef struct tap_event_t {
+	uint64_t time;
+	uint32_t conn;
+	uint32_t len;
+	uint8_t type;
+	uint8_t reserved[7];
+} tap_event_t;
+
+/**
+ * Data of a TAP_OPEN event
+ *
+ * */
+typedef struct tap_open_t {
+	uint8_t addr[16];
+	uint16_t port;
+} tap_open_t;
+
+/**
+ * Writes the events the workers queue in their rings to a file, from the
+ * writer's thread
+ *
+ * */
+typedef struct tap_log_t {
+	FILE *fp;
+	int failed;
+
+	ring_writer_t writer;
+} tap_log_t;
+
+int tap_open(tap_log_t *log, const char *path, int protocol);
+ring_t *tap_ring(tap_log_t *log);
+int tap_start(tap_log_t *log);
+void tap_stop(tap_log_t *log);
+
+uint32_t tap_id(void);
+void tap_write(ring_t *ring, uint32_t conn, int type, const void *data, size_t len);
+
+#endif
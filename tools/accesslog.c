@@ -0,0 +1,456 @@
+/*
+ * accesslog.c - convert and summarize mpdproxy access logs
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../access.h"
+#include "../protocol.h"
+#include "../util.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define FORMAT_CSV 0
+#define FORMAT_JSON 1
+#define FORMAT_SUMMARY 2
+
+// Initial slots of a table of keys, a power of two
+#define TABLE_SIZE 1024
+
+static const char *outcomes[] = { "upstream", "miss", "hit", "coalesced", "mirror", "art" };
+#define N_OUTCOMES (sizeof outcomes / sizeof outcomes[0])
+
+/**
+ * Records sharing a key: a command, a command and its arguments, or a client
+ *
+ * */
+typedef struct stat_t {
+	int used;
+	uint8_t addr[16];
+	uint32_t args;
+	int command;
+
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t latency;
+	uint64_t upstream;
+} stat_t;
+
+typedef struct table_t {
+	stat_t *slots;
+	size_t size;
+	size_t used;
+} table_t;
+
+static stat_t commands[MPD_COMMANDS + 1];
+static uint64_t by_outcome[N_OUTCOMES];
+static table_t queries;
+static table_t clients;
+static uint64_t total, first, last;
+
+static const char *
+outcome_name(int outcome)
+{
+	return outcome >= 0 && (size_t) outcome < N_OUTCOMES ? outcomes[outcome] : "unknown";
+}
+
+static const char *
+command_name(int command)
+{
+	return command >= 0 && command <= MPD_COMMANDS ? mpd_command_name(command) : "unknown";
+}
+
+static void
+format_addr(const uint8_t *addr, char *s, size_t size)
+{
+	static const uint8_t mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+	if(memcmp(addr, mapped, sizeof mapped) == 0)
+		inet_ntop(AF_INET, addr + 12, s, (socklen_t) size);
+	else
+		inet_ntop(AF_INET6, addr, s, (socklen_t) size);
+}
+
+static void
+format_time(uint64_t us, char *s, size_t size)
+{
+	time_t t = (time_t) (us / 1000000);
+	struct tm tm;
+	size_t n;
+
+	gmtime_r(&t, &tm);
+	n = strftime(s, size, "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(s + n, size - n, ".%06luZ", (unsigned long) (us % 1000000));
+}
+
+static void
+print_csv(const access_record_t *r)
+{
+	char addr[INET6_ADDRSTRLEN], time[32];
+
+	format_addr(r->addr, addr, sizeof addr);
+	format_time(r->time, time, sizeof time);
+
+	printf("%s,%s,%u,%s,%08x,%s,%u,%u\n", time, addr, r->port, command_name(r->command), r->args,
+			outcome_name(r->outcome), r->size, r->latency);
+}
+
+static void
+print_json(const access_record_t *r)
+{
+	char addr[INET6_ADDRSTRLEN], time[32];
+
+	format_addr(r->addr, addr, sizeof addr);
+	format_time(r->time, time, sizeof time);
+
+	printf("{\"time\":\"%s\",\"client\":\"%s\",\"port\":%u,\"command\":\"%s\",\"args\":\"%08x\",\"outcome\":\"%s\","
+			"\"size\":%u,\"latency_us\":%u}\n", time, addr, r->port, command_name(r->command), r->args,
+			outcome_name(r->outcome), r->size, r->latency);
+}
+
+static int
+table_init(table_t *table)
+{
+	table->size = TABLE_SIZE;
+	table->used = 0;
+
+	return (table->slots = calloc(table->size, sizeof(stat_t))) == NULL ? -1 : 0;
+}
+
+static stat_t *
+table_find(stat_t *slots, size_t size, const stat_t *key)
+{
+	uint32_t h = hash(key->addr, sizeof key->addr) ^ hash(&key->args, sizeof key->args) ^ hash(&key->command, sizeof key->command);
+	size_t i;
+
+	for(i = h & (size - 1); slots[i].used; i = (i + 1) & (size - 1)){
+		if(slots[i].command == key->command && slots[i].args == key->args && memcmp(slots[i].addr, key->addr, sizeof key->addr) == 0)
+			break;
+	}
+
+	return &slots[i];
+}
+
+/**
+ * The stat of key, added if it is not in the table yet. Returns NULL if the
+ * table could not grow.
+ *
+ * */
+static stat_t *
+table_get(table_t *table, const stat_t *key)
+{
+	stat_t *slots, *s;
+	size_t i;
+
+	// Kept at most half full
+	if(2 * (table->used + 1) > table->size){
+		if((slots = calloc(2 * table->size, sizeof(stat_t))) == NULL)
+			return NULL;
+
+		for(i = 0; i < table->size; i++){
+			if(table->slots[i].used)
+				*table_find(slots, 2 * table->size, &table->slots[i]) = table->slots[i];
+		}
+
+		free(table->slots);
+		table->slots = slots;
+		table->size *= 2;
+	}
+
+	if(!(s = table_find(table->slots, table->size, key))->used){
+		*s = *key;
+		s->used = TRUE;
+		table->used++;
+	}
+
+	return s;
+}
+
+static void
+count(stat_t *s, const access_record_t *r)
+{
+	s->count++;
+	s->bytes += r->size;
+
+	if(r->outcome == ACCESS_UPSTREAM || r->outcome == ACCESS_MISS){
+		s->latency += r->latency;
+		s->upstream++;
+	}
+}
+
+static int
+add(const access_record_t *r)
+{
+	stat_t key, *s;
+
+	if(total++ == 0 || r->time < first)
+		first = r->time;
+	if(r->time > last)
+		last = r->time;
+
+	count(&commands[r->command <= MPD_COMMANDS ? r->command : MPD_COMMANDS], r);
+
+	if(r->outcome < N_OUTCOMES)
+		by_outcome[r->outcome]++;
+
+	memset(&key, 0, sizeof key);
+	key.command = r->command;
+	key.args = r->args;
+
+	if((s = table_get(&queries, &key)) == NULL)
+		return -1;
+	count(s, r);
+
+	memset(&key, 0, sizeof key);
+	memcpy(key.addr, r->addr, sizeof key.addr);
+
+	if((s = table_get(&clients, &key)) == NULL)
+		return -1;
+	count(s, r);
+
+	return 0;
+}
+
+static int
+by_count(const void *a, const void *b)
+{
+	const stat_t *x = a, *y = b;
+
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static int
+by_bytes(const void *a, const void *b)
+{
+	const stat_t *x = a, *y = b;
+
+	return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+static int
+by_latency(const void *a, const void *b)
+{
+	const stat_t *x = a, *y = b;
+
+	return x->latency < y->latency ? 1 : x->latency > y->latency ? -1 : 0;
+}
+
+/**
+ * The used stats of slots, in order
+ *
+ * */
+static stat_t *
+sorted(const stat_t *slots, size_t size, size_t *n, int (*cmp)(const void*, const void*))
+{
+	stat_t *list;
+	size_t i;
+
+	if((list = malloc((size > 0 ? size : 1) * sizeof(stat_t))) == NULL)
+		return NULL;
+
+	for(i = 0, *n = 0; i < size; i++){
+		if(slots[i].used && slots[i].count > 0)
+			list[(*n)++] = slots[i];
+	}
+
+	qsort(list, *n, sizeof(stat_t), cmp);
+
+	return list;
+}
+
+static double
+mean_ms(const stat_t *s)
+{
+	return s->upstream > 0 ? (double) s->latency / (double) s->upstream / 1000.0 : 0.0;
+}
+
+static void
+print_commands(const char *title, int (*cmp)(const void*, const void*), size_t top)
+{
+	stat_t *list;
+	size_t i, n;
+
+	if((list = sorted(commands, MPD_COMMANDS + 1, &n, cmp)) == NULL)
+		return;
+
+	printf("\nTop commands by %s\n", title);
+	printf("  %-20s %10s %14s %14s %10s\n", "command", "count", "bytes", "upstream ms", "mean ms");
+
+	for(i = 0; i < n && i < top; i++)
+		printf("  %-20s %10lu %14lu %14.1f %10.3f\n", command_name(list[i].command), (unsigned long) list[i].count,
+				(unsigned long) list[i].bytes, (double) list[i].latency / 1000.0, mean_ms(&list[i]));
+
+	free(list);
+}
+
+static void
+print_summary(size_t top)
+{
+	char addr[INET6_ADDRSTRLEN];
+	stat_t *list;
+	size_t i, n;
+
+	for(i = 0; i <= MPD_COMMANDS; i++){
+		commands[i].command = (int) i;
+		commands[i].used = TRUE;
+	}
+
+	printf("%lu records", (unsigned long) total);
+	if(total > 0)
+		printf(" over %.1f s", (double) (last - first) / 1000000.0);
+	printf("\n");
+
+	printf("\nOutcomes\n");
+	for(i = 0; i < N_OUTCOMES; i++)
+		printf("  %-20s %10lu %9.1f%%\n", outcomes[i], (unsigned long) by_outcome[i],
+				total > 0 ? 100.0 * (double) by_outcome[i] / (double) total : 0.0);
+
+	print_commands("count", by_count, top);
+	print_commands("bytes", by_bytes, top);
+	print_commands("upstream latency", by_latency, top);
+
+	if((list = sorted(queries.slots, queries.size, &n, by_count)) != NULL){
+		printf("\nTop queries by count\n");
+		printf("  %-20s %10s %10s %14s %10s\n", "command", "args", "count", "bytes", "mean ms");
+
+		for(i = 0; i < n && i < top; i++)
+			printf("  %-20s %10.8x %10lu %14lu %10.3f\n", command_name(list[i].command), list[i].args,
+					(unsigned long) list[i].count, (unsigned long) list[i].bytes, mean_ms(&list[i]));
+
+		free(list);
+	}
+
+	if((list = sorted(clients.slots, clients.size, &n, by_count)) != NULL){
+		printf("\nTop clients by count\n");
+		printf("  %-39s %10s %14s\n", "client", "count", "bytes");
+
+		for(i = 0; i < n && i < top; i++){
+			format_addr(list[i].addr, addr, sizeof addr);
+			printf("  %-39s %10lu %14lu\n", addr, (unsigned long) list[i].count, (unsigned long) list[i].bytes);
+		}
+
+		free(list);
+	}
+}
+
+/**
+ * Convert or count the records of a log. Returns -1 if it is not a log of
+ * this version.
+ *
+ * */
+static int
+read_log(FILE *fp, const char *path, int format)
+{
+	access_header_t header;
+	access_record_t record;
+
+	if(fread(&header, sizeof header, 1, fp) != 1 || memcmp(header.magic, ACCESS_MAGIC, sizeof ACCESS_MAGIC) != 0){
+		fprintf(stderr, "%s: not an access log\n", path);
+		return -1;
+	}
+
+	if(header.version != ACCESS_VERSION || header.size != sizeof(access_record_t)){
+		fprintf(stderr, "%s: unsupported version %u\n", path, header.version);
+		return -1;
+	}
+
+	while(fread(&record, sizeof record, 1, fp) == 1){
+		if(format == FORMAT_CSV){
+			print_csv(&record);
+		} else if(format == FORMAT_JSON){
+			print_json(&record);
+		} else if(add(&record) < 0){
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			return -1;
+		}
+	}
+
+	if(ferror(fp)){
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-f csv|json] [-t N] [file...]\n", name);
+	fprintf(stderr, "  -f csv|json  convert records to CSV, or JSON objects one per line (default: csv)\n");
+	fprintf(stderr, "  -t N         summarize instead, showing the top N of every list\n");
+	fprintf(stderr, "Reads standard input if no file is given.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	int format = FORMAT_CSV;
+	size_t top = 10;
+	int c, i, ret = 0;
+	FILE *fp;
+
+	while((c = getopt(argc, argv, "f:t:h")) != -1){
+		switch(c){
+			case 'f':
+				if(strcmp(optarg, "csv") == 0){
+					format = FORMAT_CSV;
+				} else if(strcmp(optarg, "json") == 0){
+					format = FORMAT_JSON;
+				} else {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 't':
+				format = FORMAT_SUMMARY;
+				top = (size_t) strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if(format == FORMAT_SUMMARY && (table_init(&queries) < 0 || table_init(&clients) < 0)){
+		perror("calloc");
+		return 1;
+	}
+
+	if(format == FORMAT_CSV)
+		printf("time,client,port,command,args,outcome,size,latency_us\n");
+
+	if(optind == argc)
+		ret = read_log(stdin, "stdin", format);
+
+	for(i = optind; i < argc; i++){
+		if((fp = fopen(argv[i], "rb")) == NULL){
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			ret = -1;
+			continue;
+		}
+
+		if(read_log(fp, argv[i], format) < 0)
+			ret = -1;
+
+		fclose(fp);
+	}
+
+	if(format == FORMAT_SUMMARY)
+		print_summary(top);
+
+	free(queries.slots);
+	free(clients.slots);
+
+	return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * mirrorcheck.c - compare the answers of mpdproxy's mirror with MPD's
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "../protocol.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define BUF_SIZE 65536
+#define LINE_SIZE 4096
+
+// Queries run on every tag MPD knows, given its name: those MPD answers for
+// songs without the tag
+static const char *queries[] = {
+	"find %s \"\"",
+	"search %s \"\"",
+	"find \"(%s == \\\"\\\")\"",
+	"find \"(%s != \\\"\\\")\"",
+	"list %s",
+};
+
+/**
+ * A connection, and the last response read from it
+ *
+ * */
+typedef struct peer_t {
+	const char *name;
+	int fd;
+	mpd_response_t res;
+
+	char *data;
+	size_t len;
+	size_t size;
+} peer_t;
+
+/**
+ * Read a whole response into data.
+ *
+ * */
+static int
+peer_read(peer_t *peer)
+{
+	char buf[BUF_SIZE], *tmp;
+	ssize_t bytes;
+	size_t n;
+
+	mpd_response_init(&peer->res);
+	peer->len = 0;
+
+	while(!peer->res.done){
+		if((bytes = recv(peer->fd, buf, sizeof buf, 0)) <= 0){
+			if(bytes < 0 && errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: %s\n", peer->name, bytes == 0 ? "Connection closed" : strerror(errno));
+			return -1;
+		}
+
+		n = mpd_response_feed(&peer->res, buf, (size_t) bytes);
+
+		if(peer->len + n > peer->size){
+			for(peer->size = peer->size ? peer->size : BUF_SIZE; peer->size < peer->len + n; peer->size *= 2);
+			if((tmp = realloc(peer->data, peer->size)) == NULL){
+				perror("realloc");
+				return -1;
+			}
+			peer->data = tmp;
+		}
+
+		memcpy(peer->data + peer->len, buf, n);
+		peer->len += n;
+	}
+
+	return 0;
+}
+
+static int
+peer_open(peer_t *peer, const char *name, const char *host, const char *port)
+{
+	struct addrinfo hints, *addr, *a;
+	int err;
+
+	memset(peer, 0, sizeof(peer_t));
+	peer->name = name;
+	peer->fd = -1;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if((err = getaddrinfo(host, port, &hints, &addr)) != 0){
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		return -1;
+	}
+
+	for(a = addr; a != NULL && peer->fd < 0; a = a->ai_next){
+		if((peer->fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) >= 0 && connect(peer->fd, a->ai_addr, a->ai_addrlen) < 0){
+			close(peer->fd);
+			peer->fd = -1;
+		}
+	}
+
+	freeaddrinfo(addr);
+
+	if(peer->fd < 0){
+		fprintf(stderr, "connect %s:%s: %s\n", host, port, strerror(errno));
+		return -1;
+	}
+
+	// The greeting
+	return peer_read(peer);
+}
+
+static int
+peer_send(peer_t *peer, const char *cmd, size_t len)
+{
+	ssize_t bytes;
+
+	while(len > 0){
+		if((bytes = send(peer->fd, cmd, len, MSG_NOSIGNAL)) < 0){
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: %s\n", peer->name, strerror(errno));
+			return -1;
+		}
+
+		cmd += bytes;
+		len -= (size_t) bytes;
+	}
+
+	return 0;
+}
+
+/**
+ * Print the line of a response holding byte at.
+ *
+ * */
+static void
+print_line(const peer_t *peer, size_t at)
+{
+	const char *start, *end;
+
+	if(at >= peer->len){
+		printf("  %-6s (end of response)\n", peer->name);
+		return;
+	}
+
+	for(start = peer->data + at; start > peer->data && start[-1] != '\n'; start--);
+	end = memchr(start, '\n', (size_t) (peer->data + peer->len - start));
+
+	printf("  %-6s %.*s\n", peer->name, (int) (end ? end - start : peer->data + peer->len - start), start);
+}
+
+/**
+ * Send a command to both, and compare their responses byte for byte.
+ * Returns 1 if they differ, -1 if either could not be asked.
+ *
+ * */
+static int
+check(peer_t *mpd, peer_t *proxy, const char *cmd)
+{
+	char line[LINE_SIZE];
+	size_t len, at;
+
+	if((len = (size_t) snprintf(line, sizeof line, "%s\n", cmd)) >= sizeof line){
+		fprintf(stderr, "%s: too long\n", cmd);
+		return -1;
+	}
+
+	if(peer_send(mpd, line, len) < 0 || peer_read(mpd) < 0 || peer_send(proxy, line, len) < 0 || peer_read(proxy) < 0)
+		return -1;
+
+	if(mpd->len == proxy->len && memcmp(mpd->data, proxy->data, mpd->len) == 0)
+		return 0;
+
+	for(at = 0; at < mpd->len && at < proxy->len && mpd->data[at] == proxy->data[at]; at++);
+
+	printf("%s: %lu bytes from MPD, %lu from the proxy, differing from byte %lu\n", cmd, (unsigned long) mpd->len,
+			(unsigned long) proxy->len, (unsigned long) at);
+	print_line(mpd, at);
+	print_line(proxy, at);
+
+	return 1;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-h host] [-p port] [-H host] -P port [-f file]\n", name);
+	fprintf(stderr, "  -h host   MPD server (default: 127.0.0.1)\n");
+	fprintf(stderr, "  -p port   its port (default: 6600)\n");
+	fprintf(stderr, "  -H host   mpdproxy, with the mirror enabled and built (default: the MPD server)\n");
+	fprintf(stderr, "  -P port   its port\n");
+	fprintf(stderr, "  -f file   commands to compare, one per line (default: queries for songs without each tag)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1", *port = "6600", *proxy_host = NULL, *proxy_port = NULL, *file = NULL;
+	char line[LINE_SIZE], cmd[LINE_SIZE], *tags = NULL, *tag, *end;
+	unsigned long n_checked = 0, n_differ = 0;
+	peer_t mpd, proxy;
+	unsigned int i;
+	size_t len;
+	int opt, ret = 0;
+	FILE *fp;
+
+	while((opt = getopt(argc, argv, "h:p:H:P:f:")) != -1){
+		switch(opt){
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'H':
+				proxy_host = optarg;
+				break;
+			case 'P':
+				proxy_port = optarg;
+				break;
+			case 'f':
+				file = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(optind != argc || proxy_port == NULL){
+		usage(argv[0]);
+		return 1;
+	}
+
+	if(peer_open(&mpd, "mpd", host, port) < 0 || peer_open(&proxy, "proxy", proxy_host ? proxy_host : host, proxy_port) < 0)
+		return 1;
+
+	if(file != NULL){
+		if((fp = fopen(file, "r")) == NULL){
+			fprintf(stderr, "%s: %s\n", file, strerror(errno));
+			return 1;
+		}
+
+		while(ret >= 0 && fgets(line, sizeof line, fp) != NULL){
+			if((len = strcspn(line, "\n")) == 0)
+				continue;
+			line[len] = '\0';
+
+			if((ret = check(&mpd, &proxy, line)) > 0)
+				n_differ++;
+			n_checked++;
+		}
+
+		fclose(fp);
+	} else {
+		// The tags MPD knows, as it names them
+		if(peer_send(&mpd, "tagtypes\n", 9) < 0 || peer_read(&mpd) < 0 || (tags = strndup(mpd.data, mpd.len)) == NULL)
+			return 1;
+
+		for(tag = tags; ret >= 0 && (end = strchr(tag, '\n')) != NULL; tag = end + 1){
+			*end = '\0';
+			if(strncmp(tag, "tagtype: ", 9) != 0)
+				continue;
+
+			for(i = 0; ret >= 0 && i < sizeof queries / sizeof queries[0]; i++){
+				snprintf(cmd, sizeof cmd, queries[i], tag + 9);
+
+				if((ret = check(&mpd, &proxy, cmd)) > 0)
+					n_differ++;
+				n_checked++;
+			}
+		}
+
+		free(tags);
+	}
+
+	close(mpd.fd);
+	close(proxy.fd);
+	free(mpd.data);
+	free(proxy.data);
+
+	if(ret < 0)
+		return 1;
+
+	printf("%lu commands, %lu answered differently\n", n_checked, n_differ);
+
+	return n_differ > 0 ? 1 : 0;
+}
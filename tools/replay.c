@@ -0,0 +1,569 @@
+/*
+ * replay.c - replay traffic captured by mpdproxy
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+
+#include "../tap.h"
+#include "../config.h"
+#include "../protocol.h"
+#include "../util.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define BUF_SIZE 65536
+
+// Sub-buckets of the latency histogram per power of two, as bits
+#define SUB_BITS 5
+#define SUB (1 << SUB_BITS)
+#define POWERS 40
+#define BUCKETS (POWERS * SUB)
+
+/**
+ * Data a client sent, and how many responses it had been sent before
+ *
+ * */
+typedef struct chunk_t {
+	uint64_t time;
+	const char *data;
+	size_t len;
+	unsigned long responses;
+} chunk_t;
+
+/**
+ * A captured connection, and its replay
+ *
+ * */
+typedef struct session_t {
+	uint32_t id;
+	uint64_t open;
+	uint64_t close;
+
+	chunk_t *chunks;
+	size_t n_chunks;
+	size_t size;
+
+	// Responses and bytes the client was sent in the capture, framed as
+	// they are captured
+	mpd_response_t res;
+	unsigned long responses;
+	uint64_t bytes;
+
+	int fd;
+	int started;
+	int done;
+	size_t next;
+	size_t off;
+	uint64_t ready;
+	uint64_t sent;
+	mpd_response_t reply;
+	unsigned long replies;
+	uint64_t received;
+} session_t;
+
+static session_t **sessions;
+static size_t n_sessions;
+
+static double speed = 1.0;
+static uint64_t timeout = 5000000;
+static int sync_responses;
+
+static uint64_t counts[BUCKETS];
+static unsigned long stalls, broken;
+
+/**
+ * The session of connection id, added on its first event. Sessions are kept
+ * by id, which the proxy hands out in order.
+ *
+ * */
+static session_t *
+session_get(uint32_t id)
+{
+	session_t **tmp;
+	size_t size;
+
+	if(id >= n_sessions){
+		size = n_sessions ? n_sessions : 1024;
+		while(size <= id)
+			size *= 2;
+
+		if((tmp = realloc(sessions, size * sizeof(session_t*))) == NULL)
+			return NULL;
+
+		memset(tmp + n_sessions, 0, (size - n_sessions) * sizeof(session_t*));
+		sessions = tmp;
+		n_sessions = size;
+	}
+
+	if(sessions[id] == NULL){
+		if((sessions[id] = calloc(1, sizeof(session_t))) == NULL)
+			return NULL;
+		sessions[id]->id = id;
+		sessions[id]->fd = -1;
+	}
+
+	return sessions[id];
+}
+
+static int
+chunk_add(session_t *s, uint64_t time, const char *data, size_t len)
+{
+	chunk_t *tmp;
+
+	if(s->n_chunks == s->size){
+		s->size = s->size ? 2 * s->size : 16;
+		if((tmp = realloc(s->chunks, s->size * sizeof(chunk_t))) == NULL)
+			return -1;
+		s->chunks = tmp;
+	}
+
+	s->chunks[s->n_chunks].time = time;
+	s->chunks[s->n_chunks].data = data;
+	s->chunks[s->n_chunks].len = len;
+	s->chunks[s->n_chunks].responses = s->responses;
+	s->n_chunks++;
+
+	return 0;
+}
+
+static unsigned long
+responses(mpd_response_t *res, const char *data, size_t len)
+{
+	unsigned long n = 0;
+	size_t off;
+
+	for(off = 0; off < len; ){
+		off += mpd_response_feed(res, data + off, len - off);
+		if(res->done)
+			n++;
+	}
+
+	return n;
+}
+
+/**
+ * Split a capture into sessions. Data is referred to in place, the capture
+ * stays loaded. Returns the time of the first event, or 0 if there is none.
+ *
+ * */
+static uint64_t
+load(const char *data, size_t len, uint64_t *last)
+{
+	tap_event_t event;
+	uint64_t first = 0;
+	session_t *s;
+	size_t off;
+
+	for(off = 0; off + sizeof(tap_event_t) <= len; off += sizeof(tap_event_t) + event.len){
+		// Events are packed, their headers are not aligned
+		memcpy(&event, data + off, sizeof event);
+
+		if(off + sizeof(tap_event_t) + event.len > len){
+			fprintf(stderr, "Capture cut short, ignoring its last event\n");
+			break;
+		}
+
+		if((s = session_get(event.conn)) == NULL){
+			perror("session");
+			exit(1);
+		}
+
+		if(first == 0 || event.time < first)
+			first = event.time;
+		if(event.time > *last)
+			*last = event.time;
+
+		switch(event.type){
+			case TAP_OPEN:
+				s->open = event.time;
+				break;
+			case TAP_CLIENT:
+				if(chunk_add(s, event.time, data + off + sizeof(tap_event_t), event.len) < 0){
+					perror("chunk");
+					exit(1);
+				}
+				break;
+			case TAP_SERVER:
+				s->bytes += event.len;
+				s->responses += responses(&s->res, data + off + sizeof(tap_event_t), event.len);
+				break;
+			case TAP_CLOSE:
+				s->close = event.time;
+				break;
+		}
+
+		// Connections open before the capture started were not captured whole
+		if(s->open == 0)
+			s->done = TRUE;
+	}
+
+	return first;
+}
+
+/**
+ * When something captured at time is due, relative to start
+ *
+ * */
+static uint64_t
+due(uint64_t time, uint64_t first, uint64_t start)
+{
+	return speed > 0 ? start + (uint64_t) ((double) (time - first) / speed) : start;
+}
+
+static int
+session_open(session_t *s, struct addrinfo *addr, int epfd)
+{
+	struct epoll_event ev;
+	int opt = 1;
+
+	if((s->fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0)
+		return -1;
+
+	if(connect(s->fd, addr->ai_addr, addr->ai_addrlen) < 0 ||
+			fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK) < 0){
+		close(s->fd);
+		s->fd = -1;
+		return -1;
+	}
+
+	setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof opt);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev);
+}
+
+static void
+session_close(session_t *s)
+{
+	if(s->fd >= 0)
+		close(s->fd);
+
+	s->fd = -1;
+	s->done = TRUE;
+}
+
+static void
+session_read(session_t *s, char *buf)
+{
+	uint64_t now;
+	ssize_t bytes;
+	unsigned long n;
+
+	for(;;){
+		if((bytes = recv(s->fd, buf, BUF_SIZE, 0)) < 0){
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK){
+				broken++;
+				session_close(s);
+			}
+			return;
+		}
+
+		if(bytes == 0){
+			// Closed by the server before the client would have
+			if(s->next < s->n_chunks)
+				broken++;
+			session_close(s);
+			return;
+		}
+
+		s->received += (uint64_t) bytes;
+
+		if(!sync_responses)
+			continue;
+
+		// Responses are timed from the data sent last before them
+		if((n = responses(&s->reply, buf, (size_t) bytes)) > 0){
+			now = now_us();
+			if(s->replies > 0)
+				counts[histogram_bucket(now - s->sent, SUB_BITS, BUCKETS)] += n;
+			s->replies += n;
+		}
+	}
+}
+
+/**
+ * Send the client's data that is due, once the responses it had been sent
+ * before came in, or it waited for them too long. Returns when the session
+ * has something due next, 0 if it is done.
+ *
+ * */
+static uint64_t
+session_step(session_t *s, uint64_t first, uint64_t start, uint64_t now)
+{
+	chunk_t *c;
+	ssize_t n;
+	uint64_t at;
+
+	while(s->next < s->n_chunks){
+		c = &s->chunks[s->next];
+
+		if((at = due(c->time, first, start)) > now)
+			return at;
+
+		if(s->off == 0 && sync_responses && s->replies < c->responses){
+			if(s->ready == 0)
+				s->ready = now;
+			if(now - s->ready < timeout)
+				return s->ready + timeout;
+			stalls++;
+		}
+
+		if((n = send(s->fd, c->data + s->off, c->len - s->off, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0){
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return now + 1000;
+			broken++;
+			session_close(s);
+			return 0;
+		}
+
+		s->off += (size_t) n;
+		if(s->off < c->len)
+			return now + 1000;
+
+		s->off = 0;
+		s->ready = 0;
+		s->sent = now;
+		s->next++;
+	}
+
+	// The client closed once it was answered
+	at = due(s->close ? s->close : s->open, first, start);
+	if(at > now)
+		return at;
+
+	if(sync_responses && s->replies < s->responses){
+		if(s->ready == 0)
+			s->ready = now;
+		if(now - s->ready < timeout)
+			return s->ready + timeout;
+		stalls++;
+	}
+
+	session_close(s);
+
+	return 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-h host] [-p port] [-x speed] [-t ms] [-n] capture\n", name);
+	fprintf(stderr, "  -h host   server to replay against (default: 127.0.0.1)\n");
+	fprintf(stderr, "  -p port   its port (default: 6600)\n");
+	fprintf(stderr, "  -x speed  how much faster than captured, 0 as fast as the server answers (default: 1)\n");
+	fprintf(stderr, "  -t ms     how long to wait for the responses a client had before sending on (default: 5000)\n");
+	fprintf(stderr, "  -n        do not wait for responses, only follow the captured timing\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1", *port = "6600";
+	uint64_t first, last = 0, start, now, next, at, sent = 0, received = 0, captured = 0, total, seen, n_responses = 0;
+	double percentiles[] = { 50.0, 99.0, 99.9 };
+	struct epoll_event events[64];
+	struct addrinfo hints, *addr;
+	const tap_header_t *header;
+	int opt, err, epfd, nowait = FALSE, active, i, n, ms;
+	unsigned long n_replayed = 0, n_chunks = 0;
+	struct stat st;
+	session_t *s;
+	unsigned int b;
+	char *data, *buf;
+	size_t j;
+	FILE *fp;
+
+	while((opt = getopt(argc, argv, "h:p:x:t:n")) != -1){
+		switch(opt){
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'x':
+				speed = atof(optarg);
+				break;
+			case 't':
+				timeout = (uint64_t) strtoull(optarg, NULL, 10) * 1000;
+				break;
+			case 'n':
+				nowait = TRUE;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(optind != argc - 1 || speed < 0){
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if((fp = fopen(argv[optind], "rb")) == NULL || fstat(fileno(fp), &st) < 0){
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	if((data = malloc((size_t) st.st_size + 1)) == NULL || fread(data, 1, (size_t) st.st_size, fp) != (size_t) st.st_size){
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	fclose(fp);
+
+	header = (const tap_header_t*) data;
+	if((size_t) st.st_size < sizeof(tap_header_t) || memcmp(header->magic, TAP_MAGIC, sizeof TAP_MAGIC) != 0 ||
+			header->version != TAP_VERSION){
+		fprintf(stderr, "%s: not a capture of this version\n", argv[optind]);
+		return 1;
+	}
+
+	// Only MPD's responses can be told apart
+	sync_responses = header->protocol == PROTOCOL_MPD && !nowait;
+
+	first = load(data + sizeof(tap_header_t), (size_t) st.st_size - sizeof(tap_header_t), &last);
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if((err = getaddrinfo(host, port, &hints, &addr)) != 0){
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		return 1;
+	}
+
+	if((epfd = epoll_create1(0)) < 0 || (buf = malloc(BUF_SIZE)) == NULL){
+		perror("epoll");
+		return 1;
+	}
+
+	start = now_us();
+
+	for(;;){
+		now = now_us();
+		next = UINT64_MAX;
+		active = FALSE;
+
+		for(j = 0; j < n_sessions; j++){
+			if((s = sessions[j]) == NULL || s->done)
+				continue;
+
+			active = TRUE;
+
+			if(!s->started){
+				if((at = due(s->open, first, start)) > now){
+					next = at < next ? at : next;
+					continue;
+				}
+
+				s->started = TRUE;
+				n_replayed++;
+
+				if(session_open(s, addr, epfd) < 0){
+					fprintf(stderr, "connect %s:%s: %s\n", host, port, strerror(errno));
+					broken++;
+					session_close(s);
+					continue;
+				}
+			}
+
+			if((at = session_step(s, first, start, now)) > 0 && at < next)
+				next = at;
+		}
+
+		if(!active)
+			break;
+
+		ms = next == UINT64_MAX ? 100 : next <= now ? 0 : (int) ((next - now + 999) / 1000);
+		if(ms > 100)
+			ms = 100;
+
+		if((n = epoll_wait(epfd, events, 64, ms)) < 0 && errno != EINTR){
+			perror("epoll_wait");
+			return 1;
+		}
+
+		for(i = 0; i < n; i++){
+			s = events[i].data.ptr;
+			if(s->fd >= 0)
+				session_read(s, buf);
+		}
+	}
+
+	now = now_us();
+	freeaddrinfo(addr);
+
+	for(j = 0; j < n_sessions; j++){
+		if((s = sessions[j]) == NULL || !s->started)
+			continue;
+
+		for(i = 0; (size_t) i < s->n_chunks; i++)
+			sent += s->chunks[i].len;
+
+		n_chunks += (unsigned long) s->n_chunks;
+		received += s->received;
+		captured += s->bytes;
+	}
+
+	for(j = 0; j < n_sessions; j++){
+		if(sessions[j]){
+			free(sessions[j]->chunks);
+			free(sessions[j]);
+		}
+	}
+
+	for(b = 0; b < BUCKETS; b++)
+		n_responses += counts[b];
+
+	close(epfd);
+	free(buf);
+
+	printf("replayed    %lu connections, %lu writes, %lu bytes in %.2f s (captured over %.2f s)\n", n_replayed, n_chunks,
+			(unsigned long) sent, (double) (now - start) / 1e6, (double) (last - first) / 1e6);
+	printf("received    %lu bytes (%lu captured), %lu stalls, %lu broken connections\n", (unsigned long) received,
+			(unsigned long) captured, stalls, broken);
+
+	if(sync_responses){
+		printf("latency    ");
+		for(i = 0; i < (int) (sizeof percentiles / sizeof percentiles[0]); i++){
+			total = (uint64_t) ((double) n_responses * percentiles[i] / 100.0 + 0.5);
+
+			for(b = 0, seen = 0; b < BUCKETS - 1 && seen + counts[b] < total; b++)
+				seen += counts[b];
+
+			printf(" p%g %lu us", percentiles[i], n_responses > 0 ? (unsigned long) histogram_value(b, SUB_BITS) : 0UL);
+		}
+		printf(" (%lu responses)\n", (unsigned long) n_responses);
+	}
+
+	free(sessions);
+	free(data);
+
+	return broken > 0 ? 1 : 0;
+}
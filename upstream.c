@@ -0,0 +1,496 @@
+/*
+ * upstream.c - MPD server connections
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "upstream.h"
+#include "config.h"
+#include "event.h"
+#include "uring.h"
+#include "list.h"
+#include "metrics.h"
+#include "util.h"
+
+#define TRUE 1
+#define FALSE 0
+
+static void on_attempt(handler_t*, uint32_t);
+static void on_attempt_op(uring_op_t*, int, uint32_t);
+static void on_delay(timeout_t*);
+static void on_deadline(timeout_t*);
+static void on_report(deferred_t*);
+
+/**
+ * Reorder a resolved address list the way RFC 8305 section 4 asks for:
+ * alternate between address families, starting with the family of the
+ * first result. The order within a family is kept.
+ *
+ * */
+void
+upstream_order(struct addrinfo **list)
+{
+	struct addrinfo *first = NULL, **first_tail = &first;
+	struct addrinfo *other = NULL, **other_tail = &other;
+	struct addrinfo *p, *next, **tail = list;
+	int family;
+
+	if(*list == NULL)
+		return;
+
+	family = (*list)->ai_family;
+	for(p = *list; p != NULL; p = next){
+		next = p->ai_next;
+		p->ai_next = NULL;
+
+		if(p->ai_family == family){
+			*first_tail = p;
+			first_tail = &p->ai_next;
+		} else {
+			*other_tail = p;
+			other_tail = &p->ai_next;
+		}
+	}
+
+	while(first != NULL || other != NULL){
+		if(first != NULL){
+			*tail = first;
+			first = first->ai_next;
+			tail = &(*tail)->ai_next;
+		}
+		if(other != NULL){
+			*tail = other;
+			other = other->ai_next;
+			tail = &(*tail)->ai_next;
+		}
+	}
+	*tail = NULL;
+}
+
+static backend_t *
+pick(upstream_t *upstream, int replica)
+{
+	backend_t *b, *best = NULL;
+	uint64_t cost, best_cost = 0;
+	int i;
+
+	for(i = 0; i < upstream->n_backends; i++){
+		b = &upstream->backends[i];
+
+		if(b->replica != replica || !__atomic_load_n(&b->up, __ATOMIC_RELAXED))
+			continue;
+
+		// Connections per weight, in fixed point
+		cost = ((uint64_t) __atomic_load_n(&b->conns, __ATOMIC_RELAXED) + 1) << 20;
+		if(upstream->balance == BALANCE_LATENCY)
+			cost *= (uint64_t) __atomic_load_n(&b->latency, __ATOMIC_RELAXED) + 1;
+		cost /= b->weight;
+
+		if(best == NULL || cost < best_cost){
+			best = b;
+			best_cost = cost;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * Pick the backend a new connection goes to, among the primaries or, if
+ * replica is set, the replicas that are up: the one with the fewest
+ * connections for its weight, or, balancing on latency, the one with the
+ * lowest latency times connections for its weight. Library queries fall back
+ * to the primaries if no replica is up. If all of them are down the first
+ * primary is tried anyway.
+ *
+ * */
+backend_t *
+upstream_pick(upstream_t *upstream, int replica)
+{
+	backend_t *b = NULL;
+
+	if(replica)
+		b = pick(upstream, TRUE);
+	if(b == NULL)
+		b = pick(upstream, FALSE);
+
+	return b ? b : upstream_primary(upstream);
+}
+
+/**
+ * The first primary that is up, in configuration order. Connections that
+ * should all end up on the same server, like the idle watcher's, go there.
+ *
+ * */
+backend_t *
+upstream_primary(upstream_t *upstream)
+{
+	backend_t *b, *first = NULL;
+	int i;
+
+	for(i = 0; i < upstream->n_backends; i++){
+		b = &upstream->backends[i];
+		if(b->replica)
+			continue;
+
+		if(__atomic_load_n(&b->up, __ATOMIC_RELAXED))
+			return b;
+		if(first == NULL)
+			first = b;
+	}
+
+	return first ? first : &upstream->backends[0];
+}
+
+/**
+ * Whether a replica is up to take library queries.
+ *
+ * */
+int
+upstream_replicated(upstream_t *upstream)
+{
+	int i;
+
+	for(i = 0; upstream->replicas > 0 && i < upstream->n_backends; i++){
+		if(upstream->backends[i].replica && __atomic_load_n(&upstream->backends[i].up, __ATOMIC_RELAXED))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Close a connection to a backend.
+ *
+ * */
+void
+upstream_close(backend_t *backend, int fd)
+{
+	close(fd);
+	__atomic_sub_fetch(&backend->conns, 1, __ATOMIC_RELAXED);
+}
+
+static void
+attempt_close(attempt_t *a)
+{
+	connect_t *c = a->c;
+	struct io_uring_sqe *sqe;
+
+	if(!a->active)
+		return;
+
+	a->active = FALSE;
+	c->active--;
+
+	// The ring keeps the socket alive until the cancelled connect completes
+	if(c->uring && a->op.cb != NULL && (sqe = uring_sqe(c->loop->ring, NULL)) != NULL){
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uint64_t) (uintptr_t) &a->op;
+	}
+
+	close(a->h.fd);
+	a->h.fd = -1;
+}
+
+static void
+maybe_free(connect_t *c)
+{
+	if(c->report.cb == NULL && c->pending == 0)
+		free(c);
+}
+
+/**
+ * Settle the connect. The result is reported after the current batch of
+ * events, so the callback never runs from within upstream_connect.
+ *
+ * */
+static void
+finish(connect_t *c, int fd)
+{
+	int i;
+
+	if(c->done)
+		return;
+
+	c->done = TRUE;
+	c->fd = fd;
+	c->next = NULL;
+
+	if(fd >= 0 && !c->cancelled && c->loop->metrics)
+		metrics_record(&c->loop->metrics->connect, now_us() - c->started);
+
+	loop_untimeout(&c->delay);
+	loop_untimeout(&c->deadline);
+
+	for(i = 0; i < CONNECT_ATTEMPTS; i++)
+		attempt_close(&c->attempts[i]);
+
+	loop_defer(c->loop, &c->report);
+}
+
+static void
+win(connect_t *c, attempt_t *a)
+{
+	int fd = a->h.fd;
+
+	if(!c->uring)
+		loop_del(c->loop, &a->h);
+
+	a->active = FALSE;
+	a->h.fd = -1;
+	c->active--;
+
+	finish(c, fd);
+}
+
+/**
+ * Returns -1 if the attempt failed right away, 0 if it is in progress and 1
+ * if it connected immediately.
+ *
+ * */
+static int
+attempt_start(attempt_t *a, struct addrinfo *p)
+{
+	connect_t *c = a->c;
+	struct io_uring_sqe *sqe;
+	int fd, type = p->ai_socktype | SOCK_CLOEXEC;
+
+	if(!c->uring)
+		type |= SOCK_NONBLOCK;
+
+	if((fd = socket(p->ai_family, type, p->ai_protocol)) < 0)
+		return -1;
+
+	a->addr = p;
+	a->h.fd = fd;
+
+	if(c->uring){
+		if((sqe = uring_sqe(c->loop->ring, &a->op)) == NULL){
+			close(fd);
+			return -1;
+		}
+
+		sqe->opcode = IORING_OP_CONNECT;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t) (uintptr_t) p->ai_addr;
+		sqe->off = p->ai_addrlen;
+		c->pending++;
+		a->op.cb = &on_attempt_op;
+	} else {
+		if(connect(fd, p->ai_addr, p->ai_addrlen) < 0 && errno != EINPROGRESS){
+			close(fd);
+			return -1;
+		}
+
+		if(loop_add(c->loop, &a->h, EPOLLOUT | EPOLLET) < 0){
+			close(fd);
+			return -1;
+		}
+	}
+
+	a->active = TRUE;
+	c->active++;
+
+	return 0;
+}
+
+/**
+ * Start attempts until one is in progress or the candidates run out.
+ *
+ * */
+static void
+start(connect_t *c)
+{
+	attempt_t *a = NULL;
+	struct addrinfo *p;
+	int i;
+
+	while(!c->done && c->next != NULL){
+		for(i = 0, a = NULL; i < CONNECT_ATTEMPTS; i++){
+			// A cancelled uring attempt is busy until its completion arrives
+			if(!c->attempts[i].active && c->attempts[i].op.cb == NULL){
+				a = &c->attempts[i];
+				break;
+			}
+		}
+
+		if(a == NULL)
+			break;
+
+		p = c->next;
+		c->next = p->ai_next;
+
+		if(attempt_start(a, p) == 0){
+			if(c->next != NULL)
+				loop_timeout(c->loop, &c->delay, CONNECT_DELAY);
+			return;
+		}
+
+		c->err = errno;
+	}
+
+	if(!c->done && c->active == 0 && c->next == NULL)
+		finish(c, -1);
+}
+
+/**
+ * Connect to a backend, or to the primary upstream_pick chooses if it is NULL,
+ * racing its addresses. cb receives the connected socket and its backend, or
+ * -1 with errno set if no address could be reached within the timeout. The
+ * socket is counted as a connection to the backend until upstream_close.
+ *
+ * */
+connect_t *
+upstream_connect(loop_t *loop, upstream_t *upstream, backend_t *backend, connect_cb cb, void *data)
+{
+	connect_t *c;
+	int i;
+
+	if((c = calloc(1, sizeof(connect_t))) == NULL)
+		return NULL;
+
+	if(backend == NULL)
+		backend = upstream_pick(upstream, FALSE);
+
+	// Counted right away, so a burst of connects is spread over the backends
+	__atomic_add_fetch(&backend->conns, 1, __ATOMIC_RELAXED);
+
+	c->loop = loop;
+	c->uring = (loop->ring != NULL);
+	c->backend = backend;
+	c->next = backend->addr;
+	c->err = EHOSTUNREACH;
+	c->fd = -1;
+	c->cb = cb;
+	c->data = data;
+	c->report.cb = &on_report;
+	c->started = now_us();
+
+	timeout_init(&c->delay, &on_delay);
+	timeout_init(&c->deadline, &on_deadline);
+
+	for(i = 0; i < CONNECT_ATTEMPTS; i++){
+		c->attempts[i].c = c;
+		c->attempts[i].h.fd = -1;
+		c->attempts[i].h.cb = &on_attempt;
+	}
+
+	if(upstream->timeout > 0)
+		loop_timeout(loop, &c->deadline, upstream->timeout);
+
+	start(c);
+
+	return c;
+}
+
+/**
+ * Abandon a connect whose result is no longer wanted. The callback will not
+ * be called, and a socket that connected in the meantime is closed.
+ *
+ * */
+void
+upstream_cancel(connect_t *c)
+{
+	c->cancelled = TRUE;
+	finish(c, -1);
+}
+
+/**
+ * Callbacks
+ *
+ * */
+static void
+on_attempt(handler_t *handler, uint32_t events)
+{
+	attempt_t *a = container_of(handler, attempt_t, h);
+	connect_t *c = a->c;
+	int err = 0;
+	socklen_t len = sizeof err;
+
+	if(!a->active)
+		return;
+
+	if(getsockopt(a->h.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	if(err == EINPROGRESS || (err == 0 && !(events & EPOLLOUT)))
+		return;
+
+	if(err){
+		c->err = err;
+		attempt_close(a);
+		start(c);
+		return;
+	}
+
+	win(c, a);
+}
+
+static void
+on_attempt_op(uring_op_t *op, int res, uint32_t flags)
+{
+	attempt_t *a = container_of(op, attempt_t, op);
+	connect_t *c = a->c;
+
+	c->pending--;
+	a->op.cb = NULL;
+
+	if(!a->active){
+		maybe_free(c);
+		return;
+	}
+
+	if(res < 0){
+		c->err = -res;
+		attempt_close(a);
+		start(c);
+		return;
+	}
+
+	win(c, a);
+}
+
+static void
+on_delay(timeout_t *timeout)
+{
+	start(container_of(timeout, connect_t, delay));
+}
+
+static void
+on_deadline(timeout_t *timeout)
+{
+	connect_t *c = container_of(timeout, connect_t, deadline);
+
+	c->err = ETIMEDOUT;
+	finish(c, -1);
+}
+
+static void
+on_report(deferred_t *deferred)
+{
+	connect_t *c = container_of(deferred, connect_t, report);
+
+	// Only a socket handed to the callback stays counted
+	if(c->cancelled || c->fd < 0)
+		__atomic_sub_fetch(&c->backend->conns, 1, __ATOMIC_RELAXED);
+
+	if(c->cancelled){
+		if(c->fd >= 0)
+			close(c->fd);
+	} else {
+		if(c->fd < 0)
+			errno = c->err;
+		c->cb(c->data, c->fd, c->backend);
+	}
+
+	c->report.cb = NULL;
+	maybe_free(c);
+}
@@ -0,0 +1,110 @@
+/*
+ * upstream.h - MPD server connections
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <netdb.h>
+
+#include "event.h"
+#include "uring.h"
+
+// Parallel connection attempts per connect
+#define CONNECT_ATTEMPTS 4
+
+// RFC 8305 Connection Attempt Delay
+#define CONNECT_DELAY 250
+
+// Longest backend name, host:port as configured
+#define BACKEND_NAME 128
+
+/**
+ * An MPD server the proxy connects to. Connections open or opening to it are
+ * counted, and health checks tell whether it is up and how long it takes to
+ * answer a ping, in microseconds. These are shared by all threads. A replica
+ * is a read-only server with a copy of the library, it is only sent library
+ * queries.
+ *
+ * */
+typedef struct backend_t {
+	struct addrinfo *addr;
+	char name[BACKEND_NAME];
+	unsigned int weight;
+	int replica;
+
+	int up;
+	int conns;
+	unsigned int latency;
+} backend_t;
+
+/**
+ * The MPD servers the proxy connects to, all serving the same library
+ *
+ * */
+typedef struct upstream_t {
+	backend_t *backends;
+	int n_backends;
+	int replicas;
+	int balance;
+	unsigned int timeout;
+	unsigned int idle;
+	int protocol;
+} upstream_t;
+
+struct connect_t;
+
+typedef void (*connect_cb)(void *data, int fd, backend_t *backend);
+
+typedef struct attempt_t {
+	handler_t h;
+	uring_op_t op;
+	struct addrinfo *addr;
+	struct connect_t *c;
+	int active;
+} attempt_t;
+
+/**
+ * A Happy Eyeballs connect: attempts are started CONNECT_DELAY apart (or as
+ * soon as the previous one fails) over the interleaved address list, the
+ * first to complete wins and the others are abandoned.
+ *
+ * */
+typedef struct connect_t {
+	loop_t *loop;
+	int uring;
+
+	struct addrinfo *next;
+	attempt_t attempts[CONNECT_ATTEMPTS];
+	int active;
+	int pending;
+	int err;
+
+	timeout_t delay;
+	timeout_t deadline;
+
+	int done;
+	int cancelled;
+	int fd;
+	backend_t *backend;
+	uint64_t started;
+	deferred_t report;
+
+	connect_cb cb;
+	void *data;
+} connect_t;
+
+void upstream_order(struct addrinfo **list);
+
+backend_t *upstream_pick(upstream_t *upstream, int replica);
+backend_t *upstream_primary(upstream_t *upstream);
+int upstream_replicated(upstream_t *upstream);
+
+connect_t *upstream_connect(loop_t *loop, upstream_t *upstream, backend_t *backend, connect_cb cb, void *data);
+void upstream_cancel(connect_t *c);
+void upstream_close(backend_t *backend, int fd);
+
+#endif
@@ -0,0 +1,284 @@
+/*
+ * uring.c - io_uring submission and completion rings
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "list.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int
+sys_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int
+sys_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int
+setup_bufs(uring_t *ring)
+{
+	struct io_uring_buf_reg reg;
+	uint16_t i;
+
+	ring->br_sz = URING_BUFS * sizeof(struct io_uring_buf);
+	ring->br = mmap(NULL, ring->br_sz, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if(ring->br == MAP_FAILED){
+		ring->br = NULL;
+		return -1;
+	}
+
+	if((ring->bufs = malloc((size_t) URING_BUFS * URING_BUF_SIZE)) == NULL)
+		return -1;
+
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uint64_t) (uintptr_t) ring->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+
+	if(sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+
+	for(i = 0; i < URING_BUFS; i++)
+		uring_buf_put(ring, i);
+
+	return 0;
+}
+
+/**
+ * Set up a ring and its provided buffers.
+ * Returns -1 if the kernel lacks io_uring or one of the features we rely on.
+ *
+ * */
+int
+uring_init(uring_t *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(uring_t));
+	memset(&p, 0, sizeof p);
+	ring->fd = -1;
+	ring->multishot = TRUE;
+	INIT_LIST_HEAD(&ring->starved);
+
+	if((ring->fd = sys_setup(entries, &p)) < 0)
+		return -1;
+
+	ring->features = p.features;
+
+	// Timed waits appeared in 5.11, linked files in 5.17 and provided
+	// buffer rings (checked when registering them) in 5.19
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+			!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_LINKED_FILE)){
+		errno = ENOSYS;
+		goto fail;
+	}
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(ring->cq_ring_sz > ring->sq_ring_sz)
+		ring->sq_ring_sz = ring->cq_ring_sz;
+	ring->cq_ring_sz = ring->sq_ring_sz;
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_ring == MAP_FAILED){
+		ring->sq_ring = NULL;
+		goto fail;
+	}
+	ring->cq_ring = ring->sq_ring;
+
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED){
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	ring->sq_head = (unsigned int*) ((char*) ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned int*) ((char*) ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned int*) ((char*) ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*) ((char*) ring->sq_ring + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local = *ring->sq_tail;
+
+	ring->cq_head = (unsigned int*) ((char*) ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned int*) ((char*) ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned int*) ((char*) ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) ((char*) ring->cq_ring + p.cq_off.cqes);
+
+	if(setup_bufs(ring) < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	uring_destroy(ring);
+	return -1;
+}
+
+void
+uring_destroy(uring_t *ring)
+{
+	int err = errno;
+
+	if(ring->br)
+		munmap(ring->br, ring->br_sz);
+	free(ring->bufs);
+	if(ring->sqes)
+		munmap(ring->sqes, ring->sqes_sz);
+	if(ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+	if(ring->fd >= 0)
+		close(ring->fd);
+
+	ring->br = NULL;
+	ring->bufs = NULL;
+	ring->sqes = NULL;
+	ring->sq_ring = NULL;
+	ring->fd = -1;
+
+	errno = err;
+}
+
+/**
+ * Get a zeroed submission queue entry whose completion will be delivered to
+ * op. Entries are only handed to the kernel by the next uring_enter, which
+ * lets a loop iteration batch all of its operations into a single syscall.
+ * Pass NULL as op for operations whose completion is not interesting.
+ *
+ * */
+struct io_uring_sqe *
+uring_sqe(uring_t *ring, uring_op_t *op)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if(ring->sq_local - load_acquire(ring->sq_head) >= ring->sq_entries){
+		uring_enter(ring, 0, -1);
+		if(ring->sq_local - load_acquire(ring->sq_head) >= ring->sq_entries)
+			return NULL;
+	}
+
+	idx = ring->sq_local & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data = (uint64_t) (uintptr_t) op;
+
+	ring->sq_array[idx] = idx;
+	ring->sq_local++;
+
+	return sqe;
+}
+
+/**
+ * Submit all queued entries and wait for at least wait_nr completions, or
+ * timeout milliseconds if timeout is not negative.
+ *
+ * */
+int
+uring_enter(uring_t *ring, unsigned int wait_nr, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int to_submit, flags = 0;
+	int ret;
+
+	store_release(ring->sq_tail, ring->sq_local);
+	to_submit = ring->sq_local - load_acquire(ring->sq_head);
+
+	if(to_submit == 0 && wait_nr == 0)
+		return 0;
+
+	memset(&arg, 0, sizeof arg);
+	if(wait_nr)
+		flags |= IORING_ENTER_GETEVENTS;
+	if(wait_nr && timeout >= 0){
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+
+	if(flags & IORING_ENTER_EXT_ARG)
+		ret = sys_enter(ring->fd, to_submit, wait_nr, flags, &arg, sizeof arg);
+	else
+		ret = sys_enter(ring->fd, to_submit, wait_nr, flags, NULL, 0);
+
+	if(ret < 0 && (errno == EINTR || errno == ETIME))
+		return 0;
+
+	return ret;
+}
+
+/**
+ * Dispatch all available completions to their operations.
+ *
+ * */
+void
+uring_reap(uring_t *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	while(head != load_acquire(ring->cq_tail)){
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		uring_op_t *op = (uring_op_t*) (uintptr_t) cqe->user_data;
+		int res = cqe->res;
+		uint32_t flags = cqe->flags;
+
+		// Release the slot before the callback, it may queue more work
+		head++;
+		store_release(ring->cq_head, head);
+
+		if(op != NULL)
+			op->cb(op, res, flags);
+	}
+}
+
+char *
+uring_buf(uring_t *ring, uint16_t bid)
+{
+	return ring->bufs + (size_t) bid * URING_BUF_SIZE;
+}
+
+/**
+ * Hand a buffer back to the kernel for subsequent recvs.
+ *
+ * */
+void
+uring_buf_put(uring_t *ring, uint16_t bid)
+{
+	struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (URING_BUFS - 1)];
+
+	buf->addr = (uint64_t) (uintptr_t) uring_buf(ring, bid);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+
+	ring->br_tail++;
+	store_release(&ring->br->tail, ring->br_tail);
+}
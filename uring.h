@@ -0,0 +1,80 @@
+/*
+ * uring.h - io_uring submission and completion rings
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#include "list.h"
+
+#define URING_ENTRIES 256
+#define URING_BUFS 256
+#define URING_BUF_SIZE 16384
+#define URING_BGID 0
+
+/**
+ * An operation submitted to the ring. Like handler_t, operations are embedded
+ * in their owner and the sqe's user_data points back at them.
+ *
+ * */
+typedef struct uring_op_t {
+	void (*cb)(struct uring_op_t *op, int res, uint32_t flags);
+} uring_op_t;
+
+typedef struct uring_t {
+	int fd;
+	unsigned int features;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_local;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+
+	// Provided buffer ring, the kernel picks a buffer for every recv
+	struct io_uring_buf_ring *br;
+	size_t br_sz;
+	char *bufs;
+	uint16_t br_tail;
+
+	// Buffers handed out by the kernel are chained per channel
+	int buf_next[URING_BUFS];
+	uint32_t buf_len[URING_BUFS];
+
+	// Channels waiting for a buffer to be returned to the ring
+	struct list_head starved;
+
+	int multishot;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned int entries);
+void uring_destroy(uring_t *ring);
+
+struct io_uring_sqe *uring_sqe(uring_t *ring, uring_op_t *op);
+int uring_enter(uring_t *ring, unsigned int wait_nr, int timeout);
+void uring_reap(uring_t *ring);
+
+char *uring_buf(uring_t *ring, uint16_t bid);
+void uring_buf_put(uring_t *ring, uint16_t bid);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * util.h - hashing, clocks and histograms
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * FNV-1a hash of len bytes
+ *
+ * */
+static inline uint32_t
+hash(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		h = (h ^ p[i]) * 16777619U;
+
+	return h;
+}
+
+/**
+ * Microseconds on the monotonic clock, to measure time with
+ *
+ * */
+static inline uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/**
+ * Microseconds since the epoch, to timestamp records with
+ *
+ * */
+static inline uint64_t
+epoch_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/**
+ * Bucket of a log-linear histogram counting value: values below 2^(bits + 1)
+ * have a bucket of their own, every power of two above is split in 2^bits
+ * equal parts. Values past the last of n buckets are counted in it, n spans
+ * at least the first 2^(bits + 1)
+ *
+ * */
+static inline unsigned int
+histogram_bucket(uint64_t value, unsigned int bits, unsigned int n)
+{
+	unsigned int p, i;
+
+	if(value < 2U << bits)
+		return (unsigned int) value;
+
+	p = 63 - (unsigned int) __builtin_clzll(value);
+	i = (p - bits + 1) << bits | (unsigned int) ((value >> (p - bits)) & ((1U << bits) - 1));
+
+	return i < n ? i : n - 1;
+}
+
+/**
+ * Lowest value counted in bucket i of a log-linear histogram
+ *
+ * */
+static inline uint64_t
+histogram_value(unsigned int i, unsigned int bits)
+{
+	unsigned int p;
+
+	if(i < 2U << bits)
+		return i;
+
+	p = (i >> bits) + bits - 1;
+	return (uint64_t) ((1U << bits) + (i & ((1U << bits) - 1))) << (p - bits);
+}
+
+#endif
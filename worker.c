@@ -0,0 +1,242 @@
+/*
+ * worker.c - per-core accept and event loop
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "worker.h"
+#include "connection.h"
+#include "config.h"
+#include "event.h"
+#include "uring.h"
+#include "cache.h"
+#include "log.h"
+
+static void on_listen(handler_t*, uint32_t);
+static void on_accept(uring_op_t*, int, uint32_t);
+static void on_notify(post_t*);
+
+/**
+ * Changed subsystems on their way to a worker
+ *
+ * */
+typedef struct notify_t {
+	post_t post;
+	worker_t *worker;
+	unsigned int mask;
+} notify_t;
+
+/**
+ * Set up the worker's event loop, its share of the upstream pool and of the
+ * limit on upstream connections (0 for none), and its response cache
+ * (disabled if cache_size is 0). If
+ * io_uring was requested but the kernel cannot provide it, the worker is left
+ * on epoll with FORWARD_COPY.
+ *
+ * */
+int
+worker_init(worker_t *worker, int id, int forward, upstream_t *upstream, int pool_size, int limit, size_t cache_size)
+{
+	memset(worker, 0, sizeof(worker_t));
+	worker->id = id;
+	worker->forward = forward;
+	worker->upstream = upstream;
+	worker->listen.fd = -1;
+	worker->listen.cb = &on_listen;
+	worker->accept.cb = &on_accept;
+	pool_init(&worker->pool, &worker->loop, upstream, pool_size, upstream->idle, limit);
+	INIT_LIST_HEAD(&worker->sessions);
+	cache_init(&worker->cache, cache_size);
+
+	if(loop_init(&worker->loop) < 0)
+		return -1;
+
+	if(forward == FORWARD_URING && loop_uring(&worker->loop) < 0)
+		worker->forward = FORWARD_COPY;
+
+	return 0;
+}
+
+void
+worker_destroy(worker_t *worker)
+{
+	if(worker->listen.fd >= 0)
+		close(worker->listen.fd);
+	cache_destroy(&worker->cache);
+	loop_destroy(&worker->loop);
+}
+
+static int
+arm_accept(worker_t *worker)
+{
+	struct io_uring_sqe *sqe;
+
+	if((sqe = uring_sqe(worker->loop.ring, &worker->accept)) == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = worker->listen.fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+
+	return 0;
+}
+
+/**
+ * Bind the worker's own listening socket to addr. All workers bind the same
+ * address, SO_REUSEPORT makes the kernel balance connections between them.
+ *
+ * */
+int
+worker_listen(worker_t *worker, struct addrinfo *addr)
+{
+	int fd, optval = 1;
+
+	if((fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol)) < 0)
+		return -1;
+
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval) < 0 ||
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval) < 0)
+		goto fail;
+
+	// Prefer connections whose packets are processed on this worker's core
+	optval = worker->id % (int) sysconf(_SC_NPROCESSORS_ONLN);
+	setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &optval, sizeof optval);
+
+	if(bind(fd, addr->ai_addr, addr->ai_addrlen) < 0 || listen(fd, SOMAXCONN) < 0)
+		goto fail;
+
+	worker->listen.fd = fd;
+
+	if(worker->forward == FORWARD_URING){
+		if(arm_accept(worker) < 0)
+			goto fail;
+	} else if(loop_add(&worker->loop, &worker->listen, EPOLLIN) < 0){
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	close(fd);
+	worker->listen.fd = -1;
+	return -1;
+}
+
+/**
+ * Fill the pool and start the worker's loop thread, pinned to a core.
+ *
+ * */
+int
+worker_start(worker_t *worker)
+{
+	cpu_set_t set;
+	int err;
+
+	pool_fill(&worker->pool);
+
+	if((err = loop_start(&worker->loop)))
+		return err;
+
+	CPU_ZERO(&set);
+	CPU_SET((size_t) (worker->id % (int) sysconf(_SC_NPROCESSORS_ONLN)), &set);
+	pthread_setaffinity_np(worker->loop.th_id, sizeof set, &set);
+
+	return 0;
+}
+
+/**
+ * Tell the worker's sessions about changed subsystems. Called from any thread.
+ *
+ * */
+void
+worker_notify(worker_t *worker, unsigned int mask)
+{
+	notify_t *notify;
+
+	if((notify = malloc(sizeof(notify_t))) == NULL){
+		print("notify", strerror(errno));
+		return;
+	}
+
+	notify->post.cb = &on_notify;
+	notify->worker = worker;
+	notify->mask = mask;
+
+	loop_post(&worker->loop, &notify->post);
+}
+
+static void
+accepted(worker_t *worker, int sock_cli)
+{
+	connection_t *conn = conn_new(sock_cli, -1, worker->forward);
+
+	if(conn == NULL){
+		print("conn_new", strerror(errno));
+		close(sock_cli);
+		return;
+	}
+
+	conn_connect(conn, worker);
+}
+
+/**
+ * Callbacks
+ *
+ * */
+static void
+on_listen(handler_t *handler, uint32_t events)
+{
+	worker_t *worker = container_of(handler, worker_t, listen);
+	int sock_cli;
+
+	// The listening socket is level-triggered, a burst is accepted in batches
+	while((sock_cli = accept4(handler->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+		accepted(worker, sock_cli);
+
+	if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		print("accept", strerror(errno));
+}
+
+static void
+on_accept(uring_op_t *op, int res, uint32_t flags)
+{
+	worker_t *worker = container_of(op, worker_t, accept);
+
+	if(!(flags & IORING_CQE_F_MORE) && arm_accept(worker) < 0)
+		print("arm_accept", strerror(errno));
+
+	if(res < 0){
+		errno = -res;
+		print("accept", strerror(errno));
+		return;
+	}
+
+	accepted(worker, res);
+}
+
+static void
+on_notify(post_t *post)
+{
+	notify_t *notify = container_of(post, notify_t, post);
+	connection_t *conn, *tmp;
+
+	cache_invalidate(&notify->worker->cache, notify->mask);
+
+	list_for_each_entry_safe(conn, tmp, &notify->worker->sessions, session)
+		conn_changed(conn, notify->mask);
+
+	free(notify);
+}
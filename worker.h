@@ -0,0 +1,73 @@
+/*
+ * worker.h - per-core accept and event loop
+ *
+ * Florian Dejonckheere <florian@floriandejonckheere.be>
+ *
+ * */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <netdb.h>
+
+#include "event.h"
+#include "uring.h"
+#include "upstream.h"
+#include "pool.h"
+#include "cache.h"
+#include "mirror.h"
+#include "art.h"
+#include "limit.h"
+#include "metrics.h"
+#include "access.h"
+#include "tap.h"
+#include "list.h"
+
+/**
+ * A worker owns an event loop and its own SO_REUSEPORT listening socket, so
+ * the kernel spreads new connections across workers and a connection stays
+ * on the worker (and core) that accepted it for its whole life.
+ *
+ * */
+typedef struct worker_t {
+	int id;
+	int forward;
+	loop_t loop;
+
+	handler_t listen;
+	uring_op_t accept;
+
+	upstream_t *upstream;
+	pool_t pool;
+
+	// PROTOCOL_MPD connections, told about changed subsystems, and the
+	// responses they share
+	struct list_head sessions;
+	cache_t cache;
+
+	// PROTOCOL_MPD: database mirror shared by all workers, if enabled
+	mirror_t *mirror;
+
+	// PROTOCOL_MPD: album art cache shared by all workers, if enabled
+	art_cache_t *art;
+
+	// PROTOCOL_MPD: rate limits of clients, if any
+	limit_t *limit;
+
+	// Counted by the worker's loop while metrics are exported
+	metrics_t metrics;
+
+	// PROTOCOL_MPD: where the worker's commands are logged to, if enabled
+	ring_t *access;
+
+	// Where the worker's traffic is captured to, if enabled
+	ring_t *tap;
+} worker_t;
+
+int worker_init(worker_t *worker, int id, int forward, upstream_t *upstream, int pool_size, int limit, size_t cache_size);
+void worker_destroy(worker_t *worker);
+int worker_listen(worker_t *worker, struct addrinfo *addr);
+int worker_start(worker_t *worker);
+void worker_notify(worker_t *worker, unsigned int mask);
+
+#endif